@@ -0,0 +1,143 @@
+#include "ws/ws.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+// Opens connections to an in-process server, completes their handshakes and
+// leaves them idle, then reports how much memory each one costs the server.
+
+static const char request[] =
+    "GET / HTTP/1.1\r\n"
+    "Host: 127.0.0.1\r\n"
+    "Upgrade: websocket\r\n"
+    "Connection: Upgrade\r\n"
+    "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+    "Sec-WebSocket-Version: 13\r\n"
+    "\r\n";
+
+static int open_count;
+
+static void on_connect(ws_connection_t *connection) {
+    (void)connection;
+    open_count++;
+}
+
+static long resident_bytes(void) {
+    long pages = 0;
+    FILE *file = fopen("/proc/self/statm", "r");
+    
+    if (!file) {
+        return -1;
+    }
+    if (fscanf(file, "%*s %ld", &pages) != 1) {
+        pages = -1;
+    }
+    fclose(file);
+    
+    return pages < 0 ? -1 : pages * sysconf(_SC_PAGESIZE);
+}
+
+static int connect_client(int port) {
+    struct sockaddr_in address;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    
+    if (fd < 0) {
+        return -1;
+    }
+    
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+        send(fd, request, sizeof(request) - 1, 0) != (ssize_t)(sizeof(request) - 1)) {
+        close(fd);
+        return -1;
+    }
+    
+    return fd;
+}
+
+int main(int argc, char *argv[]) {
+    int count = argc > 1 ? atoi(argv[1]) : 10000;
+    int port = argc > 2 ? atoi(argv[2]) : 9090;
+    int batch = 256;
+    
+    // Both ends of every connection live in this process
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+        if (limit.rlim_cur != RLIM_INFINITY && (rlim_t)count * 2 + 64 > limit.rlim_cur) {
+            count = (int)((limit.rlim_cur - 64) / 2);
+            printf("Open file limit allows %d connections\n", count);
+        }
+    }
+    
+    int *clients = calloc(count, sizeof(int));
+    if (!clients) {
+        perror("calloc");
+        return 1;
+    }
+    
+    ws_server_t server;
+    ws_server_create(&server);
+    server.on_connect = on_connect;
+    
+    if (ws_server_listen_tcp(&server, "127.0.0.1", port) != 0) {
+        fprintf(stderr, "Failed to listen on port %d\n", port);
+        return 1;
+    }
+    
+    // Warm up allocator and poll set before taking the baseline
+    ws_server_step(&server, 0);
+    long before = resident_bytes();
+    
+    int opened = 0;
+    while (opened < count) {
+        for (int i = 0; i < batch && opened < count; i++) {
+            int fd = connect_client(port);
+            if (fd < 0) {
+                fprintf(stderr, "Connection %d failed: %s\n", opened, strerror(errno));
+                count = opened;
+                break;
+            }
+            clients[opened++] = fd;
+        }
+        
+        while (open_count < opened) {
+            ws_server_step(&server, 100);
+        }
+    }
+    
+    // Let the responses drain so every connection is idle
+    for (int i = 0; i < 10; i++) {
+        ws_server_step(&server, 10);
+    }
+    
+    long after = resident_bytes();
+    
+    printf("Connections:            %d\n", open_count);
+    printf("sizeof(ws_connection_t): %zu bytes\n", sizeof(ws_connection_t));
+    printf("Pooled receive buffers: %zu of %zu bytes\n", server.rx_pool.cached, server.rx_pool.buffer_size);
+    if (before >= 0 && after >= 0 && open_count > 0) {
+        printf("Resident memory:        %ld -> %ld KB\n", before / 1024, after / 1024);
+        printf("Per connection:         %.1f bytes\n", (double)(after - before) / open_count);
+    }
+    
+    for (int i = 0; i < count; i++) {
+        close(clients[i]);
+    }
+    free(clients);
+    ws_server_cleanup(&server);
+    
+    return 0;
+}
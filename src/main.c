@@ -15,12 +15,16 @@ void signal_handler(int signal) {
 }
 
 void on_connect(ws_connection_t *connection) {
-    printf("Client connected: %s:%d\n", connection->host, connection->port);
+    printf("Client connected: %s:%d (id %llu)\n", connection->info->host, connection->info->port,
+           (unsigned long long)connection->id);
+    
+    // Messages websocket-publish sends to topic 0 reach every client
+    ws_subscribe(connection, 0);
 }
 
 void on_message(ws_connection_t *connection, const uint8_t *data, size_t len, bool is_binary) {
     printf("Received %s message (%zu bytes) from %s:%d\n", 
-           is_binary ? "binary" : "text", len, connection->host, connection->port);
+           is_binary ? "binary" : "text", len, connection->info->host, connection->info->port);
     
     // Echo the message back
     if (is_binary) {
@@ -32,12 +36,12 @@ void on_message(ws_connection_t *connection, const uint8_t *data, size_t len, bo
 
 void on_close(ws_connection_t *connection, int code, const char *reason) {
     printf("Client disconnected: %s:%d (code: %d, reason: %s)\n", 
-           connection->host, connection->port, code, reason ? reason : "");
+           connection->info->host, connection->info->port, code, reason ? reason : "");
 }
 
 void on_error(ws_connection_t *connection, const char *error) {
     printf("Error on connection %s:%d: %s\n", 
-           connection->host, connection->port, error);
+           connection->info->host, connection->info->port, error);
 }
 
 int main(int argc, char *argv[]) {
@@ -46,32 +50,145 @@ int main(int argc, char *argv[]) {
     
     // Default port
     int port = 8080;
+    int workers = 0;
+    const char *unix_path = NULL;
+    const char *control_path = NULL;
+    const char *capture_path = NULL;
+    int busy_poll = 0;
+    int busy_poll_cpu = -1;
+    char relay_host[256] = "";
+    int relay_port = 0;
+    const char *ingest_path = NULL;
+    bool http2 = false;
     
     // Parse command line arguments
     if (argc > 1) {
         port = atoi(argv[1]);
     }
-    
-    // Initialize WebSocket server
-    if (ws_server_init(&server, port) != 0) {
-        fprintf(stderr, "Failed to initialize WebSocket server\n");
-        return 1;
+    if (argc > 2) {
+        workers = atoi(argv[2]);
+    }
+    if (argc > 3 && argv[3][0]) {
+        unix_path = argv[3];
+    }
+    if (argc > 4 && argv[4][0]) {
+        control_path = argv[4];
+    }
+    if (argc > 5 && argv[5][0]) {
+        capture_path = argv[5];
+    }
+    if (argc > 6) {
+        busy_poll = atoi(argv[6]);
+    }
+    if (argc > 7) {
+        busy_poll_cpu = atoi(argv[7]);
+    }
+    if (argc > 8 && argv[8][0]) {
+        // Backend as host:port; the last colon separates the port
+        const char *colon = strrchr(argv[8], ':');
+        if (!colon || colon == argv[8] || (size_t)(colon - argv[8]) >= sizeof(relay_host)) {
+            fprintf(stderr, "Relay backend must be host:port\n");
+            return 1;
+        }
+        memcpy(relay_host, argv[8], colon - argv[8]);
+        relay_host[colon - argv[8]] = '\0';
+        relay_port = atoi(colon + 1);
+    }
+    if (argc > 9 && argv[9][0]) {
+        ingest_path = argv[9];
+    }
+    if (argc > 10) {
+        http2 = atoi(argv[10]) != 0;
     }
     
     // Set callbacks
+    ws_server_create(&server);
+    server.config.port = port;
+    server.config.http2 = http2;
     server.on_connect = on_connect;
     server.on_message = on_message;
     server.on_close = on_close;
     server.on_error = on_error;
     
+    // Hot restart: take the sockets of a running instance if there is one
+    if (control_path && ws_server_takeover(&server, control_path) != 0 && server.num_listeners == 0) {
+        printf("No running server to take over from at %s\n", control_path);
+    }
+    
+    if (server.num_listeners == 0) {
+        // Initialize WebSocket server
+        if (ws_server_listen_tcp(&server, NULL, port) != 0) {
+            fprintf(stderr, "Failed to initialize WebSocket server\n");
+            ws_server_cleanup(&server);
+            return 1;
+        }
+        
+        // Optionally accept same-host clients on a Unix domain socket too
+        if (unix_path && ws_server_listen_unix(&server, unix_path) != 0) {
+            fprintf(stderr, "Failed to listen on %s\n", unix_path);
+            ws_server_cleanup(&server);
+            return 1;
+        }
+    }
+    
+    // Let the next instance take over from us
+    if (control_path && ws_server_enable_handoff(&server, control_path) != 0) {
+        fprintf(stderr, "Failed to create control socket %s\n", control_path);
+        ws_server_cleanup(&server);
+        return 1;
+    }
+    
+    // Optionally record inbound traffic for websocket-replay
+    if (capture_path && ws_server_enable_capture(&server, capture_path, 1, 4096) != 0) {
+        fprintf(stderr, "Failed to create capture file %s\n", capture_path);
+        ws_server_cleanup(&server);
+        return 1;
+    }
+    
+    // Optionally spin instead of sleeping between events
+    if (busy_poll > 0 && ws_server_enable_busy_poll(&server, busy_poll, busy_poll_cpu) != 0) {
+        fprintf(stderr, "Failed to pin the event loop to CPU %d\n", busy_poll_cpu);
+    }
+    
+    // Optionally bridge every client to a TCP backend instead of echoing
+    if (relay_host[0] && ws_server_enable_relay(&server, relay_host, relay_port) != 0) {
+        fprintf(stderr, "Failed to set up relay to %s:%d\n", relay_host, relay_port);
+        ws_server_cleanup(&server);
+        return 1;
+    }
+    
+    // Optionally take messages from websocket-publish processes
+    if (ingest_path && ws_server_enable_ingest(&server, ingest_path, 0) != 0) {
+        fprintf(stderr, "Failed to create ingest ring at %s\n", ingest_path);
+        ws_server_cleanup(&server);
+        return 1;
+    }
+    
+    // Optionally run on_message on a worker pool
+    if (workers > 0 && ws_server_enable_dispatch(&server, workers) != 0) {
+        fprintf(stderr, "Failed to start %d dispatch workers\n", workers);
+        ws_server_cleanup(&server);
+        return 1;
+    }
+    
     printf("WebSocket server started on port %d\n", port);
     printf("Press Ctrl+C to exit\n");
     
-    // Run the server in non-blocking mode
-    while (running) {
+    // Run the server in non-blocking mode until stopped, or until handed
+    // off and the connections that stayed have closed and released their
+    // zero-copy payloads
+    while (running && !(server.handed_off && server.clients == NULL && server.lingering == NULL)) {
         ws_server_step(&server, 100); // 100ms timeout
     }
     
+    if (busy_poll > 0) {
+        ws_busy_poll_stats_t *stats = &server.busy_poll_stats;
+        uint64_t spun = stats->useful_ns + stats->wasted_ns;
+        printf("Busy poll: %llu spins, %llu found work, %llu fell back to blocking, %.1f%% of %.3f s spinning useful\n",
+               (unsigned long long)stats->spins, (unsigned long long)stats->hits,
+               (unsigned long long)stats->blocks, spun ? 100.0 * stats->useful_ns / spun : 0.0, spun / 1e9);
+    }
+    
     // Clean up
     ws_server_cleanup(&server);
     printf("WebSocket server stopped\n");
@@ -0,0 +1,328 @@
+#include "ws/utils/capture.h"
+#include "ws/utils/frames.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+// Re-drives a capture written by ws_server_enable_capture() against a
+// server. Connections are opened, fed and closed in captured order, each
+// record sent at its captured time divided by the speed-up factor. Payloads
+// that were not captured are replaced with filler of the same size.
+
+typedef struct {
+    uint64_t id;                // Captured connection id
+    int socket;                 // Replay socket, or -1
+} replay_connection_t;
+
+static replay_connection_t *connections;
+static size_t num_connections;
+static size_t connections_capacity;
+
+static const uint8_t mask_key[4] = { 0x37, 0xfa, 0x21, 0x3d };
+
+static int64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static replay_connection_t *find_connection(uint64_t id, bool create) {
+    for (size_t i = 0; i < num_connections; i++) {
+        if (connections[i].id == id) {
+            return &connections[i];
+        }
+    }
+    
+    if (!create) {
+        return NULL;
+    }
+    
+    if (num_connections == connections_capacity) {
+        size_t capacity = connections_capacity ? connections_capacity * 2 : 64;
+        replay_connection_t *grown = realloc(connections, capacity * sizeof(*grown));
+        if (!grown) {
+            return NULL;
+        }
+        connections = grown;
+        connections_capacity = capacity;
+    }
+    
+    replay_connection_t *connection = &connections[num_connections++];
+    connection->id = id;
+    connection->socket = -1;
+    return connection;
+}
+
+// Discard whatever the server sent so its writes never block on us
+static void drain(void) {
+    uint8_t buffer[65536];
+    
+    for (size_t i = 0; i < num_connections; i++) {
+        int fd = connections[i].socket;
+        while (fd >= 0 && recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT) > 0) {
+        }
+    }
+}
+
+// Sleep until a deadline, draining replies meanwhile
+static void wait_until(int64_t deadline) {
+    for (;;) {
+        int64_t remaining = deadline - now_ns();
+        if (remaining <= 0) {
+            return;
+        }
+        
+        struct timespec pause = { 0, remaining > 1000000 ? 1000000 : remaining };
+        nanosleep(&pause, NULL);
+        drain();
+    }
+}
+
+static int send_all(int fd, const uint8_t *data, size_t len) {
+    while (len > 0) {
+        ssize_t sent = send(fd, data, len, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                drain();
+                struct pollfd pfd = { fd, POLLOUT, 0 };
+                poll(&pfd, 1, 10);
+                continue;
+            }
+            return -1;
+        }
+        data += sent;
+        len -= sent;
+    }
+    
+    return 0;
+}
+
+static int open_connection(const char *host, const char *port) {
+    struct addrinfo hints, *result;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    
+    if (getaddrinfo(host, port, &hints, &result) != 0) {
+        return -1;
+    }
+    
+    int fd = -1;
+    for (struct addrinfo *ai = result; ai && fd < 0; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(result);
+    if (fd < 0) {
+        return -1;
+    }
+    
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    
+    char request[512];
+    int len = snprintf(request, sizeof(request),
+                       "GET / HTTP/1.1\r\n"
+                       "Host: %s:%s\r\n"
+                       "Upgrade: websocket\r\n"
+                       "Connection: Upgrade\r\n"
+                       "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                       "Sec-WebSocket-Version: 13\r\n"
+                       "\r\n", host, port);
+    
+    // Wait for the end of the response headers
+    char response[4096];
+    size_t received = 0;
+    if (send_all(fd, (const uint8_t *)request, len) != 0) {
+        close(fd);
+        return -1;
+    }
+    while (received < sizeof(response) - 1) {
+        ssize_t n = recv(fd, response + received, sizeof(response) - 1 - received, 0);
+        if (n <= 0) {
+            close(fd);
+            return -1;
+        }
+        received += n;
+        response[received] = '\0';
+        if (strstr(response, "\r\n\r\n")) {
+            break;
+        }
+    }
+    
+    if (strncmp(response, "HTTP/1.1 101", 12) != 0) {
+        close(fd);
+        return -1;
+    }
+    
+    return fd;
+}
+
+static int send_frame(int fd, const ws_capture_record_t *record, const uint8_t *payload) {
+    size_t length = record->length;
+    uint8_t *frame = malloc(14 + length);
+    if (!frame) {
+        return -1;
+    }
+    
+    int idx = ws_create_frame_header(record->opcode, record->fin, length, true, frame);
+    memcpy(frame + idx, mask_key, 4);
+    idx += 4;
+    
+    uint8_t *data = frame + idx;
+    if (record->captured_length == length) {
+        memcpy(data, payload, length);
+    } else {
+        // Filler that is valid UTF-8; a close frame keeps a normal code
+        memset(data, 'a', length);
+        if (record->opcode == WS_OPCODE_CLOSE && length >= 2) {
+            data[0] = 1000 >> 8;
+            data[1] = 1000 & 0xFF;
+        }
+    }
+    for (size_t i = 0; i < length; i++) {
+        data[i] ^= mask_key[i % 4];
+    }
+    
+    int result = send_all(fd, frame, idx + length);
+    free(frame);
+    return result;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 4) {
+        fprintf(stderr, "Usage: %s capture_file host port [speed]\n", argv[0]);
+        fprintf(stderr, "  speed: 1 replays in real time, 10 ten times faster, 0 as fast as possible\n");
+        return 1;
+    }
+    
+    const char *host = argv[2];
+    const char *port = argv[3];
+    double speed = argc > 4 ? atof(argv[4]) : 1.0;
+    
+    FILE *file = fopen(argv[1], "rb");
+    if (!file) {
+        perror("fopen");
+        return 1;
+    }
+    
+    ws_capture_header_t header;
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        memcmp(header.magic, WS_CAPTURE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != WS_CAPTURE_VERSION) {
+        fprintf(stderr, "%s is not a capture file\n", argv[1]);
+        fclose(file);
+        return 1;
+    }
+    
+    ws_capture_record_t record;
+    uint8_t *payload = NULL;
+    size_t payload_capacity = 0;
+    uint64_t records = 0, frames = 0, bytes = 0, skipped = 0;
+    int64_t max_lag = 0;
+    int64_t start = now_ns();
+    
+    while (fread(&record, sizeof(record), 1, file) == 1) {
+        if (record.captured_length > payload_capacity) {
+            uint8_t *grown = realloc(payload, record.captured_length);
+            if (!grown) {
+                perror("realloc");
+                break;
+            }
+            payload = grown;
+            payload_capacity = record.captured_length;
+        }
+        if (record.captured_length > 0 && fread(payload, record.captured_length, 1, file) != 1) {
+            fprintf(stderr, "Truncated capture file\n");
+            break;
+        }
+        
+        // Keep the captured pacing, scaled by speed
+        if (speed > 0) {
+            int64_t due = start + (int64_t)((double)record.time / speed);
+            wait_until(due);
+            int64_t lag = now_ns() - due;
+            if (lag > max_lag) {
+                max_lag = lag;
+            }
+        }
+        records++;
+        
+        replay_connection_t *connection = find_connection(record.connection, record.type == WS_CAPTURE_OPEN);
+        if (!connection) {
+            skipped++;
+            continue;
+        }
+        
+        switch (record.type) {
+            case WS_CAPTURE_OPEN:
+                connection->socket = open_connection(host, port);
+                if (connection->socket < 0) {
+                    fprintf(stderr, "Failed to open connection %llu\n", (unsigned long long)record.connection);
+                }
+                break;
+                
+            case WS_CAPTURE_FRAME:
+                if (connection->socket < 0) {
+                    skipped++;
+                } else if (send_frame(connection->socket, &record, payload) != 0) {
+                    fprintf(stderr, "Connection %llu closed by server\n", (unsigned long long)record.connection);
+                    close(connection->socket);
+                    connection->socket = -1;
+                } else {
+                    frames++;
+                    bytes += record.length;
+                }
+                break;
+                
+            case WS_CAPTURE_CLOSE:
+                if (connection->socket >= 0) {
+                    drain();
+                    close(connection->socket);
+                    connection->socket = -1;
+                }
+                break;
+        }
+    }
+    
+    double elapsed = (double)(now_ns() - start) / 1e9;
+    
+    for (size_t i = 0; i < num_connections; i++) {
+        if (connections[i].socket >= 0) {
+            close(connections[i].socket);
+        }
+    }
+    
+    printf("Replayed %llu records: %zu connections, %llu frames, %llu payload bytes in %.3f s\n",
+           (unsigned long long)records, num_connections, (unsigned long long)frames,
+           (unsigned long long)bytes, elapsed);
+    if (elapsed > 0) {
+        printf("Rate: %.0f frames/s, %.1f MB/s\n", frames / elapsed, bytes / elapsed / 1e6);
+    }
+    if (speed > 0) {
+        printf("Largest delay behind the captured schedule: %.3f ms\n", max_lag / 1e6);
+    }
+    if (skipped > 0) {
+        printf("Skipped %llu records of connections that failed to open\n", (unsigned long long)skipped);
+    }
+    
+    free(payload);
+    free(connections);
+    fclose(file);
+    return 0;
+}
@@ -0,0 +1,224 @@
+#include "ws/ws.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+
+// Echoes messages between clients and an in-process server, once over
+// memory transports and once over Unix socket pairs. The memory run costs
+// only the library's framing, parsing and dispatch; the difference to the
+// socket run is what the kernel adds.
+
+static const char request[] =
+    "GET / HTTP/1.1\r\n"
+    "Host: 127.0.0.1\r\n"
+    "Upgrade: websocket\r\n"
+    "Connection: Upgrade\r\n"
+    "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+    "Sec-WebSocket-Version: 13\r\n"
+    "\r\n";
+
+typedef struct {
+    ws_transport_t transport;      // Client end
+    long sent;                     // Messages written
+    long received;                 // Echoes read completely
+    size_t partial;                // Bytes of the echo being read
+    bool upgraded;                 // The handshake response was read
+} bench_client_t;
+
+static int open_count;
+
+static void on_connect(ws_connection_t *connection) {
+    (void)connection;
+    open_count++;
+}
+
+static void on_message(ws_connection_t *connection, const uint8_t *data, size_t len, bool is_binary) {
+    (void)is_binary;
+    ws_send_binary(connection, data, len);
+}
+
+static int64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+// Masked binary frame as a client sends it
+static size_t encode_frame(uint8_t *frame, size_t size) {
+    static const uint8_t mask[4] = { 0x12, 0x34, 0x56, 0x78 };
+    size_t header = 2;
+    
+    frame[0] = 0x82;
+    if (size < 126) {
+        frame[1] = 0x80 | (uint8_t)size;
+    } else if (size < 65536) {
+        frame[1] = 0x80 | 126;
+        frame[2] = (uint8_t)(size >> 8);
+        frame[3] = (uint8_t)size;
+        header = 4;
+    } else {
+        frame[1] = 0x80 | 127;
+        for (int i = 0; i < 8; i++) {
+            frame[2 + i] = (uint8_t)((uint64_t)size >> (56 - 8 * i));
+        }
+        header = 10;
+    }
+    
+    memcpy(frame + header, mask, 4);
+    for (size_t i = 0; i < size; i++) {
+        frame[header + 4 + i] = (uint8_t)('a' + i % 26) ^ mask[i % 4];
+    }
+    return header + 4 + size;
+}
+
+static size_t echo_length(size_t size) {
+    return size + (size < 126 ? 2 : size < 65536 ? 4 : 10);
+}
+
+// Read everything available; echoes all have the same length
+static int drain_client(bench_client_t *client, size_t echo) {
+    uint8_t buffer[65536];
+    
+    while (1) {
+        ssize_t n = ws_transport_read(&client->transport, buffer, sizeof(buffer));
+        if (n < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        if (n == 0) {
+            return -1;
+        }
+        
+        size_t offset = 0;
+        if (!client->upgraded) {
+            // The response arrives before any echo, and in one piece
+            while (offset + 4 <= (size_t)n && memcmp(buffer + offset, "\r\n\r\n", 4) != 0) {
+                offset++;
+            }
+            if (offset + 4 > (size_t)n) {
+                continue;
+            }
+            offset += 4;
+            client->upgraded = true;
+        }
+        
+        client->partial += (size_t)n - offset;
+        client->received += (long)(client->partial / echo);
+        client->partial %= echo;
+    }
+}
+
+static int make_pair(bool memory, ws_transport_t *client, ws_transport_t *server) {
+    if (memory) {
+        return ws_transport_init_memory_pair(client, server, 0, NULL);
+    }
+    
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds) != 0) {
+        return -1;
+    }
+    ws_transport_init_socket(client, fds[0]);
+    ws_transport_init_socket(server, fds[1]);
+    return 0;
+}
+
+static int run(bool memory, int count, long messages, size_t size, int window) {
+    bench_client_t *clients = calloc((size_t)count, sizeof(bench_client_t));
+    uint8_t *frame = malloc(size + 14);
+    if (!clients || !frame) {
+        perror("malloc");
+        return -1;
+    }
+    size_t frame_length = encode_frame(frame, size);
+    size_t echo = echo_length(size);
+    
+    ws_server_t server;
+    ws_server_create(&server);
+    server.config.max_frame_size = 0;
+    server.on_connect = on_connect;
+    server.on_message = on_message;
+    open_count = 0;
+    
+    for (int i = 0; i < count; i++) {
+        ws_transport_t end;
+        if (make_pair(memory, &clients[i].transport, &end) != 0 ||
+            !ws_server_attach(&server, &end, memory ? "memory" : "socketpair")) {
+            fprintf(stderr, "Connection %d failed\n", i);
+            return -1;
+        }
+        struct iovec iov = { (void *)request, sizeof(request) - 1 };
+        ws_transport_writev(&clients[i].transport, &iov, 1);
+    }
+    
+    while (open_count < count) {
+        ws_server_step(&server, 0);
+    }
+    
+    int64_t start = now_ns();
+    long total = (long)count * messages;
+    long done = 0;
+    
+    while (done < total) {
+        // Keep a window of messages in flight on every connection
+        for (int i = 0; i < count; i++) {
+            bench_client_t *client = &clients[i];
+            while (client->sent < messages && client->sent - client->received < window) {
+                struct iovec iov = { frame, frame_length };
+                if (ws_transport_writev(&client->transport, &iov, 1) != (ssize_t)frame_length) {
+                    break; // Frames are small enough to go whole or not at all
+                }
+                client->sent++;
+            }
+        }
+        
+        ws_server_step(&server, 0);
+        
+        done = 0;
+        for (int i = 0; i < count; i++) {
+            if (drain_client(&clients[i], echo) != 0) {
+                fprintf(stderr, "Connection %d closed\n", i);
+                return -1;
+            }
+            done += clients[i].received;
+        }
+    }
+    
+    double seconds = (now_ns() - start) / 1e9;
+    printf("%-10s %8ld messages of %zu bytes in %.3f s: %9.0f msg/s, %6.0f ns/msg\n",
+           memory ? "memory" : "socketpair", total, size, seconds,
+           seconds > 0 ? total / seconds : 0.0, seconds * 1e9 / total);
+    
+    for (int i = 0; i < count; i++) {
+        ws_transport_close(&clients[i].transport);
+    }
+    ws_server_cleanup(&server);
+    free(frame);
+    free(clients);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int count = argc > 1 ? atoi(argv[1]) : 16;
+    long messages = argc > 2 ? atol(argv[2]) : 100000;
+    size_t size = argc > 3 ? (size_t)atol(argv[3]) : 64;
+    int window = 16;
+    
+    if (count <= 0 || messages <= 0 || size + 14 > WS_MEMORY_TRANSPORT_SIZE) {
+        fprintf(stderr, "Usage: %s [connections] [messages per connection] [message size]\n", argv[0]);
+        return 1;
+    }
+    
+    // Echoes must fit the window into the memory ring of every connection
+    if ((size_t)window * (size + 14) > WS_MEMORY_TRANSPORT_SIZE) {
+        window = (int)(WS_MEMORY_TRANSPORT_SIZE / (size + 14));
+    }
+    
+    if (run(true, count, messages, size, window) != 0 || run(false, count, messages, size, window) != 0) {
+        return 1;
+    }
+    return 0;
+}
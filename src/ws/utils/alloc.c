@@ -0,0 +1,45 @@
+#include "alloc.h"
+#include <stdlib.h>
+#include <string.h>
+
+void *ws_mem_alloc(const ws_allocator_t *allocator, size_t size) {
+    if (!allocator) {
+        return malloc(size);
+    }
+    
+    return allocator->alloc(allocator->ctx, size);
+}
+
+void *ws_mem_realloc(const ws_allocator_t *allocator, void *ptr, size_t old_size, size_t new_size) {
+    if (!allocator) {
+        return realloc(ptr, new_size);
+    }
+    
+    if (allocator->realloc) {
+        return allocator->realloc(allocator->ctx, ptr, old_size, new_size);
+    }
+    
+    void *moved = allocator->alloc(allocator->ctx, new_size);
+    if (!moved) {
+        return NULL;
+    }
+    
+    if (ptr) {
+        memcpy(moved, ptr, old_size < new_size ? old_size : new_size);
+        allocator->free(allocator->ctx, ptr, old_size);
+    }
+    return moved;
+}
+
+void ws_mem_free(const ws_allocator_t *allocator, void *ptr, size_t size) {
+    if (!ptr) {
+        return;
+    }
+    
+    if (!allocator) {
+        free(ptr);
+        return;
+    }
+    
+    allocator->free(allocator->ctx, ptr, size);
+}
@@ -0,0 +1,50 @@
+#ifndef WS_ALLOC_H
+#define WS_ALLOC_H
+
+#include <stddef.h>
+
+/**
+ * Application-provided memory allocator
+ *
+ * Every function gets the context pointer and the size of the block it
+ * operates on, so arena and size-class allocators need no headers of
+ * their own. realloc may be NULL, in which case blocks are moved with
+ * alloc, memcpy and free.
+ */
+typedef struct {
+    void *(*alloc)(void *ctx, size_t size);
+    void *(*realloc)(void *ctx, void *ptr, size_t old_size, size_t new_size);
+    void (*free)(void *ctx, void *ptr, size_t size);
+    void *ctx;
+} ws_allocator_t;
+
+/**
+ * Allocate a block
+ *
+ * @param allocator Allocator, or NULL for malloc
+ * @param size Size in bytes
+ * @return Block, or NULL on failure
+ */
+void *ws_mem_alloc(const ws_allocator_t *allocator, size_t size);
+
+/**
+ * Resize a block
+ *
+ * @param allocator Allocator the block came from, or NULL for malloc
+ * @param ptr Block, or NULL to allocate
+ * @param old_size Current size of the block
+ * @param new_size New size in bytes
+ * @return Resized block, or NULL on failure with ptr left untouched
+ */
+void *ws_mem_realloc(const ws_allocator_t *allocator, void *ptr, size_t old_size, size_t new_size);
+
+/**
+ * Free a block
+ *
+ * @param allocator Allocator the block came from, or NULL for malloc
+ * @param ptr Block, or NULL
+ * @param size Size of the block
+ */
+void ws_mem_free(const ws_allocator_t *allocator, void *ptr, size_t size);
+
+#endif /* WS_ALLOC_H */
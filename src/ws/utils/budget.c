@@ -0,0 +1,43 @@
+#include "budget.h"
+
+void ws_budget_init(ws_memory_budget_t *budget, size_t limit) {
+    budget->limit = limit;
+    budget->used = 0;
+    budget->peak = 0;
+    budget->holders = 0;
+    budget->paused = 0;
+    budget->rejected = 0;
+}
+
+void ws_budget_charge(ws_memory_budget_t *budget, size_t *held, size_t now) {
+    if (!budget) {
+        *held = now;
+        return;
+    }
+    
+    budget->used = budget->used - *held + now;
+    *held = now;
+    if (budget->used > budget->peak) {
+        budget->peak = budget->used;
+    }
+}
+
+bool ws_budget_admit(ws_memory_budget_t *budget, size_t growth) {
+    if (budget->limit == 0 || (budget->used <= budget->limit && growth <= budget->limit - budget->used)) {
+        return true;
+    }
+    
+    budget->rejected++;
+    return false;
+}
+
+bool ws_budget_over_share(const ws_memory_budget_t *budget, size_t held) {
+    if (budget->limit == 0 || held == 0 ||
+        budget->used < budget->limit / 100 * WS_BUDGET_PRESSURE) {
+        return false;
+    }
+    
+    // The heaviest holders pause first; with everyone even, all of them do
+    int holders = budget->holders > 0 ? budget->holders : 1;
+    return held >= budget->limit / (size_t)holders;
+}
@@ -0,0 +1,65 @@
+#ifndef WS_BUDGET_H
+#define WS_BUDGET_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#define WS_BUDGET_PRESSURE 75 // Percent of the limit above which reads of heavy holders pause
+
+/**
+ * Server-wide account of buffered memory
+ *
+ * Holders (a connection's receive and reassembly buffers, its output
+ * queue) charge what they hold now, and the account keeps the sum. Large
+ * growth has to be admitted first; once the sum is above
+ * WS_BUDGET_PRESSURE percent of the limit, holders with more than an even
+ * share stop taking input until memory is released. Not thread-safe.
+ */
+typedef struct {
+    size_t limit;              // Bytes allowed, 0 for no limit
+    size_t used;               // Bytes charged by all holders
+    size_t peak;               // Highest used seen
+    int holders;               // Connections holding memory at the last count
+    int paused;                // Connections whose reads were paused in the last step
+    uint64_t rejected;         // Growth refused because it did not fit
+} ws_memory_budget_t;
+
+/**
+ * Initialize an empty budget
+ *
+ * @param budget Budget
+ * @param limit Bytes allowed, 0 for no limit
+ */
+void ws_budget_init(ws_memory_budget_t *budget, size_t limit);
+
+/**
+ * Update the charge of one holder
+ *
+ * @param budget Budget, or NULL to do nothing
+ * @param held What the holder is charged with so far, updated to now
+ * @param now Bytes the holder holds now
+ */
+void ws_budget_charge(ws_memory_budget_t *budget, size_t *held, size_t now);
+
+/**
+ * Ask whether memory may grow by some bytes
+ *
+ * Refusals are counted in rejected.
+ *
+ * @param budget Budget
+ * @param growth Bytes about to be allocated
+ * @return true if the growth fits the limit
+ */
+bool ws_budget_admit(ws_memory_budget_t *budget, size_t growth);
+
+/**
+ * Whether a holder should stop taking input
+ *
+ * @param budget Budget
+ * @param held Bytes the holder holds
+ * @return true under pressure for holders with at least limit / holders bytes
+ */
+bool ws_budget_over_share(const ws_memory_budget_t *budget, size_t held);
+
+#endif /* WS_BUDGET_H */
@@ -0,0 +1,86 @@
+#include "capture.h"
+#include "latency.h"
+#include <string.h>
+
+#define WS_CAPTURE_BUFFER (1 << 20)
+
+ws_capture_t *ws_capture_open(const char *path, uint32_t sample_rate, size_t max_payload) {
+    ws_capture_t *capture = calloc(1, sizeof(*capture));
+    if (!capture) {
+        perror("calloc");
+        return NULL;
+    }
+    
+    capture->file = fopen(path, "wb");
+    if (!capture->file) {
+        perror("fopen");
+        free(capture);
+        return NULL;
+    }
+    
+    // Records are small; write them out in large blocks
+    setvbuf(capture->file, NULL, _IOFBF, WS_CAPTURE_BUFFER);
+    
+    capture->start = ws_latency_now();
+    capture->sample_rate = sample_rate > 0 ? sample_rate : 1;
+    capture->max_payload = max_payload;
+    
+    ws_capture_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, WS_CAPTURE_MAGIC, sizeof(header.magic));
+    header.version = WS_CAPTURE_VERSION;
+    header.sample_rate = capture->sample_rate;
+    header.start_realtime = ws_latency_realtime();
+    
+    if (fwrite(&header, sizeof(header), 1, capture->file) != 1) {
+        perror("fwrite");
+        fclose(capture->file);
+        free(capture);
+        return NULL;
+    }
+    
+    return capture;
+}
+
+bool ws_capture_sampled(const ws_capture_t *capture, uint64_t connection) {
+    return connection % capture->sample_rate == 0;
+}
+
+void ws_capture_record(ws_capture_t *capture, uint64_t connection, uint8_t type,
+                       uint8_t opcode, bool fin, uint64_t length, const uint8_t *payload) {
+    if (capture->failed) {
+        return;
+    }
+    
+    ws_capture_record_t record;
+    memset(&record, 0, sizeof(record));
+    record.time = (uint64_t)(ws_latency_now() - capture->start);
+    record.connection = connection;
+    record.length = length > UINT32_MAX ? UINT32_MAX : (uint32_t)length;
+    record.type = type;
+    record.opcode = opcode;
+    record.fin = fin ? 1 : 0;
+    
+    // Only whole payloads are kept, so replayed text stays valid UTF-8
+    if (payload && length > 0 && length <= capture->max_payload) {
+        record.captured_length = (uint32_t)length;
+    }
+    
+    if (fwrite(&record, sizeof(record), 1, capture->file) != 1 ||
+        (record.captured_length > 0 &&
+         fwrite(payload, record.captured_length, 1, capture->file) != 1)) {
+        perror("capture write failed");
+        capture->failed = true;
+    }
+}
+
+void ws_capture_close(ws_capture_t *capture) {
+    if (!capture) {
+        return;
+    }
+    
+    if (fclose(capture->file) != 0) {
+        perror("fclose");
+    }
+    free(capture);
+}
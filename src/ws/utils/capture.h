@@ -0,0 +1,92 @@
+#ifndef WS_CAPTURE_H
+#define WS_CAPTURE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+/**
+ * Capture file layout
+ *
+ * A ws_capture_header_t followed by ws_capture_record_t entries in the
+ * order they happened, each followed by captured_length payload bytes.
+ * Integers are in host byte order.
+ */
+#define WS_CAPTURE_MAGIC "WSCAP1\0\0"
+#define WS_CAPTURE_VERSION 1
+
+#define WS_CAPTURE_OPEN  1             // Handshake completed
+#define WS_CAPTURE_FRAME 2             // Frame received
+#define WS_CAPTURE_CLOSE 3             // Connection closed, length holds the close code
+
+typedef struct {
+    char magic[8];                     // WS_CAPTURE_MAGIC
+    uint32_t version;                  // WS_CAPTURE_VERSION
+    uint32_t sample_rate;              // One in this many connections was captured
+    int64_t start_realtime;            // CLOCK_REALTIME at the start of the capture, ns
+} ws_capture_header_t;
+
+typedef struct {
+    uint64_t time;                     // Nanoseconds since the start of the capture
+    uint64_t connection;               // Connection id
+    uint32_t length;                   // Payload length, or close code
+    uint32_t captured_length;          // Payload bytes following the record
+    uint8_t type;                      // WS_CAPTURE_OPEN, _FRAME or _CLOSE
+    uint8_t opcode;                    // Frame opcode
+    uint8_t fin;                       // Frame FIN bit
+    uint8_t reserved[5];
+} ws_capture_record_t;
+
+/**
+ * Open capture file
+ */
+typedef struct {
+    FILE *file;
+    int64_t start;                     // CLOCK_MONOTONIC at the start of the capture, ns
+    uint32_t sample_rate;              // Capture one in this many connections
+    size_t max_payload;                // Payloads up to this size are stored
+    bool failed;                       // A write failed; nothing more is recorded
+} ws_capture_t;
+
+/**
+ * Create a capture file
+ *
+ * @param path File to create or truncate
+ * @param sample_rate Capture one in this many connections, at least 1
+ * @param max_payload Store payloads of up to this many bytes, 0 for none
+ * @return Capture, or NULL on failure
+ */
+ws_capture_t *ws_capture_open(const char *path, uint32_t sample_rate, size_t max_payload);
+
+/**
+ * Check whether a connection is sampled
+ *
+ * @param capture Capture
+ * @param connection Connection id
+ * @return true if its traffic is recorded
+ */
+bool ws_capture_sampled(const ws_capture_t *capture, uint64_t connection);
+
+/**
+ * Append a record
+ *
+ * @param capture Capture
+ * @param connection Connection id
+ * @param type WS_CAPTURE_OPEN, _FRAME or _CLOSE
+ * @param opcode Frame opcode
+ * @param fin Frame FIN bit
+ * @param length Payload length, or close code
+ * @param payload Payload, stored if no longer than max_payload
+ */
+void ws_capture_record(ws_capture_t *capture, uint64_t connection, uint8_t type,
+                       uint8_t opcode, bool fin, uint64_t length, const uint8_t *payload);
+
+/**
+ * Flush and close a capture file
+ *
+ * @param capture Capture
+ */
+void ws_capture_close(ws_capture_t *capture);
+
+#endif /* WS_CAPTURE_H */
@@ -12,4 +12,20 @@ void ws_config_init(ws_config_t *config) {
     config->buffer_size = WS_BUFFER_SIZE;
     config->ping_interval = WS_PING_INTERVAL;
     config->timeout = WS_TIMEOUT;
+    config->zerocopy_threshold = WS_ZEROCOPY_THRESHOLD;
+    config->fragment_size = WS_FRAGMENT_SIZE;
+    config->read_budget = WS_READ_BUDGET;
+    config->frame_budget = WS_FRAME_BUDGET;
+    config->step_budget = WS_STEP_BUDGET;
+    config->coalesce = false;
+    config->accept_batch = WS_ACCEPT_BATCH;
+    config->handshake_timeout = WS_HANDSHAKE_TIMEOUT;
+    config->linger_timeout = WS_LINGER_TIMEOUT;
+    config->rx_pool_size = WS_RX_POOL_SIZE;
+    config->busy_poll = WS_BUSY_POLL;
+    config->ingest_budget = WS_INGEST_BUDGET;
+    config->high_water = WS_HIGH_WATER;
+    config->slow_policy = 0;
+    config->http2 = WS_HTTP2;
+    config->memory_limit = WS_MEMORY_LIMIT;
 }
@@ -1,6 +1,9 @@
 #ifndef WS_CONFIG_H
 #define WS_CONFIG_H
 
+#include <stddef.h>
+#include <stdbool.h>
+
 // Default WebSocket configuration
 #define WS_DEFAULT_PORT 8080
 #define WS_MAX_CLIENTS 64
@@ -8,6 +11,20 @@
 #define WS_BUFFER_SIZE 8192
 #define WS_PING_INTERVAL 30000 // 30 seconds
 #define WS_TIMEOUT 60000       // 60 seconds
+#define WS_ZEROCOPY_THRESHOLD 0 // Disabled
+#define WS_FRAGMENT_SIZE 65536
+#define WS_READ_BUDGET 65536   // Bytes per client per step
+#define WS_FRAME_BUDGET 64     // Frames per client per step
+#define WS_STEP_BUDGET 5000    // 5 milliseconds
+#define WS_ACCEPT_BATCH 128    // Connections per step
+#define WS_HANDSHAKE_TIMEOUT 5000 // 5 seconds
+#define WS_LINGER_TIMEOUT 30000 // 30 seconds
+#define WS_RX_POOL_SIZE 1024   // Idle receive buffers kept
+#define WS_BUSY_POLL 0         // Disabled
+#define WS_INGEST_BUDGET 1024  // Ingested messages per step
+#define WS_HIGH_WATER 0        // No limit
+#define WS_HTTP2 false         // Only HTTP/1.1 upgrades
+#define WS_MEMORY_LIMIT ((size_t)256 << 20) // 256 MiB buffered across all connections
 
 // WebSocket server configuration structure
 typedef struct {
@@ -17,6 +34,22 @@ typedef struct {
     int buffer_size;           // Buffer size for reading/writing
     int ping_interval;         // Ping interval in milliseconds
     int timeout;               // Connection timeout in milliseconds
+    size_t zerocopy_threshold; // Binary payloads this large use MSG_ZEROCOPY, 0 to disable
+    size_t fragment_size;      // Larger messages are split into frames of this size, 0 to disable
+    size_t read_budget;        // Bytes read from one client per step, 0 for no limit
+    int frame_budget;          // Frames handled for one client per step, 0 for no limit
+    int step_budget;           // Time spent reading clients per step in microseconds, 0 for no limit
+    bool coalesce;             // Write frames sent during a step together at its end
+    int accept_batch;          // Connections accepted per step, 0 for no limit
+    int handshake_timeout;     // Time allowed for the opening handshake in milliseconds, 0 for no limit
+    int linger_timeout;        // Time a closed socket waits for zero-copy completions before it is reset, in milliseconds
+    int rx_pool_size;          // Idle receive buffers kept for reuse across clients
+    int busy_poll;             // Spin this many microseconds before blocking in poll, 0 to disable
+    int ingest_budget;         // Messages taken from the ingest ring per step, 0 for no limit
+    size_t high_water;         // Output bytes queued for a client before slow_policy applies, 0 for no limit
+    int slow_policy;           // Default ws_slow_policy_t of new connections
+    bool http2;                // Accept RFC 8441 WebSockets from clients that start with the HTTP/2 preface
+    size_t memory_limit;       // Bytes all clients may hold in receive, reassembly and output buffers, 0 for no limit
 } ws_config_t;
 
 /**
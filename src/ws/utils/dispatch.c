@@ -0,0 +1,553 @@
+#include "dispatch.h"
+#include "helper.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define INITIAL_DEQUE_SIZE 64
+#define MAX_JOBS_PER_TURN 32
+
+/**
+ * Message waiting to be delivered to on_message
+ */
+typedef struct ws_dispatch_job {
+    uint8_t *data;                  // Copy of the message payload
+    size_t len;                     // Payload length
+    bool is_binary;                 // Whether the message is binary
+    int64_t submitted_ns;           // Monotonic time of submission, 0 if not traced
+    struct ws_dispatch_job *next;   // Next job of the same connection
+} ws_dispatch_job_t;
+
+/**
+ * Per-connection message queue
+ *
+ * A connection is pushed onto a worker deque only while it is not already
+ * scheduled, so at most one worker drains it at any time.
+ */
+struct ws_mailbox {
+    pthread_mutex_t lock;
+    ws_dispatch_job_t *head;
+    ws_dispatch_job_t *tail;
+    bool scheduled;
+};
+
+/**
+ * Worker thread with its own deque of ready connections
+ */
+typedef struct {
+    ws_dispatch_t *dispatch;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    ws_connection_t **deque;        // Ring buffer of ready connections
+    size_t capacity;
+    size_t head;
+    size_t count;
+} ws_dispatch_worker_t;
+
+struct ws_dispatch {
+    ws_dispatch_worker_t *workers;
+    int num_workers;
+    int capacity;                   // Allocated entries of workers
+    unsigned int next_worker;       // Round-robin submission cursor (loop thread only)
+    int queued;                     // Ready connections across all deques
+    bool stopping;
+    bool joined;                    // Worker threads have exited
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+    
+    pthread_mutex_t reply_lock;
+    ws_dispatch_reply_t *reply_head;
+    ws_dispatch_reply_t *reply_tail;
+    int wake_pipe[2];               // Readable while replies are pending
+    bool wake_pending;
+    
+    void (*on_message)(ws_connection_t *connection, const uint8_t *data, size_t len, bool is_binary);
+    const ws_allocator_t *allocator; // Source of jobs, payload copies and replies
+};
+
+static __thread ws_dispatch_worker_t *current_worker = NULL;
+static __thread ws_dispatch_job_t *current_job = NULL;
+static __thread ws_connection_t *current_connection = NULL;
+
+// Free a job and the payload copy it still owns
+static void ws_dispatch_free_job(const ws_allocator_t *allocator, ws_dispatch_job_t *job) {
+    ws_mem_free(allocator, job->data, job->len ? job->len : 1);
+    ws_mem_free(allocator, job, sizeof(*job));
+}
+
+// Push a ready connection to the back of a worker deque
+static int deque_push(ws_dispatch_worker_t *worker, ws_connection_t *connection) {
+    pthread_mutex_lock(&worker->lock);
+    
+    if (worker->count == worker->capacity) {
+        size_t new_capacity = worker->capacity ? worker->capacity * 2 : INITIAL_DEQUE_SIZE;
+        const ws_allocator_t *allocator = worker->dispatch->allocator;
+        ws_connection_t **new_deque = (ws_connection_t **)ws_mem_alloc(allocator, new_capacity * sizeof(*new_deque));
+        if (!new_deque) {
+            pthread_mutex_unlock(&worker->lock);
+            return -1;
+        }
+        
+        for (size_t i = 0; i < worker->count; i++) {
+            new_deque[i] = worker->deque[(worker->head + i) % worker->capacity];
+        }
+        
+        ws_mem_free(allocator, worker->deque, worker->capacity * sizeof(*worker->deque));
+        worker->deque = new_deque;
+        worker->capacity = new_capacity;
+        worker->head = 0;
+    }
+    
+    worker->deque[(worker->head + worker->count) % worker->capacity] = connection;
+    worker->count++;
+    
+    pthread_mutex_unlock(&worker->lock);
+    return 0;
+}
+
+// Pop from the front (owner) or steal from the back (other workers)
+static ws_connection_t *deque_pop(ws_dispatch_worker_t *worker, bool steal) {
+    ws_connection_t *connection = NULL;
+    
+    pthread_mutex_lock(&worker->lock);
+    
+    if (worker->count > 0) {
+        if (steal) {
+            connection = worker->deque[(worker->head + worker->count - 1) % worker->capacity];
+        } else {
+            connection = worker->deque[worker->head];
+            worker->head = (worker->head + 1) % worker->capacity;
+        }
+        worker->count--;
+    }
+    
+    pthread_mutex_unlock(&worker->lock);
+    return connection;
+}
+
+// Mark a connection ready and wake an idle worker
+static int ws_dispatch_schedule(ws_dispatch_t *dispatch, ws_dispatch_worker_t *worker,
+                                ws_connection_t *connection) {
+    if (deque_push(worker, connection) != 0) {
+        return -1;
+    }
+    
+    __atomic_add_fetch(&dispatch->queued, 1, __ATOMIC_SEQ_CST);
+    
+    pthread_mutex_lock(&dispatch->idle_lock);
+    pthread_cond_signal(&dispatch->idle_cond);
+    pthread_mutex_unlock(&dispatch->idle_lock);
+    
+    return 0;
+}
+
+// Find a ready connection: own deque first, then steal from the others
+static ws_connection_t *ws_dispatch_next(ws_dispatch_worker_t *worker) {
+    ws_dispatch_t *dispatch = worker->dispatch;
+    ws_connection_t *connection = deque_pop(worker, false);
+    
+    if (!connection) {
+        int self = (int)(worker - dispatch->workers);
+        for (int i = 1; i < dispatch->num_workers && !connection; i++) {
+            connection = deque_pop(&dispatch->workers[(self + i) % dispatch->num_workers], true);
+        }
+    }
+    
+    if (connection) {
+        __atomic_sub_fetch(&dispatch->queued, 1, __ATOMIC_SEQ_CST);
+    }
+    
+    return connection;
+}
+
+// Push a reply and wake the event loop if it is not already woken
+static int ws_dispatch_push_reply(ws_dispatch_t *dispatch, ws_connection_t *connection,
+                                  ws_output_item_t *item) {
+    ws_dispatch_reply_t *reply = (ws_dispatch_reply_t *)ws_mem_alloc(dispatch->allocator, sizeof(ws_dispatch_reply_t));
+    if (!reply) {
+        return -1;
+    }
+    
+    reply->connection = connection;
+    reply->item = item;
+    reply->next = NULL;
+    
+    pthread_mutex_lock(&dispatch->reply_lock);
+    
+    if (dispatch->reply_tail) {
+        dispatch->reply_tail->next = reply;
+    } else {
+        dispatch->reply_head = reply;
+    }
+    dispatch->reply_tail = reply;
+    
+    bool wake = !dispatch->wake_pending;
+    dispatch->wake_pending = true;
+    
+    pthread_mutex_unlock(&dispatch->reply_lock);
+    
+    if (wake) {
+        uint8_t byte = 1;
+        if (write(dispatch->wake_pipe[1], &byte, 1) < 0) {
+            // Pipe full means the loop is already going to wake up
+        }
+    }
+    
+    return 0;
+}
+
+// Deliver queued messages of one connection, in order
+static void ws_dispatch_run(ws_dispatch_worker_t *worker, ws_connection_t *connection) {
+    ws_dispatch_t *dispatch = worker->dispatch;
+    struct ws_mailbox *mailbox = connection->info->mailbox;
+    int processed = 0;
+    
+    pthread_mutex_lock(&mailbox->lock);
+    ws_dispatch_job_t *job = mailbox->head;
+    if (job) {
+        mailbox->head = job->next;
+        if (!mailbox->head) {
+            mailbox->tail = NULL;
+        }
+    }
+    pthread_mutex_unlock(&mailbox->lock);
+    
+    while (job) {
+        ws_latency_t *latency = connection->server ? connection->server->latency : NULL;
+        int64_t start = latency ? ws_latency_now() : 0;
+        if (latency && job->submitted_ns) {
+            ws_histogram_record(&latency->stages[WS_LATENCY_QUEUE], (uint64_t)(start - job->submitted_ns));
+        }
+        
+        current_job = job;
+        current_connection = connection;
+        dispatch->on_message(connection, job->data, job->len, job->is_binary);
+        current_job = NULL;
+        current_connection = NULL;
+        
+        if (latency) {
+            ws_histogram_record(&latency->stages[WS_LATENCY_HANDLER], (uint64_t)(ws_latency_now() - start));
+        }
+        processed++;
+        
+        // Look at the next job before completing this one: once the
+        // completion marker is queued the loop may free the connection
+        pthread_mutex_lock(&mailbox->lock);
+        ws_dispatch_job_t *next = mailbox->head;
+        bool requeue = false;
+        
+        if (next && processed >= MAX_JOBS_PER_TURN) {
+            // Give other connections a turn; stays scheduled
+            next = NULL;
+            requeue = true;
+        } else if (next) {
+            mailbox->head = next->next;
+            if (!mailbox->head) {
+                mailbox->tail = NULL;
+            }
+        } else {
+            mailbox->scheduled = false;
+        }
+        pthread_mutex_unlock(&mailbox->lock);
+        
+        if (requeue && ws_dispatch_schedule(dispatch, worker, connection) != 0) {
+            // Could not yield; keep draining on this worker instead
+            pthread_mutex_lock(&mailbox->lock);
+            next = mailbox->head;
+            mailbox->head = next->next;
+            if (!mailbox->head) {
+                mailbox->tail = NULL;
+            }
+            pthread_mutex_unlock(&mailbox->lock);
+        }
+        
+        ws_dispatch_free_job(dispatch->allocator, job);
+        
+        // Completion marker releases the connection reference held by the job
+        while (ws_dispatch_push_reply(dispatch, connection, NULL) != 0) {
+            usleep(1000);
+        }
+        
+        job = next;
+    }
+}
+
+static void *ws_dispatch_thread(void *arg) {
+    ws_dispatch_worker_t *worker = (ws_dispatch_worker_t *)arg;
+    ws_dispatch_t *dispatch = worker->dispatch;
+    
+    current_worker = worker;
+    
+    while (1) {
+        ws_connection_t *connection = ws_dispatch_next(worker);
+        if (connection) {
+            ws_dispatch_run(worker, connection);
+            continue;
+        }
+        
+        pthread_mutex_lock(&dispatch->idle_lock);
+        while (!dispatch->stopping && __atomic_load_n(&dispatch->queued, __ATOMIC_SEQ_CST) == 0) {
+            pthread_cond_wait(&dispatch->idle_cond, &dispatch->idle_lock);
+        }
+        bool done = dispatch->stopping && __atomic_load_n(&dispatch->queued, __ATOMIC_SEQ_CST) == 0;
+        pthread_mutex_unlock(&dispatch->idle_lock);
+        
+        if (done) {
+            break;
+        }
+    }
+    
+    current_worker = NULL;
+    return NULL;
+}
+
+ws_dispatch_t *ws_dispatch_create(int num_workers,
+                                  void (*on_message)(ws_connection_t *connection, const uint8_t *data,
+                                                     size_t len, bool is_binary),
+                                  const ws_allocator_t *allocator) {
+    if (num_workers <= 0 || !on_message) {
+        return NULL;
+    }
+    
+    ws_dispatch_t *dispatch = (ws_dispatch_t *)ws_mem_alloc(allocator, sizeof(ws_dispatch_t));
+    if (!dispatch) {
+        return NULL;
+    }
+    memset(dispatch, 0, sizeof(*dispatch));
+    dispatch->allocator = allocator;
+    
+    size_t workers_size = num_workers * sizeof(ws_dispatch_worker_t);
+    dispatch->workers = (ws_dispatch_worker_t *)ws_mem_alloc(allocator, workers_size);
+    if (!dispatch->workers) {
+        ws_mem_free(allocator, dispatch, sizeof(*dispatch));
+        return NULL;
+    }
+    memset(dispatch->workers, 0, workers_size);
+    dispatch->capacity = num_workers;
+    
+    if (pipe(dispatch->wake_pipe) == -1) {
+        perror("pipe failed");
+        ws_mem_free(allocator, dispatch->workers, workers_size);
+        ws_mem_free(allocator, dispatch, sizeof(*dispatch));
+        return NULL;
+    }
+    ws_set_nonblocking(dispatch->wake_pipe[0]);
+    ws_set_nonblocking(dispatch->wake_pipe[1]);
+    
+    dispatch->on_message = on_message;
+    pthread_mutex_init(&dispatch->idle_lock, NULL);
+    pthread_cond_init(&dispatch->idle_cond, NULL);
+    pthread_mutex_init(&dispatch->reply_lock, NULL);
+    
+    for (int i = 0; i < num_workers; i++) {
+        ws_dispatch_worker_t *worker = &dispatch->workers[i];
+        worker->dispatch = dispatch;
+        pthread_mutex_init(&worker->lock, NULL);
+        
+        if (pthread_create(&worker->thread, NULL, ws_dispatch_thread, worker) != 0) {
+            fprintf(stderr, "Failed to start dispatch worker %d\n", i);
+            pthread_mutex_destroy(&worker->lock);
+            break;
+        }
+        dispatch->num_workers++;
+    }
+    
+    if (dispatch->num_workers == 0) {
+        ws_dispatch_destroy(dispatch);
+        return NULL;
+    }
+    
+    return dispatch;
+}
+
+void ws_dispatch_stop(ws_dispatch_t *dispatch) {
+    if (!dispatch || dispatch->joined) {
+        return;
+    }
+    
+    pthread_mutex_lock(&dispatch->idle_lock);
+    dispatch->stopping = true;
+    pthread_cond_broadcast(&dispatch->idle_cond);
+    pthread_mutex_unlock(&dispatch->idle_lock);
+    
+    for (int i = 0; i < dispatch->num_workers; i++) {
+        pthread_join(dispatch->workers[i].thread, NULL);
+    }
+    dispatch->joined = true;
+}
+
+void ws_dispatch_destroy(ws_dispatch_t *dispatch) {
+    if (!dispatch) {
+        return;
+    }
+    
+    ws_dispatch_stop(dispatch);
+    
+    for (int i = 0; i < dispatch->num_workers; i++) {
+        ws_dispatch_worker_t *worker = &dispatch->workers[i];
+        pthread_mutex_destroy(&worker->lock);
+        ws_mem_free(dispatch->allocator, worker->deque, worker->capacity * sizeof(*worker->deque));
+    }
+    
+    ws_dispatch_reply_t *reply = ws_dispatch_take_replies(dispatch);
+    while (reply) {
+        ws_dispatch_reply_t *next = reply->next;
+        if (reply->item) {
+            ws_output_item_free(reply->item);
+        }
+        ws_dispatch_free_reply(dispatch, reply);
+        reply = next;
+    }
+    
+    close(dispatch->wake_pipe[0]);
+    close(dispatch->wake_pipe[1]);
+    pthread_mutex_destroy(&dispatch->idle_lock);
+    pthread_cond_destroy(&dispatch->idle_cond);
+    pthread_mutex_destroy(&dispatch->reply_lock);
+    ws_mem_free(dispatch->allocator, dispatch->workers, dispatch->capacity * sizeof(ws_dispatch_worker_t));
+    ws_mem_free(dispatch->allocator, dispatch, sizeof(*dispatch));
+}
+
+int ws_dispatch_submit(ws_dispatch_t *dispatch, ws_connection_t *connection,
+                       const uint8_t *data, size_t len, bool is_binary) {
+    if (!dispatch || !connection) {
+        return -1;
+    }
+    
+    if (!connection->info->mailbox) {
+        struct ws_mailbox *mailbox = (struct ws_mailbox *)ws_mem_alloc(dispatch->allocator, sizeof(struct ws_mailbox));
+        if (!mailbox) {
+            return -1;
+        }
+        memset(mailbox, 0, sizeof(*mailbox));
+        pthread_mutex_init(&mailbox->lock, NULL);
+        connection->info->mailbox = mailbox;
+    }
+    
+    ws_dispatch_job_t *job = (ws_dispatch_job_t *)ws_mem_alloc(dispatch->allocator, sizeof(ws_dispatch_job_t));
+    if (!job) {
+        return -1;
+    }
+    
+    // Keep the allocation non-empty so empty messages still get a valid pointer
+    job->data = (uint8_t *)ws_mem_alloc(dispatch->allocator, len ? len : 1);
+    if (!job->data) {
+        ws_mem_free(dispatch->allocator, job, sizeof(*job));
+        return -1;
+    }
+    memcpy(job->data, data, len);
+    job->len = len;
+    job->is_binary = is_binary;
+    job->submitted_ns = connection->server && connection->server->latency ? ws_latency_now() : 0;
+    job->next = NULL;
+    
+    struct ws_mailbox *mailbox = connection->info->mailbox;
+    
+    pthread_mutex_lock(&mailbox->lock);
+    if (mailbox->tail) {
+        mailbox->tail->next = job;
+    } else {
+        mailbox->head = job;
+    }
+    mailbox->tail = job;
+    
+    bool schedule = !mailbox->scheduled;
+    mailbox->scheduled = true;
+    pthread_mutex_unlock(&mailbox->lock);
+    
+    if (schedule) {
+        ws_dispatch_worker_t *worker = &dispatch->workers[dispatch->next_worker++ % dispatch->num_workers];
+        if (ws_dispatch_schedule(dispatch, worker, connection) != 0) {
+            // No worker owns an unscheduled mailbox, so the job can be taken
+            // back; left queued it might never run and its reference would leak
+            pthread_mutex_lock(&mailbox->lock);
+            ws_dispatch_job_t **link = &mailbox->head;
+            ws_dispatch_job_t *previous = NULL;
+            while (*link != job) {
+                previous = *link;
+                link = &previous->next;
+            }
+            *link = NULL;
+            mailbox->tail = previous;
+            mailbox->scheduled = false;
+            pthread_mutex_unlock(&mailbox->lock);
+            
+            ws_dispatch_free_job(dispatch->allocator, job);
+            return -1;
+        }
+    }
+    
+    return 0;
+}
+
+int ws_dispatch_reply(ws_dispatch_t *dispatch, ws_connection_t *connection,
+                      ws_output_item_t *item) {
+    if (!dispatch || !connection || !item) {
+        return -1;
+    }
+    
+    return ws_dispatch_push_reply(dispatch, connection, item);
+}
+
+ws_dispatch_reply_t *ws_dispatch_take_replies(ws_dispatch_t *dispatch) {
+    uint8_t drain[64];
+    
+    while (read(dispatch->wake_pipe[0], drain, sizeof(drain)) > 0) {
+        // Empty the wake pipe
+    }
+    
+    pthread_mutex_lock(&dispatch->reply_lock);
+    ws_dispatch_reply_t *replies = dispatch->reply_head;
+    dispatch->reply_head = NULL;
+    dispatch->reply_tail = NULL;
+    dispatch->wake_pending = false;
+    pthread_mutex_unlock(&dispatch->reply_lock);
+    
+    return replies;
+}
+
+void ws_dispatch_free_reply(ws_dispatch_t *dispatch, ws_dispatch_reply_t *reply) {
+    ws_mem_free(dispatch->allocator, reply, sizeof(*reply));
+}
+
+int ws_dispatch_fd(ws_dispatch_t *dispatch) {
+    return dispatch->wake_pipe[0];
+}
+
+uint8_t *ws_dispatch_take_payload(ws_connection_t *connection, size_t *len) {
+    if (!current_job || current_connection != connection || !current_job->data) {
+        return NULL;
+    }
+    
+    uint8_t *data = current_job->data;
+    *len = current_job->len;
+    current_job->data = NULL;
+    return data;
+}
+
+ws_dispatch_t *ws_dispatch_current(void) {
+    return current_worker ? current_worker->dispatch : NULL;
+}
+
+void ws_dispatch_release_connection(ws_connection_t *connection) {
+    struct ws_mailbox *mailbox = connection->info->mailbox;
+    
+    if (!mailbox) {
+        return;
+    }
+    
+    // Jobs and mailboxes come from the pool's allocator, which is the server's
+    const ws_allocator_t *allocator = connection->server ? connection->server->allocator : NULL;
+    ws_dispatch_job_t *job = mailbox->head;
+    while (job) {
+        ws_dispatch_job_t *next = job->next;
+        ws_dispatch_free_job(allocator, job);
+        job = next;
+    }
+    
+    pthread_mutex_destroy(&mailbox->lock);
+    ws_mem_free(allocator, mailbox, sizeof(*mailbox));
+    connection->info->mailbox = NULL;
+}
@@ -0,0 +1,139 @@
+#ifndef WS_DISPATCH_H
+#define WS_DISPATCH_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "../ws.h"
+#include "output.h"
+
+/**
+ * Worker pool that runs on_message callbacks off the event-loop thread
+ */
+typedef struct ws_dispatch ws_dispatch_t;
+
+/**
+ * Reply produced by a worker, routed back to the event loop
+ */
+typedef struct ws_dispatch_reply {
+    ws_connection_t *connection;    // Connection the reply belongs to
+    ws_output_item_t *item;         // Frame to send, or NULL for a completion marker
+    struct ws_dispatch_reply *next; // Next reply in queue
+} ws_dispatch_reply_t;
+
+/**
+ * Create a worker pool and start its threads
+ *
+ * @param num_workers Number of worker threads
+ * @param on_message Callback invoked for every dispatched message
+ * @param allocator Allocator for jobs, payload copies and replies, NULL for
+ *                  malloc; must be thread-safe
+ * @return Worker pool, or NULL on error
+ */
+ws_dispatch_t *ws_dispatch_create(int num_workers,
+                                  void (*on_message)(ws_connection_t *connection, const uint8_t *data,
+                                                     size_t len, bool is_binary),
+                                  const ws_allocator_t *allocator);
+
+/**
+ * Stop all worker threads
+ *
+ * Messages already queued are still delivered before the workers exit,
+ * so their replies can be taken afterwards.
+ *
+ * @param dispatch Worker pool
+ */
+void ws_dispatch_stop(ws_dispatch_t *dispatch);
+
+/**
+ * Stop all worker threads and free the pool
+ *
+ * Replies that were never taken are freed without being sent.
+ *
+ * @param dispatch Worker pool
+ */
+void ws_dispatch_destroy(ws_dispatch_t *dispatch);
+
+/**
+ * Queue a message for a connection
+ *
+ * Messages of the same connection are delivered in order and never run
+ * concurrently. The payload is copied. Each submitted message produces
+ * exactly one completion marker in the reply queue once its callback
+ * has returned.
+ *
+ * @param dispatch Worker pool
+ * @param connection Connection the message arrived on
+ * @param data Message payload
+ * @param len Payload length
+ * @param is_binary Whether the message is binary
+ * @return 0 on success, -1 on error
+ */
+int ws_dispatch_submit(ws_dispatch_t *dispatch, ws_connection_t *connection,
+                       const uint8_t *data, size_t len, bool is_binary);
+
+/**
+ * Queue a frame for the event loop to send
+ *
+ * Takes ownership of item.
+ *
+ * @param dispatch Worker pool
+ * @param connection Destination connection
+ * @param item Frame to send
+ * @return 0 on success, -1 on error
+ */
+int ws_dispatch_reply(ws_dispatch_t *dispatch, ws_connection_t *connection,
+                      ws_output_item_t *item);
+
+/**
+ * Take all pending replies in the order they were produced
+ *
+ * @param dispatch Worker pool
+ * @return List of replies (caller frees each one with ws_dispatch_free_reply()
+ *         and takes its item), or NULL
+ */
+ws_dispatch_reply_t *ws_dispatch_take_replies(ws_dispatch_t *dispatch);
+
+/**
+ * Free a reply taken from the pool, but not its item
+ *
+ * @param dispatch Worker pool
+ * @param reply Reply
+ */
+void ws_dispatch_free_reply(ws_dispatch_t *dispatch, ws_dispatch_reply_t *reply);
+
+/**
+ * Get the file descriptor that becomes readable when replies are pending
+ *
+ * @param dispatch Worker pool
+ * @return File descriptor to poll for POLLIN
+ */
+int ws_dispatch_fd(ws_dispatch_t *dispatch);
+
+/**
+ * Take the payload of the message a worker is delivering
+ *
+ * @param connection Connection whose on_message is running
+ * @param len Receives the payload length
+ * @return malloc'd payload the caller now owns, or NULL if there is none
+ */
+uint8_t *ws_dispatch_take_payload(ws_connection_t *connection, size_t *len);
+
+/**
+ * Get the pool of the calling worker thread
+ *
+ * @return Worker pool, or NULL when not called from a worker thread
+ */
+ws_dispatch_t *ws_dispatch_current(void);
+
+/**
+ * Free the per-connection dispatch state
+ *
+ * Must only be called once no messages are pending for the connection.
+ *
+ * @param connection Connection
+ */
+void ws_dispatch_release_connection(ws_connection_t *connection);
+
+#endif /* WS_DISPATCH_H */
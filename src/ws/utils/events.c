@@ -0,0 +1,131 @@
+#include "events.h"
+#include <string.h>
+
+#define WS_EVENT_CHUNK_SIZE 65536
+
+void ws_event_queue_init(ws_event_queue_t *queue, const ws_allocator_t *allocator) {
+    queue->events = NULL;
+    queue->count = 0;
+    queue->head = 0;
+    queue->capacity = 0;
+    queue->chunks = NULL;
+    queue->allocator = allocator;
+}
+
+static void ws_event_chunk_free(ws_event_queue_t *queue, ws_event_chunk_t *chunk) {
+    if (chunk) {
+        ws_mem_free(queue->allocator, chunk, sizeof(*chunk) + chunk->size);
+    }
+}
+
+static uint8_t *ws_event_queue_alloc(ws_event_queue_t *queue, size_t size) {
+    ws_event_chunk_t *chunk = queue->chunks;
+    
+    if (!chunk || chunk->size - chunk->used < size) {
+        // Large payloads get a block of their own
+        size_t chunk_size = size > WS_EVENT_CHUNK_SIZE ? size : WS_EVENT_CHUNK_SIZE;
+        chunk = ws_mem_alloc(queue->allocator, sizeof(*chunk) + chunk_size);
+        if (!chunk) {
+            return NULL;
+        }
+        
+        chunk->size = chunk_size;
+        chunk->used = 0;
+        chunk->next = queue->chunks;
+        queue->chunks = chunk;
+    }
+    
+    uint8_t *data = chunk->data + chunk->used;
+    chunk->used += size;
+    return data;
+}
+
+ws_event_t *ws_event_queue_push(ws_event_queue_t *queue, ws_event_type_t type,
+                                struct ws_connection *connection,
+                                const void *data, size_t length, bool text) {
+    if (queue->count == queue->capacity) {
+        size_t capacity = queue->capacity ? queue->capacity * 2 : 64;
+        ws_event_t *events = ws_mem_realloc(queue->allocator, queue->events,
+                                            queue->capacity * sizeof(*events), capacity * sizeof(*events));
+        if (!events) {
+            return NULL;
+        }
+        queue->events = events;
+        queue->capacity = capacity;
+    }
+    
+    uint8_t *copy = NULL;
+    if (data || text) {
+        copy = ws_event_queue_alloc(queue, length + (text ? 1 : 0));
+        if (!copy) {
+            return NULL;
+        }
+        if (length > 0) {
+            memcpy(copy, data, length);
+        }
+        if (text) {
+            copy[length] = '\0';
+        }
+    }
+    
+    ws_event_t *event = &queue->events[queue->count++];
+    event->type = type;
+    event->connection = connection;
+    event->data = copy;
+    event->length = length;
+    event->is_binary = false;
+    event->code = 0;
+    
+    return event;
+}
+
+int ws_event_queue_take(ws_event_queue_t *queue, ws_event_t *events, int max) {
+    size_t available = queue->count - queue->head;
+    
+    if (max <= 0) {
+        return 0;
+    }
+    
+    size_t n = (size_t)max < available ? (size_t)max : available;
+    memcpy(events, &queue->events[queue->head], n * sizeof(*events));
+    queue->head += n;
+    
+    return (int)n;
+}
+
+bool ws_event_queue_pending(const ws_event_queue_t *queue) {
+    return queue->head < queue->count;
+}
+
+void ws_event_queue_reset(ws_event_queue_t *queue, void (*release)(struct ws_connection *connection)) {
+    if (release) {
+        for (size_t i = 0; i < queue->count; i++) {
+            release(queue->events[i].connection);
+        }
+    }
+    queue->count = 0;
+    queue->head = 0;
+    
+    // Keep one block for the next batch
+    ws_event_chunk_t *chunk = queue->chunks;
+    while (chunk && chunk->next) {
+        ws_event_chunk_t *next = chunk->next;
+        chunk->next = next->next;
+        ws_event_chunk_free(queue, next);
+    }
+    if (chunk) {
+        chunk->used = 0;
+        if (chunk->size > WS_EVENT_CHUNK_SIZE) {
+            // Do not hold on to a block sized for one large message
+            ws_event_chunk_free(queue, chunk);
+            queue->chunks = NULL;
+        }
+    }
+}
+
+void ws_event_queue_destroy(ws_event_queue_t *queue) {
+    ws_event_queue_reset(queue, NULL);
+    ws_event_chunk_free(queue, queue->chunks);
+    ws_mem_free(queue->allocator, queue->events, queue->capacity * sizeof(*queue->events));
+    ws_event_queue_init(queue, queue->allocator);
+}
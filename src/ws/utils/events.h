@@ -0,0 +1,119 @@
+#ifndef WS_EVENTS_H
+#define WS_EVENTS_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "alloc.h"
+
+struct ws_connection;
+
+/**
+ * Kinds of events returned by ws_server_poll_events()
+ */
+typedef enum {
+    WS_EVENT_CONNECT,
+    WS_EVENT_MESSAGE,
+    WS_EVENT_CLOSE,
+    WS_EVENT_ERROR
+} ws_event_type_t;
+
+/**
+ * Something that happened on a connection
+ *
+ * Pointers stay valid until the next call to ws_server_poll_events(),
+ * including the connection of a close event.
+ */
+typedef struct {
+    ws_event_type_t type;          // What happened
+    struct ws_connection *connection; // Connection it happened on
+    const uint8_t *data;           // Message payload, or close reason / error text
+    size_t length;                 // Length of data, excluding the terminator of text
+    bool is_binary;                // Binary message (WS_EVENT_MESSAGE only)
+    int code;                      // Close status code (WS_EVENT_CLOSE only)
+} ws_event_t;
+
+/**
+ * Block of event payload storage
+ */
+typedef struct ws_event_chunk {
+    struct ws_event_chunk *next;   // Next block
+    size_t size;                   // Usable bytes in data
+    size_t used;                   // Bytes handed out
+    uint8_t data[];
+} ws_event_chunk_t;
+
+/**
+ * Events recorded during a step, with their payloads
+ *
+ * Payloads are copied into chunks that never move, so they stay in place
+ * however many events are added. Everything is dropped at once by
+ * ws_event_queue_reset().
+ */
+typedef struct {
+    ws_event_t *events;            // Recorded events
+    size_t count;                  // Number of recorded events
+    size_t head;                   // Events already returned to the application
+    size_t capacity;               // Allocated entries of events
+    ws_event_chunk_t *chunks;      // Payload storage, current block first
+    const ws_allocator_t *allocator; // Source of events and chunks, NULL for malloc
+} ws_event_queue_t;
+
+/**
+ * Initialize an event queue
+ *
+ * @param queue Event queue
+ * @param allocator Allocator for events and payloads, NULL for malloc
+ */
+void ws_event_queue_init(ws_event_queue_t *queue, const ws_allocator_t *allocator);
+
+/**
+ * Record an event
+ *
+ * @param queue Event queue
+ * @param type Event type
+ * @param connection Connection the event happened on
+ * @param data Payload to copy, or NULL
+ * @param length Length of data
+ * @param text Whether data is text that gets a terminating NUL
+ * @return Recorded event, or NULL on allocation failure
+ */
+ws_event_t *ws_event_queue_push(ws_event_queue_t *queue, ws_event_type_t type,
+                                struct ws_connection *connection,
+                                const void *data, size_t length, bool text);
+
+/**
+ * Move recorded events to the caller
+ *
+ * @param queue Event queue
+ * @param events Array receiving the events
+ * @param max Size of events
+ * @return Number of events stored in events
+ */
+int ws_event_queue_take(ws_event_queue_t *queue, ws_event_t *events, int max);
+
+/**
+ * Check whether recorded events are waiting to be taken
+ *
+ * @param queue Event queue
+ * @return true if ws_event_queue_take() would return events
+ */
+bool ws_event_queue_pending(const ws_event_queue_t *queue);
+
+/**
+ * Drop all events and their payloads
+ *
+ * @param queue Event queue
+ * @param release Called for the connection of every dropped event, or NULL
+ */
+void ws_event_queue_reset(ws_event_queue_t *queue, void (*release)(struct ws_connection *connection));
+
+/**
+ * Free an event queue
+ *
+ * @param queue Event queue, reset beforehand
+ */
+void ws_event_queue_destroy(ws_event_queue_t *queue);
+
+#endif /* WS_EVENTS_H */
@@ -15,6 +15,8 @@ int ws_fragment_init(ws_fragment_t *fragment) {
     fragment->data = NULL;
     fragment->data_length = 0;
     fragment->buffer_size = 0;
+    fragment->allocator = NULL;
+    ws_utf8_init(&fragment->utf8);
     
     return 0;
 }
@@ -40,7 +42,7 @@ int ws_fragment_process(ws_fragment_t *fragment, uint8_t opcode, bool fin,
         // Allocate initial buffer if needed
         if (!fragment->data) {
             fragment->buffer_size = INITIAL_BUFFER_SIZE;
-            fragment->data = (uint8_t*)malloc(fragment->buffer_size);
+            fragment->data = (uint8_t*)ws_mem_alloc(fragment->allocator, fragment->buffer_size);
             
             if (!fragment->data) {
                 fragment->in_progress = false;
@@ -63,7 +65,8 @@ int ws_fragment_process(ws_fragment_t *fragment, uint8_t opcode, bool fin,
             new_size *= 2;
         }
         
-        uint8_t *new_buffer = (uint8_t*)realloc(fragment->data, new_size);
+        uint8_t *new_buffer = (uint8_t*)ws_mem_realloc(fragment->allocator, fragment->data,
+                                                       fragment->buffer_size, new_size);
         if (!new_buffer) {
             return -1; // Memory allocation error
         }
@@ -85,9 +88,24 @@ int ws_fragment_process(ws_fragment_t *fragment, uint8_t opcode, bool fin,
     return 0; // Still fragmenting
 }
 
+uint8_t *ws_fragment_detach(ws_fragment_t *fragment, size_t *size) {
+    if (!fragment || !fragment->data || fragment->in_progress) {
+        return NULL;
+    }
+    
+    uint8_t *data = fragment->data;
+    *size = fragment->buffer_size;
+    
+    fragment->data = NULL;
+    fragment->data_length = 0;
+    fragment->buffer_size = 0;
+    
+    return data;
+}
+
 void ws_fragment_cleanup(ws_fragment_t *fragment) {
     if (fragment && fragment->data) {
-        free(fragment->data);
+        ws_mem_free(fragment->allocator, fragment->data, fragment->buffer_size);
         fragment->data = NULL;
         fragment->data_length = 0;
         fragment->buffer_size = 0;
@@ -5,6 +5,9 @@
 #include <stdlib.h>
 #include <stdbool.h>
 
+#include "alloc.h"
+#include "utf8.h"
+
 /**
  * Structure to track fragmented message state
  */
@@ -14,6 +17,8 @@ typedef struct {
     uint8_t *data;             // Buffer for fragmented data
     size_t data_length;        // Current data length
     size_t buffer_size;        // Allocated buffer size
+    const ws_allocator_t *allocator; // Allocator of data, NULL for malloc
+    ws_utf8_state_t utf8;      // Validation of a text message, carried across its fragments
 } ws_fragment_t;
 
 /**
@@ -37,6 +42,18 @@ int ws_fragment_init(ws_fragment_t *fragment);
 int ws_fragment_process(ws_fragment_t *fragment, uint8_t opcode, bool fin,
                        const uint8_t *data, size_t data_length);
 
+/**
+ * Give up the reassembled message buffer
+ *
+ * The caller frees the returned block with ws_mem_free() using
+ * fragment->allocator and the size stored in size.
+ *
+ * @param fragment Fragmentation context with a completed message
+ * @param size Receives the allocated size of the block
+ * @return Block holding the message, or NULL if there is none
+ */
+uint8_t *ws_fragment_detach(ws_fragment_t *fragment, size_t *size);
+
 /**
  * Clean up fragmentation context
  *
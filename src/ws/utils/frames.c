@@ -1,9 +1,40 @@
 #include "frames.h"
+#include "dispatch.h"
+#include "trace.h"
 #include <string.h>
-#include <sys/socket.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <time.h>
 
+int ws_create_frame_header(uint8_t opcode, bool fin, uint64_t payload_length,
+                          bool use_mask, uint8_t *buffer) {
+    int idx = 0;
+    
+    // FIN bit + RSV bits + opcode
+    buffer[idx++] = (fin ? 0x80 : 0) | (opcode & 0x0F);
+    
+    // MASK bit + payload length
+    if (payload_length <= 125) {
+        buffer[idx++] = (use_mask ? 0x80 : 0) | (uint8_t)payload_length;
+    } else if (payload_length <= 65535) {
+        buffer[idx++] = (use_mask ? 0x80 : 0) | 126;
+        buffer[idx++] = (payload_length >> 8) & 0xFF;
+        buffer[idx++] = payload_length & 0xFF;
+    } else {
+        buffer[idx++] = (use_mask ? 0x80 : 0) | 127;
+        buffer[idx++] = (payload_length >> 56) & 0xFF;
+        buffer[idx++] = (payload_length >> 48) & 0xFF;
+        buffer[idx++] = (payload_length >> 40) & 0xFF;
+        buffer[idx++] = (payload_length >> 32) & 0xFF;
+        buffer[idx++] = (payload_length >> 24) & 0xFF;
+        buffer[idx++] = (payload_length >> 16) & 0xFF;
+        buffer[idx++] = (payload_length >> 8) & 0xFF;
+        buffer[idx++] = payload_length & 0xFF;
+    }
+    
+    return idx;
+}
+
 int ws_create_frame(uint8_t opcode, const uint8_t *payload, uint64_t payload_length,
                    uint8_t *buffer, size_t buffer_size, bool use_mask) {
     // Calculate frame size
@@ -30,29 +61,7 @@ int ws_create_frame(uint8_t opcode, const uint8_t *payload, uint64_t payload_len
     }
     
     // Create the frame header
-    int idx = 0;
-    
-    // FIN bit + RSV bits + opcode
-    buffer[idx++] = 0x80 | (opcode & 0x0F);
-    
-    // MASK bit + payload length
-    if (payload_length <= 125) {
-        buffer[idx++] = (use_mask ? 0x80 : 0) | (uint8_t)payload_length;
-    } else if (payload_length <= 65535) {
-        buffer[idx++] = (use_mask ? 0x80 : 0) | 126;
-        buffer[idx++] = (payload_length >> 8) & 0xFF;
-        buffer[idx++] = payload_length & 0xFF;
-    } else {
-        buffer[idx++] = (use_mask ? 0x80 : 0) | 127;
-        buffer[idx++] = (payload_length >> 56) & 0xFF;
-        buffer[idx++] = (payload_length >> 48) & 0xFF;
-        buffer[idx++] = (payload_length >> 40) & 0xFF;
-        buffer[idx++] = (payload_length >> 32) & 0xFF;
-        buffer[idx++] = (payload_length >> 24) & 0xFF;
-        buffer[idx++] = (payload_length >> 16) & 0xFF;
-        buffer[idx++] = (payload_length >> 8) & 0xFF;
-        buffer[idx++] = payload_length & 0xFF;
-    }
+    int idx = ws_create_frame_header(opcode, true, payload_length, use_mask, buffer);
     
     // Add masking key if needed
     if (use_mask) {
@@ -77,30 +86,151 @@ int ws_create_frame(uint8_t opcode, const uint8_t *payload, uint64_t payload_len
     return idx;
 }
 
-int ws_send_frame(ws_connection_t *connection, uint8_t opcode,
-                 const uint8_t *payload, size_t payload_length) {
-    // Create a buffer for the frame
-    // Calculate max frame size: header (14) + payload
-    size_t buffer_size = 14 + payload_length;
-    uint8_t *buffer = (uint8_t *)malloc(buffer_size);
+void ws_send_complete(void *connection, const uint8_t *data, size_t len) {
+    ws_connection_t *conn = (ws_connection_t *)connection;
+    
+    if (conn->server && conn->server->on_send_complete) {
+        conn->server->on_send_complete(conn, data, len);
+    }
+}
+
+ws_output_t *ws_connection_output(ws_connection_t *connection) {
+    if (connection->output) {
+        return connection->output;
+    }
+    
+    ws_server_t *server = connection->server;
+    ws_output_t *output = ws_mem_alloc(server ? server->allocator : NULL, sizeof(ws_output_t));
+    if (!output) {
+        return NULL;
+    }
+    ws_output_init(output);
+    
+    if (server) {
+        output->budget = &server->memory;
+        
+        // Opt in to MSG_ZEROCOPY; sends fall back to copying if unsupported
+        if (server->config.zerocopy_threshold > 0 && connection->socket >= 0) {
+            ws_output_enable_zerocopy(output, connection->socket);
+        }
+        if (server->latency) {
+            output->latency = &server->latency->stages[WS_LATENCY_SEND];
+        }
+    }
+    
+    connection->output = output;
+    return output;
+}
+
+int ws_queue_frame(ws_connection_t *connection, ws_output_item_t *item) {
+    size_t total = item->header_length + item->length;
+    int frame_size = total > INT_MAX ? INT_MAX : (int)total;
+    
+    WS_PROBE4(send, connection->id, item->opcode, total, item->lane);
+    
+    if (connection->server && connection->server->latency) {
+        item->queued_ns = ws_latency_now();
+    }
+    
+    // Frames sent from a worker thread are written by the event loop
+    ws_dispatch_t *dispatch = ws_dispatch_current();
+    if (dispatch) {
+        if (ws_dispatch_reply(dispatch, connection, item) != 0) {
+            ws_output_item_free(item);
+            return -1;
+        }
+        return frame_size;
+    }
+    
+    if (!connection->transport.ops) {
+        ws_output_item_free(item);
+        return -1;
+    }
     
-    if (!buffer) {
+    ws_output_t *output = ws_connection_output(connection);
+    if (!output) {
+        ws_output_item_free(item); // Only a queue that exists lends payloads out
         return -1;
     }
     
-    // Create frame
-    int frame_size = ws_create_frame(opcode, payload, payload_length, buffer, buffer_size, false);
+    bool data = item->lane != WS_LANE_CONTROL;
+    bool over = data && connection->info->high_water > 0 &&
+                output->queued_bytes + item->length > connection->info->high_water;
     
-    if (frame_size < 0) {
-        free(buffer);
+    // A slow consumer gets the latest message per key instead of a backlog
+    if (over && item->keyed && connection->info->slow_policy == WS_SLOW_CONFLATE &&
+        ws_output_conflate(output, item)) {
+        return frame_size;
+    }
+    
+    // Queue behind anything not yet written, then write what the socket takes;
+    // a connection about to be closed for falling behind takes no more data
+    if ((data && connection->overflowed) || ws_output_push(output, item) != 0) {
+        // Connection is closing; nothing may follow the close frame
+        if (item->borrowed) {
+            ws_send_complete(connection, item->data, item->length);
+        }
+        ws_output_item_free(item);
+        return -1;
+    }
+    
+    if (over && connection->info->slow_policy == WS_SLOW_DISCONNECT) {
+        connection->overflowed = true;
+    } else if (over && connection->info->slow_policy == WS_SLOW_DROP_OLDEST) {
+        ws_output_drop(output, connection->info->high_water, item, ws_send_complete, connection);
+    }
+    
+    // Coalescing leaves the write to the end of the step; a close frame
+    // goes out right away since the connection is torn down after it
+    if (connection->server && connection->server->config.coalesce &&
+        item->opcode != WS_OPCODE_CLOSE) {
+        connection->flush_deferred = true;
+        return frame_size;
+    }
+    
+    if (ws_output_write(output, &connection->transport, ws_send_complete, connection) < 0) {
         return -1;
     }
     
-    // Send frame
-    int bytes_sent = send(connection->socket, buffer, frame_size, 0);
+    return frame_size;
+}
+
+int ws_send_message(ws_connection_t *connection, uint8_t opcode, const uint8_t *payload,
+                    size_t payload_length, int lane, bool zerocopy) {
+    // Without SO_ZEROCOPY (or off the loop thread) the payload is copied
+    // and can be reused as soon as it is queued
+    ws_output_t *output = zerocopy && !ws_dispatch_current() ? ws_connection_output(connection) : NULL;
+    bool borrow = output && output->zerocopy;
+    int result = -1;
+    
+    const ws_allocator_t *allocator = connection->server ? connection->server->allocator : NULL;
+    ws_output_item_t *item = ws_output_item_create(opcode, payload, payload_length, borrow, allocator);
+    if (item) {
+        item->lane = (uint8_t)lane;
+        
+        // Split large messages so control frames can go in between
+        size_t fragment_size = connection->server ? connection->server->config.fragment_size : 0;
+        if (lane != WS_LANE_CONTROL && fragment_size > 0 && payload_length > fragment_size) {
+            ws_output_item_fragment(item, fragment_size);
+        }
+        
+        result = ws_queue_frame(connection, item);
+    } else {
+        borrow = false; // Nothing references the payload
+    }
+    
+    if (zerocopy && !borrow) {
+        ws_send_complete(connection, payload, payload_length);
+    }
+    
+    return result;
+}
+
+int ws_send_frame(ws_connection_t *connection, uint8_t opcode,
+                 const uint8_t *payload, size_t payload_length) {
+    int lane = (opcode & 0x08) ? WS_LANE_CONTROL : WS_LANE_HIGH;
     
-    free(buffer);
-    return bytes_sent;
+    return ws_send_message(connection, opcode, payload, payload_length, lane, false);
 }
 
 int ws_send_ping(ws_connection_t *connection, const uint8_t *payload, size_t payload_length) {
@@ -6,6 +6,7 @@
 #include <stdbool.h>
 
 #include "../ws.h"
+#include "output.h"
 
 /**
  * WebSocket frame opcodes
@@ -30,8 +31,22 @@ typedef struct {
     uint8_t mask_key[4];       // Masking key (if mask bit is set)
     uint64_t payload_length;   // Payload length
     uint8_t *payload;          // Payload data
+    size_t frame_length;       // Header plus payload length
 } ws_frame_t;
 
+/**
+ * Encode a WebSocket frame header without masking key
+ *
+ * @param opcode Frame opcode
+ * @param fin Whether this is the final frame of the message
+ * @param payload_length Payload length
+ * @param use_mask Whether to set the MASK bit
+ * @param buffer Output buffer, at least 10 bytes
+ * @return Size of the header
+ */
+int ws_create_frame_header(uint8_t opcode, bool fin, uint64_t payload_length,
+                          bool use_mask, uint8_t *buffer);
+
 /**
  * Create a WebSocket frame
  *
@@ -47,17 +62,77 @@ int ws_create_frame(uint8_t opcode, const uint8_t *payload, uint64_t payload_len
                    uint8_t *buffer, size_t buffer_size, bool use_mask);
 
 /**
- * Send a WebSocket frame to a client
+ * Queue a WebSocket frame to a client
+ *
+ * The frame is written right away as far as the socket allows; the rest
+ * is written by the event loop when the socket becomes writable. Control
+ * frames take the control lane, data frames the high-priority lane.
  *
  * @param connection Client connection
  * @param opcode Frame opcode
  * @param payload Payload data
  * @param payload_length Payload length
- * @return Number of bytes sent, or -1 on error
+ * @return Number of bytes queued, or -1 on error
  */
 int ws_send_frame(ws_connection_t *connection, uint8_t opcode,
                  const uint8_t *payload, size_t payload_length);
 
+/**
+ * Queue a WebSocket message on a given outbound lane
+ *
+ * Data messages larger than config.fragment_size are split into frames of
+ * that size so control frames can be written between them.
+ *
+ * With zerocopy set the payload is sent with MSG_ZEROCOPY and not copied.
+ * The server's on_send_complete callback is invoked once the kernel no
+ * longer references it, which may happen before this function returns if
+ * the payload had to be copied after all.
+ *
+ * @param connection Client connection
+ * @param opcode Message opcode
+ * @param payload Payload data
+ * @param payload_length Payload length
+ * @param lane Outbound lane (WS_LANE_*)
+ * @param zerocopy Whether to send the payload by reference
+ * @return Number of bytes queued, or -1 on error
+ */
+int ws_send_message(ws_connection_t *connection, uint8_t opcode, const uint8_t *payload,
+                    size_t payload_length, int lane, bool zerocopy);
+
+/**
+ * Queue an encoded frame on a connection and start writing it
+ *
+ * Takes ownership of item.
+ *
+ * @param connection Client connection
+ * @param item Output item
+ * @return Number of bytes queued, or -1 on error
+ */
+int ws_queue_frame(ws_connection_t *connection, ws_output_item_t *item);
+
+/**
+ * Get the output queue of a connection, creating it on first use
+ *
+ * Connections that never send hold no queue. A new queue is charged to
+ * the server's memory budget and, when configured, has MSG_ZEROCOPY and
+ * send latency tracing enabled. Event loop thread only.
+ *
+ * @param connection Client connection
+ * @return Output queue, or NULL on allocation failure
+ */
+ws_output_t *ws_connection_output(ws_connection_t *connection);
+
+/**
+ * Report a borrowed payload as reusable through on_send_complete
+ *
+ * Matches ws_output_done_fn with the connection as context.
+ *
+ * @param connection Client connection
+ * @param data Payload data
+ * @param len Payload length
+ */
+void ws_send_complete(void *connection, const uint8_t *data, size_t len);
+
 /**
  * Send a ping frame to a client
  *
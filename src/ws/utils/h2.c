@@ -0,0 +1,965 @@
+#include "h2.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+// Frame types (RFC 9113 section 6)
+#define WS_H2_DATA_FRAME 0x0
+#define WS_H2_HEADERS 0x1
+#define WS_H2_PRIORITY 0x2
+#define WS_H2_RST_STREAM 0x3
+#define WS_H2_SETTINGS 0x4
+#define WS_H2_PUSH_PROMISE 0x5
+#define WS_H2_PING 0x6
+#define WS_H2_GOAWAY 0x7
+#define WS_H2_WINDOW_UPDATE 0x8
+#define WS_H2_CONTINUATION 0x9
+
+// Frame flags
+#define WS_H2_FLAG_ACK 0x1
+#define WS_H2_FLAG_END_STREAM 0x1
+#define WS_H2_FLAG_END_HEADERS 0x4
+#define WS_H2_FLAG_PADDED 0x8
+#define WS_H2_FLAG_PRIORITY 0x20
+
+// Settings
+#define WS_H2_SETTINGS_ENABLE_PUSH 0x2
+#define WS_H2_SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define WS_H2_SETTINGS_INITIAL_WINDOW_SIZE 0x4
+#define WS_H2_SETTINGS_MAX_FRAME_SIZE 0x5
+#define WS_H2_SETTINGS_ENABLE_CONNECT_PROTOCOL 0x8
+
+// Error codes
+#define WS_H2_NO_ERROR 0x0
+#define WS_H2_PROTOCOL_ERROR 0x1
+#define WS_H2_INTERNAL_ERROR 0x2
+#define WS_H2_FLOW_CONTROL_ERROR 0x3
+#define WS_H2_STREAM_CLOSED 0x5
+#define WS_H2_FRAME_SIZE_ERROR 0x6
+#define WS_H2_REFUSED_STREAM 0x7
+#define WS_H2_COMPRESSION_ERROR 0x9
+#define WS_H2_ENHANCE_YOUR_CALM 0xB
+
+#define WS_H2_MAX_WINDOW 0x7FFFFFFF
+#define WS_H2_DEFAULT_WINDOW 65535
+
+// Static table entries of the only responses we send
+#define WS_H2_STATUS_200 0x88
+#define WS_H2_STATUS_400 0x8C
+
+/**
+ * Pseudo-headers and headers of a request that matter for RFC 8441
+ */
+typedef struct {
+    char method[16];
+    char protocol[16];
+    char version[8];
+    bool scheme;
+    bool path;
+    bool malformed;
+} ws_h2_request_t;
+
+static uint32_t ws_h2_read32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void ws_h2_write32(uint8_t *p, uint32_t value) {
+    p[0] = (uint8_t)(value >> 24);
+    p[1] = (uint8_t)(value >> 16);
+    p[2] = (uint8_t)(value >> 8);
+    p[3] = (uint8_t)value;
+}
+
+static void ws_h2_frame_header(uint8_t *p, size_t length, uint8_t type, uint8_t flags, uint32_t stream_id) {
+    p[0] = (uint8_t)(length >> 16);
+    p[1] = (uint8_t)(length >> 8);
+    p[2] = (uint8_t)length;
+    p[3] = type;
+    p[4] = flags;
+    ws_h2_write32(p + 5, stream_id & WS_H2_MAX_WINDOW);
+}
+
+bool ws_h2_is_preface(const uint8_t *data, size_t len) {
+    if (len > WS_H2_PREFACE_LENGTH) {
+        len = WS_H2_PREFACE_LENGTH;
+    }
+    return len > 0 && memcmp(data, WS_H2_PREFACE, len) == 0;
+}
+
+// Make room for len more bytes of output; NULL marks the session failed
+static uint8_t *ws_h2_reserve(ws_h2_session_t *session, size_t len) {
+    if (session->out_offset > 0 && session->out_offset == session->out_length) {
+        session->out_offset = 0;
+        session->out_length = 0;
+    }
+    
+    size_t needed = session->out_length + len;
+    if (needed > session->out_capacity) {
+        size_t capacity = session->out_capacity ? session->out_capacity : 16384;
+        while (capacity < needed) {
+            capacity *= 2;
+        }
+        
+        uint8_t *out = ws_mem_realloc(session->allocator, session->out, session->out_capacity, capacity);
+        if (!out) {
+            session->failed = true;
+            return NULL;
+        }
+        session->out = out;
+        session->out_capacity = capacity;
+    }
+    
+    return session->out + session->out_length;
+}
+
+static int ws_h2_send_frame(ws_h2_session_t *session, uint8_t type, uint8_t flags, uint32_t stream_id,
+                            const uint8_t *payload, size_t len) {
+    uint8_t *frame = ws_h2_reserve(session, 9 + len);
+    if (!frame) {
+        return -1;
+    }
+    
+    ws_h2_frame_header(frame, len, type, flags, stream_id);
+    if (len > 0) {
+        memcpy(frame + 9, payload, len);
+    }
+    session->out_length += 9 + len;
+    return 0;
+}
+
+static int ws_h2_send_u32(ws_h2_session_t *session, uint8_t type, uint32_t stream_id, uint32_t value) {
+    uint8_t payload[4];
+    
+    ws_h2_write32(payload, value);
+    return ws_h2_send_frame(session, type, 0, stream_id, payload, sizeof(payload));
+}
+
+// Connection error: queue GOAWAY; the owner closes the session
+static int ws_h2_fail(ws_h2_session_t *session, uint32_t code) {
+    uint8_t payload[8];
+    
+    if (!session->failed) {
+        ws_h2_write32(payload, session->last_stream);
+        ws_h2_write32(payload + 4, code);
+        ws_h2_send_frame(session, WS_H2_GOAWAY, 0, 0, payload, sizeof(payload));
+        session->failed = true;
+    }
+    return -1;
+}
+
+ws_h2_session_t *ws_h2_session_create(int socket, const uint8_t *data, size_t len,
+                                      ws_h2_event_fn on_event, void *ctx,
+                                      const ws_allocator_t *allocator) {
+    ws_h2_session_t *session = (ws_h2_session_t *)ws_mem_alloc(allocator, sizeof(ws_h2_session_t));
+    if (!session) {
+        return NULL;
+    }
+    
+    memset(session, 0, sizeof(*session));
+    session->socket = socket;
+    session->allocator = allocator;
+    session->on_event = on_event;
+    session->ctx = ctx;
+    session->send_window = WS_H2_DEFAULT_WINDOW;
+    session->recv_window = WS_H2_SESSION_WINDOW;
+    session->peer_initial_window = WS_H2_DEFAULT_WINDOW;
+    session->peer_max_frame = WS_H2_FRAME_SIZE;
+    ws_hpack_decoder_init(&session->hpack, WS_HPACK_TABLE_SIZE, allocator);
+    
+    // Room for one maximal frame plus a partial one behind it
+    session->in_capacity = 2 * (9 + WS_H2_FRAME_SIZE);
+    if (len > session->in_capacity) {
+        session->in_capacity = len;
+    }
+    session->in = (uint8_t *)ws_mem_alloc(allocator, session->in_capacity);
+    if (!session->in) {
+        ws_mem_free(allocator, session, sizeof(*session));
+        return NULL;
+    }
+    memcpy(session->in, data, len);
+    session->in_length = len;
+    
+    // Extended CONNECT must be announced before clients may use it
+    uint8_t settings[18];
+    uint16_t ids[3] = { WS_H2_SETTINGS_MAX_CONCURRENT_STREAMS, WS_H2_SETTINGS_INITIAL_WINDOW_SIZE,
+                        WS_H2_SETTINGS_ENABLE_CONNECT_PROTOCOL };
+    uint32_t values[3] = { WS_H2_MAX_STREAMS, WS_H2_STREAM_WINDOW, 1 };
+    for (int i = 0; i < 3; i++) {
+        settings[i * 6] = (uint8_t)(ids[i] >> 8);
+        settings[i * 6 + 1] = (uint8_t)ids[i];
+        ws_h2_write32(settings + i * 6 + 2, values[i]);
+    }
+    ws_h2_send_frame(session, WS_H2_SETTINGS, 0, 0, settings, sizeof(settings));
+    ws_h2_send_u32(session, WS_H2_WINDOW_UPDATE, 0, WS_H2_SESSION_WINDOW - WS_H2_DEFAULT_WINDOW);
+    
+    if (session->failed) {
+        ws_h2_session_close(session);
+        return NULL;
+    }
+    return session;
+}
+
+static ws_h2_stream_t *ws_h2_find(ws_h2_session_t *session, uint32_t id) {
+    ws_h2_stream_t *stream = session->streams;
+    while (stream && stream->id != id) {
+        stream = stream->next;
+    }
+    return stream;
+}
+
+static void ws_h2_free_stream(ws_h2_session_t *session, ws_h2_stream_t *stream) {
+    ws_h2_stream_t **link = &session->streams;
+    while (*link && *link != stream) {
+        link = &(*link)->next;
+    }
+    if (*link) {
+        *link = stream->next;
+        session->num_streams--;
+    }
+    
+    // Unread bytes still count against the connection window
+    session->consumed += stream->rx_length - stream->rx_offset;
+    
+    ws_mem_free(session->allocator, stream->rx, stream->rx_capacity);
+    ws_mem_free(session->allocator, stream, sizeof(*stream));
+}
+
+// Return window for bytes the application has taken
+static void ws_h2_credit(ws_h2_session_t *session, ws_h2_stream_t *stream) {
+    if (stream && !stream->remote_closed && stream->consumed >= WS_H2_STREAM_WINDOW / 2) {
+        ws_h2_send_u32(session, WS_H2_WINDOW_UPDATE, stream->id, (uint32_t)stream->consumed);
+        stream->recv_window += (int64_t)stream->consumed;
+        stream->consumed = 0;
+    }
+    
+    if (session->consumed >= WS_H2_SESSION_WINDOW / 2) {
+        ws_h2_send_u32(session, WS_H2_WINDOW_UPDATE, 0, (uint32_t)session->consumed);
+        session->recv_window += (int64_t)session->consumed;
+        session->consumed = 0;
+    }
+}
+
+static int ws_h2_data(ws_h2_session_t *session, uint8_t flags, uint32_t id, const uint8_t *payload,
+                      size_t length) {
+    size_t pad = 0;
+    
+    if (id == 0) {
+        return ws_h2_fail(session, WS_H2_PROTOCOL_ERROR);
+    }
+    if (flags & WS_H2_FLAG_PADDED) {
+        if (length == 0 || payload[0] >= length) {
+            return ws_h2_fail(session, WS_H2_PROTOCOL_ERROR);
+        }
+        pad = (size_t)payload[0] + 1;
+    }
+    
+    // Padding counts against the windows too
+    session->recv_window -= (int64_t)length;
+    if (session->recv_window < 0) {
+        return ws_h2_fail(session, WS_H2_FLOW_CONTROL_ERROR);
+    }
+    
+    ws_h2_stream_t *stream = ws_h2_find(session, id);
+    if (!stream) {
+        if (id > session->last_stream) {
+            return ws_h2_fail(session, WS_H2_PROTOCOL_ERROR);
+        }
+        
+        // A stream we closed: the bytes are dropped, the window returned
+        session->consumed += length;
+        ws_h2_credit(session, NULL);
+        return 0;
+    }
+    
+    if (stream->remote_closed) {
+        return ws_h2_fail(session, WS_H2_STREAM_CLOSED);
+    }
+    stream->recv_window -= (int64_t)length;
+    if (stream->recv_window < 0) {
+        return ws_h2_fail(session, WS_H2_FLOW_CONTROL_ERROR);
+    }
+    
+    const uint8_t *data = payload + (pad ? 1 : 0);
+    size_t data_length = length - pad;
+    
+    if (data_length > 0) {
+        // Drop the bytes already read before growing the buffer
+        if (stream->rx_offset > 0) {
+            memmove(stream->rx, stream->rx + stream->rx_offset, stream->rx_length - stream->rx_offset);
+            stream->rx_length -= stream->rx_offset;
+            stream->rx_offset = 0;
+        }
+        
+        size_t needed = stream->rx_length + data_length;
+        if (needed > stream->rx_capacity) {
+            size_t capacity = stream->rx_capacity ? stream->rx_capacity : 16384;
+            while (capacity < needed) {
+                capacity *= 2;
+            }
+            uint8_t *rx = ws_mem_realloc(session->allocator, stream->rx, stream->rx_capacity, capacity);
+            if (!rx) {
+                return ws_h2_fail(session, WS_H2_INTERNAL_ERROR);
+            }
+            stream->rx = rx;
+            stream->rx_capacity = capacity;
+        }
+        
+        memcpy(stream->rx + stream->rx_length, data, data_length);
+        stream->rx_length += data_length;
+    }
+    
+    stream->consumed += pad;
+    session->consumed += pad;
+    if (flags & WS_H2_FLAG_END_STREAM) {
+        stream->remote_closed = true;
+    }
+    ws_h2_credit(session, stream);
+    
+    if (stream->connection) {
+        session->on_event(session->ctx, stream, WS_H2_DATA);
+    }
+    return 0;
+}
+
+static void ws_h2_copy_value(char *dest, size_t size, const char *value, size_t value_length,
+                             bool *malformed) {
+    if (value_length >= size) {
+        *malformed = true;
+        value_length = size - 1;
+    }
+    memcpy(dest, value, value_length);
+    dest[value_length] = '\0';
+}
+
+static void ws_h2_collect(void *ctx, const char *name, size_t name_length,
+                          const char *value, size_t value_length) {
+    ws_h2_request_t *request = (ws_h2_request_t *)ctx;
+    
+    if (name_length == 7 && memcmp(name, ":method", 7) == 0) {
+        ws_h2_copy_value(request->method, sizeof(request->method), value, value_length, &request->malformed);
+    } else if (name_length == 9 && memcmp(name, ":protocol", 9) == 0) {
+        ws_h2_copy_value(request->protocol, sizeof(request->protocol), value, value_length, &request->malformed);
+    } else if (name_length == 21 && memcmp(name, "sec-websocket-version", 21) == 0) {
+        ws_h2_copy_value(request->version, sizeof(request->version), value, value_length, &request->malformed);
+    } else if (name_length == 7 && memcmp(name, ":scheme", 7) == 0) {
+        request->scheme = value_length > 0;
+    } else if (name_length == 5 && memcmp(name, ":path", 5) == 0) {
+        request->path = value_length > 0;
+    }
+}
+
+// Answer a request that does not open a WebSocket
+static void ws_h2_reject(ws_h2_session_t *session, uint32_t id) {
+    uint8_t status = WS_H2_STATUS_400;
+    ws_h2_send_frame(session, WS_H2_HEADERS, WS_H2_FLAG_END_HEADERS | WS_H2_FLAG_END_STREAM, id, &status, 1);
+}
+
+static int ws_h2_headers_done(ws_h2_session_t *session) {
+    uint32_t id = session->header_stream;
+    bool end_stream = session->header_end_stream;
+    ws_h2_request_t request;
+    
+    memset(&request, 0, sizeof(request));
+    session->header_stream = 0;
+    
+    // Every block has to be decoded to keep the dynamic table in step
+    int decoded = ws_hpack_decode(&session->hpack, session->headers, session->headers_length,
+                                  ws_h2_collect, &request);
+    session->headers_length = 0;
+    if (decoded != 0) {
+        return ws_h2_fail(session, WS_H2_COMPRESSION_ERROR);
+    }
+    
+    // Trailers on an open stream can only end it
+    ws_h2_stream_t *stream = ws_h2_find(session, id);
+    if (stream) {
+        if (end_stream && !stream->remote_closed) {
+            stream->remote_closed = true;
+            if (stream->connection) {
+                session->on_event(session->ctx, stream, WS_H2_DATA);
+            }
+        }
+        return 0;
+    }
+    
+    if (id <= session->last_stream) {
+        return ws_h2_fail(session, WS_H2_STREAM_CLOSED);
+    }
+    session->last_stream = id;
+    
+    if (session->num_streams >= WS_H2_MAX_STREAMS) {
+        return ws_h2_send_u32(session, WS_H2_RST_STREAM, id, WS_H2_REFUSED_STREAM);
+    }
+    
+    // RFC 8441 section 4: extended CONNECT with the websocket protocol
+    if (request.malformed || end_stream || !request.scheme || !request.path ||
+        strcmp(request.method, "CONNECT") != 0 || strcmp(request.protocol, "websocket") != 0 ||
+        strcmp(request.version, "13") != 0) {
+        ws_h2_reject(session, id);
+        return 0;
+    }
+    
+    stream = (ws_h2_stream_t *)ws_mem_alloc(session->allocator, sizeof(ws_h2_stream_t));
+    if (!stream) {
+        return ws_h2_send_u32(session, WS_H2_RST_STREAM, id, WS_H2_REFUSED_STREAM);
+    }
+    memset(stream, 0, sizeof(*stream));
+    stream->id = id;
+    stream->session = session;
+    stream->send_window = session->peer_initial_window;
+    stream->recv_window = WS_H2_STREAM_WINDOW;
+    stream->next = session->streams;
+    session->streams = stream;
+    session->num_streams++;
+    
+    // The owner may close the stream again before this returns
+    if (session->on_event(session->ctx, stream, WS_H2_OPEN) != 0) {
+        ws_h2_free_stream(session, stream);
+        return ws_h2_send_u32(session, WS_H2_RST_STREAM, id, WS_H2_REFUSED_STREAM);
+    }
+    return 0;
+}
+
+static int ws_h2_header_block(ws_h2_session_t *session, const uint8_t *fragment, size_t length,
+                              bool end_headers) {
+    if (session->headers_length + length > WS_H2_MAX_HEADERS) {
+        return ws_h2_fail(session, WS_H2_ENHANCE_YOUR_CALM);
+    }
+    
+    if (session->headers_length + length > session->headers_capacity) {
+        uint8_t *headers = ws_mem_realloc(session->allocator, session->headers, session->headers_capacity,
+                                          WS_H2_MAX_HEADERS);
+        if (!headers) {
+            return ws_h2_fail(session, WS_H2_INTERNAL_ERROR);
+        }
+        session->headers = headers;
+        session->headers_capacity = WS_H2_MAX_HEADERS;
+    }
+    
+    memcpy(session->headers + session->headers_length, fragment, length);
+    session->headers_length += length;
+    
+    return end_headers ? ws_h2_headers_done(session) : 0;
+}
+
+static int ws_h2_headers(ws_h2_session_t *session, uint8_t flags, uint32_t id, const uint8_t *payload,
+                         size_t length) {
+    size_t skip = 0;
+    size_t pad = 0;
+    
+    if (id == 0 || (id & 1) == 0) {
+        return ws_h2_fail(session, WS_H2_PROTOCOL_ERROR);
+    }
+    if (flags & WS_H2_FLAG_PADDED) {
+        if (length == 0) {
+            return ws_h2_fail(session, WS_H2_PROTOCOL_ERROR);
+        }
+        pad = payload[0];
+        skip = 1;
+    }
+    if (flags & WS_H2_FLAG_PRIORITY) {
+        skip += 5;
+    }
+    if (skip + pad > length) {
+        return ws_h2_fail(session, WS_H2_PROTOCOL_ERROR);
+    }
+    
+    session->header_stream = id;
+    session->header_end_stream = (flags & WS_H2_FLAG_END_STREAM) != 0;
+    return ws_h2_header_block(session, payload + skip, length - skip - pad,
+                              (flags & WS_H2_FLAG_END_HEADERS) != 0);
+}
+
+static int ws_h2_reset(ws_h2_session_t *session, uint32_t id, size_t length) {
+    if (length != 4) {
+        return ws_h2_fail(session, WS_H2_FRAME_SIZE_ERROR);
+    }
+    if (id == 0) {
+        return ws_h2_fail(session, WS_H2_PROTOCOL_ERROR);
+    }
+    
+    ws_h2_stream_t *stream = ws_h2_find(session, id);
+    if (!stream) {
+        return id > session->last_stream ? ws_h2_fail(session, WS_H2_PROTOCOL_ERROR) : 0;
+    }
+    
+    stream->remote_closed = true;
+    stream->local_closed = true;
+    
+    // The owner closes the stream, which frees it
+    if (stream->connection) {
+        session->on_event(session->ctx, stream, WS_H2_RESET);
+    } else {
+        ws_h2_free_stream(session, stream);
+    }
+    return 0;
+}
+
+static int ws_h2_settings(ws_h2_session_t *session, uint8_t flags, uint32_t id, const uint8_t *payload,
+                          size_t length) {
+    if (id != 0) {
+        return ws_h2_fail(session, WS_H2_PROTOCOL_ERROR);
+    }
+    if (flags & WS_H2_FLAG_ACK) {
+        return length == 0 ? 0 : ws_h2_fail(session, WS_H2_FRAME_SIZE_ERROR);
+    }
+    if (length % 6 != 0) {
+        return ws_h2_fail(session, WS_H2_FRAME_SIZE_ERROR);
+    }
+    
+    for (size_t i = 0; i < length; i += 6) {
+        uint16_t setting = (uint16_t)((payload[i] << 8) | payload[i + 1]);
+        uint32_t value = ws_h2_read32(payload + i + 2);
+        
+        if (setting == WS_H2_SETTINGS_ENABLE_PUSH && value > 1) {
+            return ws_h2_fail(session, WS_H2_PROTOCOL_ERROR);
+        }
+        
+        if (setting == WS_H2_SETTINGS_INITIAL_WINDOW_SIZE) {
+            if (value > WS_H2_MAX_WINDOW) {
+                return ws_h2_fail(session, WS_H2_FLOW_CONTROL_ERROR);
+            }
+            
+            // Applies to the windows of open streams as a delta
+            int64_t delta = (int64_t)value - session->peer_initial_window;
+            for (ws_h2_stream_t *stream = session->streams; stream; stream = stream->next) {
+                stream->send_window += delta;
+                if (stream->send_window > WS_H2_MAX_WINDOW) {
+                    return ws_h2_fail(session, WS_H2_FLOW_CONTROL_ERROR);
+                }
+            }
+            session->peer_initial_window = value;
+        }
+        
+        if (setting == WS_H2_SETTINGS_MAX_FRAME_SIZE) {
+            if (value < WS_H2_FRAME_SIZE || value > 0xFFFFFF) {
+                return ws_h2_fail(session, WS_H2_PROTOCOL_ERROR);
+            }
+            session->peer_max_frame = value;
+        }
+    }
+    
+    return ws_h2_send_frame(session, WS_H2_SETTINGS, WS_H2_FLAG_ACK, 0, NULL, 0);
+}
+
+static int ws_h2_window_update(ws_h2_session_t *session, uint32_t id, const uint8_t *payload,
+                               size_t length) {
+    if (length != 4) {
+        return ws_h2_fail(session, WS_H2_FRAME_SIZE_ERROR);
+    }
+    
+    uint32_t increment = ws_h2_read32(payload) & WS_H2_MAX_WINDOW;
+    if (increment == 0) {
+        return ws_h2_fail(session, WS_H2_PROTOCOL_ERROR);
+    }
+    
+    if (id == 0) {
+        session->send_window += increment;
+        return session->send_window > WS_H2_MAX_WINDOW ? ws_h2_fail(session, WS_H2_FLOW_CONTROL_ERROR) : 0;
+    }
+    
+    // Updates may still arrive for streams we closed
+    ws_h2_stream_t *stream = ws_h2_find(session, id);
+    if (stream) {
+        stream->send_window += increment;
+        if (stream->send_window > WS_H2_MAX_WINDOW) {
+            return ws_h2_fail(session, WS_H2_FLOW_CONTROL_ERROR);
+        }
+    }
+    return 0;
+}
+
+static int ws_h2_frame(ws_h2_session_t *session, uint8_t type, uint8_t flags, uint32_t id,
+                       const uint8_t *payload, size_t length) {
+    // A header block must not be interleaved with other frames
+    if (session->header_stream != 0 && (type != WS_H2_CONTINUATION || id != session->header_stream)) {
+        return ws_h2_fail(session, WS_H2_PROTOCOL_ERROR);
+    }
+    
+    switch (type) {
+    case WS_H2_DATA_FRAME:
+        return ws_h2_data(session, flags, id, payload, length);
+    case WS_H2_HEADERS:
+        return ws_h2_headers(session, flags, id, payload, length);
+    case WS_H2_CONTINUATION:
+        if (session->header_stream == 0) {
+            return ws_h2_fail(session, WS_H2_PROTOCOL_ERROR);
+        }
+        return ws_h2_header_block(session, payload, length, (flags & WS_H2_FLAG_END_HEADERS) != 0);
+    case WS_H2_RST_STREAM:
+        return ws_h2_reset(session, id, length);
+    case WS_H2_SETTINGS:
+        return ws_h2_settings(session, flags, id, payload, length);
+    case WS_H2_PING:
+        if (length != 8) {
+            return ws_h2_fail(session, WS_H2_FRAME_SIZE_ERROR);
+        }
+        if (id != 0) {
+            return ws_h2_fail(session, WS_H2_PROTOCOL_ERROR);
+        }
+        if (flags & WS_H2_FLAG_ACK) {
+            return 0;
+        }
+        return ws_h2_send_frame(session, WS_H2_PING, WS_H2_FLAG_ACK, 0, payload, length);
+    case WS_H2_WINDOW_UPDATE:
+        return ws_h2_window_update(session, id, payload, length);
+    case WS_H2_PUSH_PROMISE:
+        return ws_h2_fail(session, WS_H2_PROTOCOL_ERROR);
+    default:
+        // PRIORITY, GOAWAY and unknown types need no action; after a
+        // GOAWAY the client simply opens no more streams
+        return 0;
+    }
+}
+
+// Handle every complete frame received so far
+static int ws_h2_parse(ws_h2_session_t *session) {
+    size_t pos = 0;
+    
+    if (!session->preface) {
+        if (!ws_h2_is_preface(session->in, session->in_length)) {
+            return -1;
+        }
+        if (session->in_length < WS_H2_PREFACE_LENGTH) {
+            return 0;
+        }
+        pos = WS_H2_PREFACE_LENGTH;
+        session->preface = true;
+    }
+    
+    while (session->in_length - pos >= 9 && !session->failed && !ws_h2_session_backlogged(session)) {
+        const uint8_t *header = session->in + pos;
+        size_t length = ((size_t)header[0] << 16) | ((size_t)header[1] << 8) | header[2];
+        uint32_t id = ws_h2_read32(header + 5) & WS_H2_MAX_WINDOW;
+        
+        if (length > WS_H2_FRAME_SIZE) {
+            return ws_h2_fail(session, WS_H2_FRAME_SIZE_ERROR);
+        }
+        if (session->in_length - pos < 9 + length) {
+            break;
+        }
+        
+        if (ws_h2_frame(session, header[3], header[4], id, header + 9, length) != 0) {
+            return -1;
+        }
+        pos += 9 + length;
+    }
+    
+    // Keep the partial frame at the start of the buffer
+    memmove(session->in, session->in + pos, session->in_length - pos);
+    session->in_length -= pos;
+    return session->failed ? -1 : 0;
+}
+
+int ws_h2_session_read(ws_h2_session_t *session) {
+    int result = 0;
+    
+    // Bytes received before the session existed come first
+    for (int reads = 0; reads < 16; reads++) {
+        if (ws_h2_parse(session) != 0) {
+            result = -1;
+            break;
+        }
+        
+        // Frames the replies did not fit behind wait until the client reads
+        if (ws_h2_session_backlogged(session)) {
+            if (ws_h2_session_flush(session) < 0) {
+                return -1;
+            }
+            if (ws_h2_session_backlogged(session)) {
+                break;
+            }
+            continue;
+        }
+        
+        ssize_t bytes_read = recv(session->socket, session->in + session->in_length,
+                                  session->in_capacity - session->in_length, 0);
+        if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            break;
+        }
+        if (bytes_read <= 0) {
+            result = -1;
+            break;
+        }
+        session->in_length += (size_t)bytes_read;
+    }
+    
+    // SETTINGS acknowledgements, window updates and GOAWAY go out right away
+    if (ws_h2_session_flush(session) < 0) {
+        return -1;
+    }
+    return result;
+}
+
+int ws_h2_session_flush(ws_h2_session_t *session) {
+    while (session->out_offset < session->out_length) {
+        ssize_t bytes_sent = send(session->socket, session->out + session->out_offset,
+                                  session->out_length - session->out_offset, MSG_NOSIGNAL);
+        if (bytes_sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 1;
+            }
+            return -1;
+        }
+        session->out_offset += (size_t)bytes_sent;
+    }
+    
+    session->out_offset = 0;
+    session->out_length = 0;
+    return 0;
+}
+
+bool ws_h2_session_pending(const ws_h2_session_t *session) {
+    return session->out_offset < session->out_length;
+}
+
+bool ws_h2_session_backlogged(const ws_h2_session_t *session) {
+    return session->out_length - session->out_offset > WS_H2_OUTPUT_LIMIT;
+}
+
+size_t ws_h2_session_footprint(const ws_h2_session_t *session) {
+    size_t held = session->in_capacity + session->out_capacity + session->headers_capacity;
+    for (const ws_h2_stream_t *stream = session->streams; stream; stream = stream->next) {
+        held += stream->rx_capacity;
+    }
+    return held;
+}
+
+// Bytes a stream may put into one DATA frame right now
+static size_t ws_h2_stream_room(const ws_h2_stream_t *stream) {
+    const ws_h2_session_t *session = stream->session;
+    size_t buffered = session->out_length - session->out_offset;
+    
+    if (stream->send_window <= 0 || session->send_window <= 0 || buffered + 9 >= WS_H2_OUTPUT_LIMIT) {
+        return 0;
+    }
+    
+    int64_t room = stream->send_window < session->send_window ? stream->send_window : session->send_window;
+    if (room > (int64_t)session->peer_max_frame) {
+        room = session->peer_max_frame;
+    }
+    if (room > (int64_t)(WS_H2_OUTPUT_LIMIT - buffered - 9)) {
+        room = (int64_t)(WS_H2_OUTPUT_LIMIT - buffered - 9);
+    }
+    return (size_t)room;
+}
+
+void ws_h2_session_resume(ws_h2_session_t *session) {
+    ws_h2_stream_t *stream = session->streams;
+    
+    while (stream) {
+        // The owner may close the stream it is told about
+        ws_h2_stream_t *next = stream->next;
+        if (stream->blocked && stream->connection && ws_h2_stream_room(stream) > 0) {
+            stream->blocked = false;
+            session->on_event(session->ctx, stream, WS_H2_WRITABLE);
+        }
+        stream = next;
+    }
+}
+
+void ws_h2_session_close(ws_h2_session_t *session) {
+    if (!session) {
+        return;
+    }
+    
+    // Best effort: the client learns which streams were processed, or
+    // why the connection failed
+    if (!session->failed && session->preface) {
+        uint8_t payload[8];
+        ws_h2_write32(payload, session->last_stream);
+        ws_h2_write32(payload + 4, WS_H2_NO_ERROR);
+        ws_h2_send_frame(session, WS_H2_GOAWAY, 0, 0, payload, sizeof(payload));
+    }
+    ws_h2_session_flush(session);
+    
+    while (session->streams) {
+        ws_h2_free_stream(session, session->streams);
+    }
+    
+    ws_hpack_decoder_cleanup(&session->hpack);
+    ws_mem_free(session->allocator, session->in, session->in_capacity);
+    ws_mem_free(session->allocator, session->out, session->out_capacity);
+    ws_mem_free(session->allocator, session->headers, session->headers_capacity);
+    close(session->socket);
+    ws_mem_free(session->allocator, session, sizeof(*session));
+}
+
+int ws_h2_stream_accept(ws_h2_stream_t *stream, void *connection) {
+    uint8_t status = WS_H2_STATUS_200;
+    
+    // The stream stays open: the WebSocket bytes follow in DATA frames
+    if (ws_h2_send_frame(stream->session, WS_H2_HEADERS, WS_H2_FLAG_END_HEADERS, stream->id, &status, 1) != 0) {
+        return -1;
+    }
+    
+    stream->connection = connection;
+    ws_h2_session_flush(stream->session);
+    return 0;
+}
+
+ssize_t ws_h2_stream_read(ws_h2_stream_t *stream, uint8_t *buffer, size_t size) {
+    size_t available = stream->rx_length - stream->rx_offset;
+    
+    if (available == 0) {
+        if (stream->remote_closed) {
+            return 0;
+        }
+        errno = EAGAIN;
+        return -1;
+    }
+    
+    size_t n = available < size ? available : size;
+    memcpy(buffer, stream->rx + stream->rx_offset, n);
+    stream->rx_offset += n;
+    
+    // Idle streams hold no buffer
+    if (stream->rx_offset == stream->rx_length) {
+        ws_mem_free(stream->session->allocator, stream->rx, stream->rx_capacity);
+        stream->rx = NULL;
+        stream->rx_offset = 0;
+        stream->rx_length = 0;
+        stream->rx_capacity = 0;
+    }
+    
+    stream->consumed += n;
+    stream->session->consumed += n;
+    
+    size_t queued = stream->session->out_length;
+    ws_h2_credit(stream->session, stream);
+    if (stream->session->out_length != queued) {
+        ws_h2_session_flush(stream->session);
+    }
+    
+    return (ssize_t)n;
+}
+
+// Put as much of iov into DATA frames as the windows allow
+static ssize_t ws_h2_stream_writev(ws_transport_t *transport, const struct iovec *iov, int iovcnt) {
+    ws_h2_stream_t *stream = (ws_h2_stream_t *)transport->handle;
+    ws_h2_session_t *session = stream->session;
+    size_t written = 0;
+    int index = 0;
+    size_t offset = 0;
+    
+    if (stream->local_closed || session->failed) {
+        errno = EPIPE;
+        return -1;
+    }
+    
+    stream->blocked = false;
+    while (index < iovcnt) {
+        if (offset == iov[index].iov_len) {
+            index++;
+            offset = 0;
+            continue;
+        }
+        
+        size_t room = ws_h2_stream_room(stream);
+        if (room == 0) {
+            stream->blocked = true;
+            break;
+        }
+        
+        uint8_t *frame = ws_h2_reserve(session, 9 + room);
+        if (!frame) {
+            return -1;
+        }
+        
+        // Fill the frame from as many buffers as it takes
+        size_t length = 0;
+        while (length < room && index < iovcnt) {
+            size_t n = iov[index].iov_len - offset;
+            if (n > room - length) {
+                n = room - length;
+            }
+            memcpy(frame + 9 + length, (const uint8_t *)iov[index].iov_base + offset, n);
+            length += n;
+            offset += n;
+            if (offset == iov[index].iov_len) {
+                index++;
+                offset = 0;
+            }
+        }
+        
+        ws_h2_frame_header(frame, length, WS_H2_DATA_FRAME, 0, stream->id);
+        session->out_length += 9 + length;
+        stream->send_window -= (int64_t)length;
+        session->send_window -= (int64_t)length;
+        written += length;
+    }
+    
+    if (ws_h2_session_flush(session) < 0) {
+        return -1;
+    }
+    if (written == 0 && stream->blocked) {
+        errno = EAGAIN;
+        return -1;
+    }
+    return (ssize_t)written;
+}
+
+static ssize_t ws_h2_stream_read_op(ws_transport_t *transport, uint8_t *buffer, size_t size) {
+    return ws_h2_stream_read((ws_h2_stream_t *)transport->handle, buffer, size);
+}
+
+// The session reads the socket, so a stream never blocks
+static int ws_h2_stream_wait(ws_transport_t *transport, int timeout_ms) {
+    ws_h2_stream_t *stream = (ws_h2_stream_t *)transport->handle;
+    
+    (void)timeout_ms;
+    return stream->rx_offset < stream->rx_length || stream->remote_closed ? 1 : 0;
+}
+
+static void ws_h2_stream_close_op(ws_transport_t *transport) {
+    ws_h2_stream_close((ws_h2_stream_t *)transport->handle);
+}
+
+static const ws_transport_ops_t ws_h2_stream_transport_ops = {
+    "http2",
+    ws_h2_stream_read_op,
+    ws_h2_stream_writev,
+    ws_h2_stream_wait,
+    ws_h2_stream_close_op
+};
+
+void ws_h2_stream_transport(ws_h2_stream_t *stream, ws_transport_t *transport) {
+    transport->ops = &ws_h2_stream_transport_ops;
+    transport->fd = -1;
+    transport->handle = stream;
+}
+
+void ws_h2_stream_close(ws_h2_stream_t *stream) {
+    ws_h2_session_t *session = stream->session;
+    
+    // Nothing more is sent on a connection that failed
+    if (session->failed) {
+        stream->local_closed = true;
+        stream->remote_closed = true;
+    }
+    
+    if (!stream->local_closed) {
+        ws_h2_send_frame(session, WS_H2_DATA_FRAME, WS_H2_FLAG_END_STREAM, stream->id, NULL, 0);
+        stream->local_closed = true;
+    }
+    
+    // The client need not send the rest of its side
+    if (!stream->remote_closed) {
+        ws_h2_send_u32(session, WS_H2_RST_STREAM, stream->id, WS_H2_NO_ERROR);
+    }
+    
+    stream->connection = NULL;
+    ws_h2_free_stream(session, stream);
+    ws_h2_credit(session, NULL);
+    ws_h2_session_flush(session);
+}
@@ -0,0 +1,237 @@
+#ifndef WS_H2_H
+#define WS_H2_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "alloc.h"
+#include "hpack.h"
+#include "transport.h"
+
+#define WS_H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define WS_H2_PREFACE_LENGTH 24
+#define WS_H2_FRAME_SIZE 16384          // Largest frame payload we accept (the protocol default)
+#define WS_H2_MAX_STREAMS 256           // Concurrent streams one client may open
+#define WS_H2_STREAM_WINDOW (256 << 10) // Receive window of every stream
+#define WS_H2_SESSION_WINDOW (4 << 20)  // Receive window of the whole connection
+#define WS_H2_OUTPUT_LIMIT (256 << 10)  // Frames buffered before streams stop producing more
+#define WS_H2_MAX_HEADERS 16384         // Largest header block accepted
+
+/**
+ * What an HTTP/2 session reports to its owner
+ */
+typedef enum {
+    WS_H2_OPEN,                    // A stream asked for a WebSocket; accept it or return -1
+    WS_H2_DATA,                    // Bytes arrived on a stream, or the client ended it
+    WS_H2_RESET,                   // The client reset a stream; nothing more can be sent on it
+    WS_H2_WRITABLE                 // A stream that ran out of flow-control window may send again
+} ws_h2_event_t;
+
+struct ws_h2_session;
+
+/**
+ * HTTP/2 stream carrying one WebSocket (RFC 8441)
+ */
+typedef struct ws_h2_stream {
+    uint32_t id;                   // Stream identifier chosen by the client
+    struct ws_h2_session *session; // Connection the stream belongs to
+    void *connection;              // WebSocket connection carried by the stream, NULL until accepted
+    int64_t send_window;           // Bytes the client lets us send on this stream
+    int64_t recv_window;           // Bytes we let the client send on this stream
+    size_t consumed;               // Bytes read but not yet returned to the client as window
+    uint8_t *rx;                   // DATA payload not yet read, NULL when drained
+    size_t rx_offset;
+    size_t rx_length;
+    size_t rx_capacity;
+    bool remote_closed;            // The client sent END_STREAM or reset the stream
+    bool local_closed;             // We sent END_STREAM or the stream was reset
+    bool blocked;                  // Output is waiting for window or buffer space
+    struct ws_h2_stream *next;     // Next stream of the session
+} ws_h2_stream_t;
+
+/**
+ * Callback for session events
+ *
+ * @return For WS_H2_OPEN, 0 if the stream was accepted with
+ *         ws_h2_stream_accept(); ignored otherwise
+ */
+typedef int (*ws_h2_event_fn)(void *ctx, ws_h2_stream_t *stream, ws_h2_event_t event);
+
+/**
+ * Server side of an HTTP/2 connection whose streams carry WebSockets
+ *
+ * Only what RFC 8441 needs is implemented: extended CONNECT requests open
+ * streams, DATA frames carry the WebSocket bytes both ways under flow
+ * control, and everything else is answered with 400 or ignored. The
+ * responses consist of static table entries, so no HPACK encoder is needed.
+ */
+typedef struct ws_h2_session {
+    int socket;                    // TCP connection to the client
+    uint8_t *in;                   // Received bytes not yet parsed into frames
+    size_t in_length;
+    size_t in_capacity;
+    uint8_t *out;                  // Frames not yet written to the socket
+    size_t out_offset;
+    size_t out_length;
+    size_t out_capacity;
+    bool preface;                  // The client connection preface was received
+    bool failed;                   // A connection error occurred and GOAWAY was queued
+    ws_hpack_decoder_t hpack;      // Header decompression state
+    uint8_t *headers;              // Header block being assembled from HEADERS and CONTINUATION
+    size_t headers_length;
+    size_t headers_capacity;
+    uint32_t header_stream;        // Stream of the incomplete header block, 0 if none
+    bool header_end_stream;        // The HEADERS frame also ended its stream
+    uint32_t last_stream;          // Highest stream identifier the client used
+    int64_t send_window;           // Bytes the client lets us send on the connection
+    int64_t recv_window;           // Bytes we let the client send on the connection
+    size_t consumed;               // Connection bytes read but not yet returned as window
+    uint32_t peer_initial_window;  // SETTINGS_INITIAL_WINDOW_SIZE of the client
+    uint32_t peer_max_frame;       // SETTINGS_MAX_FRAME_SIZE of the client
+    ws_h2_stream_t *streams;       // Open streams
+    int num_streams;
+    char host[128];                // Client address for the connections of the streams
+    int port;
+    int family;
+    ws_h2_event_fn on_event;       // Owner callback
+    void *ctx;                     // Passed to on_event
+    const ws_allocator_t *allocator; // Source of the session, its streams and buffers
+    size_t memory;                 // Bytes charged to the owner's memory budget
+    struct ws_h2_session *next;    // Next session of the server
+} ws_h2_session_t;
+
+/**
+ * Check whether received bytes are (the start of) the HTTP/2 preface
+ *
+ * @param data Received data
+ * @param len Length of data
+ * @return true if data matches the preface as far as it goes
+ */
+bool ws_h2_is_preface(const uint8_t *data, size_t len);
+
+/**
+ * Take over a connection that sent the HTTP/2 preface
+ *
+ * Queues the server SETTINGS. The received bytes are parsed by the first
+ * ws_h2_session_read().
+ *
+ * @param socket Non-blocking client socket, owned by the session from now on
+ * @param data Bytes received so far, starting with the preface
+ * @param len Length of data
+ * @param on_event Owner callback
+ * @param ctx Passed to on_event
+ * @param allocator Allocator for the session, NULL for malloc
+ * @return Session, or NULL on allocation failure
+ */
+ws_h2_session_t *ws_h2_session_create(int socket, const uint8_t *data, size_t len,
+                                      ws_h2_event_fn on_event, void *ctx,
+                                      const ws_allocator_t *allocator);
+
+/**
+ * Read and handle what the client sent
+ *
+ * @param session Session
+ * @return 0 on success, -1 if the connection closed or failed
+ */
+int ws_h2_session_read(ws_h2_session_t *session);
+
+/**
+ * Write queued frames
+ *
+ * @param session Session
+ * @return 0 if everything was written, 1 if frames remain, -1 on error
+ */
+int ws_h2_session_flush(ws_h2_session_t *session);
+
+/**
+ * Check whether frames are waiting to be written
+ *
+ * @param session Session
+ * @return true if the socket should be polled for writability
+ */
+bool ws_h2_session_pending(const ws_h2_session_t *session);
+
+/**
+ * Check whether the client sends faster than it reads
+ *
+ * Replies to PING, SETTINGS and requests pile up in the output of a
+ * client that does not read them. Past WS_H2_OUTPUT_LIMIT bytes, frames
+ * stay unparsed and the socket should not be polled for input until the
+ * output has been written.
+ *
+ * @param session Session
+ * @return true if more than WS_H2_OUTPUT_LIMIT bytes wait to be written
+ */
+bool ws_h2_session_backlogged(const ws_h2_session_t *session);
+
+/**
+ * Get the bytes a session holds in its buffers and those of its streams
+ *
+ * @param session Session
+ * @return Allocated bytes
+ */
+size_t ws_h2_session_footprint(const ws_h2_session_t *session);
+
+/**
+ * Report WS_H2_WRITABLE for blocked streams that may send again
+ *
+ * @param session Session
+ */
+void ws_h2_session_resume(ws_h2_session_t *session);
+
+/**
+ * Tell the client we are going away, close the socket and free the session
+ *
+ * Streams still open are freed; their connections must have been detached.
+ *
+ * @param session Session, or NULL
+ */
+void ws_h2_session_close(ws_h2_session_t *session);
+
+/**
+ * Accept a stream reported by WS_H2_OPEN
+ *
+ * @param stream Stream
+ * @param connection Connection that carries the WebSocket from now on
+ * @return 0 on success, -1 on allocation failure
+ */
+int ws_h2_stream_accept(ws_h2_stream_t *stream, void *connection);
+
+/**
+ * Read WebSocket bytes the client sent on a stream
+ *
+ * Bytes read are returned to the client as flow-control window.
+ *
+ * @param stream Stream
+ * @param buffer Destination
+ * @param size Size of buffer
+ * @return Bytes read, 0 once the client ended the stream, or -1 with
+ *         errno set to EAGAIN if nothing is available
+ */
+ssize_t ws_h2_stream_read(ws_h2_stream_t *stream, uint8_t *buffer, size_t size);
+
+/**
+ * Make a transport that carries a connection over a stream
+ *
+ * Writes become DATA frames and stop at the flow-control windows or when
+ * the session has buffered WS_H2_OUTPUT_LIMIT bytes; the stream is then
+ * reported WS_H2_WRITABLE once it may continue. Closing the transport
+ * closes the stream.
+ *
+ * @param stream Accepted stream
+ * @param transport Transport to initialize
+ */
+void ws_h2_stream_transport(ws_h2_stream_t *stream, ws_transport_t *transport);
+
+/**
+ * End a stream and free it
+ *
+ * Sends END_STREAM, and RST_STREAM if the client has not ended its side.
+ *
+ * @param stream Stream
+ */
+void ws_h2_stream_close(ws_h2_stream_t *stream);
+
+#endif /* WS_H2_H */
@@ -0,0 +1,235 @@
+#define _GNU_SOURCE
+#include "handoff.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#define WS_HANDOFF_MAGIC 0x57534831 // "WSH1", bumped whenever the layout changes
+
+// Fixed part of a record on the wire; both ends run the same build
+typedef struct {
+    uint32_t magic;
+    uint8_t type;
+    uint8_t has_fd;
+    uint16_t host_length;
+    int32_t family;
+    int32_t port;
+    uint32_t data_length;
+} ws_handoff_header_t;
+
+static socklen_t ws_handoff_address(const char *path, struct sockaddr_un *address) {
+    size_t path_len = strlen(path);
+    bool abstract = path[0] == '@';
+    
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    
+    if (path_len == 0 || path_len >= sizeof(address->sun_path)) {
+        return 0;
+    }
+    
+    // A leading '@' names a socket in the abstract namespace
+    memcpy(address->sun_path, path, path_len);
+    if (abstract) {
+        address->sun_path[0] = '\0';
+    }
+    
+    return offsetof(struct sockaddr_un, sun_path) + path_len + (abstract ? 0 : 1);
+}
+
+int ws_handoff_listen(const char *path) {
+    struct sockaddr_un address;
+    socklen_t addrlen = ws_handoff_address(path, &address);
+    if (addrlen == 0) {
+        fprintf(stderr, "Invalid control socket path: %s\n", path);
+        return -1;
+    }
+    
+    // Sequenced packets keep records apart and carry their socket with them
+    int control = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (control == -1) {
+        perror("socket failed");
+        return -1;
+    }
+    
+    // Replace a stale socket left behind by a previous run
+    struct stat st;
+    if (path[0] != '@' && lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+    
+    if (bind(control, (struct sockaddr *)&address, addrlen) == -1 || listen(control, 1) == -1) {
+        perror("control socket failed");
+        close(control);
+        return -1;
+    }
+    
+    return control;
+}
+
+int ws_handoff_connect(const char *path) {
+    struct sockaddr_un address;
+    socklen_t addrlen = ws_handoff_address(path, &address);
+    if (addrlen == 0) {
+        return -1;
+    }
+    
+    int control = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (control == -1) {
+        return -1;
+    }
+    
+    if (connect(control, (struct sockaddr *)&address, addrlen) == -1) {
+        close(control);
+        return -1;
+    }
+    
+    return control;
+}
+
+int ws_handoff_check_peer(int control) {
+    struct ucred credentials;
+    socklen_t length = sizeof(credentials);
+    
+    if (getsockopt(control, SOL_SOCKET, SO_PEERCRED, &credentials, &length) != 0) {
+        return -1;
+    }
+    
+    if (credentials.uid != geteuid()) {
+        fprintf(stderr, "Control connection from uid %u refused\n", (unsigned)credentials.uid);
+        return -1;
+    }
+    
+    return 0;
+}
+
+int ws_handoff_send(int control, const ws_handoff_record_t *record) {
+    ws_handoff_header_t header;
+    size_t host_length = strlen(record->host);
+    
+    if (host_length > WS_HANDOFF_MAX_HOST || record->data_length > WS_HANDOFF_MAX_DATA) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    
+    memset(&header, 0, sizeof(header));
+    header.magic = WS_HANDOFF_MAGIC;
+    header.type = record->type;
+    header.has_fd = record->fd >= 0;
+    header.host_length = (uint16_t)host_length;
+    header.family = record->family;
+    header.port = record->port;
+    header.data_length = (uint32_t)record->data_length;
+    
+    struct iovec iov[3];
+    int iovcnt = 0;
+    iov[iovcnt].iov_base = &header;
+    iov[iovcnt].iov_len = sizeof(header);
+    iovcnt++;
+    if (host_length > 0) {
+        iov[iovcnt].iov_base = (void *)record->host;
+        iov[iovcnt].iov_len = host_length;
+        iovcnt++;
+    }
+    if (record->data_length > 0) {
+        iov[iovcnt].iov_base = (void *)record->data;
+        iov[iovcnt].iov_len = record->data_length;
+        iovcnt++;
+    }
+    
+    union {
+        struct cmsghdr align;
+        char buffer[CMSG_SPACE(sizeof(int))];
+    } control_buffer;
+    
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+    
+    // The socket travels as ancillary data
+    if (record->fd >= 0) {
+        memset(&control_buffer, 0, sizeof(control_buffer));
+        msg.msg_control = control_buffer.buffer;
+        msg.msg_controllen = sizeof(control_buffer.buffer);
+        
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &record->fd, sizeof(int));
+    }
+    
+    ssize_t sent;
+    do {
+        sent = sendmsg(control, &msg, MSG_NOSIGNAL);
+    } while (sent < 0 && errno == EINTR);
+    
+    return sent < 0 ? -1 : 0;
+}
+
+int ws_handoff_recv(int control, ws_handoff_record_t *record, uint8_t *buffer, size_t buffer_size) {
+    ws_handoff_header_t header;
+    
+    union {
+        struct cmsghdr align;
+        char buffer[CMSG_SPACE(sizeof(int))];
+    } control_buffer;
+    
+    // Host and data arrive back to back in buffer
+    struct iovec iov[2];
+    iov[0].iov_base = &header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = buffer;
+    iov[1].iov_len = buffer_size;
+    
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    msg.msg_control = control_buffer.buffer;
+    msg.msg_controllen = sizeof(control_buffer.buffer);
+    
+    ssize_t received;
+    do {
+        received = recvmsg(control, &msg, MSG_CMSG_CLOEXEC);
+    } while (received < 0 && errno == EINTR);
+    
+    // Take ownership of the socket first so no error path leaks it
+    record->fd = -1;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (received > 0 && cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+        cmsg->cmsg_len == CMSG_LEN(sizeof(int))) {
+        memcpy(&record->fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+    
+    if (received < (ssize_t)sizeof(header) || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) ||
+        header.magic != WS_HANDOFF_MAGIC || header.host_length > WS_HANDOFF_MAX_HOST ||
+        header.host_length + (size_t)header.data_length > buffer_size || header.has_fd != (record->fd >= 0) ||
+        (size_t)received != sizeof(header) + header.host_length + header.data_length) {
+        if (record->fd >= 0) {
+            close(record->fd);
+            record->fd = -1;
+        }
+        errno = EPROTO;
+        return -1;
+    }
+    
+    record->type = header.type;
+    record->family = header.family;
+    record->port = header.port;
+    memcpy(record->host, buffer, header.host_length);
+    record->host[header.host_length] = '\0';
+    record->data = buffer + header.host_length;
+    record->data_length = header.data_length;
+    
+    return 0;
+}
@@ -0,0 +1,86 @@
+#ifndef WS_HANDOFF_H
+#define WS_HANDOFF_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+/**
+ * Record types sent over a hot-restart control connection
+ */
+#define WS_HANDOFF_LISTENER   1 // Listening socket
+#define WS_HANDOFF_CONNECTION 2 // Established connection at a message boundary
+#define WS_HANDOFF_END        3 // Nothing follows
+
+#define WS_HANDOFF_MAX_HOST 255     // Longest host or listener path
+#define WS_HANDOFF_MAX_DATA 65536   // Most buffered input carried by a connection
+#define WS_HANDOFF_BUFFER_SIZE (WS_HANDOFF_MAX_HOST + WS_HANDOFF_MAX_DATA)
+
+/**
+ * One socket and its minimal state, as passed between processes
+ */
+typedef struct {
+    uint8_t type;              // WS_HANDOFF_*
+    int fd;                    // Socket passed with SCM_RIGHTS, or -1
+    int family;                // Address family of the peer or listener
+    int port;                  // Peer port
+    char host[WS_HANDOFF_MAX_HOST + 1]; // Peer host or listener path, may be empty
+    const uint8_t *data;       // Input received but not yet handled
+    size_t data_length;        // Length of data
+} ws_handoff_record_t;
+
+/**
+ * Create the control socket a new process connects to for a takeover
+ *
+ * @param path Unix socket path, '@' for the abstract namespace
+ * @return Listening socket, or -1 on error
+ */
+int ws_handoff_listen(const char *path);
+
+/**
+ * Connect to the control socket of a running process
+ *
+ * @param path Unix socket path, '@' for the abstract namespace
+ * @return Connected socket, or -1 if no process is listening
+ */
+int ws_handoff_connect(const char *path);
+
+/**
+ * Check that the process at the other end of a control connection runs
+ * as the same user as this one
+ *
+ * Whatever is sent over the connection grants full access to this
+ * process's sockets or memory, and abstract sockets have no file
+ * permissions to keep other users from connecting.
+ *
+ * @param control Accepted control connection
+ * @return 0 if the peer may be trusted, -1 otherwise
+ */
+int ws_handoff_check_peer(int control);
+
+/**
+ * Send one record, passing its socket along
+ *
+ * The sender keeps its own copy of the socket and must close it.
+ *
+ * @param control Control connection
+ * @param record Record to send
+ * @return 0 on success, -1 on error
+ */
+int ws_handoff_send(int control, const ws_handoff_record_t *record);
+
+/**
+ * Receive one record
+ *
+ * record->data points into buffer. The received socket belongs to the
+ * caller.
+ *
+ * @param control Control connection
+ * @param record Record received
+ * @param buffer Storage for the record's host and data
+ * @param buffer_size Size of buffer, at least WS_HANDOFF_BUFFER_SIZE
+ * @return 0 on success, -1 on error
+ */
+int ws_handoff_recv(int control, ws_handoff_record_t *record, uint8_t *buffer, size_t buffer_size);
+
+#endif /* WS_HANDOFF_H */
@@ -8,36 +8,11 @@
 #include <sys/socket.h>
 #include <openssl/sha.h>
 #include <openssl/evp.h>
-#include <openssl/bio.h>
-#include <openssl/buffer.h>
 #include <ctype.h>  // For case-insensitive string comparison
 
 #define BUFFER_SIZE 4096
 #define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
 
-// Base64 encode a string
-static char *base64_encode(const unsigned char *input, int length) {
-    BIO *bio, *b64;
-    BUF_MEM *bufferPtr;
-    
-    b64 = BIO_new(BIO_f_base64());
-    bio = BIO_new(BIO_s_mem());
-    bio = BIO_push(b64, bio);
-    
-    BIO_set_flags(bio, BIO_FLAGS_BASE64_NO_NL);
-    BIO_write(bio, input, length);
-    BIO_flush(bio);
-    BIO_get_mem_ptr(bio, &bufferPtr);
-    
-    char *result = (char *)malloc(bufferPtr->length + 1);
-    if (result) {
-        memcpy(result, bufferPtr->data, bufferPtr->length);
-        result[bufferPtr->length] = 0;
-    }
-    
-    BIO_free_all(bio);
-    return result;
-}
 
 // Case insensitive string search
 static char *strcasestr(const char *haystack, const char *needle) {
@@ -115,16 +90,20 @@ int ws_generate_accept_key(const char *client_key, char *accept_key) {
     unsigned char hash[SHA_DIGEST_LENGTH];
     SHA1((unsigned char *)combined, len, hash);
     
-    // Base64 encode the hash
-    char *base64_result = base64_encode(hash, SHA_DIGEST_LENGTH);
-    
-    if (!base64_result) {
+    // Base64 encode the hash straight into the output (28 characters and a NUL)
+    if (EVP_EncodeBlock((unsigned char *)accept_key, hash, SHA_DIGEST_LENGTH) <= 0) {
         return -1;
     }
     
-    // Copy to output
-    strcpy(accept_key, base64_result);
-    free(base64_result);
+    return 0;
+}
+
+size_t ws_handshake_request_length(const char *data, size_t length) {
+    for (size_t i = 3; i < length; i++) {
+        if (data[i] == '\n' && data[i - 1] == '\r' && data[i - 2] == '\n' && data[i - 3] == '\r') {
+            return i + 1;
+        }
+    }
     
     return 0;
 }
@@ -132,7 +111,6 @@ int ws_generate_accept_key(const char *client_key, char *accept_key) {
 int ws_handshake(ws_connection_t *connection) {
     char buffer[BUFFER_SIZE];
     char response[BUFFER_SIZE];
-    char key[256] = {0};
     ssize_t bytes_read;
     int total_bytes = 0;
     bool headers_complete = false;
@@ -143,19 +121,19 @@ int ws_handshake(ws_connection_t *connection) {
     // Keep reading until we find the end of the HTTP headers or timeout
     while (!headers_complete && total_bytes < (BUFFER_SIZE - 1)) {
         // Wait for data with a timeout
-        int ready = ws_wait_for_read(connection->socket, timeout);
+        int ready = ws_transport_wait(&connection->transport, timeout);
         if (ready <= 0) {
             fprintf(stderr, "Handshake timeout or error for %s:%d\n", 
-                   connection->host, connection->port);
+                   connection->info->host, connection->info->port);
             return -1;
         }
         
-        bytes_read = recv(connection->socket, buffer + total_bytes, 
-                         BUFFER_SIZE - total_bytes - 1, 0);
+        bytes_read = ws_transport_read(&connection->transport, (uint8_t *)buffer + total_bytes,
+                                       BUFFER_SIZE - total_bytes - 1);
                          
         if (bytes_read <= 0) {
             fprintf(stderr, "Failed to read handshake data from %s:%d\n", 
-                   connection->host, connection->port);
+                   connection->info->host, connection->info->port);
             return -1;
         }
         
@@ -170,26 +148,47 @@ int ws_handshake(ws_connection_t *connection) {
     
     if (!headers_complete) {
         fprintf(stderr, "Incomplete HTTP headers from %s:%d\n", 
-               connection->host, connection->port);
+               connection->info->host, connection->info->port);
         return -1;
     }
     
+    int response_len = ws_handshake_response(connection, buffer, response, sizeof(response));
+    if (response_len < 0) {
+        return -1;
+    }
+    
+    // Send response
+    struct iovec iov = { response, (size_t)response_len };
+    if (ws_transport_writev(&connection->transport, &iov, 1) != response_len) {
+        fprintf(stderr, "Failed to send handshake response to %s:%d\n", 
+               connection->info->host, connection->info->port);
+        return -1;
+    }
+    
+    printf("Handshake successful with %s:%d\n", connection->info->host, connection->info->port);
+    return 0;
+}
+
+int ws_handshake_response(ws_connection_t *connection, const char *request,
+                          char *response, size_t response_size) {
+    char key[256] = {0};
+    
     // Debug - print the received headers
-    printf("Received HTTP request from %s:%d (%d bytes):\n%s\n", 
-           connection->host, connection->port, total_bytes, buffer);
+    printf("Received HTTP request from %s:%d (%zu bytes):\n%s\n", 
+           connection->info->host, connection->info->port, strlen(request), request);
     
     // Verify this is a WebSocket upgrade request
-    if (!strcasestr(buffer, "Upgrade: websocket") || 
-        !strcasestr(buffer, "Connection: Upgrade")) {
+    if (!strcasestr(request, "Upgrade: websocket") || 
+        !strcasestr(request, "Connection: Upgrade")) {
         fprintf(stderr, "Not a valid WebSocket upgrade request from %s:%d\n", 
-               connection->host, connection->port);
+               connection->info->host, connection->info->port);
         return -1;
     }
     
     // Extract WebSocket key
-    if (extract_header_value(buffer, "Sec-WebSocket-Key", key, sizeof(key)) != 0) {
+    if (extract_header_value(request, "Sec-WebSocket-Key", key, sizeof(key)) != 0) {
         fprintf(stderr, "Missing or invalid Sec-WebSocket-Key from %s:%d\n", 
-               connection->host, connection->port);
+               connection->info->host, connection->info->port);
         return -1;
     }
     
@@ -199,31 +198,27 @@ int ws_handshake(ws_connection_t *connection) {
     char accept_key[64];
     if (ws_generate_accept_key(key, accept_key) != 0) {
         fprintf(stderr, "Failed to generate accept key for %s:%d\n", 
-               connection->host, connection->port);
+               connection->info->host, connection->info->port);
         return -1;
     }
     
     printf("Generated accept key: '%s'\n", accept_key);
     
     // Create handshake response
-    int response_len = snprintf(response, sizeof(response),
+    int response_len = snprintf(response, response_size,
         "HTTP/1.1 101 Switching Protocols\r\n"
         "Upgrade: websocket\r\n"
         "Connection: Upgrade\r\n"
         "Sec-WebSocket-Accept: %s\r\n\r\n",
         accept_key);
     
-    // Debug - print the response
-    printf("Sending handshake response to %s:%d:\n%s\n", 
-           connection->host, connection->port, response);
-    
-    // Send response
-    if (send(connection->socket, response, response_len, 0) != response_len) {
-        fprintf(stderr, "Failed to send handshake response to %s:%d\n", 
-               connection->host, connection->port);
+    if (response_len < 0 || (size_t)response_len >= response_size) {
         return -1;
     }
     
-    printf("Handshake successful with %s:%d\n", connection->host, connection->port);
-    return 0;
+    // Debug - print the response
+    printf("Sending handshake response to %s:%d:\n%s\n", 
+           connection->info->host, connection->info->port, response);
+    
+    return response_len;
 }
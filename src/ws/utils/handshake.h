@@ -3,14 +3,40 @@
 
 #include "../ws.h"
 
+#define WS_HANDSHAKE_MAX_REQUEST 4096 // Largest accepted upgrade request, including the terminator
+
 /**
  * Perform WebSocket handshake with a client
  *
+ * Blocks for up to 5 seconds waiting for the request. The server itself
+ * reads the request from its event loop and uses ws_handshake_response().
+ *
  * @param connection Client connection
  * @return 0 on success, -1 on error
  */
 int ws_handshake(ws_connection_t *connection);
 
+/**
+ * Find the end of the HTTP request headers
+ *
+ * @param data Received data
+ * @param length Length of data
+ * @return Length of the headers including the blank line, or 0 if incomplete
+ */
+size_t ws_handshake_request_length(const char *data, size_t length);
+
+/**
+ * Validate an upgrade request and build the response
+ *
+ * @param connection Client connection
+ * @param request NUL-terminated request headers
+ * @param response Buffer for the response
+ * @param response_size Size of the response buffer
+ * @return Length of the response, or -1 if the request is not a valid upgrade
+ */
+int ws_handshake_response(ws_connection_t *connection, const char *request,
+                          char *response, size_t response_size);
+
 /**
  * Generate the WebSocket accept key
  *
@@ -0,0 +1,395 @@
+#include "hpack.h"
+
+#include <string.h>
+
+// Canonical Huffman code of RFC 7541 Appendix B: the first code of each
+// length, how many codes have it and where their symbols start
+static const struct {
+    uint32_t first;
+    uint16_t count;
+    uint16_t offset;
+} ws_hpack_huffman_lengths[31] = {
+    [5] = { 0, 10, 0 },
+    [6] = { 20, 26, 10 },
+    [7] = { 92, 32, 36 },
+    [8] = { 248, 6, 68 },
+    [10] = { 1016, 5, 74 },
+    [11] = { 2042, 3, 79 },
+    [12] = { 4090, 2, 82 },
+    [13] = { 8184, 6, 84 },
+    [14] = { 16380, 2, 90 },
+    [15] = { 32764, 3, 92 },
+    [19] = { 524272, 3, 95 },
+    [20] = { 1048550, 8, 98 },
+    [21] = { 2097116, 13, 106 },
+    [22] = { 4194258, 26, 119 },
+    [23] = { 8388568, 29, 145 },
+    [24] = { 16777194, 12, 174 },
+    [25] = { 33554412, 4, 186 },
+    [26] = { 67108832, 15, 190 },
+    [27] = { 134217694, 19, 205 },
+    [28] = { 268435426, 29, 224 },
+    [30] = { 1073741820, 4, 253 },
+};
+
+// Symbols ordered by code; 256 is EOS
+static const uint16_t ws_hpack_huffman_symbols[257] = {
+    48, 49, 50, 97, 99, 101, 105, 111, 115, 116, 32, 37,
+    45, 46, 47, 51, 52, 53, 54, 55, 56, 57, 61, 65,
+    95, 98, 100, 102, 103, 104, 108, 109, 110, 112, 114, 117,
+    58, 66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76,
+    77, 78, 79, 80, 81, 82, 83, 84, 85, 86, 87, 89,
+    106, 107, 113, 118, 119, 120, 121, 122, 38, 42, 44, 59,
+    88, 90, 33, 34, 40, 41, 63, 39, 43, 124, 35, 62,
+    0, 36, 64, 91, 93, 126, 94, 125, 60, 96, 123, 92,
+    195, 208, 128, 130, 131, 162, 184, 194, 224, 226, 153, 161,
+    167, 172, 176, 177, 179, 209, 216, 217, 227, 229, 230, 129,
+    132, 133, 134, 136, 146, 154, 156, 160, 163, 164, 169, 170,
+    173, 178, 181, 185, 186, 187, 189, 190, 196, 198, 228, 232,
+    233, 1, 135, 137, 138, 139, 140, 141, 143, 147, 149, 150,
+    151, 152, 155, 157, 158, 165, 166, 168, 174, 175, 180, 182,
+    183, 188, 191, 197, 231, 239, 9, 142, 144, 145, 148, 159,
+    171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193,
+    200, 201, 202, 205, 210, 213, 218, 219, 238, 240, 242, 243,
+    255, 203, 204, 211, 212, 214, 221, 222, 223, 241, 244, 245,
+    246, 247, 248, 250, 251, 252, 253, 254, 2, 3, 4, 5,
+    6, 7, 8, 11, 12, 14, 15, 16, 17, 18, 19, 20,
+    21, 23, 24, 25, 26, 27, 28, 29, 30, 31, 127, 220,
+    249, 10, 13, 22, 256,
+};
+
+static const struct {
+    const char *name;
+    const char *value;
+} ws_hpack_static_table[WS_HPACK_STATIC_ENTRIES] = {
+    { ":authority", "" },
+    { ":method", "GET" },
+    { ":method", "POST" },
+    { ":path", "/" },
+    { ":path", "/index.html" },
+    { ":scheme", "http" },
+    { ":scheme", "https" },
+    { ":status", "200" },
+    { ":status", "204" },
+    { ":status", "206" },
+    { ":status", "304" },
+    { ":status", "400" },
+    { ":status", "404" },
+    { ":status", "500" },
+    { "accept-charset", "" },
+    { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" },
+    { "accept-ranges", "" },
+    { "accept", "" },
+    { "access-control-allow-origin", "" },
+    { "age", "" },
+    { "allow", "" },
+    { "authorization", "" },
+    { "cache-control", "" },
+    { "content-disposition", "" },
+    { "content-encoding", "" },
+    { "content-language", "" },
+    { "content-length", "" },
+    { "content-location", "" },
+    { "content-range", "" },
+    { "content-type", "" },
+    { "cookie", "" },
+    { "date", "" },
+    { "etag", "" },
+    { "expect", "" },
+    { "expires", "" },
+    { "from", "" },
+    { "host", "" },
+    { "if-match", "" },
+    { "if-modified-since", "" },
+    { "if-none-match", "" },
+    { "if-range", "" },
+    { "if-unmodified-since", "" },
+    { "last-modified", "" },
+    { "link", "" },
+    { "location", "" },
+    { "max-forwards", "" },
+    { "proxy-authenticate", "" },
+    { "proxy-authorization", "" },
+    { "range", "" },
+    { "referer", "" },
+    { "refresh", "" },
+    { "retry-after", "" },
+    { "server", "" },
+    { "set-cookie", "" },
+    { "strict-transport-security", "" },
+    { "transfer-encoding", "" },
+    { "user-agent", "" },
+    { "vary", "" },
+    { "via", "" },
+    { "www-authenticate", "" },
+};
+
+// Decode an integer with an N-bit prefix (RFC 7541 section 5.1)
+static int ws_hpack_integer(const uint8_t **pos, const uint8_t *end, int prefix, uint64_t *value) {
+    uint64_t mask = ((uint64_t)1 << prefix) - 1;
+    uint64_t result = **pos & mask;
+    int shift = 0;
+    
+    (*pos)++;
+    if (result < mask) {
+        *value = result;
+        return 0;
+    }
+    
+    while (*pos < end) {
+        uint8_t byte = *(*pos)++;
+        if (shift > 56) {
+            return -1;
+        }
+        result += (uint64_t)(byte & 0x7F) << shift;
+        shift += 7;
+        if (!(byte & 0x80)) {
+            *value = result;
+            return 0;
+        }
+    }
+    
+    return -1;
+}
+
+static int ws_hpack_huffman_decode(const uint8_t *data, size_t len, char *out, size_t *out_length) {
+    uint32_t code = 0;
+    int bits = 0;
+    size_t n = 0;
+    
+    for (size_t i = 0; i < len; i++) {
+        for (int bit = 7; bit >= 0; bit--) {
+            code = (code << 1) | ((data[i] >> bit) & 1);
+            bits++;
+            
+            // Codes are canonical, so a code of this length is a range
+            uint32_t rank = code - ws_hpack_huffman_lengths[bits].first;
+            if (rank < ws_hpack_huffman_lengths[bits].count) {
+                uint16_t symbol = ws_hpack_huffman_symbols[ws_hpack_huffman_lengths[bits].offset + rank];
+                if (symbol == 256 || n == WS_HPACK_MAX_STRING) {
+                    return -1; // EOS must not appear in a string
+                }
+                out[n++] = (char)symbol;
+                code = 0;
+                bits = 0;
+            } else if (bits == 30) {
+                return -1;
+            }
+        }
+    }
+    
+    // Padding is a prefix of EOS: fewer than 8 bits, all ones
+    if (bits > 7 || code != ((uint32_t)1 << bits) - 1) {
+        return -1;
+    }
+    
+    *out_length = n;
+    return 0;
+}
+
+// Decode a string literal, Huffman-coded or not (RFC 7541 section 5.2)
+static int ws_hpack_string(const uint8_t **pos, const uint8_t *end, char *out, size_t *out_length) {
+    uint64_t length;
+    
+    if (*pos >= end) {
+        return -1;
+    }
+    bool huffman = (**pos & 0x80) != 0;
+    if (ws_hpack_integer(pos, end, 7, &length) != 0 || length > (uint64_t)(end - *pos)) {
+        return -1;
+    }
+    
+    if (huffman) {
+        if (ws_hpack_huffman_decode(*pos, (size_t)length, out, out_length) != 0) {
+            return -1;
+        }
+    } else {
+        if (length > WS_HPACK_MAX_STRING) {
+            return -1;
+        }
+        memcpy(out, *pos, (size_t)length);
+        *out_length = (size_t)length;
+    }
+    
+    *pos += length;
+    return 0;
+}
+
+void ws_hpack_decoder_init(ws_hpack_decoder_t *decoder, size_t settings_size,
+                           const ws_allocator_t *allocator) {
+    memset(decoder, 0, sizeof(*decoder));
+    decoder->max_size = settings_size;
+    decoder->settings_size = settings_size;
+    decoder->allocator = allocator;
+}
+
+static ws_hpack_entry_t *ws_hpack_dynamic(ws_hpack_decoder_t *decoder, size_t i) {
+    return &decoder->entries[(decoder->head + decoder->capacity - i) % decoder->capacity];
+}
+
+static void ws_hpack_evict(ws_hpack_decoder_t *decoder, size_t limit) {
+    while (decoder->count > 0 && decoder->size > limit) {
+        ws_hpack_entry_t *oldest = ws_hpack_dynamic(decoder, decoder->count - 1);
+        size_t length = oldest->name_length + oldest->value_length;
+        
+        decoder->size -= 32 + length;
+        ws_mem_free(decoder->allocator, oldest->data, length ? length : 1);
+        oldest->data = NULL;
+        decoder->count--;
+    }
+}
+
+// Look up a table index; static entries come first
+static int ws_hpack_lookup(ws_hpack_decoder_t *decoder, uint64_t index, const char **name, size_t *name_length,
+                           const char **value, size_t *value_length) {
+    if (index == 0) {
+        return -1;
+    }
+    
+    if (index <= WS_HPACK_STATIC_ENTRIES) {
+        *name = ws_hpack_static_table[index - 1].name;
+        *name_length = strlen(*name);
+        *value = ws_hpack_static_table[index - 1].value;
+        *value_length = strlen(*value);
+        return 0;
+    }
+    
+    index -= WS_HPACK_STATIC_ENTRIES + 1;
+    if (index >= decoder->count) {
+        return -1;
+    }
+    
+    ws_hpack_entry_t *entry = ws_hpack_dynamic(decoder, (size_t)index);
+    *name = (const char *)entry->data;
+    *name_length = entry->name_length;
+    *value = (const char *)entry->data + entry->name_length;
+    *value_length = entry->value_length;
+    return 0;
+}
+
+static int ws_hpack_insert(ws_hpack_decoder_t *decoder, const char *name, size_t name_length,
+                           const char *value, size_t value_length) {
+    size_t length = name_length + value_length;
+    
+    // An entry larger than the table just empties it
+    if (32 + length > decoder->max_size) {
+        ws_hpack_evict(decoder, 0);
+        return 0;
+    }
+    
+    // Copy first: name may point into an entry about to be evicted
+    uint8_t *data = (uint8_t *)ws_mem_alloc(decoder->allocator, length ? length : 1);
+    if (!data) {
+        return -1;
+    }
+    memcpy(data, name, name_length);
+    memcpy(data + name_length, value, value_length);
+    
+    ws_hpack_evict(decoder, decoder->max_size - 32 - length);
+    
+    if (decoder->count == decoder->capacity) {
+        size_t capacity = decoder->capacity ? decoder->capacity * 2 : 16;
+        ws_hpack_entry_t *entries = (ws_hpack_entry_t *)ws_mem_alloc(decoder->allocator,
+                                                                     capacity * sizeof(*entries));
+        if (!entries) {
+            ws_mem_free(decoder->allocator, data, length ? length : 1);
+            return -1;
+        }
+        
+        // Oldest first, so the newest ends up at count - 1
+        for (size_t i = 0; i < decoder->count; i++) {
+            entries[i] = *ws_hpack_dynamic(decoder, decoder->count - 1 - i);
+        }
+        ws_mem_free(decoder->allocator, decoder->entries, decoder->capacity * sizeof(*entries));
+        decoder->entries = entries;
+        decoder->head = decoder->count ? decoder->count - 1 : capacity - 1;
+        decoder->capacity = capacity;
+    }
+    
+    decoder->head = (decoder->head + 1) % decoder->capacity;
+    decoder->entries[decoder->head].data = data;
+    decoder->entries[decoder->head].name_length = name_length;
+    decoder->entries[decoder->head].value_length = value_length;
+    decoder->count++;
+    decoder->size += 32 + length;
+    return 0;
+}
+
+int ws_hpack_decode(ws_hpack_decoder_t *decoder, const uint8_t *block, size_t len,
+                    ws_hpack_header_fn emit, void *ctx) {
+    const uint8_t *pos = block;
+    const uint8_t *end = block + len;
+    char name_buffer[WS_HPACK_MAX_STRING];
+    char value_buffer[WS_HPACK_MAX_STRING];
+    bool leading = true; // No header field decoded yet
+    
+    while (pos < end) {
+        uint8_t byte = *pos;
+        uint64_t index;
+        const char *name, *value;
+        size_t name_length, value_length;
+        
+        if (byte & 0x80) {
+            // Indexed field
+            if (ws_hpack_integer(&pos, end, 7, &index) != 0 ||
+                ws_hpack_lookup(decoder, index, &name, &name_length, &value, &value_length) != 0) {
+                return -1;
+            }
+            emit(ctx, name, name_length, value, value_length);
+            leading = false;
+            continue;
+        }
+        
+        if ((byte & 0xE0) == 0x20) {
+            // Table size update, bounded by what we advertised and only
+            // allowed ahead of the first field (RFC 7541 section 4.2)
+            if (!leading || ws_hpack_integer(&pos, end, 5, &index) != 0 || index > decoder->settings_size) {
+                return -1;
+            }
+            decoder->max_size = (size_t)index;
+            ws_hpack_evict(decoder, decoder->max_size);
+            continue;
+        }
+        
+        // Literal field, with incremental indexing or without
+        bool indexing = (byte & 0x40) != 0;
+        if (ws_hpack_integer(&pos, end, indexing ? 6 : 4, &index) != 0) {
+            return -1;
+        }
+        
+        if (index > 0) {
+            const char *unused;
+            size_t unused_length;
+            if (ws_hpack_lookup(decoder, index, &name, &name_length, &unused, &unused_length) != 0) {
+                return -1;
+            }
+        } else {
+            if (ws_hpack_string(&pos, end, name_buffer, &name_length) != 0) {
+                return -1;
+            }
+            name = name_buffer;
+        }
+        
+        if (ws_hpack_string(&pos, end, value_buffer, &value_length) != 0) {
+            return -1;
+        }
+        value = value_buffer;
+        
+        emit(ctx, name, name_length, value, value_length);
+        leading = false;
+        if (indexing && ws_hpack_insert(decoder, name, name_length, value, value_length) != 0) {
+            return -1;
+        }
+    }
+    
+    return 0;
+}
+
+void ws_hpack_decoder_cleanup(ws_hpack_decoder_t *decoder) {
+    ws_hpack_evict(decoder, 0);
+    ws_mem_free(decoder->allocator, decoder->entries, decoder->capacity * sizeof(*decoder->entries));
+    decoder->entries = NULL;
+    decoder->capacity = 0;
+    decoder->head = 0;
+}
@@ -0,0 +1,81 @@
+#ifndef WS_HPACK_H
+#define WS_HPACK_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "alloc.h"
+
+#define WS_HPACK_STATIC_ENTRIES 61  // Entries of the static table
+#define WS_HPACK_TABLE_SIZE 4096    // Dynamic table size allowed by default
+#define WS_HPACK_MAX_STRING 4096    // Longest decoded header name or value
+
+/**
+ * Header field held by the dynamic table
+ */
+typedef struct {
+    uint8_t *data;                 // Name followed by value
+    size_t name_length;
+    size_t value_length;
+} ws_hpack_entry_t;
+
+/**
+ * HPACK (RFC 7541) decoder state of one HTTP/2 connection
+ *
+ * Only decoding is needed: the responses the server sends consist of
+ * static table entries.
+ */
+typedef struct {
+    ws_hpack_entry_t *entries;     // Ring of dynamic entries, newest at head
+    size_t capacity;               // Slots in entries
+    size_t count;                  // Entries in use
+    size_t head;                   // Slot of the newest entry
+    size_t size;                   // Table size as RFC 7541 counts it
+    size_t max_size;               // Limit set by the encoder's last size update
+    size_t settings_size;          // Upper bound for size updates (SETTINGS_HEADER_TABLE_SIZE)
+    const ws_allocator_t *allocator; // Source of the entries
+} ws_hpack_decoder_t;
+
+/**
+ * Callback for a decoded header field
+ *
+ * Name and value are only valid during the call and not NUL-terminated.
+ */
+typedef void (*ws_hpack_header_fn)(void *ctx, const char *name, size_t name_length,
+                                   const char *value, size_t value_length);
+
+/**
+ * Initialize a decoder
+ *
+ * @param decoder Decoder
+ * @param settings_size Dynamic table size advertised to the peer
+ * @param allocator Allocator for the dynamic table, NULL for malloc
+ */
+void ws_hpack_decoder_init(ws_hpack_decoder_t *decoder, size_t settings_size,
+                           const ws_allocator_t *allocator);
+
+/**
+ * Decode a complete header block
+ *
+ * The dynamic table is updated even if the caller ignores the headers, so
+ * every block received must be decoded.
+ *
+ * @param decoder Decoder
+ * @param block Header block fragment(s) joined together
+ * @param len Length of the block
+ * @param emit Called for every header field in order
+ * @param ctx Passed to emit
+ * @return 0 on success, -1 on a compression error
+ */
+int ws_hpack_decode(ws_hpack_decoder_t *decoder, const uint8_t *block, size_t len,
+                    ws_hpack_header_fn emit, void *ctx);
+
+/**
+ * Free the dynamic table
+ *
+ * @param decoder Decoder
+ */
+void ws_hpack_decoder_cleanup(ws_hpack_decoder_t *decoder);
+
+#endif /* WS_HPACK_H */
@@ -0,0 +1,386 @@
+#define _GNU_SOURCE
+#include "ingest.h"
+#include "handoff.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+
+#define WS_INGEST_MAGIC 0x31474e4953535743ULL // Set once the segment is initialized
+#define WS_INGEST_MAX_SIZE (1u << 30)        // Record sizes must fit in 32 bits
+#define WS_INGEST_PAD 0                      // Record kind that skips to the end of the ring
+
+/**
+ * Start of the shared segment
+ *
+ * Positions only grow; the byte offset is the position modulo capacity.
+ * Producer and consumer fields sit on separate cache lines.
+ */
+typedef struct {
+    uint64_t magic;
+    uint64_t capacity;              // Bytes of record space, a power of two
+    uint64_t reserve __attribute__((aligned(64))); // Next position publishers reserve
+    uint64_t tail __attribute__((aligned(64)));    // Next position the server reads
+    uint32_t waiting;               // Server sleeps until the eventfd is written
+} ws_ingest_header_t;
+
+/**
+ * Record in the ring, 8-byte aligned
+ *
+ * The header word is written last with a release store and is zero until
+ * then. It holds the record size in the low 32 bits, the target kind in
+ * the next 8 and the binary flag above that.
+ */
+typedef struct {
+    uint64_t header;
+    uint64_t target;
+    uint64_t length;
+    uint8_t data[];
+} ws_ingest_record_t;
+
+struct ws_ingest {
+    ws_ingest_header_t *header;     // Mapped segment
+    uint8_t *records;               // Record space right after the header
+    size_t mapped;                  // Size of the mapping
+    uint64_t capacity;              // Record space; the copy in the segment is not trusted
+    uint64_t tail;                  // Next position read (server only), mirrored to the segment
+    bool broken;                    // A malformed record was read, nothing more is taken
+    int memfd;                      // Segment, passed to publishers
+    int event;                      // eventfd, passed to publishers
+    int control;                    // Control socket (server only), or -1
+    char *path;                     // Control socket path (server only)
+};
+
+static size_t ws_ingest_segment_size(uint64_t capacity) {
+    return sizeof(ws_ingest_header_t) + capacity;
+}
+
+static ws_ingest_t *ws_ingest_map(int memfd, int event, size_t mapped) {
+    ws_ingest_t *ring = (ws_ingest_t *)calloc(1, sizeof(ws_ingest_t));
+    if (!ring) {
+        return NULL;
+    }
+    
+    void *segment = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (segment == MAP_FAILED) {
+        perror("mmap failed");
+        free(ring);
+        return NULL;
+    }
+    
+    ring->header = (ws_ingest_header_t *)segment;
+    ring->records = (uint8_t *)segment + sizeof(ws_ingest_header_t);
+    ring->mapped = mapped;
+    ring->memfd = memfd;
+    ring->event = event;
+    ring->control = -1;
+    return ring;
+}
+
+ws_ingest_t *ws_ingest_create(const char *path, size_t size) {
+    uint64_t capacity = 4096;
+    if (size > WS_INGEST_MAX_SIZE) {
+        fprintf(stderr, "Ingest ring too large: %zu bytes\n", size);
+        return NULL;
+    }
+    while (capacity < size) {
+        capacity <<= 1;
+    }
+    
+    int memfd = memfd_create("cws-ingest", MFD_CLOEXEC);
+    if (memfd == -1 || ftruncate(memfd, (off_t)ws_ingest_segment_size(capacity)) == -1) {
+        perror("memfd failed");
+        if (memfd >= 0) {
+            close(memfd);
+        }
+        return NULL;
+    }
+    
+    int event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event == -1) {
+        perror("eventfd failed");
+        close(memfd);
+        return NULL;
+    }
+    
+    ws_ingest_t *ring = ws_ingest_map(memfd, event, ws_ingest_segment_size(capacity));
+    if (!ring) {
+        close(memfd);
+        close(event);
+        return NULL;
+    }
+    
+    // A fresh memfd is zeroed, so only the fixed fields need setting
+    ring->header->capacity = capacity;
+    ring->capacity = capacity;
+    __atomic_store_n(&ring->header->magic, WS_INGEST_MAGIC, __ATOMIC_RELEASE);
+    
+    ring->path = strdup(path);
+    ring->control = ws_handoff_listen(path);
+    if (ring->control < 0 || !ring->path) {
+        ws_ingest_close(ring);
+        return NULL;
+    }
+    
+    return ring;
+}
+
+ws_ingest_t *ws_ingest_attach(const char *path) {
+    int control = ws_handoff_connect(path);
+    if (control < 0) {
+        return NULL;
+    }
+    
+    // The server answers with the segment and the eventfd
+    uint64_t capacity = 0;
+    char buffer[CMSG_SPACE(2 * sizeof(int))];
+    struct iovec iov = { &capacity, sizeof(capacity) };
+    struct msghdr msg;
+    
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = buffer;
+    msg.msg_controllen = sizeof(buffer);
+    
+    ssize_t received = recvmsg(control, &msg, MSG_CMSG_CLOEXEC);
+    close(control);
+    
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (received != sizeof(capacity) || !cmsg || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(2 * sizeof(int))) {
+        fprintf(stderr, "Invalid ingest handshake from %s\n", path);
+        return NULL;
+    }
+    
+    int fds[2];
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    
+    ws_ingest_t *ring = ws_ingest_map(fds[0], fds[1], ws_ingest_segment_size(capacity));
+    if (!ring) {
+        close(fds[0]);
+        close(fds[1]);
+        return NULL;
+    }
+    
+    if (__atomic_load_n(&ring->header->magic, __ATOMIC_ACQUIRE) != WS_INGEST_MAGIC ||
+        ring->header->capacity != capacity) {
+        fprintf(stderr, "Invalid ingest segment from %s\n", path);
+        ws_ingest_close(ring);
+        return NULL;
+    }
+    
+    ring->capacity = capacity;
+    return ring;
+}
+
+int ws_ingest_publish(ws_ingest_t *ring, ws_ingest_target_t kind, uint64_t target,
+                      const void *data, size_t len, bool is_binary) {
+    ws_ingest_header_t *header = ring->header;
+    uint64_t capacity = ring->capacity;
+    uint64_t size = (sizeof(ws_ingest_record_t) + len + 7) & ~(uint64_t)7;
+    
+    if (size > capacity / 4) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    
+    // Reserve the record, plus padding when it would cross the end
+    uint64_t position = __atomic_load_n(&header->reserve, __ATOMIC_RELAXED);
+    uint64_t pad;
+    do {
+        uint64_t offset = position & (capacity - 1);
+        pad = capacity - offset < size ? capacity - offset : 0;
+        
+        uint64_t tail = __atomic_load_n(&header->tail, __ATOMIC_ACQUIRE);
+        if (position + pad + size - tail > capacity) {
+            errno = EAGAIN;
+            return -1;
+        }
+    } while (!__atomic_compare_exchange_n(&header->reserve, &position, position + pad + size,
+                                          true, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+    
+    if (pad > 0) {
+        ws_ingest_record_t *skip = (ws_ingest_record_t *)(ring->records + (position & (capacity - 1)));
+        __atomic_store_n(&skip->header, pad | ((uint64_t)WS_INGEST_PAD << 32), __ATOMIC_RELEASE);
+        position += pad;
+    }
+    
+    ws_ingest_record_t *record = (ws_ingest_record_t *)(ring->records + (position & (capacity - 1)));
+    record->target = target;
+    record->length = len;
+    if (len > 0) {
+        memcpy(record->data, data, len);
+    }
+    
+    uint64_t word = size | ((uint64_t)kind << 32) | ((uint64_t)(is_binary ? 1 : 0) << 40);
+    __atomic_store_n(&record->header, word, __ATOMIC_RELEASE);
+    
+    // Wake the server only if it went to sleep; the fence pairs with the
+    // one in ws_ingest_prepare_wait() so one side always sees the other
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&header->waiting, __ATOMIC_RELAXED) &&
+        __atomic_exchange_n(&header->waiting, 0, __ATOMIC_SEQ_CST)) {
+        uint64_t one = 1;
+        if (write(ring->event, &one, sizeof(one)) < 0) {
+            // Counter saturated means the server is going to wake anyway
+        }
+    }
+    
+    return 0;
+}
+
+void ws_ingest_fds(const ws_ingest_t *ring, int *control, int *event) {
+    *control = ring->control;
+    *event = ring->event;
+}
+
+int ws_ingest_accept(ws_ingest_t *ring) {
+    int publisher = accept4(ring->control, NULL, NULL, SOCK_CLOEXEC);
+    if (publisher < 0) {
+        return -1;
+    }
+    
+    // The segment is writable, so only processes of our own user get it
+    if (ws_handoff_check_peer(publisher) != 0) {
+        close(publisher);
+        return -1;
+    }
+    
+    // The capacity goes along so the publisher knows how much to map
+    uint64_t capacity = ring->capacity;
+    int fds[2] = { ring->memfd, ring->event };
+    char buffer[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = { &capacity, sizeof(capacity) };
+    struct msghdr msg;
+    
+    memset(buffer, 0, sizeof(buffer));
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = buffer;
+    msg.msg_controllen = sizeof(buffer);
+    
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    
+    int result = sendmsg(publisher, &msg, MSG_NOSIGNAL) == (ssize_t)sizeof(capacity) ? 0 : -1;
+    close(publisher);
+    return result;
+}
+
+static bool ws_ingest_ready(const ws_ingest_t *ring) {
+    if (ring->broken) {
+        return false;
+    }
+    
+    const ws_ingest_record_t *record =
+        (const ws_ingest_record_t *)(ring->records + (ring->tail & (ring->capacity - 1)));
+    
+    return __atomic_load_n(&record->header, __ATOMIC_ACQUIRE) != 0;
+}
+
+bool ws_ingest_prepare_wait(ws_ingest_t *ring) {
+    // Announce the sleep, then look once more for records committed before
+    __atomic_store_n(&ring->header->waiting, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    
+    return ws_ingest_ready(ring);
+}
+
+void ws_ingest_clear(ws_ingest_t *ring) {
+    uint64_t count;
+    
+    if (read(ring->event, &count, sizeof(count)) < 0) {
+        // Already reset
+    }
+}
+
+static bool ws_ingest_valid(uint64_t size, int kind, uint64_t length, uint64_t room) {
+    // Publishers share the segment, so nothing in a record is trusted
+    if (size % 8 != 0 || size > room) {
+        return false;
+    }
+    if (kind == WS_INGEST_PAD) {
+        return size >= sizeof(uint64_t) && size == room;
+    }
+    if (kind != WS_INGEST_CONNECTION && kind != WS_INGEST_TOPIC && kind != WS_INGEST_BROADCAST) {
+        return false;
+    }
+    
+    return size >= sizeof(ws_ingest_record_t) && length <= size - sizeof(ws_ingest_record_t);
+}
+
+int ws_ingest_drain(ws_ingest_t *ring, ws_ingest_fn deliver, void *ctx, int max) {
+    ws_ingest_header_t *header = ring->header;
+    uint64_t mask = ring->capacity - 1;
+    uint64_t tail = ring->tail;
+    int taken = 0;
+    
+    while (!ring->broken && (max <= 0 || taken < max)) {
+        ws_ingest_record_t *record = (ws_ingest_record_t *)(ring->records + (tail & mask));
+        uint64_t word = __atomic_load_n(&record->header, __ATOMIC_ACQUIRE);
+        if (word == 0) {
+            break; // Empty, or the next record is not committed yet
+        }
+        
+        uint64_t size = word & 0xFFFFFFFFu;
+        int kind = (int)((word >> 32) & 0xFF);
+        bool is_binary = (word >> 40) & 1;
+        uint64_t room = ring->capacity - (tail & mask);
+        
+        // Read once, so a publisher cannot change it after the check
+        uint64_t length = 0;
+        if (kind != WS_INGEST_PAD && room >= sizeof(ws_ingest_record_t)) {
+            length = __atomic_load_n(&record->length, __ATOMIC_RELAXED);
+        }
+        
+        // After a bad record there is no telling where the next one starts
+        if (!ws_ingest_valid(size, kind, length, room)) {
+            fprintf(stderr, "Malformed ingest record at %llu, ring closed\n",
+                    (unsigned long long)tail);
+            ring->broken = true;
+            break;
+        }
+        
+        if (kind != WS_INGEST_PAD) {
+            deliver(ctx, (ws_ingest_target_t)kind, record->target, record->data,
+                    (size_t)length, is_binary);
+            taken++;
+        }
+        
+        // Publishers rely on unreserved space being zero
+        memset(record, 0, size);
+        tail += size;
+        ring->tail = tail;
+        __atomic_store_n(&header->tail, tail, __ATOMIC_RELEASE);
+    }
+    
+    return taken;
+}
+
+void ws_ingest_close(ws_ingest_t *ring) {
+    if (!ring) {
+        return;
+    }
+    
+    if (ring->control >= 0) {
+        close(ring->control);
+        if (ring->path && ring->path[0] != '@') {
+            unlink(ring->path);
+        }
+    }
+    free(ring->path);
+    
+    munmap(ring->header, ring->mapped);
+    close(ring->memfd);
+    close(ring->event);
+    free(ring);
+}
@@ -0,0 +1,133 @@
+#ifndef WS_INGEST_H
+#define WS_INGEST_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+/**
+ * Who an ingested message is for
+ */
+typedef enum {
+    WS_INGEST_CONNECTION = 1,  // One connection, by its id
+    WS_INGEST_TOPIC = 2,       // Connections subscribed to a topic (0-63)
+    WS_INGEST_BROADCAST = 3    // Every open connection
+} ws_ingest_target_t;
+
+#define WS_INGEST_TOPICS 64         // Topics a connection can subscribe to
+#define WS_INGEST_DEFAULT_SIZE (4 << 20) // Ring size when none is given
+
+/**
+ * Shared-memory message ring between publisher processes and the server
+ *
+ * The ring lives in a memfd that the server hands to every publisher
+ * that connects to its control socket, together with an eventfd. Any
+ * number of publishers reserve space with a compare-and-swap and commit
+ * their record with a single release store; the server's event loop is
+ * the only reader. A publisher that dies between reserving and committing
+ * stalls the ring, so publishers should not be killed mid-write.
+ */
+typedef struct ws_ingest ws_ingest_t;
+
+/**
+ * Callback for a message taken from the ring
+ *
+ * data points into the ring and is only valid during the call.
+ */
+typedef void (*ws_ingest_fn)(void *ctx, ws_ingest_target_t kind, uint64_t target,
+                             const uint8_t *data, size_t len, bool is_binary);
+
+/**
+ * Create a ring and its control socket
+ *
+ * @param path Unix socket path publishers connect to, '@' for the abstract namespace
+ * @param size Bytes of message space, rounded up to a power of two
+ * @return Ring, or NULL on error
+ */
+ws_ingest_t *ws_ingest_create(const char *path, size_t size);
+
+/**
+ * Attach to the ring of a running server as a publisher
+ *
+ * @param path Control socket path of the server
+ * @return Ring, or NULL if no server answered
+ */
+ws_ingest_t *ws_ingest_attach(const char *path);
+
+/**
+ * Write a message into the ring
+ *
+ * Never blocks: when the server is behind and the ring is full, the call
+ * fails with errno set to EAGAIN and the message can be retried.
+ *
+ * @param ring Ring attached with ws_ingest_attach()
+ * @param kind Target kind
+ * @param target Connection id or topic; ignored for broadcasts
+ * @param data Payload
+ * @param len Payload length, at most a quarter of the ring
+ * @param is_binary Whether to send a binary rather than a text message
+ * @return 0 on success, -1 on error
+ */
+int ws_ingest_publish(ws_ingest_t *ring, ws_ingest_target_t kind, uint64_t target,
+                      const void *data, size_t len, bool is_binary);
+
+/**
+ * Get the descriptors the server polls
+ *
+ * @param ring Ring created with ws_ingest_create()
+ * @param control Set to the control socket, readable when a publisher connects
+ * @param event Set to the eventfd, readable when messages were committed
+ */
+void ws_ingest_fds(const ws_ingest_t *ring, int *control, int *event);
+
+/**
+ * Hand the ring to a publisher waiting on the control socket
+ *
+ * @param ring Ring created with ws_ingest_create()
+ * @return 0 on success, -1 on error
+ */
+int ws_ingest_accept(ws_ingest_t *ring);
+
+/**
+ * Announce that the server is about to sleep
+ *
+ * Publishers write the eventfd only after this. Messages committed before
+ * the call are not signalled, so the caller must not sleep if this
+ * returns true.
+ *
+ * @param ring Ring created with ws_ingest_create()
+ * @return true if messages are already waiting
+ */
+bool ws_ingest_prepare_wait(ws_ingest_t *ring);
+
+/**
+ * Reset the eventfd after it polled readable
+ *
+ * @param ring Ring created with ws_ingest_create()
+ */
+void ws_ingest_clear(ws_ingest_t *ring);
+
+/**
+ * Take messages from the ring in the order their space was reserved
+ *
+ * Records are checked against the ring before use. The first malformed
+ * one is reported and breaks the ring: nothing more is taken from it.
+ *
+ * @param ring Ring created with ws_ingest_create()
+ * @param deliver Called for every message
+ * @param ctx Passed to deliver
+ * @param max Most messages taken, 0 for no limit
+ * @return Number of messages taken
+ */
+int ws_ingest_drain(ws_ingest_t *ring, ws_ingest_fn deliver, void *ctx, int max);
+
+/**
+ * Unmap the ring and close its descriptors
+ *
+ * For a server ring, a filesystem control socket is removed as well.
+ *
+ * @param ring Ring, or NULL
+ */
+void ws_ingest_close(ws_ingest_t *ring);
+
+#endif /* WS_INGEST_H */
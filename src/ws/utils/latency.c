@@ -0,0 +1,107 @@
+#include "latency.h"
+#include <string.h>
+#include <time.h>
+
+#define WS_HISTOGRAM_HALF (1 << (WS_HISTOGRAM_SUB_BITS - 1))
+
+static int ws_histogram_index(uint64_t value) {
+    if (value < (1u << WS_HISTOGRAM_SUB_BITS)) {
+        return (int)value;
+    }
+    
+    if (value >= (1ull << WS_HISTOGRAM_MAX_BITS)) {
+        value = (1ull << WS_HISTOGRAM_MAX_BITS) - 1;
+    }
+    
+    // Keep the top SUB_BITS - 1 bits below the leading one
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - (WS_HISTOGRAM_SUB_BITS - 1);
+    return (1 << WS_HISTOGRAM_SUB_BITS) + (shift - 1) * WS_HISTOGRAM_HALF +
+           (int)((value >> shift) - WS_HISTOGRAM_HALF);
+}
+
+static uint64_t ws_histogram_upper(int index) {
+    if (index < (1 << WS_HISTOGRAM_SUB_BITS)) {
+        return (uint64_t)index;
+    }
+    
+    int offset = index - (1 << WS_HISTOGRAM_SUB_BITS);
+    int shift = offset / WS_HISTOGRAM_HALF + 1;
+    uint64_t sub = (uint64_t)(offset % WS_HISTOGRAM_HALF + WS_HISTOGRAM_HALF);
+    return ((sub + 1) << shift) - 1;
+}
+
+void ws_histogram_reset(ws_histogram_t *histogram) {
+    memset(histogram->counts, 0, sizeof(histogram->counts));
+    histogram->total = 0;
+    histogram->sum = 0;
+    histogram->min = UINT64_MAX;
+    histogram->max = 0;
+}
+
+void ws_histogram_record(ws_histogram_t *histogram, uint64_t value) {
+    __atomic_fetch_add(&histogram->counts[ws_histogram_index(value)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->total, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->sum, value, __ATOMIC_RELAXED);
+    
+    uint64_t seen = __atomic_load_n(&histogram->min, __ATOMIC_RELAXED);
+    while (value < seen &&
+           !__atomic_compare_exchange_n(&histogram->min, &seen, value, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+    
+    seen = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+    while (value > seen &&
+           !__atomic_compare_exchange_n(&histogram->max, &seen, value, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+uint64_t ws_histogram_percentile(const ws_histogram_t *histogram, double percentile) {
+    uint64_t total = __atomic_load_n(&histogram->total, __ATOMIC_RELAXED);
+    if (total == 0) {
+        return 0;
+    }
+    
+    if (percentile < 0) {
+        percentile = 0;
+    } else if (percentile > 100) {
+        percentile = 100;
+    }
+    
+    // Rank of the value, counting from 1
+    uint64_t rank = (uint64_t)(percentile / 100.0 * (double)total + 0.5);
+    if (rank == 0) {
+        rank = 1;
+    }
+    
+    uint64_t seen = 0;
+    for (int i = 0; i < WS_HISTOGRAM_BUCKETS; i++) {
+        seen += __atomic_load_n(&histogram->counts[i], __ATOMIC_RELAXED);
+        if (seen >= rank) {
+            uint64_t upper = ws_histogram_upper(i);
+            uint64_t max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+            return upper < max ? upper : max;
+        }
+    }
+    
+    return __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+}
+
+double ws_histogram_mean(const ws_histogram_t *histogram) {
+    uint64_t total = __atomic_load_n(&histogram->total, __ATOMIC_RELAXED);
+    
+    return total ? (double)__atomic_load_n(&histogram->sum, __ATOMIC_RELAXED) / (double)total : 0;
+}
+
+int64_t ws_latency_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+int64_t ws_latency_realtime(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
@@ -0,0 +1,99 @@
+#ifndef WS_LATENCY_H
+#define WS_LATENCY_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+/**
+ * HDR-style histogram buckets
+ *
+ * Values below 128 ns are counted exactly. Above that every power of two
+ * is split into 64 buckets, so percentiles are within 1.6% of the true
+ * value up to 2^40 ns (about 18 minutes); larger values are clamped.
+ */
+#define WS_HISTOGRAM_SUB_BITS 7
+#define WS_HISTOGRAM_MAX_BITS 40
+#define WS_HISTOGRAM_BUCKETS ((1 << WS_HISTOGRAM_SUB_BITS) + \
+    (WS_HISTOGRAM_MAX_BITS - WS_HISTOGRAM_SUB_BITS + 1) * (1 << (WS_HISTOGRAM_SUB_BITS - 1)))
+
+/**
+ * Latency histogram in nanoseconds
+ *
+ * Recording is lock-free, so worker threads and the event loop may record
+ * into the same histogram.
+ */
+typedef struct {
+    uint64_t counts[WS_HISTOGRAM_BUCKETS];
+    uint64_t total;                // Number of recorded values
+    uint64_t sum;                  // Sum of recorded values
+    uint64_t min;                  // Smallest recorded value, UINT64_MAX if empty
+    uint64_t max;                  // Largest recorded value
+} ws_histogram_t;
+
+/**
+ * Stages a message goes through
+ */
+typedef enum {
+    WS_LATENCY_RECEIVE,            // Kernel receive timestamp to frame parsed
+    WS_LATENCY_QUEUE,              // Frame parsed to on_message start on a dispatch worker
+    WS_LATENCY_HANDLER,            // on_message start to return
+    WS_LATENCY_SEND,               // Frame queued to last byte handed to the kernel
+    WS_LATENCY_STAGES
+} ws_latency_stage_t;
+
+/**
+ * Per-server latency tracing state
+ */
+typedef struct {
+    ws_histogram_t stages[WS_LATENCY_STAGES];
+    bool kernel_timestamps;        // SO_TIMESTAMPING is requested on client sockets
+} ws_latency_t;
+
+/**
+ * Reset a histogram to empty
+ *
+ * @param histogram Histogram
+ */
+void ws_histogram_reset(ws_histogram_t *histogram);
+
+/**
+ * Record one value
+ *
+ * @param histogram Histogram
+ * @param value Value in nanoseconds
+ */
+void ws_histogram_record(ws_histogram_t *histogram, uint64_t value);
+
+/**
+ * Value at a percentile
+ *
+ * @param histogram Histogram
+ * @param percentile Percentile between 0 and 100
+ * @return Upper bound of the bucket holding the percentile, 0 if empty
+ */
+uint64_t ws_histogram_percentile(const ws_histogram_t *histogram, double percentile);
+
+/**
+ * Mean of the recorded values
+ *
+ * @param histogram Histogram
+ * @return Mean in nanoseconds, 0 if empty
+ */
+double ws_histogram_mean(const ws_histogram_t *histogram);
+
+/**
+ * Current CLOCK_MONOTONIC time
+ *
+ * @return Nanoseconds
+ */
+int64_t ws_latency_now(void);
+
+/**
+ * Current CLOCK_REALTIME time, the clock of kernel timestamps
+ *
+ * @return Nanoseconds since the epoch
+ */
+int64_t ws_latency_realtime(void);
+
+#endif /* WS_LATENCY_H */
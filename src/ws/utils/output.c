@@ -0,0 +1,965 @@
+#define _GNU_SOURCE
+#include "output.h"
+#include "frames.h"
+
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#if defined(__linux__) && defined(MSG_ZEROCOPY)
+#include <linux/errqueue.h>
+#define WS_HAVE_ZEROCOPY 1
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define WS_OUTPUT_GATHER_MAX 32 // Frames written by one sendmsg()
+
+void ws_output_init(ws_output_t *output) {
+    for (int i = 0; i < WS_LANE_COUNT; i++) {
+        output->lanes[i].head = NULL;
+        output->lanes[i].tail = NULL;
+    }
+    output->current = NULL;
+    output->active = NULL;
+    output->closed = false;
+    output->zc_head = NULL;
+    output->zc_tail = NULL;
+    output->zc_next = 0;
+    output->zc_done = 0;
+    output->zerocopy = false;
+    output->latency = NULL;
+    output->queued_bytes = 0;
+    output->keys = NULL;
+    output->key_buckets = 0;
+    output->key_count = 0;
+    output->key_allocator = NULL;
+    output->dropped = 0;
+    output->conflated = 0;
+    output->budget = NULL;
+    output->charged = 0;
+}
+
+int ws_output_enable_zerocopy(ws_output_t *output, int socket) {
+#ifdef WS_HAVE_ZEROCOPY
+    int one = 1;
+    if (setsockopt(socket, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0) {
+        output->zerocopy = true;
+        return 0;
+    }
+#else
+    (void)output;
+    (void)socket;
+#endif
+    return -1;
+}
+
+// Encode the header of the next frame of an item
+static void ws_output_next_frame(ws_output_item_t *item) {
+    size_t remaining = item->length - item->frame_end;
+    size_t frame_length = remaining;
+    
+    if (item->fragment_size > 0 && frame_length > item->fragment_size) {
+        frame_length = item->fragment_size;
+    }
+    
+    uint8_t opcode = item->frame_end == 0 ? item->opcode : WS_OPCODE_CONTINUATION;
+    bool fin = frame_length == remaining;
+    
+    item->header_length = ws_create_frame_header(opcode, fin, frame_length, false, item->header);
+    item->header_sent = 0;
+    item->frame_end += frame_length;
+}
+
+// Common initialization of a new item
+static void ws_output_item_init(ws_output_item_t *item, uint8_t opcode, size_t len) {
+    item->opcode = opcode;
+    item->lane = (opcode & 0x08) ? WS_LANE_CONTROL : WS_LANE_HIGH;
+    item->data = NULL;
+    item->file = -1;
+    item->spliced = false;
+    item->file_offset = 0;
+    item->length = len;
+    item->offset = 0;
+    item->frame_end = 0;
+    item->fragment_size = 0;
+    item->borrowed = false;
+    item->prepared = NULL;
+    item->zerocopy = false;
+    item->zerocopy_used = false;
+    item->zerocopy_id = 0;
+    item->queued_ns = 0;
+    item->allocator = NULL;
+    item->keyed = false;
+    item->key = 0;
+    item->key_next = NULL;
+    item->next = NULL;
+}
+
+ws_output_item_t *ws_output_item_create(uint8_t opcode, const uint8_t *data, size_t len, bool borrow,
+                                        const ws_allocator_t *allocator) {
+    ws_output_item_t *item = (ws_output_item_t *)ws_mem_alloc(allocator, sizeof(ws_output_item_t) + (borrow ? 0 : len));
+    if (!item) {
+        return NULL;
+    }
+    
+    ws_output_item_init(item, opcode, len);
+    item->allocator = allocator;
+    item->borrowed = borrow;
+    item->zerocopy = borrow;
+    
+    if (borrow) {
+        item->data = data;
+    } else {
+        // Payload lives right after the item in the same allocation
+        uint8_t *copy = (uint8_t *)(item + 1);
+        if (len > 0) {
+            memcpy(copy, data, len);
+        }
+        item->data = copy;
+    }
+    
+    ws_output_next_frame(item);
+    return item;
+}
+
+ws_output_item_t *ws_output_item_create_prepared(ws_prepared_message_t *message,
+                                                 const ws_allocator_t *allocator) {
+    ws_output_item_t *item = (ws_output_item_t *)ws_mem_alloc(allocator, sizeof(ws_output_item_t));
+    if (!item) {
+        return NULL;
+    }
+    
+    // The cached frame already holds the header, so it is all payload here
+    ws_output_item_init(item, message->opcode, message->frame_length);
+    item->allocator = allocator;
+    item->prepared = ws_prepared_message_retain(message);
+    item->data = message->frame;
+    item->header_length = 0;
+    item->header_sent = 0;
+    item->frame_end = item->length;
+    
+    return item;
+}
+
+ws_output_item_t *ws_output_item_create_file(int fd, off_t offset, size_t len, size_t fragment_size,
+                                             const ws_allocator_t *allocator) {
+    ws_output_item_t *item = (ws_output_item_t *)ws_mem_alloc(allocator, sizeof(ws_output_item_t));
+    if (!item) {
+        return NULL;
+    }
+    
+    ws_output_item_init(item, WS_OPCODE_BINARY, len);
+    item->allocator = allocator;
+    item->file = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (item->file < 0) {
+        ws_mem_free(allocator, item, sizeof(ws_output_item_t));
+        return NULL;
+    }
+    item->file_offset = offset;
+    item->fragment_size = fragment_size;
+    item->lane = WS_LANE_LOW;
+    
+    ws_output_next_frame(item);
+    return item;
+}
+
+ws_output_item_t *ws_output_item_create_pipe(int pipe_fd, size_t len, const ws_allocator_t *allocator) {
+    ws_output_item_t *item = (ws_output_item_t *)ws_mem_alloc(allocator, sizeof(ws_output_item_t));
+    if (!item) {
+        return NULL;
+    }
+    
+    ws_output_item_init(item, WS_OPCODE_BINARY, len);
+    item->allocator = allocator;
+    item->file = pipe_fd;
+    item->spliced = true;
+    
+    ws_output_next_frame(item);
+    return item;
+}
+
+ws_output_item_t *ws_output_item_create_keyed(uint8_t opcode, const uint8_t *data, size_t len, uint64_t key,
+                                              const ws_allocator_t *allocator) {
+    ws_output_item_t *item = (ws_output_item_t *)ws_mem_alloc(allocator, sizeof(ws_output_item_t));
+    if (!item) {
+        return NULL;
+    }
+    
+    uint8_t *copy = (uint8_t *)ws_mem_alloc(allocator, len ? len : 1);
+    if (!copy) {
+        ws_mem_free(allocator, item, sizeof(ws_output_item_t));
+        return NULL;
+    }
+    if (len > 0) {
+        memcpy(copy, data, len);
+    }
+    
+    ws_output_item_init(item, opcode, len);
+    item->allocator = allocator;
+    item->data = copy;
+    item->keyed = true;
+    item->key = key;
+    
+    ws_output_next_frame(item);
+    return item;
+}
+
+void ws_output_item_fragment(ws_output_item_t *item, size_t fragment_size) {
+    item->fragment_size = fragment_size;
+    item->frame_end = 0;
+    ws_output_next_frame(item);
+}
+
+void ws_output_item_free(ws_output_item_t *item) {
+    if (item->file >= 0 && !item->spliced) {
+        close(item->file);
+    }
+    if (item->prepared) {
+        ws_prepared_message_release(item->prepared);
+    }
+    if (item->keyed) {
+        ws_mem_free(item->allocator, (void *)item->data, item->length ? item->length : 1);
+    }
+    
+    // A copied payload was part of the item's allocation
+    size_t size = sizeof(*item);
+    if (item->data == (const uint8_t *)(item + 1)) {
+        size += item->length;
+    }
+    ws_mem_free(item->allocator, item, size);
+}
+
+static size_t ws_output_key_bucket(const ws_output_t *output, uint64_t key) {
+    // Fibonacci hashing spreads sequential keys over the buckets
+    return (size_t)((key * 0x9E3779B97F4A7C15ULL) >> 32) & (output->key_buckets - 1);
+}
+
+static ws_output_item_t *ws_output_key_find(const ws_output_t *output, uint64_t key) {
+    if (!output->keys) {
+        return NULL;
+    }
+    
+    ws_output_item_t *item = output->keys[ws_output_key_bucket(output, key)];
+    while (item && item->key != key) {
+        item = item->key_next;
+    }
+    return item;
+}
+
+static void ws_output_key_remove(ws_output_t *output, ws_output_item_t *item) {
+    if (!output->keys) {
+        return;
+    }
+    
+    // Superseded items were already unlinked
+    ws_output_item_t **link = &output->keys[ws_output_key_bucket(output, item->key)];
+    while (*link) {
+        if (*link == item) {
+            *link = item->key_next;
+            item->key_next = NULL;
+            output->key_count--;
+            return;
+        }
+        link = &(*link)->key_next;
+    }
+}
+
+static int ws_output_key_grow(ws_output_t *output, const ws_allocator_t *allocator) {
+    size_t buckets = output->key_buckets ? output->key_buckets * 2 : 16;
+    ws_output_item_t **keys = (ws_output_item_t **)ws_mem_alloc(allocator, buckets * sizeof(*keys));
+    if (!keys) {
+        return -1;
+    }
+    memset(keys, 0, buckets * sizeof(*keys));
+    
+    ws_output_item_t **old_keys = output->keys;
+    size_t old_buckets = output->key_buckets;
+    output->keys = keys;
+    output->key_buckets = buckets;
+    
+    for (size_t i = 0; i < old_buckets; i++) {
+        ws_output_item_t *item = old_keys[i];
+        while (item) {
+            ws_output_item_t *next = item->key_next;
+            size_t bucket = ws_output_key_bucket(output, item->key);
+            item->key_next = keys[bucket];
+            keys[bucket] = item;
+            item = next;
+        }
+    }
+    
+    ws_mem_free(output->key_allocator, old_keys, old_buckets * sizeof(*old_keys));
+    output->key_allocator = allocator;
+    return 0;
+}
+
+// Make a keyed item the one its key refers to
+static void ws_output_key_insert(ws_output_t *output, ws_output_item_t *item) {
+    ws_output_item_t *previous = ws_output_key_find(output, item->key);
+    if (previous) {
+        ws_output_key_remove(output, previous);
+    }
+    
+    // Without an entry the item is just never conflated
+    if (output->key_count >= output->key_buckets && ws_output_key_grow(output, item->allocator) != 0) {
+        return;
+    }
+    
+    size_t bucket = ws_output_key_bucket(output, item->key);
+    item->key_next = output->keys[bucket];
+    output->keys[bucket] = item;
+    output->key_count++;
+}
+
+// Account for an item leaving its lane
+static void ws_output_forget(ws_output_t *output, ws_output_item_t *item) {
+    if (item->lane != WS_LANE_CONTROL) {
+        output->queued_bytes -= item->length;
+        ws_budget_charge(output->budget, &output->charged, output->queued_bytes);
+    }
+    if (item->keyed) {
+        ws_output_key_remove(output, item);
+    }
+}
+
+int ws_output_push(ws_output_t *output, ws_output_item_t *item) {
+    ws_output_lane_t *lane = &output->lanes[item->lane];
+    
+    if (output->closed) {
+        return -1;
+    }
+    
+    item->next = NULL;
+    if (lane->tail) {
+        lane->tail->next = item;
+    } else {
+        lane->head = item;
+    }
+    lane->tail = item;
+    
+    if (item->lane != WS_LANE_CONTROL) {
+        output->queued_bytes += item->length;
+        ws_budget_charge(output->budget, &output->charged, output->queued_bytes);
+    }
+    if (item->keyed) {
+        ws_output_key_insert(output, item);
+    }
+    
+    return 0;
+}
+
+// Whether any of an item has been handed to the socket
+static bool ws_output_started(const ws_output_t *output, const ws_output_item_t *item) {
+    return item == output->current || item == output->active ||
+           item->header_sent > 0 || item->offset > 0;
+}
+
+bool ws_output_conflate(ws_output_t *output, ws_output_item_t *item) {
+    ws_output_item_t *queued = ws_output_key_find(output, item->key);
+    if (!queued || ws_output_started(output, queued)) {
+        return false;
+    }
+    
+    // The queued item keeps its place and takes the newer payload
+    const uint8_t *data = queued->data;
+    size_t length = queued->length;
+    
+    if (queued->lane != WS_LANE_CONTROL) {
+        output->queued_bytes = output->queued_bytes - length + item->length;
+        ws_budget_charge(output->budget, &output->charged, output->queued_bytes);
+    }
+    queued->opcode = item->opcode;
+    queued->data = item->data;
+    queued->length = item->length;
+    queued->fragment_size = item->fragment_size;
+    queued->frame_end = 0;
+    ws_output_next_frame(queued);
+    
+    // The item leaves with the older payload
+    item->data = data;
+    item->length = length;
+    ws_output_item_free(item);
+    
+    output->conflated++;
+    return true;
+}
+
+int ws_output_drop(ws_output_t *output, size_t limit, const ws_output_item_t *keep,
+                   ws_output_done_fn done, void *ctx) {
+    int dropped = 0;
+    
+    // Bulk messages go first; control frames are never dropped
+    for (int i = WS_LANE_LOW; i > WS_LANE_CONTROL && output->queued_bytes > limit; i--) {
+        ws_output_lane_t *lane = &output->lanes[i];
+        ws_output_item_t **link = &lane->head;
+        ws_output_item_t *previous = NULL;
+        
+        while (*link && *link != keep && output->queued_bytes > limit) {
+            ws_output_item_t *item = *link;
+            
+            // A spliced payload has to leave its pipe in order
+            if (ws_output_started(output, item) || item->spliced) {
+                previous = item;
+                link = &item->next;
+                continue;
+            }
+            
+            *link = item->next;
+            if (lane->tail == item) {
+                lane->tail = previous;
+            }
+            ws_output_forget(output, item);
+            
+            if (item->borrowed && done) {
+                done(ctx, item->data, item->length);
+            }
+            ws_output_item_free(item);
+            output->dropped++;
+            dropped++;
+        }
+    }
+    
+    return dropped;
+}
+
+// Pick the item whose next frame goes out first
+static ws_output_item_t *ws_output_select(ws_output_t *output) {
+    // A frame that has started must be finished first
+    if (output->current) {
+        return output->current;
+    }
+    
+    // Control frames may go between fragments of a message
+    if (output->lanes[WS_LANE_CONTROL].head) {
+        return output->lanes[WS_LANE_CONTROL].head;
+    }
+    
+    // Fragments of different messages must not interleave
+    if (output->active) {
+        return output->active;
+    }
+    
+    if (output->lanes[WS_LANE_HIGH].head) {
+        return output->lanes[WS_LANE_HIGH].head;
+    }
+    
+    return output->lanes[WS_LANE_LOW].head;
+}
+
+// Unlink the head item of a lane
+static void ws_output_pop(ws_output_t *output, ws_output_item_t *item) {
+    ws_output_lane_t *lane = &output->lanes[item->lane];
+    
+    lane->head = item->next;
+    if (!lane->head) {
+        lane->tail = NULL;
+    }
+    item->next = NULL;
+    ws_output_forget(output, item);
+}
+
+// Free an item the queue is done with, unless the kernel may still be
+// transmitting from its payload
+static void ws_output_release(ws_output_t *output, ws_output_item_t *item,
+                              ws_output_done_fn done, void *ctx) {
+    if (item->zerocopy_used) {
+        item->next = NULL;
+        if (output->zc_tail) {
+            output->zc_tail->next = item;
+        } else {
+            output->zc_head = item;
+        }
+        output->zc_tail = item;
+        return;
+    }
+    
+    // The kernel copied whatever it was given, so a borrowed payload is free again
+    if (item->borrowed && done) {
+        done(ctx, item->data, item->length);
+    }
+    ws_output_item_free(item);
+}
+
+// Move a fully written item to where it waits for its payload to be released
+static void ws_output_retire(ws_output_t *output, ws_output_item_t *item,
+                             ws_output_done_fn done, void *ctx) {
+    if (output->latency && item->queued_ns) {
+        ws_histogram_record(output->latency, (uint64_t)(ws_latency_now() - item->queued_ns));
+    }
+    
+    ws_output_release(output, item, done, ctx);
+}
+
+// Write file payload of the current frame straight from the page cache,
+// or pipe payload straight from the pipe buffer
+static ssize_t ws_output_send_file(ws_output_item_t *item, int socket) {
+    off_t file_offset = item->file_offset + (off_t)item->offset;
+    size_t count = item->frame_end - item->offset;
+
+#ifdef __linux__
+    if (item->spliced) {
+        return splice(item->file, NULL, socket, NULL, count, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    }
+    return sendfile(socket, item->file, &file_offset, count);
+#else
+    // Without sendfile, bounce through a small buffer
+    uint8_t buffer[16384];
+    if (count > sizeof(buffer)) {
+        count = sizeof(buffer);
+    }
+    
+    ssize_t bytes_read = pread(item->file, buffer, count, file_offset);
+    if (bytes_read <= 0) {
+        return bytes_read;
+    }
+    return send(socket, buffer, (size_t)bytes_read, MSG_NOSIGNAL);
+#endif
+}
+
+// Write the rest of the current frame of a memory item
+static ssize_t ws_output_send_memory(ws_output_t *output, ws_output_item_t *item, int socket) {
+    struct iovec iov[2];
+    int iovcnt = 0;
+    
+#ifdef WS_HAVE_ZEROCOPY
+    // The header buffer is reused for the next fragment, so it must be
+    // copied by the kernel rather than referenced
+    if (item->zerocopy && output->zerocopy && item->header_sent < item->header_length) {
+        return send(socket, item->header + item->header_sent,
+                    item->header_length - item->header_sent,
+                    MSG_NOSIGNAL | (item->offset < item->frame_end ? MSG_MORE : 0));
+    }
+#endif
+    
+    // Remaining part of the header, then of the payload
+    if (item->header_sent < item->header_length) {
+        iov[iovcnt].iov_base = item->header + item->header_sent;
+        iov[iovcnt].iov_len = item->header_length - item->header_sent;
+        iovcnt++;
+    }
+    
+    if (item->offset < item->frame_end) {
+        iov[iovcnt].iov_base = (void *)(item->data + item->offset);
+        iov[iovcnt].iov_len = item->frame_end - item->offset;
+        iovcnt++;
+    }
+    
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+    
+    int flags = MSG_NOSIGNAL;
+    bool zerocopy = false;
+#ifdef WS_HAVE_ZEROCOPY
+    zerocopy = item->zerocopy && output->zerocopy;
+    if (zerocopy) {
+        flags |= MSG_ZEROCOPY;
+    }
+#else
+    (void)output;
+#endif
+    
+    ssize_t bytes_sent = sendmsg(socket, &msg, flags);
+
+#ifdef WS_HAVE_ZEROCOPY
+    if (bytes_sent < 0 && errno == ENOBUFS && zerocopy) {
+        // Out of option memory for notifications: fall back to a copy
+        zerocopy = false;
+        bytes_sent = sendmsg(socket, &msg, MSG_NOSIGNAL);
+    }
+#endif
+    
+    if (bytes_sent > 0 && zerocopy) {
+        // Every successful MSG_ZEROCOPY send takes one sequence number
+        item->zerocopy_used = true;
+        item->zerocopy_id = output->zc_next++;
+    }
+    
+    return bytes_sent;
+}
+
+// Drop everything still queued once a close frame has been written
+static void ws_output_discard(ws_output_t *output, ws_output_done_fn done, void *ctx) {
+    for (int i = 0; i < WS_LANE_COUNT; i++) {
+        ws_output_item_t *item = output->lanes[i].head;
+        while (item) {
+            ws_output_item_t *next = item->next;
+            ws_output_release(output, item, done, ctx);
+            item = next;
+        }
+        output->lanes[i].head = NULL;
+        output->lanes[i].tail = NULL;
+    }
+    
+    output->current = NULL;
+    output->active = NULL;
+    output->queued_bytes = 0;
+    ws_budget_charge(output->budget, &output->charged, 0);
+    if (output->keys) {
+        memset(output->keys, 0, output->key_buckets * sizeof(*output->keys));
+    }
+    output->key_count = 0;
+}
+
+static bool ws_output_gatherable(const ws_output_t *output, const ws_output_item_t *item) {
+    // Single frames from memory that the kernel copies
+    return item->file < 0 && item->frame_end == item->length &&
+           !(item->zerocopy && output->zerocopy);
+}
+
+static int ws_output_flush_gather(ws_output_t *output, ws_output_item_t *first, int socket,
+                                  ws_transport_t *transport, ws_output_done_fn done, void *ctx) {
+    ws_output_item_t *items[WS_OUTPUT_GATHER_MAX];
+    struct iovec iov[WS_OUTPUT_GATHER_MAX * 2];
+    int count = 0;
+    int iovcnt = 0;
+    bool more = false;
+    
+    // Collect frames in the order ws_output_select() would pick them;
+    // nothing may follow a close frame
+    items[count++] = first;
+    for (int lane = 0; lane < WS_LANE_COUNT && !more; lane++) {
+        ws_output_item_t *item = output->lanes[lane].head;
+        for (; item && !more && items[count - 1]->opcode != WS_OPCODE_CLOSE; item = item->next) {
+            if (item == first) {
+                continue;
+            }
+            if (count == WS_OUTPUT_GATHER_MAX || !ws_output_gatherable(output, item)) {
+                more = true;
+                break;
+            }
+            items[count++] = item;
+        }
+    }
+    
+    for (int i = 0; i < count; i++) {
+        ws_output_item_t *item = items[i];
+        if (item->header_sent < item->header_length) {
+            iov[iovcnt].iov_base = item->header + item->header_sent;
+            iov[iovcnt].iov_len = item->header_length - item->header_sent;
+            iovcnt++;
+        }
+        if (item->offset < item->frame_end) {
+            iov[iovcnt].iov_base = (void *)(item->data + item->offset);
+            iov[iovcnt].iov_len = item->frame_end - item->offset;
+            iovcnt++;
+        }
+    }
+    
+    ssize_t bytes_sent;
+    if (transport) {
+        bytes_sent = ws_transport_writev(transport, iov, iovcnt);
+    } else {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        
+        // MSG_MORE holds back a partial segment when more frames follow
+        bytes_sent = sendmsg(socket, &msg, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+    }
+    if (bytes_sent < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return 1;
+        }
+        return -1;
+    }
+    
+    // Retire the frames that were written completely
+    size_t written = (size_t)bytes_sent;
+    for (int i = 0; i < count; i++) {
+        ws_output_item_t *item = items[i];
+        
+        size_t part = item->header_length - item->header_sent;
+        if (part > written) {
+            part = written;
+        }
+        item->header_sent += part;
+        written -= part;
+        
+        part = item->frame_end - item->offset;
+        if (part > written) {
+            part = written;
+        }
+        item->offset += part;
+        written -= part;
+        
+        if (item->header_sent < item->header_length || item->offset < item->frame_end) {
+            // A frame not started yet may still be overtaken by control frames
+            if (item->header_sent > 0 || item->offset > 0) {
+                output->current = item;
+            }
+            return 1; // Short write: the socket buffer is full
+        }
+        output->current = NULL;
+        
+        ws_output_pop(output, item);
+        if (item->opcode == WS_OPCODE_CLOSE) {
+            output->closed = true;
+            ws_output_retire(output, item, done, ctx);
+            ws_output_discard(output, done, ctx);
+            return 0;
+        }
+        ws_output_retire(output, item, done, ctx);
+    }
+    
+    return 0;
+}
+
+// Write the rest of the current frame to a transport other than a socket
+static ssize_t ws_output_send_transport(ws_output_item_t *item, ws_transport_t *transport) {
+    struct iovec iov[2];
+    int iovcnt = 0;
+    uint8_t buffer[16384];
+    
+    if (item->header_sent < item->header_length) {
+        iov[iovcnt].iov_base = item->header + item->header_sent;
+        iov[iovcnt].iov_len = item->header_length - item->header_sent;
+        iovcnt++;
+    }
+    
+    if (item->offset < item->frame_end) {
+        size_t count = item->frame_end - item->offset;
+        
+        if (item->file < 0) {
+            iov[iovcnt].iov_base = (void *)(item->data + item->offset);
+        } else if (item->spliced) {
+            // Bytes read from the pipe could not be put back after a short write
+            errno = EINVAL;
+            return -1;
+        } else {
+            // File payload bounces through a small buffer
+            if (count > sizeof(buffer)) {
+                count = sizeof(buffer);
+            }
+            ssize_t bytes_read = pread(item->file, buffer, count, item->file_offset + (off_t)item->offset);
+            if (bytes_read <= 0) {
+                if (bytes_read == 0) {
+                    errno = EIO;
+                }
+                return -1;
+            }
+            iov[iovcnt].iov_base = buffer;
+            count = (size_t)bytes_read;
+        }
+        iov[iovcnt].iov_len = count;
+        iovcnt++;
+    }
+    
+    return ws_transport_writev(transport, iov, iovcnt);
+}
+
+// Socket writes use the socket directly; any other transport gets iovecs
+static int ws_output_write_frames(ws_output_t *output, int socket, ws_transport_t *transport,
+                                  ws_output_done_fn done, void *ctx) {
+    ws_output_item_t *item;
+    
+    while ((item = ws_output_select(output)) != NULL) {
+        ssize_t bytes_sent;
+        
+        // Runs of small frames go out with a single system call
+        if (!output->active && ws_output_gatherable(output, item)) {
+            int result = ws_output_flush_gather(output, item, socket, transport, done, ctx);
+            if (result != 0 || output->closed) {
+                return result;
+            }
+            continue;
+        }
+        
+        if (transport) {
+            bytes_sent = ws_output_send_transport(item, transport);
+        } else if (item->file >= 0 && item->header_sent < item->header_length) {
+            // Header on its own; MSG_MORE lets it share a segment with the payload
+            bytes_sent = send(socket, item->header + item->header_sent,
+                              item->header_length - item->header_sent,
+                              MSG_NOSIGNAL | (item->offset < item->frame_end ? MSG_MORE : 0));
+        } else if (item->file >= 0) {
+            bytes_sent = ws_output_send_file(item, socket);
+            if (bytes_sent == 0) {
+                // File is shorter than promised; the frame can never be finished
+                errno = EIO;
+                return -1;
+            }
+        } else {
+            bytes_sent = ws_output_send_memory(output, item, socket);
+        }
+        
+        if (bytes_sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                return 1;
+            }
+            return -1;
+        }
+        
+        // Account header bytes first, the rest is payload
+        size_t written = (size_t)bytes_sent;
+        size_t header_part = item->header_length - item->header_sent;
+        if (header_part > written) {
+            header_part = written;
+        }
+        item->header_sent += header_part;
+        item->offset += written - header_part;
+        
+        if (item->header_sent < item->header_length || item->offset < item->frame_end) {
+            output->current = item;
+            // A write that stopped at the end of the header may just have
+            // been the header alone; only a write stopping elsewhere is short
+            bool header_only = written == header_part && item->header_sent == item->header_length;
+            if (item->file < 0 && !header_only) {
+                return 1; // Short write: the socket buffer is full
+            }
+            continue;
+        }
+        output->current = NULL;
+        
+        // Frame complete: start the next fragment, or retire the message
+        if (item->frame_end < item->length) {
+            ws_output_next_frame(item);
+            output->active = item;
+            continue;
+        }
+        
+        if (output->active == item) {
+            output->active = NULL;
+        }
+        ws_output_pop(output, item);
+        
+        if (item->opcode == WS_OPCODE_CLOSE) {
+            output->closed = true;
+            ws_output_retire(output, item, done, ctx);
+            ws_output_discard(output, done, ctx);
+            return 0;
+        }
+        ws_output_retire(output, item, done, ctx);
+    }
+    
+    return 0;
+}
+
+int ws_output_flush(ws_output_t *output, int socket, ws_output_done_fn done, void *ctx) {
+    return ws_output_write_frames(output, socket, NULL, done, ctx);
+}
+
+int ws_output_write(ws_output_t *output, ws_transport_t *transport, ws_output_done_fn done, void *ctx) {
+    if (transport->ops == &ws_socket_transport) {
+        return ws_output_write_frames(output, transport->fd, NULL, done, ctx);
+    }
+    return ws_output_write_frames(output, -1, transport, done, ctx);
+}
+
+int ws_output_reap(ws_output_t *output, int socket, ws_output_done_fn done, void *ctx) {
+#ifdef WS_HAVE_ZEROCOPY
+    while (1) {
+        char control[128];
+        struct msghdr msg;
+        
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        
+        if (recvmsg(socket, &msg, MSG_ERRQUEUE) < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                break;
+            }
+            return -1;
+        }
+        
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                  (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))) {
+                continue;
+            }
+            
+            struct sock_extended_err *serr = (struct sock_extended_err *)CMSG_DATA(cm);
+            if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr->ee_errno != 0) {
+                continue;
+            }
+            
+            // ee_info..ee_data is the completed range; TCP completes in order
+            if ((int32_t)(serr->ee_data + 1 - output->zc_done) > 0) {
+                output->zc_done = serr->ee_data + 1;
+            }
+        }
+    }
+#else
+    (void)socket;
+#endif
+    
+    int completed = 0;
+    while (output->zc_head && (int32_t)(output->zc_head->zerocopy_id - output->zc_done) < 0) {
+        ws_output_item_t *item = output->zc_head;
+        
+        output->zc_head = item->next;
+        if (!output->zc_head) {
+            output->zc_tail = NULL;
+        }
+        
+        if (done) {
+            done(ctx, item->data, item->length);
+        }
+        ws_output_item_free(item);
+        completed++;
+    }
+    
+    return completed;
+}
+
+bool ws_output_pending(const ws_output_t *output) {
+    if (!output) {
+        return false;
+    }
+    
+    for (int i = 0; i < WS_LANE_COUNT; i++) {
+        if (output->lanes[i].head) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ws_output_zerocopy_pending(const ws_output_t *output) {
+    return output && output->zc_head != NULL;
+}
+
+void ws_output_abandon(ws_output_t *output, ws_output_done_fn done, void *ctx) {
+    if (!output) {
+        return;
+    }
+    
+    ws_output_discard(output, done, ctx);
+}
+
+void ws_output_cleanup(ws_output_t *output, ws_output_done_fn done, void *ctx) {
+    if (!output) {
+        return;
+    }
+    
+    ws_output_item_t *item = output->zc_head;
+    
+    // The caller has made sure the kernel is done with these
+    while (item) {
+        ws_output_item_t *next = item->next;
+        if (done) {
+            done(ctx, item->data, item->length);
+        }
+        ws_output_item_free(item);
+        item = next;
+    }
+    
+    ws_output_discard(output, done, ctx);
+    ws_mem_free(output->key_allocator, output->keys, output->key_buckets * sizeof(*output->keys));
+    ws_output_init(output);
+}
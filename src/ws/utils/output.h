@@ -0,0 +1,330 @@
+#ifndef WS_OUTPUT_H
+#define WS_OUTPUT_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "prepared.h"
+#include "latency.h"
+#include "alloc.h"
+#include "budget.h"
+#include "transport.h"
+
+/**
+ * Outbound lanes, written in strict priority order
+ */
+#define WS_LANE_CONTROL 0      // Ping, pong and close frames
+#define WS_LANE_HIGH    1      // Latency-sensitive messages
+#define WS_LANE_LOW     2      // Bulk messages
+#define WS_LANE_COUNT   3
+
+/**
+ * Message waiting to be written to a socket
+ *
+ * The payload comes from memory or from a file and is written as one frame
+ * or, with a fragment size, as a sequence of frames whose headers are
+ * encoded as the previous one completes.
+ */
+typedef struct ws_output_item {
+    uint8_t header[14];            // Header of the frame being written
+    size_t header_length;          // Length of the header
+    size_t header_sent;            // Header bytes already written
+    uint8_t opcode;                // Message opcode
+    uint8_t lane;                  // Outbound lane (WS_LANE_*)
+    const uint8_t *data;           // Payload (stored after the item, or borrowed), NULL for files
+    int file;                      // File (or pipe, if spliced) the payload is read from, or -1
+    bool spliced;                  // Payload is moved out of a pipe the item does not own
+    off_t file_offset;             // File offset of the first payload byte
+    size_t length;                 // Payload length
+    size_t offset;                 // Payload bytes already written
+    size_t frame_end;              // Payload offset where the current frame ends
+    size_t fragment_size;          // Maximum payload per frame, 0 for a single frame
+    bool borrowed;                 // Payload belongs to the caller until completion
+    ws_prepared_message_t *prepared; // Prepared message whose frame is the payload, or NULL
+    bool zerocopy;                 // Payload may be sent with MSG_ZEROCOPY
+    bool zerocopy_used;            // At least one MSG_ZEROCOPY send covered this item
+    uint32_t zerocopy_id;          // Sequence number of the last such send
+    int64_t queued_ns;             // Monotonic time the item was queued, 0 if not traced
+    const ws_allocator_t *allocator; // Allocator the item came from, NULL for malloc
+    bool keyed;                    // Payload is allocated separately and may be conflated
+    uint64_t key;                  // Conflation key of a keyed item
+    struct ws_output_item *key_next; // Next item in the same bucket of the key index
+    struct ws_output_item *next;   // Next item in queue
+} ws_output_item_t;
+
+/**
+ * FIFO of items in one lane
+ */
+typedef struct {
+    ws_output_item_t *head;
+    ws_output_item_t *tail;
+} ws_output_lane_t;
+
+/**
+ * Per-connection output queue
+ *
+ * Control frames are written first and may go between the fragments of a
+ * message. Data messages are taken from the high lane before the low lane,
+ * but only at message boundaries since fragments of different messages
+ * must not interleave on the wire.
+ */
+typedef struct {
+    ws_output_lane_t lanes[WS_LANE_COUNT]; // Items waiting to be written
+    ws_output_item_t *current;     // Item whose frame is partially written
+    ws_output_item_t *active;      // Data message with fragments still to write
+    bool closed;                   // A close frame went out; nothing may follow it
+    ws_output_item_t *zc_head;     // Written items waiting for zero-copy completion
+    ws_output_item_t *zc_tail;
+    uint32_t zc_next;              // Sequence number of the next MSG_ZEROCOPY send
+    uint32_t zc_done;              // All sequence numbers below this have completed
+    bool zerocopy;                 // SO_ZEROCOPY is enabled on the socket
+    ws_histogram_t *latency;       // Records queued-to-written time of items, or NULL
+    size_t queued_bytes;           // Payload bytes of queued data messages
+    ws_output_item_t **keys;       // Key index: latest queued keyed item per key, chained by bucket
+    size_t key_buckets;            // Number of buckets, a power of two, 0 before the first keyed item
+    size_t key_count;              // Items in the key index
+    const ws_allocator_t *key_allocator; // Allocator of the bucket array
+    uint64_t dropped;              // Messages dropped by ws_output_drop()
+    uint64_t conflated;            // Messages replaced by ws_output_conflate()
+    ws_memory_budget_t *budget;    // Charged with queued_bytes, or NULL
+    size_t charged;                // What budget holds against this queue
+} ws_output_t;
+
+/**
+ * Callback for a borrowed payload the library no longer references
+ */
+typedef void (*ws_output_done_fn)(void *ctx, const uint8_t *data, size_t len);
+
+/**
+ * Initialize an output queue
+ *
+ * @param output Output queue
+ */
+void ws_output_init(ws_output_t *output);
+
+/**
+ * Enable SO_ZEROCOPY on a socket
+ *
+ * @param output Output queue of the socket
+ * @param socket Socket file descriptor
+ * @return 0 on success, -1 if the kernel does not support it
+ */
+int ws_output_enable_zerocopy(ws_output_t *output, int socket);
+
+/**
+ * Create an item for one complete frame
+ *
+ * With borrow set the payload is not copied and must stay valid until
+ * the done callback reports it; otherwise the payload is copied into the
+ * same allocation as the item. Control opcodes go to the control lane,
+ * everything else to the high lane.
+ *
+ * @param opcode Frame opcode
+ * @param data Payload data
+ * @param len Payload length
+ * @param borrow Whether to reference the payload instead of copying it
+ * @param allocator Allocator for the item, NULL for malloc
+ * @return New item, or NULL on allocation failure
+ */
+ws_output_item_t *ws_output_item_create(uint8_t opcode, const uint8_t *data, size_t len, bool borrow,
+                                        const ws_allocator_t *allocator);
+
+/**
+ * Create an item that references the encoded frame of a prepared message
+ *
+ * The item holds a reference to the message until it is freed. The frame
+ * is written as is, so it is never fragmented.
+ *
+ * @param message Prepared message
+ * @param allocator Allocator for the item, NULL for malloc
+ * @return New item, or NULL on allocation failure
+ */
+ws_output_item_t *ws_output_item_create_prepared(ws_prepared_message_t *message,
+                                                 const ws_allocator_t *allocator);
+
+/**
+ * Create an item for a message that a newer one with the same key may replace
+ *
+ * The payload is copied into its own allocation so that conflation can
+ * swap it without moving the item in its queue.
+ *
+ * @param opcode Message opcode
+ * @param data Payload data
+ * @param len Payload length
+ * @param key Conflation key chosen by the application
+ * @param allocator Allocator for the item, NULL for malloc
+ * @return New item, or NULL on allocation failure
+ */
+ws_output_item_t *ws_output_item_create_keyed(uint8_t opcode, const uint8_t *data, size_t len, uint64_t key,
+                                              const ws_allocator_t *allocator);
+
+/**
+ * Split an item's payload into frames of at most fragment_size bytes
+ *
+ * Must be called before the item is queued.
+ *
+ * @param item Output item
+ * @param fragment_size Maximum payload per frame, 0 for a single frame
+ */
+void ws_output_item_fragment(ws_output_item_t *item, size_t fragment_size);
+
+/**
+ * Create an item that streams part of a file as a fragmented binary message
+ *
+ * The payload is moved with sendfile() and never enters user space.
+ * The file descriptor is duplicated, so the caller may close its own.
+ * File items go to the low lane.
+ *
+ * @param fd File descriptor to read from
+ * @param offset File offset of the first byte
+ * @param len Number of bytes to send
+ * @param fragment_size Maximum payload per frame
+ * @param allocator Allocator for the item, NULL for malloc
+ * @return New item, or NULL on error
+ */
+ws_output_item_t *ws_output_item_create_file(int fd, off_t offset, size_t len, size_t fragment_size,
+                                             const ws_allocator_t *allocator);
+
+/**
+ * Create an item that moves bytes waiting in a pipe as one binary frame
+ *
+ * The payload is spliced from the pipe into the socket without entering
+ * user space. The pipe stays the caller's and must hold exactly the bytes
+ * of the items queued from it, in order. Linux only.
+ *
+ * @param pipe_fd Read end of the pipe
+ * @param len Number of bytes to send
+ * @param allocator Allocator for the item, NULL for malloc
+ * @return New item, or NULL on allocation failure
+ */
+ws_output_item_t *ws_output_item_create_pipe(int pipe_fd, size_t len, const ws_allocator_t *allocator);
+
+/**
+ * Free an item
+ *
+ * @param item Item to free
+ */
+void ws_output_item_free(ws_output_item_t *item);
+
+/**
+ * Append an item to the queue of its lane
+ *
+ * Items queued after a close frame went out are discarded.
+ *
+ * @param output Output queue
+ * @param item Item to append
+ * @return 0 on success, -1 if the item was discarded
+ */
+int ws_output_push(ws_output_t *output, ws_output_item_t *item);
+
+/**
+ * Replace the queued message with the same key by a keyed item
+ *
+ * The queued message keeps its place in the queue and takes over the
+ * item's payload. A message whose first frame has started is not replaced.
+ *
+ * @param output Output queue
+ * @param item Keyed item, freed if it replaced a queued message
+ * @return true if the item was consumed, false if it still has to be pushed
+ */
+bool ws_output_conflate(ws_output_t *output, ws_output_item_t *item);
+
+/**
+ * Drop the oldest queued data messages until at most limit bytes remain
+ *
+ * Low-lane messages go before high-lane ones. Messages that have started
+ * to be written, spliced messages and keep are never dropped.
+ *
+ * @param output Output queue
+ * @param limit Queued payload bytes to get down to
+ * @param keep Item to keep, typically the one just queued, or NULL
+ * @param done Called for dropped borrowed payloads
+ * @param ctx Context passed to done
+ * @return Number of messages dropped
+ */
+int ws_output_drop(ws_output_t *output, size_t limit, const ws_output_item_t *keep,
+                   ws_output_done_fn done, void *ctx);
+
+/**
+ * Write as much of the queue as the socket accepts
+ *
+ * @param output Output queue
+ * @param socket Socket file descriptor
+ * @param done Called for borrowed payloads that were copied by the kernel
+ * @param ctx Context passed to done
+ * @return 0 if the queue is empty, 1 if data remains, -1 on error
+ */
+int ws_output_flush(ws_output_t *output, int socket, ws_output_done_fn done, void *ctx);
+
+/**
+ * Write as much of the queue as a transport accepts
+ *
+ * A socket transport is written like ws_output_flush() does. Other
+ * transports receive the frames through writev; spliced payloads cannot
+ * be written to them.
+ *
+ * @param output Output queue
+ * @param transport Transport of the connection
+ * @param done Called for borrowed payloads that were copied
+ * @param ctx Context passed to done
+ * @return 0 if the queue is empty, 1 if data remains, -1 on error
+ */
+int ws_output_write(ws_output_t *output, ws_transport_t *transport, ws_output_done_fn done, void *ctx);
+
+/**
+ * Read zero-copy completions from the socket error queue
+ *
+ * @param output Output queue
+ * @param socket Socket file descriptor
+ * @param done Called for every payload the kernel has released
+ * @param ctx Context passed to done
+ * @return Number of completed items, or -1 on error
+ */
+int ws_output_reap(ws_output_t *output, int socket, ws_output_done_fn done, void *ctx);
+
+/**
+ * Check whether items are waiting to be written
+ *
+ * @param output Output queue, or NULL for a connection that never sent
+ * @return true if the socket should be polled for writability
+ */
+bool ws_output_pending(const ws_output_t *output);
+
+/**
+ * Check whether zero-copy completions are outstanding
+ *
+ * @param output Output queue, or NULL for a connection that never sent
+ * @return true if the error queue should be reaped
+ */
+bool ws_output_zerocopy_pending(const ws_output_t *output);
+
+/**
+ * Drop every item not yet written, reporting borrowed payloads as done
+ *
+ * Items waiting for zero-copy completion stay, and partly written items
+ * sent with MSG_ZEROCOPY join them: the kernel may still be transmitting
+ * from them, even after the socket is closed, so they are only reported
+ * by ws_output_reap().
+ *
+ * @param output Output queue, or NULL
+ * @param done Called for every borrowed payload dropped
+ * @param ctx Context passed to done
+ */
+void ws_output_abandon(ws_output_t *output, ws_output_done_fn done, void *ctx);
+
+/**
+ * Free all items, reporting borrowed payloads as done
+ *
+ * Only valid once the kernel no longer references the payloads: every
+ * zero-copy completion was reaped, or the socket was reset, which
+ * purges its send queue.
+ *
+ * @param output Output queue, or NULL
+ * @param done Called for every borrowed payload
+ * @param ctx Context passed to done
+ */
+void ws_output_cleanup(ws_output_t *output, ws_output_done_fn done, void *ctx);
+
+#endif /* WS_OUTPUT_H */
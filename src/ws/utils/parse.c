@@ -2,8 +2,10 @@
 #include <string.h>
 
 int ws_parse_frame(const uint8_t *data, size_t length, ws_frame_t *frame) {
+    frame->frame_length = 0;
+    
     if (length < 2) {
-        return -1; // Not enough data for a valid frame
+        return 1; // Not enough data for a valid frame
     }
     
     // Parse first byte
@@ -21,35 +23,48 @@ int ws_parse_frame(const uint8_t *data, size_t length, ws_frame_t *frame) {
     size_t header_size = 2;
     if (payload_len == 126) {
         if (length < 4) {
-            return -1; // Not enough data
+            return 1; // Not enough data
         }
         frame->payload_length = ((uint16_t)data[2] << 8) | data[3];
         header_size = 4;
     } else if (payload_len == 127) {
         if (length < 10) {
-            return -1; // Not enough data
+            return 1; // Not enough data
         }
         frame->payload_length = 0;
         for (int i = 0; i < 8; i++) {
             frame->payload_length = (frame->payload_length << 8) | data[2 + i];
         }
         header_size = 10;
+        
+        // The most significant bit must be 0
+        if (frame->payload_length >> 63) {
+            return -1;
+        }
     } else {
         frame->payload_length = payload_len;
     }
     
+    // Control frames must not be fragmented and carry at most 125 bytes
+    if ((frame->opcode & 0x08) && (!frame->fin || frame->payload_length > 125)) {
+        return -1;
+    }
+    
     // Parse masking key
     if (frame->mask) {
         if (length < header_size + 4) {
-            return -1; // Not enough data
+            return 1; // Not enough data
         }
         memcpy(frame->mask_key, data + header_size, 4);
         header_size += 4;
     }
     
+    // The header is complete, so the frame size is known from here on
+    frame->frame_length = header_size + frame->payload_length;
+    
     // Check if we have the full payload
-    if (length < header_size + frame->payload_length) {
-        return -1; // Not enough data
+    if (length < frame->frame_length) {
+        return 1; // Not enough data
     }
     
     // Get payload
@@ -64,7 +79,22 @@ int ws_parse_frame(const uint8_t *data, size_t length, ws_frame_t *frame) {
 }
 
 void ws_unmask_payload(uint8_t *payload, size_t length, const uint8_t mask_key[4]) {
-    for (size_t i = 0; i < length; i++) {
+    uint64_t mask;
+    size_t i = 0;
+    
+    // Eight bytes per step; the key repeats every four, so it lines up
+    // with every word. memcpy keeps unaligned access defined and lets the
+    // compiler vectorize the loop.
+    memcpy(&mask, mask_key, 4);
+    memcpy((uint8_t *)&mask + 4, mask_key, 4);
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, payload + i, 8);
+        word ^= mask;
+        memcpy(payload + i, &word, 8);
+    }
+    
+    for (; i < length; i++) {
         payload[i] ^= mask_key[i % 4];
     }
 }
@@ -6,10 +6,14 @@
 /**
  * Parse a WebSocket frame from raw data
  *
+ * The payload is unmasked in place once the whole frame is available.
+ * If only part of the frame is available, frame->frame_length is set as
+ * soon as the header is complete and 0 before that.
+ *
  * @param data Raw frame data
  * @param length Length of data
  * @param frame Output frame structure
- * @return 0 on success, -1 on error
+ * @return 0 on success, 1 if more data is needed, -1 if the frame is invalid
  */
 int ws_parse_frame(const uint8_t *data, size_t length, ws_frame_t *frame);
 
@@ -0,0 +1,146 @@
+#include "pool.h"
+#include <string.h>
+
+void ws_buffer_pool_init(ws_buffer_pool_t *pool, size_t buffer_size, size_t max_cached,
+                         const ws_allocator_t *allocator) {
+    pool->buffer_size = buffer_size < sizeof(void *) ? sizeof(void *) : buffer_size;
+    pool->max_cached = max_cached;
+    pool->cached = 0;
+    pool->free_list = NULL;
+    pool->allocator = allocator;
+}
+
+void *ws_buffer_pool_get(ws_buffer_pool_t *pool) {
+    void *buffer = pool->free_list;
+    
+    if (!buffer) {
+        return ws_mem_alloc(pool->allocator, pool->buffer_size);
+    }
+    
+    pool->free_list = *(void **)buffer;
+    pool->cached--;
+    return buffer;
+}
+
+void ws_buffer_pool_put(ws_buffer_pool_t *pool, void *buffer) {
+    if (pool->cached >= pool->max_cached) {
+        ws_mem_free(pool->allocator, buffer, pool->buffer_size);
+        return;
+    }
+    
+    *(void **)buffer = pool->free_list;
+    pool->free_list = buffer;
+    pool->cached++;
+}
+
+void ws_buffer_pool_destroy(ws_buffer_pool_t *pool) {
+    while (pool->free_list) {
+        void *buffer = pool->free_list;
+        pool->free_list = *(void **)buffer;
+        ws_mem_free(pool->allocator, buffer, pool->buffer_size);
+    }
+    pool->cached = 0;
+}
+
+// Class index for a size, or -1 if it is too large for any class
+static int ws_size_class(size_t size) {
+    size_t class_size = WS_SIZE_CLASS_MIN;
+    
+    for (int i = 0; i < WS_SIZE_CLASSES; i++) {
+        if (size <= class_size) {
+            return i;
+        }
+        class_size <<= 1;
+    }
+    
+    return -1;
+}
+
+static void *ws_size_class_alloc(void *ctx, size_t size) {
+    ws_size_class_pool_t *pool = ctx;
+    int index = ws_size_class(size);
+    void *block = NULL;
+    
+    if (index < 0) {
+        return malloc(size);
+    }
+    
+    pthread_mutex_lock(&pool->lock);
+    pool->allocations++;
+    block = pool->free_lists[index];
+    if (block) {
+        pool->free_lists[index] = *(void **)block;
+        pool->cached[index]--;
+        pool->reused++;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    
+    return block ? block : malloc((size_t)WS_SIZE_CLASS_MIN << index);
+}
+
+static void ws_size_class_free(void *ctx, void *ptr, size_t size) {
+    ws_size_class_pool_t *pool = ctx;
+    int index = ws_size_class(size);
+    
+    if (index >= 0) {
+        pthread_mutex_lock(&pool->lock);
+        if (pool->cached[index] < pool->max_cached) {
+            *(void **)ptr = pool->free_lists[index];
+            pool->free_lists[index] = ptr;
+            pool->cached[index]++;
+            ptr = NULL;
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    
+    free(ptr);
+}
+
+static void *ws_size_class_realloc(void *ctx, void *ptr, size_t old_size, size_t new_size) {
+    // Still fits the block's class
+    int index = ws_size_class(old_size);
+    if (ptr && index >= 0 && ws_size_class(new_size) == index) {
+        return ptr;
+    }
+    
+    // Both too large for a class: plain heap blocks
+    if (ptr && index < 0 && ws_size_class(new_size) < 0) {
+        return realloc(ptr, new_size);
+    }
+    
+    void *moved = ws_size_class_alloc(ctx, new_size);
+    if (!moved) {
+        return NULL;
+    }
+    if (ptr) {
+        memcpy(moved, ptr, old_size < new_size ? old_size : new_size);
+        ws_size_class_free(ctx, ptr, old_size);
+    }
+    return moved;
+}
+
+int ws_size_class_pool_init(ws_size_class_pool_t *pool, size_t max_cached) {
+    memset(pool, 0, sizeof(*pool));
+    if (pthread_mutex_init(&pool->lock, NULL) != 0) {
+        return -1;
+    }
+    
+    pool->max_cached = max_cached;
+    pool->allocator.alloc = ws_size_class_alloc;
+    pool->allocator.realloc = ws_size_class_realloc;
+    pool->allocator.free = ws_size_class_free;
+    pool->allocator.ctx = pool;
+    return 0;
+}
+
+void ws_size_class_pool_destroy(ws_size_class_pool_t *pool) {
+    for (int i = 0; i < WS_SIZE_CLASSES; i++) {
+        while (pool->free_lists[i]) {
+            void *block = pool->free_lists[i];
+            pool->free_lists[i] = *(void **)block;
+            free(block);
+        }
+        pool->cached[i] = 0;
+    }
+    pthread_mutex_destroy(&pool->lock);
+}
@@ -0,0 +1,103 @@
+#ifndef WS_POOL_H
+#define WS_POOL_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "alloc.h"
+
+/**
+ * Cache of equally sized buffers shared by all connections of a server
+ *
+ * Connections borrow a buffer only while data is in flight and put it
+ * back when they go idle, so idle connections hold no buffer at all.
+ * Buffers are blocks of the pool's allocator and may be grown with
+ * ws_mem_realloc(), after which they must be freed instead of returned.
+ * Not thread-safe.
+ */
+typedef struct {
+    size_t buffer_size;        // Size of every pooled buffer
+    size_t max_cached;         // Most idle buffers kept for reuse
+    size_t cached;             // Idle buffers in the free list
+    void *free_list;           // Idle buffers, linked through their first bytes
+    const ws_allocator_t *allocator; // Source of the buffers, NULL for malloc
+} ws_buffer_pool_t;
+
+/**
+ * Initialize a buffer pool
+ *
+ * @param pool Buffer pool
+ * @param buffer_size Size of every buffer, at least sizeof(void *)
+ * @param max_cached Most idle buffers kept; more are freed
+ * @param allocator Source of the buffers, NULL for malloc
+ */
+void ws_buffer_pool_init(ws_buffer_pool_t *pool, size_t buffer_size, size_t max_cached,
+                         const ws_allocator_t *allocator);
+
+/**
+ * Borrow a buffer of pool->buffer_size bytes
+ *
+ * @param pool Buffer pool
+ * @return Buffer, or NULL on allocation failure
+ */
+void *ws_buffer_pool_get(ws_buffer_pool_t *pool);
+
+/**
+ * Return a buffer taken from the pool
+ *
+ * @param pool Buffer pool
+ * @param buffer Buffer of pool->buffer_size bytes
+ */
+void ws_buffer_pool_put(ws_buffer_pool_t *pool, void *buffer);
+
+/**
+ * Free all idle buffers
+ *
+ * @param pool Buffer pool
+ */
+void ws_buffer_pool_destroy(ws_buffer_pool_t *pool);
+
+#define WS_SIZE_CLASS_MIN 64     // Smallest size class
+#define WS_SIZE_CLASSES 11       // Classes 64 B to 64 KB in powers of two
+
+/**
+ * Size-class allocator for frame buffers, output items and connections
+ *
+ * Requests are rounded up to a power of two between 64 bytes and 64 KB
+ * and served from a free list per class; larger ones go to malloc. Freed
+ * blocks are kept for reuse up to max_cached per class. Thread-safe, so it
+ * can be used as server->allocator with dispatch workers.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    void *free_lists[WS_SIZE_CLASSES]; // Idle blocks per class, linked through their first bytes
+    size_t cached[WS_SIZE_CLASSES];    // Idle blocks per class
+    size_t max_cached;                 // Most idle blocks kept per class
+    uint64_t allocations;              // Blocks handed out
+    uint64_t reused;                   // Of those, taken from a free list
+    ws_allocator_t allocator;          // Allocator interface backed by this pool
+} ws_size_class_pool_t;
+
+/**
+ * Initialize a size-class pool
+ *
+ * Use &pool->allocator wherever a ws_allocator_t is expected.
+ *
+ * @param pool Pool
+ * @param max_cached Most idle blocks kept per class
+ * @return 0 on success, -1 on failure
+ */
+int ws_size_class_pool_init(ws_size_class_pool_t *pool, size_t max_cached);
+
+/**
+ * Free all idle blocks of a size-class pool
+ *
+ * Blocks still in use must not be freed to the pool afterwards.
+ *
+ * @param pool Pool
+ */
+void ws_size_class_pool_destroy(ws_size_class_pool_t *pool);
+
+#endif /* WS_POOL_H */
@@ -0,0 +1,55 @@
+#include "prepared.h"
+#include "frames.h"
+#include <limits.h>
+
+#define WS_MAX_HEADER_SIZE 10 // Unmasked header with a 64-bit length
+
+ws_prepared_message_t *ws_prepared_message_create(uint8_t opcode, const uint8_t *data, size_t len) {
+    return ws_prepared_message_create_with_allocator(opcode, data, len, NULL);
+}
+
+ws_prepared_message_t *ws_prepared_message_create_with_allocator(uint8_t opcode, const uint8_t *data, size_t len,
+                                                                 const ws_allocator_t *allocator) {
+    // ws_create_frame reports the frame size as an int
+    if (len > (size_t)INT_MAX - WS_MAX_HEADER_SIZE) {
+        return NULL;
+    }
+    
+    size_t buffer_size = WS_MAX_HEADER_SIZE + len;
+    ws_prepared_message_t *message = ws_mem_alloc(allocator, sizeof(ws_prepared_message_t) + buffer_size);
+    if (!message) {
+        return NULL;
+    }
+    
+    // Frame lives right after the structure in the same allocation
+    message->frame = (uint8_t *)(message + 1);
+    int frame_length = ws_create_frame(opcode, data, len, message->frame, buffer_size, false);
+    if (frame_length < 0) {
+        ws_mem_free(allocator, message, sizeof(ws_prepared_message_t) + buffer_size);
+        return NULL;
+    }
+    
+    message->refcount = 1;
+    message->opcode = opcode;
+    message->payload_length = len;
+    message->frame_length = (size_t)frame_length;
+    message->allocator = allocator;
+    
+    return message;
+}
+
+ws_prepared_message_t *ws_prepared_message_retain(ws_prepared_message_t *message) {
+    __atomic_add_fetch(&message->refcount, 1, __ATOMIC_RELAXED);
+    return message;
+}
+
+void ws_prepared_message_release(ws_prepared_message_t *message) {
+    if (!message) {
+        return;
+    }
+    
+    if (__atomic_sub_fetch(&message->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+        ws_mem_free(message->allocator, message,
+                    sizeof(ws_prepared_message_t) + WS_MAX_HEADER_SIZE + message->payload_length);
+    }
+}
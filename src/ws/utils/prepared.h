@@ -0,0 +1,69 @@
+#ifndef WS_PREPARED_H
+#define WS_PREPARED_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "alloc.h"
+
+/**
+ * Message encoded once and sent to any number of connections
+ *
+ * The complete frame is built at creation time. Sending it only queues a
+ * reference, so the payload is neither copied nor re-encoded per send.
+ * The message is immutable and reference counted; it is freed when the
+ * creator has released it and every send has been written.
+ */
+typedef struct ws_prepared_message {
+    int refcount;              // Creator plus queued sends
+    uint8_t opcode;            // Message opcode
+    size_t payload_length;     // Payload length
+    size_t frame_length;       // Header plus payload length
+    uint8_t *frame;            // Encoded frame, stored after the structure
+    const ws_allocator_t *allocator; // Allocator the message came from, NULL for malloc
+} ws_prepared_message_t;
+
+/**
+ * Encode a message for repeated sending
+ *
+ * @param opcode Message opcode
+ * @param data Payload data
+ * @param len Payload length
+ * @return Prepared message holding one reference, or NULL on error
+ */
+ws_prepared_message_t *ws_prepared_message_create(uint8_t opcode, const uint8_t *data, size_t len);
+
+/**
+ * Encode a message for repeated sending, allocated from an allocator
+ *
+ * The allocator must outlive the message, which the last release frees
+ * through it, possibly from another thread.
+ *
+ * @param opcode Message opcode
+ * @param data Payload data
+ * @param len Payload length
+ * @param allocator Allocator for the message, NULL for malloc
+ * @return Prepared message holding one reference, or NULL on error
+ */
+ws_prepared_message_t *ws_prepared_message_create_with_allocator(uint8_t opcode, const uint8_t *data, size_t len,
+                                                                 const ws_allocator_t *allocator);
+
+/**
+ * Take an additional reference to a prepared message
+ *
+ * @param message Prepared message
+ * @return The same message
+ */
+ws_prepared_message_t *ws_prepared_message_retain(ws_prepared_message_t *message);
+
+/**
+ * Drop a reference to a prepared message
+ *
+ * May be called from any thread and while sends are still queued.
+ *
+ * @param message Prepared message
+ */
+void ws_prepared_message_release(ws_prepared_message_t *message);
+
+#endif /* WS_PREPARED_H */
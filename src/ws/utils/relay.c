@@ -0,0 +1,242 @@
+#define _GNU_SOURCE
+#include "relay.h"
+#include "helper.h"
+#include "frames.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+int ws_relay_resolve(ws_relay_target_t *target, const char *host, int port) {
+    struct addrinfo hints;
+    struct addrinfo *result = NULL;
+    char service[16];
+    
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(service, sizeof(service), "%d", port);
+    
+    int status = getaddrinfo(host, service, &hints, &result);
+    if (status != 0 || !result) {
+        fprintf(stderr, "Cannot resolve relay backend %s: %s\n", host, gai_strerror(status));
+        return -1;
+    }
+    
+    memset(target, 0, sizeof(*target));
+    memcpy(&target->address, result->ai_addr, result->ai_addrlen);
+    target->address_length = result->ai_addrlen;
+    freeaddrinfo(result);
+    
+    return 0;
+}
+
+ws_relay_t *ws_relay_open(const ws_relay_target_t *target, bool spliced, const ws_allocator_t *allocator) {
+    ws_relay_t *relay = (ws_relay_t *)ws_mem_alloc(allocator, sizeof(ws_relay_t));
+    if (!relay) {
+        return NULL;
+    }
+    
+    memset(relay, 0, sizeof(*relay));
+    relay->allocator = allocator;
+    relay->pipe[0] = -1;
+    relay->pipe[1] = -1;
+    
+    relay->backend = socket(target->address.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (relay->backend < 0 || ws_set_nonblocking(relay->backend) == -1) {
+        perror("relay socket failed");
+        ws_relay_close(relay);
+        return NULL;
+    }
+    
+    // Relayed bytes are often interactive; do not hold them back
+    int one = 1;
+    setsockopt(relay->backend, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    
+    if (connect(relay->backend, (const struct sockaddr *)&target->address, target->address_length) == 0) {
+        relay->connecting = false;
+    } else if (errno == EINPROGRESS) {
+        relay->connecting = true;
+    } else {
+        perror("relay connect failed");
+        ws_relay_close(relay);
+        return NULL;
+    }
+
+#ifdef __linux__
+    // Without a pipe, backend bytes are copied instead of spliced
+    if (spliced && pipe2(relay->pipe, O_NONBLOCK | O_CLOEXEC) == -1) {
+        relay->pipe[0] = -1;
+        relay->pipe[1] = -1;
+    }
+#endif
+    
+    return relay;
+}
+
+// Keep client bytes the backend did not take
+static int ws_relay_buffer(ws_relay_t *relay, const uint8_t *data, size_t len) {
+    size_t needed = relay->pending_length + len;
+    
+    if (needed > relay->pending_capacity) {
+        size_t capacity = relay->pending_capacity ? relay->pending_capacity : 4096;
+        while (capacity < needed) {
+            capacity *= 2;
+        }
+        
+        uint8_t *pending = ws_mem_realloc(relay->allocator, relay->pending, relay->pending_capacity, capacity);
+        if (!pending) {
+            relay->error = ENOMEM;
+            return -1;
+        }
+        relay->pending = pending;
+        relay->pending_capacity = capacity;
+    }
+    
+    memcpy(relay->pending + relay->pending_length, data, len);
+    relay->pending_length += len;
+    return 0;
+}
+
+// Write what the backend takes; returns the bytes written, or -1
+static ssize_t ws_relay_send(ws_relay_t *relay, const uint8_t *data, size_t len) {
+    ssize_t written = send(relay->backend, data, len, MSG_NOSIGNAL);
+    
+    if (written < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return 0;
+        }
+        relay->error = errno;
+        return -1;
+    }
+    
+    return written;
+}
+
+int ws_relay_forward(ws_relay_t *relay, const uint8_t *data, size_t len) {
+    if (relay->error) {
+        return -1;
+    }
+    
+    // Straight to the backend unless earlier bytes are still waiting
+    if (!ws_relay_blocked(relay) && len > 0) {
+        ssize_t written = ws_relay_send(relay, data, len);
+        if (written < 0) {
+            return -1;
+        }
+        data += written;
+        len -= (size_t)written;
+    }
+    
+    if (len == 0) {
+        return 0;
+    }
+    
+    return ws_relay_buffer(relay, data, len);
+}
+
+int ws_relay_flush(ws_relay_t *relay) {
+    if (relay->error) {
+        return -1;
+    }
+    
+    if (relay->connecting) {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        
+        if (getsockopt(relay->backend, SOL_SOCKET, SO_ERROR, &error, &length) == -1) {
+            error = errno;
+        }
+        if (error != 0) {
+            relay->error = error;
+            return -1;
+        }
+        relay->connecting = false;
+    }
+    
+    if (relay->pending_length > 0) {
+        ssize_t written = ws_relay_send(relay, relay->pending, relay->pending_length);
+        if (written < 0) {
+            return -1;
+        }
+        
+        relay->pending_length -= (size_t)written;
+        memmove(relay->pending, relay->pending + written, relay->pending_length);
+    }
+    
+    return relay->pending_length > 0 ? 1 : 0;
+}
+
+bool ws_relay_blocked(const ws_relay_t *relay) {
+    return relay->connecting || relay->pending_length > 0;
+}
+
+ws_output_item_t *ws_relay_receive(ws_relay_t *relay) {
+    ssize_t received;
+    
+    if (relay->connecting || relay->closed || relay->error) {
+        return NULL;
+    }
+
+#ifdef __linux__
+    if (relay->pipe[0] >= 0) {
+        // The pipe is empty whenever the previous item has been written
+        received = splice(relay->backend, NULL, relay->pipe[1], NULL, WS_RELAY_CHUNK,
+                          SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (received > 0) {
+            ws_output_item_t *item = ws_output_item_create_pipe(relay->pipe[0], (size_t)received,
+                                                                relay->allocator);
+            if (!item) {
+                relay->error = ENOMEM;
+            }
+            return item;
+        }
+    } else
+#endif
+    {
+        uint8_t buffer[16384];
+        received = recv(relay->backend, buffer, sizeof(buffer), 0);
+        if (received > 0) {
+            ws_output_item_t *item = ws_output_item_create(WS_OPCODE_BINARY, buffer, (size_t)received,
+                                                           false, relay->allocator);
+            if (!item) {
+                relay->error = ENOMEM;
+            }
+            return item;
+        }
+    }
+    
+    if (received == 0) {
+        relay->closed = true;
+    } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        relay->error = errno;
+    }
+    
+    return NULL;
+}
+
+void ws_relay_close(ws_relay_t *relay) {
+    if (!relay) {
+        return;
+    }
+    
+    if (relay->backend >= 0) {
+        close(relay->backend);
+    }
+    if (relay->pipe[0] >= 0) {
+        close(relay->pipe[0]);
+        close(relay->pipe[1]);
+    }
+    
+    ws_mem_free(relay->allocator, relay->pending, relay->pending_capacity);
+    ws_mem_free(relay->allocator, relay, sizeof(*relay));
+}
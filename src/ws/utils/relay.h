@@ -0,0 +1,116 @@
+#ifndef WS_RELAY_H
+#define WS_RELAY_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "alloc.h"
+#include "output.h"
+
+#define WS_RELAY_CHUNK 65536   // Most backend bytes sent to the client as one frame
+
+/**
+ * Backend that relayed connections are paired with
+ */
+typedef struct {
+    struct sockaddr_storage address;
+    socklen_t address_length;
+} ws_relay_target_t;
+
+/**
+ * Outbound TCP connection of a relayed WebSocket connection
+ *
+ * Client payloads are written to the backend as they are parsed and only
+ * buffered when it does not take them. Backend bytes are spliced into a
+ * pipe and from there into the client socket behind a frame header, so
+ * they are never copied through user space.
+ */
+typedef struct {
+    int backend;                   // Socket connected to the backend
+    int pipe[2];                   // Backend bytes on their way to the client, -1 without splice
+    bool connecting;               // Non-blocking connect still in progress
+    bool in_message;               // A fragmented binary message is being forwarded
+    bool closed;                   // The backend closed its side
+    int error;                     // errno of a backend failure, 0 if none
+    uint8_t *pending;              // Client bytes the backend has not taken yet
+    size_t pending_length;
+    size_t pending_capacity;
+    const ws_allocator_t *allocator; // Source of the relay and its buffer
+} ws_relay_t;
+
+/**
+ * Resolve the backend address
+ *
+ * @param target Backend to fill in
+ * @param host Host name or address of the backend
+ * @param port TCP port of the backend
+ * @return 0 on success, -1 if the host cannot be resolved
+ */
+int ws_relay_resolve(ws_relay_target_t *target, const char *host, int port);
+
+/**
+ * Start connecting to the backend
+ *
+ * The connect completes in the background; ws_relay_flush() finishes it
+ * once the socket becomes writable.
+ *
+ * @param target Backend address
+ * @param spliced Whether backend bytes may be spliced, which needs a socket on the client side
+ * @param allocator Allocator for the relay, NULL for malloc
+ * @return Relay, or NULL on error
+ */
+ws_relay_t *ws_relay_open(const ws_relay_target_t *target, bool spliced, const ws_allocator_t *allocator);
+
+/**
+ * Forward client payload to the backend
+ *
+ * Whatever the backend does not take right away is buffered, and the
+ * relay counts as blocked until ws_relay_flush() has written it.
+ *
+ * @param relay Relay
+ * @param data Unmasked payload
+ * @param len Payload length
+ * @return 0 on success, -1 on a backend error
+ */
+int ws_relay_forward(ws_relay_t *relay, const uint8_t *data, size_t len);
+
+/**
+ * Complete the connect and write buffered client bytes
+ *
+ * @param relay Relay
+ * @return 0 when nothing is left to write, 1 if the backend would block,
+ *         -1 on a backend error
+ */
+int ws_relay_flush(ws_relay_t *relay);
+
+/**
+ * Check whether client input has to wait for the backend
+ *
+ * @param relay Relay
+ * @return true while connecting or while client bytes are buffered
+ */
+bool ws_relay_blocked(const ws_relay_t *relay);
+
+/**
+ * Take what the backend sent as an output item for the client
+ *
+ * With splice the bytes move into the relay's pipe and the item refers
+ * to them there; otherwise they are copied into the item.
+ *
+ * @param relay Relay
+ * @return Binary frame item, or NULL if nothing is available, the backend
+ *         closed (closed set) or failed (error set)
+ */
+ws_output_item_t *ws_relay_receive(ws_relay_t *relay);
+
+/**
+ * Close the backend connection and free the relay
+ *
+ * @param relay Relay, or NULL
+ */
+void ws_relay_close(ws_relay_t *relay);
+
+#endif /* WS_RELAY_H */
@@ -0,0 +1,42 @@
+#ifndef WS_TRACE_H
+#define WS_TRACE_H
+
+/**
+ * Static tracepoints (USDT) in provider "cws"
+ *
+ * Built with -DWS_USDT=ON the probes below are compiled in as nops that
+ * bpftrace, perf or SystemTap can attach to on a running server, e.g.
+ *
+ *     bpftrace -e 'usdt:./websocket-server:cws:frame { @[arg1] = count(); }'
+ *
+ * Otherwise they compile to nothing and their arguments are not evaluated.
+ * Every probe takes the connection id as its first argument.
+ *
+ *     accept(id, fd, family)                connection accepted
+ *     handshake(id, request_length, ok)     opening handshake answered or rejected
+ *     frame(id, opcode, payload_length, fin) frame parsed from the receive buffer
+ *     message(id, length, is_binary)        message handed to on_message
+ *     send(id, opcode, length, lane)        frame queued for writing
+ *     close(id, code)                       connection closed
+ */
+
+#if defined(WS_USDT) && defined(WS_HAVE_SYS_SDT_H)
+
+#include <sys/sdt.h>
+
+#define WS_PROBE2(name, a1, a2) DTRACE_PROBE2(cws, name, a1, a2)
+#define WS_PROBE3(name, a1, a2, a3) DTRACE_PROBE3(cws, name, a1, a2, a3)
+#define WS_PROBE4(name, a1, a2, a3, a4) DTRACE_PROBE4(cws, name, a1, a2, a3, a4)
+
+#else
+
+#define WS_PROBE2(name, a1, a2) \
+    do { (void)sizeof(a1); (void)sizeof(a2); } while (0)
+#define WS_PROBE3(name, a1, a2, a3) \
+    do { (void)sizeof(a1); (void)sizeof(a2); (void)sizeof(a3); } while (0)
+#define WS_PROBE4(name, a1, a2, a3, a4) \
+    do { (void)sizeof(a1); (void)sizeof(a2); (void)sizeof(a3); (void)sizeof(a4); } while (0)
+
+#endif
+
+#endif /* WS_TRACE_H */
@@ -0,0 +1,293 @@
+#include "transport.h"
+#include "helper.h"
+
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+static ssize_t ws_socket_read(ws_transport_t *transport, uint8_t *buffer, size_t size) {
+    return recv(transport->fd, buffer, size, 0);
+}
+
+static ssize_t ws_socket_writev(ws_transport_t *transport, const struct iovec *iov, int iovcnt) {
+    struct msghdr msg;
+    
+    // sendmsg rather than writev so that a closed peer does not raise SIGPIPE
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = (struct iovec *)iov;
+    msg.msg_iovlen = iovcnt;
+    return sendmsg(transport->fd, &msg, MSG_NOSIGNAL);
+}
+
+static int ws_socket_wait(ws_transport_t *transport, int timeout_ms) {
+    return ws_wait_for_read(transport->fd, timeout_ms);
+}
+
+static void ws_socket_close(ws_transport_t *transport) {
+    close(transport->fd);
+}
+
+const ws_transport_ops_t ws_socket_transport = {
+    "socket",
+    ws_socket_read,
+    ws_socket_writev,
+    ws_socket_wait,
+    ws_socket_close
+};
+
+void ws_transport_init_socket(ws_transport_t *transport, int socket) {
+    transport->ops = &ws_socket_transport;
+    transport->fd = socket;
+    transport->handle = NULL;
+}
+
+/**
+ * Bytes travelling in one direction of a memory transport
+ */
+typedef struct {
+    uint8_t *data;
+    size_t head;                   // Offset of the oldest byte
+    size_t length;                 // Bytes buffered
+    bool closed;                   // The writing end was closed
+} ws_memory_ring_t;
+
+struct ws_memory_link;
+
+typedef struct {
+    struct ws_memory_link *link;
+    int side;                      // Writes go to rings[side], reads come from the other
+} ws_memory_end_t;
+
+/**
+ * State shared by both ends of a memory transport
+ */
+typedef struct ws_memory_link {
+    pthread_mutex_t lock;
+    pthread_cond_t readable;       // Signalled when bytes arrive or an end closes
+    ws_memory_ring_t rings[2];
+    ws_memory_end_t ends[2];
+    size_t size;                   // Capacity of each ring
+    int open_ends;
+    const ws_allocator_t *allocator;
+} ws_memory_link_t;
+
+static ssize_t ws_memory_read(ws_transport_t *transport, uint8_t *buffer, size_t size) {
+    ws_memory_end_t *end = (ws_memory_end_t *)transport->handle;
+    ws_memory_link_t *link = end->link;
+    ws_memory_ring_t *ring = &link->rings[!end->side];
+    ssize_t result;
+    
+    pthread_mutex_lock(&link->lock);
+    if (ring->length == 0) {
+        if (ring->closed) {
+            result = 0;
+        } else {
+            errno = EAGAIN;
+            result = -1;
+        }
+    } else {
+        size_t n = ring->length < size ? ring->length : size;
+        
+        // At most two pieces: up to the end of the ring, then from its start
+        size_t first = link->size - ring->head;
+        if (first > n) {
+            first = n;
+        }
+        memcpy(buffer, ring->data + ring->head, first);
+        memcpy(buffer + first, ring->data, n - first);
+        
+        ring->head = (ring->head + n) % link->size;
+        ring->length -= n;
+        if (ring->length == 0) {
+            ring->head = 0;
+        }
+        result = (ssize_t)n;
+    }
+    pthread_mutex_unlock(&link->lock);
+    
+    return result;
+}
+
+static ssize_t ws_memory_writev(ws_transport_t *transport, const struct iovec *iov, int iovcnt) {
+    ws_memory_end_t *end = (ws_memory_end_t *)transport->handle;
+    ws_memory_link_t *link = end->link;
+    ws_memory_ring_t *ring = &link->rings[end->side];
+    size_t written = 0;
+    
+    pthread_mutex_lock(&link->lock);
+    
+    // Nobody will read what a closed end is sent
+    if (link->rings[!end->side].closed) {
+        pthread_mutex_unlock(&link->lock);
+        errno = EPIPE;
+        return -1;
+    }
+    
+    for (int i = 0; i < iovcnt && ring->length < link->size; i++) {
+        const uint8_t *data = (const uint8_t *)iov[i].iov_base;
+        size_t left = iov[i].iov_len;
+        
+        while (left > 0 && ring->length < link->size) {
+            size_t tail = (ring->head + ring->length) % link->size;
+            size_t n = link->size - ring->length;
+            if (n > link->size - tail) {
+                n = link->size - tail;
+            }
+            if (n > left) {
+                n = left;
+            }
+            
+            memcpy(ring->data + tail, data, n);
+            ring->length += n;
+            data += n;
+            left -= n;
+            written += n;
+        }
+    }
+    
+    // No waiter means no system call
+    if (written > 0) {
+        pthread_cond_broadcast(&link->readable);
+    }
+    pthread_mutex_unlock(&link->lock);
+    
+    if (written == 0) {
+        size_t offered = 0;
+        for (int i = 0; i < iovcnt; i++) {
+            offered += iov[i].iov_len;
+        }
+        if (offered > 0) {
+            errno = EAGAIN;
+            return -1;
+        }
+    }
+    return (ssize_t)written;
+}
+
+static int ws_memory_wait(ws_transport_t *transport, int timeout_ms) {
+    ws_memory_end_t *end = (ws_memory_end_t *)transport->handle;
+    ws_memory_link_t *link = end->link;
+    ws_memory_ring_t *ring = &link->rings[!end->side];
+    struct timespec deadline;
+    int result = 1;
+    
+    if (timeout_ms > 0) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+    
+    pthread_mutex_lock(&link->lock);
+    while (ring->length == 0 && !ring->closed) {
+        if (timeout_ms == 0) {
+            result = 0;
+            break;
+        }
+        
+        int error = timeout_ms < 0 ? pthread_cond_wait(&link->readable, &link->lock) :
+                                     pthread_cond_timedwait(&link->readable, &link->lock, &deadline);
+        if (error == ETIMEDOUT) {
+            result = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&link->lock);
+    
+    return result;
+}
+
+static void ws_memory_close(ws_transport_t *transport) {
+    ws_memory_end_t *end = (ws_memory_end_t *)transport->handle;
+    ws_memory_link_t *link = end->link;
+    
+    pthread_mutex_lock(&link->lock);
+    link->rings[end->side].closed = true;
+    pthread_cond_broadcast(&link->readable);
+    bool last = --link->open_ends == 0;
+    pthread_mutex_unlock(&link->lock);
+    
+    if (last) {
+        pthread_cond_destroy(&link->readable);
+        pthread_mutex_destroy(&link->lock);
+        ws_mem_free(link->allocator, link->rings[0].data, link->size);
+        ws_mem_free(link->allocator, link->rings[1].data, link->size);
+        ws_mem_free(link->allocator, link, sizeof(*link));
+    }
+}
+
+static const ws_transport_ops_t ws_memory_transport = {
+    "memory",
+    ws_memory_read,
+    ws_memory_writev,
+    ws_memory_wait,
+    ws_memory_close
+};
+
+int ws_transport_init_memory_pair(ws_transport_t *a, ws_transport_t *b, size_t size,
+                                  const ws_allocator_t *allocator) {
+    ws_memory_link_t *link = (ws_memory_link_t *)ws_mem_alloc(allocator, sizeof(ws_memory_link_t));
+    if (!link) {
+        return -1;
+    }
+    
+    memset(link, 0, sizeof(*link));
+    link->size = size > 0 ? size : WS_MEMORY_TRANSPORT_SIZE;
+    link->allocator = allocator;
+    link->rings[0].data = (uint8_t *)ws_mem_alloc(allocator, link->size);
+    link->rings[1].data = (uint8_t *)ws_mem_alloc(allocator, link->size);
+    if (!link->rings[0].data || !link->rings[1].data) {
+        ws_mem_free(allocator, link->rings[0].data, link->size);
+        ws_mem_free(allocator, link->rings[1].data, link->size);
+        ws_mem_free(allocator, link, sizeof(*link));
+        return -1;
+    }
+    
+    pthread_mutex_init(&link->lock, NULL);
+    pthread_cond_init(&link->readable, NULL);
+    link->open_ends = 2;
+    
+    ws_transport_t *transports[2] = { a, b };
+    for (int side = 0; side < 2; side++) {
+        link->ends[side].link = link;
+        link->ends[side].side = side;
+        transports[side]->ops = &ws_memory_transport;
+        transports[side]->fd = -1;
+        transports[side]->handle = &link->ends[side];
+    }
+    
+    return 0;
+}
+
+ssize_t ws_transport_read(ws_transport_t *transport, uint8_t *buffer, size_t size) {
+    return transport->ops->read(transport, buffer, size);
+}
+
+ssize_t ws_transport_writev(ws_transport_t *transport, const struct iovec *iov, int iovcnt) {
+    return transport->ops->writev(transport, iov, iovcnt);
+}
+
+int ws_transport_wait(ws_transport_t *transport, int timeout_ms) {
+    return transport->ops->wait(transport, timeout_ms);
+}
+
+void ws_transport_close(ws_transport_t *transport) {
+    if (!transport->ops) {
+        return;
+    }
+    
+    transport->ops->close(transport);
+    transport->ops = NULL;
+    transport->fd = -1;
+    transport->handle = NULL;
+}
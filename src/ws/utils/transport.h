@@ -0,0 +1,112 @@
+#ifndef WS_TRANSPORT_H
+#define WS_TRANSPORT_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "alloc.h"
+
+#define WS_MEMORY_TRANSPORT_SIZE (256 << 10) // Bytes buffered in each direction of a memory transport
+
+struct ws_transport;
+
+/**
+ * Operations of a transport
+ *
+ * They behave like their counterparts on a non-blocking socket: read and
+ * writev return -1 with errno set to EAGAIN when they would block, and
+ * read returns 0 once the peer has closed its side.
+ */
+typedef struct {
+    const char *name;
+    ssize_t (*read)(struct ws_transport *transport, uint8_t *buffer, size_t size);
+    ssize_t (*writev)(struct ws_transport *transport, const struct iovec *iov, int iovcnt);
+    int (*wait)(struct ws_transport *transport, int timeout_ms); // 1 if readable, 0 on timeout, -1 on error
+    void (*close)(struct ws_transport *transport);
+} ws_transport_ops_t;
+
+/**
+ * Byte stream a connection is carried by
+ *
+ * Transports with a descriptor are polled by the event loop. The others
+ * are checked with a zero-timeout wait on every step, so a server whose
+ * connections all use such transports should be driven with
+ * ws_server_step(server, 0).
+ */
+typedef struct ws_transport {
+    const ws_transport_ops_t *ops; // Operations, NULL once closed
+    int fd;                        // Descriptor to poll, or -1
+    void *handle;                  // State of the transport
+} ws_transport_t;
+
+/**
+ * Kernel socket; the output queue writes to it with sendfile, splice and
+ * MSG_ZEROCOPY where it can instead of going through writev
+ */
+extern const ws_transport_ops_t ws_socket_transport;
+
+/**
+ * Make a transport of a connected non-blocking socket
+ *
+ * @param transport Transport to initialize
+ * @param socket Socket, closed by ws_transport_close()
+ */
+void ws_transport_init_socket(ws_transport_t *transport, int socket);
+
+/**
+ * Connect two transports through memory
+ *
+ * Whatever one end writes the other reads, without a system call. The
+ * ends may be used from different threads; wait() blocks on a condition
+ * variable. Each end is closed separately and the buffers are freed with
+ * the second.
+ *
+ * @param a First end
+ * @param b Second end
+ * @param size Bytes buffered in each direction, 0 for WS_MEMORY_TRANSPORT_SIZE
+ * @param allocator Allocator for the buffers, NULL for malloc
+ * @return 0 on success, -1 on allocation failure
+ */
+int ws_transport_init_memory_pair(ws_transport_t *a, ws_transport_t *b, size_t size,
+                                  const ws_allocator_t *allocator);
+
+/**
+ * Read bytes from a transport
+ *
+ * @param transport Transport
+ * @param buffer Destination
+ * @param size Size of buffer
+ * @return Bytes read, 0 if the peer closed, or -1 on error
+ */
+ssize_t ws_transport_read(ws_transport_t *transport, uint8_t *buffer, size_t size);
+
+/**
+ * Write bytes gathered from several buffers
+ *
+ * @param transport Transport
+ * @param iov Buffers
+ * @param iovcnt Number of buffers
+ * @return Bytes written, which may be fewer than offered, or -1 on error
+ */
+ssize_t ws_transport_writev(ws_transport_t *transport, const struct iovec *iov, int iovcnt);
+
+/**
+ * Wait until a transport has input
+ *
+ * @param transport Transport
+ * @param timeout_ms Timeout in milliseconds, -1 to wait forever
+ * @return 1 if input (or the end of it) is available, 0 on timeout, -1 on error
+ */
+int ws_transport_wait(ws_transport_t *transport, int timeout_ms);
+
+/**
+ * Close a transport; further operations are invalid
+ *
+ * @param transport Transport, ignored if already closed
+ */
+void ws_transport_close(ws_transport_t *transport);
+
+#endif /* WS_TRANSPORT_H */
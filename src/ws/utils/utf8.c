@@ -0,0 +1,344 @@
+#include "utf8.h"
+
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define WS_UTF8_X86 1
+#include <immintrin.h>
+#endif
+
+// Inputs shorter than this are not worth a vector pass
+#define WS_UTF8_MIN_VECTOR 32
+
+// Error classes of the lookup-table validator (Keiser & Lemire, 2021)
+#define TOO_SHORT      (1 << 0)    // Lead byte followed by a non-continuation
+#define TOO_LONG       (1 << 1)    // ASCII followed by a continuation
+#define OVERLONG_3     (1 << 2)    // E0 80..9F
+#define TOO_LARGE      (1 << 3)    // F4 90..BF, F5..FF
+#define SURROGATE      (1 << 4)    // ED A0..BF
+#define OVERLONG_2     (1 << 5)    // C0..C1
+#define TOO_LARGE_1000 (1 << 6)    // F5..FF 80..8F
+#define OVERLONG_4     (1 << 6)    // F0 80..8F
+#define TWO_CONTS      (1 << 7)    // Continuation not expected here
+#define CARRY          (TOO_SHORT | TOO_LONG | TWO_CONTS)
+
+#ifdef WS_UTF8_X86
+
+// Indexed by the high nibble of the previous byte
+static const uint8_t byte_1_high_table[16] = {
+    TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+    TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+    TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+    TOO_SHORT | OVERLONG_2,
+    TOO_SHORT,
+    TOO_SHORT | OVERLONG_3 | SURROGATE,
+    TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4
+};
+
+// Indexed by the low nibble of the previous byte
+static const uint8_t byte_1_low_table[16] = {
+    CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+    CARRY | OVERLONG_2,
+    CARRY,
+    CARRY,
+    CARRY | TOO_LARGE,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000
+};
+
+// Indexed by the high nibble of the current byte
+static const uint8_t byte_2_high_table[16] = {
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT
+};
+
+// A lead byte in one of the last positions still needs continuation bytes
+static const uint8_t incomplete_max[32] = {
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xEF, 0xDF, 0xBF
+};
+
+#endif /* WS_UTF8_X86 */
+
+// Advance the scalar state machine by one byte
+static int utf8_step(ws_utf8_state_t *state, uint8_t byte) {
+    if (state->need) {
+        if (byte < state->lower || byte > state->upper) {
+            return -1;
+        }
+        state->need--;
+        state->lower = 0x80;
+        state->upper = 0xBF;
+        return 0;
+    }
+    
+    if (byte < 0x80) {
+        return 0;
+    }
+    
+    state->lower = 0x80;
+    state->upper = 0xBF;
+    
+    if (byte >= 0xC2 && byte <= 0xDF) {
+        state->need = 1;
+    } else if (byte == 0xE0) {
+        state->need = 2;
+        state->lower = 0xA0; // Overlong
+    } else if (byte == 0xED) {
+        state->need = 2;
+        state->upper = 0x9F; // Surrogates
+    } else if (byte >= 0xE1 && byte <= 0xEF) {
+        state->need = 2;
+    } else if (byte == 0xF0) {
+        state->need = 3;
+        state->lower = 0x90; // Overlong
+    } else if (byte == 0xF4) {
+        state->need = 3;
+        state->upper = 0x8F; // Above U+10FFFF
+    } else if (byte >= 0xF1 && byte <= 0xF3) {
+        state->need = 3;
+    } else {
+        return -1;
+    }
+    
+    return 0;
+}
+
+// Scalar validation with a word-at-a-time ASCII fast path
+static int utf8_validate_scalar(ws_utf8_state_t *state, const uint8_t *data, size_t len) {
+    size_t i = 0;
+    
+    while (i < len) {
+        if (state->need == 0) {
+            while (i + 8 <= len) {
+                uint64_t word;
+                memcpy(&word, data + i, sizeof(word));
+                if (word & 0x8080808080808080ULL) {
+                    break;
+                }
+                i += 8;
+            }
+            if (i == len) {
+                break;
+            }
+        }
+        
+        if (utf8_step(state, data[i]) != 0) {
+            return -1;
+        }
+        i++;
+    }
+    
+    return 0;
+}
+
+#ifdef WS_UTF8_X86
+
+// Start of the code point that straddles the end of the vector region
+static size_t utf8_boundary(const uint8_t *data, size_t end) {
+    for (size_t k = 1; k <= 3 && k <= end; k++) {
+        uint8_t byte = data[end - k];
+        if ((byte & 0xC0) == 0x80) {
+            continue;
+        }
+        
+        size_t width = byte >= 0xF0 ? 4 : byte >= 0xE0 ? 3 : byte >= 0xC0 ? 2 : 1;
+        return width > k ? end - k : end;
+    }
+    
+    return end;
+}
+
+__attribute__((target("ssse3")))
+static size_t utf8_blocks_ssse3(const uint8_t *data, size_t len) {
+    const __m128i table1 = _mm_loadu_si128((const __m128i *)byte_1_high_table);
+    const __m128i table2 = _mm_loadu_si128((const __m128i *)byte_1_low_table);
+    const __m128i table3 = _mm_loadu_si128((const __m128i *)byte_2_high_table);
+    const __m128i max_value = _mm_loadu_si128((const __m128i *)(incomplete_max + 16));
+    const __m128i nibble = _mm_set1_epi8(0x0F);
+    const __m128i third_base = _mm_set1_epi8(0xE0 - 0x80);
+    const __m128i fourth_base = _mm_set1_epi8(0xF0 - 0x80);
+    const __m128i high_bit = _mm_set1_epi8((char)0x80);
+    __m128i prev_input = _mm_setzero_si128();
+    __m128i prev_incomplete = _mm_setzero_si128();
+    __m128i error = _mm_setzero_si128();
+    size_t end = len & ~(size_t)15;
+    
+    for (size_t i = 0; i < end; i += 16) {
+        __m128i input = _mm_loadu_si128((const __m128i *)(data + i));
+        
+        if (_mm_movemask_epi8(input) == 0) {
+            // ASCII block: only an unfinished sequence before it can fail
+            error = _mm_or_si128(error, prev_incomplete);
+        } else {
+            __m128i prev1 = _mm_alignr_epi8(input, prev_input, 15);
+            __m128i prev2 = _mm_alignr_epi8(input, prev_input, 14);
+            __m128i prev3 = _mm_alignr_epi8(input, prev_input, 13);
+            
+            __m128i byte_1_high = _mm_shuffle_epi8(table1, _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble));
+            __m128i byte_1_low = _mm_shuffle_epi8(table2, _mm_and_si128(prev1, nibble));
+            __m128i byte_2_high = _mm_shuffle_epi8(table3, _mm_and_si128(_mm_srli_epi16(input, 4), nibble));
+            __m128i special = _mm_and_si128(_mm_and_si128(byte_1_high, byte_1_low), byte_2_high);
+            
+            // Third and fourth bytes of a sequence must be continuations
+            __m128i must_be_cont = _mm_or_si128(_mm_subs_epu8(prev2, third_base),
+                                                _mm_subs_epu8(prev3, fourth_base));
+            must_be_cont = _mm_and_si128(must_be_cont, high_bit);
+            
+            error = _mm_or_si128(error, _mm_xor_si128(must_be_cont, special));
+            prev_incomplete = _mm_subs_epu8(input, max_value);
+        }
+        
+        prev_input = input;
+    }
+    
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(error, _mm_setzero_si128())) != 0xFFFF) {
+        return SIZE_MAX;
+    }
+    
+    return utf8_boundary(data, end);
+}
+
+__attribute__((target("avx2")))
+static size_t utf8_blocks_avx2(const uint8_t *data, size_t len) {
+    const __m256i table1 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)byte_1_high_table));
+    const __m256i table2 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)byte_1_low_table));
+    const __m256i table3 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)byte_2_high_table));
+    const __m256i max_value = _mm256_loadu_si256((const __m256i *)incomplete_max);
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+    const __m256i third_base = _mm256_set1_epi8(0xE0 - 0x80);
+    const __m256i fourth_base = _mm256_set1_epi8(0xF0 - 0x80);
+    const __m256i high_bit = _mm256_set1_epi8((char)0x80);
+    __m256i prev_input = _mm256_setzero_si256();
+    __m256i prev_incomplete = _mm256_setzero_si256();
+    __m256i error = _mm256_setzero_si256();
+    size_t end = len & ~(size_t)31;
+    
+    for (size_t i = 0; i < end; i += 32) {
+        __m256i input = _mm256_loadu_si256((const __m256i *)(data + i));
+        
+        if (_mm256_movemask_epi8(input) == 0) {
+            // ASCII block: only an unfinished sequence before it can fail
+            error = _mm256_or_si256(error, prev_incomplete);
+        } else {
+            // Bytes shifted in from the previous block across the lane boundary
+            __m256i carried = _mm256_permute2x128_si256(prev_input, input, 0x21);
+            __m256i prev1 = _mm256_alignr_epi8(input, carried, 15);
+            __m256i prev2 = _mm256_alignr_epi8(input, carried, 14);
+            __m256i prev3 = _mm256_alignr_epi8(input, carried, 13);
+            
+            __m256i byte_1_high = _mm256_shuffle_epi8(table1, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble));
+            __m256i byte_1_low = _mm256_shuffle_epi8(table2, _mm256_and_si256(prev1, nibble));
+            __m256i byte_2_high = _mm256_shuffle_epi8(table3, _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble));
+            __m256i special = _mm256_and_si256(_mm256_and_si256(byte_1_high, byte_1_low), byte_2_high);
+            
+            // Third and fourth bytes of a sequence must be continuations
+            __m256i must_be_cont = _mm256_or_si256(_mm256_subs_epu8(prev2, third_base),
+                                                   _mm256_subs_epu8(prev3, fourth_base));
+            must_be_cont = _mm256_and_si256(must_be_cont, high_bit);
+            
+            error = _mm256_or_si256(error, _mm256_xor_si256(must_be_cont, special));
+            prev_incomplete = _mm256_subs_epu8(input, max_value);
+        }
+        
+        prev_input = input;
+    }
+    
+    if (!_mm256_testz_si256(error, error)) {
+        return SIZE_MAX;
+    }
+    
+    return utf8_boundary(data, end);
+}
+
+#endif /* WS_UTF8_X86 */
+
+/**
+ * Vector pass over whole blocks
+ *
+ * Returns the number of bytes validated, which always ends on a code point
+ * boundary, or SIZE_MAX if the data is invalid.
+ */
+typedef size_t (*utf8_blocks_fn)(const uint8_t *data, size_t len);
+
+static size_t utf8_blocks_none(const uint8_t *data, size_t len) {
+    (void)data;
+    (void)len;
+    return 0;
+}
+
+// Pick the widest implementation the CPU supports
+static utf8_blocks_fn utf8_select(void) {
+#ifdef WS_UTF8_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return utf8_blocks_avx2;
+    }
+    if (__builtin_cpu_supports("ssse3")) {
+        return utf8_blocks_ssse3;
+    }
+#endif
+    return utf8_blocks_none;
+}
+
+static utf8_blocks_fn utf8_blocks = NULL;
+
+void ws_utf8_init(ws_utf8_state_t *state) {
+    state->need = 0;
+    state->lower = 0x80;
+    state->upper = 0xBF;
+}
+
+int ws_utf8_validate(ws_utf8_state_t *state, const uint8_t *data, size_t len) {
+    size_t i = 0;
+    
+    // Finish a code point left open by the previous chunk
+    while (state->need && i < len) {
+        if (utf8_step(state, data[i]) != 0) {
+            return -1;
+        }
+        i++;
+    }
+    
+    // Vector pass; the scalar pass picks up from the returned boundary
+    if (len - i >= WS_UTF8_MIN_VECTOR) {
+        if (!utf8_blocks) {
+            utf8_blocks = utf8_select();
+        }
+        
+        size_t done = utf8_blocks(data + i, len - i);
+        if (done == SIZE_MAX) {
+            return -1;
+        }
+        i += done;
+    }
+    
+    return utf8_validate_scalar(state, data + i, len - i);
+}
+
+bool ws_utf8_complete(const ws_utf8_state_t *state) {
+    return state->need == 0;
+}
+
+bool ws_utf8_valid(const uint8_t *data, size_t len) {
+    ws_utf8_state_t state;
+    
+    ws_utf8_init(&state);
+    return ws_utf8_validate(&state, data, len) == 0 && ws_utf8_complete(&state);
+}
@@ -0,0 +1,57 @@
+#ifndef WS_UTF8_H
+#define WS_UTF8_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+/**
+ * Incremental UTF-8 validation state
+ *
+ * Carries a partially received code point from one chunk to the next so
+ * that fragmented text messages can be validated as they arrive.
+ */
+typedef struct {
+    uint8_t need;              // Continuation bytes still expected
+    uint8_t lower;             // Lowest allowed value for the next byte
+    uint8_t upper;             // Highest allowed value for the next byte
+} ws_utf8_state_t;
+
+/**
+ * Reset a validation state to the start of a message
+ *
+ * @param state Validation state
+ */
+void ws_utf8_init(ws_utf8_state_t *state);
+
+/**
+ * Validate the next chunk of a UTF-8 stream
+ *
+ * A code point may be split across chunks; call ws_utf8_complete() after
+ * the last chunk to reject a message that ends mid-sequence.
+ *
+ * @param state Validation state
+ * @param data Chunk data
+ * @param len Chunk length
+ * @return 0 if the stream is valid so far, -1 if it is invalid
+ */
+int ws_utf8_validate(ws_utf8_state_t *state, const uint8_t *data, size_t len);
+
+/**
+ * Check whether the stream ended on a code point boundary
+ *
+ * @param state Validation state
+ * @return true if no sequence is left incomplete
+ */
+bool ws_utf8_complete(const ws_utf8_state_t *state);
+
+/**
+ * Validate a complete UTF-8 buffer
+ *
+ * @param data Buffer data
+ * @param len Buffer length
+ * @return true if the buffer is valid UTF-8
+ */
+bool ws_utf8_valid(const uint8_t *data, size_t len);
+
+#endif /* WS_UTF8_H */
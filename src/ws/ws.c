@@ -1,10 +1,18 @@
+#define _GNU_SOURCE
 #include "ws.h"
 #include "utils/handshake.h"
 #include "utils/frames.h"
 #include "utils/fragmentation.h"
+#include "utils/trace.h"
 #include "utils/parse.h"
 #include "utils/helper.h"
 #include "utils/storage.h"
+#include "utils/dispatch.h"
+#include "utils/handoff.h"
+#include "utils/latency.h"
+#include "utils/capture.h"
+#include "utils/relay.h"
+#include "utils/ingest.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,26 +20,201 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <stddef.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <poll.h>
+#include <sched.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+#include <time.h>
 
-#define MAX_CLIENTS 64
-#define BUFFER_SIZE 8192
+// Bytes of one poll set entry: its client pointer, then its pollfd
+#define WS_POLL_ENTRY_SIZE (sizeof(ws_connection_t *) + sizeof(struct pollfd))
 
-static void ws_accept_client(ws_server_t *server);
-static void ws_process_client(ws_server_t *server, ws_connection_t *client);
+// New connection state goes into ws_connection_info_t; these fail to
+// compile once the struct grows or the transport operations leave the
+// first 64 bytes
+typedef char ws_connection_size_check[sizeof(ws_connection_t) <= WS_CONNECTION_SIZE ? 1 : -1];
+typedef char ws_connection_line_check[offsetof(ws_connection_t, transport.ops) + sizeof(void *) <= 64 ? 1 : -1];
+
+static int ws_server_add_listener(ws_server_t *server, int server_fd, int family, const char *path);
+static void ws_accept_clients(ws_server_t *server, ws_listener_t *listener);
+static void ws_add_client(ws_server_t *server, ws_listener_t *listener, int client_fd,
+                          const struct sockaddr_storage *client_addr);
+static ws_connection_t *ws_create_client(ws_server_t *server, int client_fd);
+static int ws_reserve_ids(ws_server_t *server);
+static void ws_track_client(ws_server_t *server, ws_connection_t *client);
+static void ws_untrack_client(ws_server_t *server, ws_connection_t *client);
+static ws_connection_t *ws_find_client(const ws_server_t *server, uint64_t id);
+static void ws_peer_address(ws_connection_t *conn, const ws_listener_t *listener,
+                            const struct sockaddr_storage *client_addr);
+static void ws_hand_off(ws_server_t *server);
+static bool ws_client_at_boundary(ws_connection_t *client);
+static void ws_adopt_client(ws_server_t *server, const ws_handoff_record_t *record);
+static int64_t ws_now_ms(void);
+static void ws_expire_handshakes(ws_server_t *server, int *timeout_ms);
+static int ws_process_handshake(ws_server_t *server, ws_connection_t *client);
+static void ws_open_client(ws_server_t *server, ws_connection_t *client);
+static void ws_start_session(ws_server_t *server, ws_connection_t *client);
+static void ws_end_session(ws_server_t *server, ws_h2_session_t *session);
+static int ws_h2_event(void *ctx, ws_h2_stream_t *stream, ws_h2_event_t event);
+static int ws_reserve_poll(ws_server_t *server, size_t count);
+static int ws_poll(ws_server_t *server, struct pollfd *fds, int nfds, int timeout_ms);
+static void ws_set_busy_poll(ws_server_t *server, int socket);
+static void ws_schedule_client(ws_server_t *server, ws_connection_t *client);
+static void ws_run_queue_push(ws_server_t *server, ws_connection_t *client);
+static void ws_run_clients(ws_server_t *server);
+static int ws_process_client(ws_server_t *server, ws_connection_t *client);
+static size_t ws_input_capacity(const ws_connection_t *client, size_t wanted, size_t chunk);
+static int ws_reserve_input(ws_connection_t *client, size_t needed, size_t chunk);
+static void ws_trim_client(ws_connection_t *client);
+static void ws_account_client(ws_server_t *server, ws_connection_t *client);
+static bool ws_client_over_budget(ws_server_t *server, ws_connection_t *client);
+static size_t ws_client_queued(const ws_connection_t *client);
+static void ws_release_input(ws_connection_t *client);
+static void ws_process_frame(ws_server_t *server, ws_connection_t *client, ws_frame_t *frame);
+static ssize_t ws_recv_input(ws_server_t *server, ws_connection_t *client, size_t space);
 static void ws_disconnect_client(ws_server_t *server, ws_connection_t *client, int code, const char *reason);
+static void ws_release_client(ws_connection_t *client);
+static void ws_finish_client(ws_connection_t *client, bool reset);
+static int ws_linger_poll(ws_server_t *server, struct pollfd *fds, int *timeout_ms);
+static void ws_linger_ready(ws_server_t *server, const struct pollfd *fds);
+static void ws_process_data_frame(ws_server_t *server, ws_connection_t *client, ws_frame_t *frame);
+static void ws_deliver_message(ws_server_t *server, ws_connection_t *client,
+                               const uint8_t *data, size_t len, bool is_binary);
+static void ws_process_replies(ws_server_t *server);
+static int ws_flush_client(ws_connection_t *client);
+static void ws_relay_poll(ws_connection_t *client, struct pollfd *fd);
+static void ws_relay_ready(ws_server_t *server, ws_connection_t *client, short revents);
+static void ws_relay_frame(ws_server_t *server, ws_connection_t *client, ws_frame_t *frame);
+static void ws_deliver_ingest(void *ctx, ws_ingest_target_t kind, uint64_t target,
+                              const uint8_t *data, size_t len, bool is_binary);
+
+// Allocator of a connection's server, NULL for malloc
+static const ws_allocator_t *ws_server_allocator(const ws_server_t *server) {
+    return server ? server->allocator : NULL;
+}
+
+// Copy a string into memory from the server's allocator
+static char *ws_strdup(const ws_server_t *server, const char *string) {
+    size_t size = strlen(string) + 1;
+    char *copy = ws_mem_alloc(ws_server_allocator(server), size);
+    if (copy) {
+        memcpy(copy, string, size);
+    }
+    return copy;
+}
+
+static void ws_strfree(const ws_server_t *server, char *string) {
+    if (string) {
+        ws_mem_free(ws_server_allocator(server), string, strlen(string) + 1);
+    }
+}
+
+void ws_server_create(ws_server_t *server) {
+    // Initialize server structure
+    server->socket = -1;
+    server->num_listeners = 0;
+    ws_config_init(&server->config);
+    server->clients = NULL;
+    server->by_id = NULL;
+    server->id_buckets = 0;
+    server->id_count = 0;
+    server->lingering = NULL;
+    server->dispatch = NULL;
+    server->poll_fds = NULL;
+    server->poll_clients = NULL;
+    server->poll_capacity = 0;
+    memset(&server->rx_pool, 0, sizeof(server->rx_pool)); // Sized on first use
+    server->run_head = NULL;
+    server->run_tail = NULL;
+    server->handoff_socket = -1;
+    server->handoff_path = NULL;
+    server->handed_off = false;
+    server->events = NULL;
+    server->last_connection_id = 0;
+    server->latency = NULL;
+    server->capture = NULL;
+    server->relay_target = NULL;
+    server->ingest = NULL;
+    server->sessions = NULL;
+    server->num_sessions = 0;
+    server->allocator = NULL;
+    server->rx_allocator = NULL;
+    server->delivering = NULL;
+    server->delivering_data = NULL;
+    server->delivering_length = 0;
+    memset(&server->busy_poll_stats, 0, sizeof(server->busy_poll_stats));
+    ws_budget_init(&server->memory, server->config.memory_limit);
+    
+    // Initialize default callbacks to prevent null pointer dereferences
+    server->on_connect = NULL;
+    server->on_message = NULL;
+    server->on_close = NULL;
+    server->on_error = NULL;
+    server->on_send_complete = NULL;
+}
 
 int ws_server_init(ws_server_t *server, int port) {
-    int server_fd;
-    struct sockaddr_in address;
+    ws_server_create(server);
+    server->config.port = port;
+    
+    // Any address, IPv6 and IPv4 alike
+    if (ws_server_listen_tcp(server, NULL, port) != 0) {
+        return -1;
+    }
+    
+    printf("WebSocket server started on port %d\n", port);
+    return 0;
+}
+
+int ws_server_listen_tcp(ws_server_t *server, const char *address, int port) {
+    struct sockaddr_storage storage;
+    struct sockaddr_in *address4 = (struct sockaddr_in *)&storage;
+    struct sockaddr_in6 *address6 = (struct sockaddr_in6 *)&storage;
+    socklen_t addrlen;
+    bool dual_stack = false;
     int opt = 1;
     
+    memset(&storage, 0, sizeof(storage));
+    
+    // Parse the address to pick the family
+    if (!address) {
+        address6->sin6_family = AF_INET6;
+        address6->sin6_addr = in6addr_any;
+        address6->sin6_port = htons(port);
+        addrlen = sizeof(*address6);
+        dual_stack = true;
+    } else if (inet_pton(AF_INET, address, &address4->sin_addr) == 1) {
+        address4->sin_family = AF_INET;
+        address4->sin_port = htons(port);
+        addrlen = sizeof(*address4);
+    } else if (inet_pton(AF_INET6, address, &address6->sin6_addr) == 1) {
+        address6->sin6_family = AF_INET6;
+        address6->sin6_port = htons(port);
+        addrlen = sizeof(*address6);
+    } else {
+        fprintf(stderr, "Invalid listen address: %s\n", address);
+        return -1;
+    }
+    
     // Create socket file descriptor
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+    int server_fd = socket(storage.ss_family, SOCK_STREAM, 0);
+    if (server_fd == -1 && dual_stack && errno == EAFNOSUPPORT) {
+        // IPv6 is disabled on this host; any IPv4 address will do
+        memset(&storage, 0, sizeof(storage));
+        address4->sin_family = AF_INET;
+        address4->sin_addr.s_addr = INADDR_ANY;
+        address4->sin_port = htons(port);
+        addrlen = sizeof(*address4);
+        server_fd = socket(AF_INET, SOCK_STREAM, 0);
+    }
+    if (server_fd == -1) {
         perror("socket failed");
         return -1;
     }
@@ -43,19 +226,76 @@ int ws_server_init(ws_server_t *server, int port) {
         return -1;
     }
     
+    // Dual-stack only for the wildcard address; a specific IPv6 address is IPv6 only
+    if (storage.ss_family == AF_INET6) {
+        int v6only = dual_stack ? 0 : 1;
+        if (setsockopt(server_fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only)) == -1) {
+            perror("setsockopt failed");
+            close(server_fd);
+            return -1;
+        }
+    }
+    
     // Bind socket to port
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(port);
+    if (bind(server_fd, (struct sockaddr *)&storage, addrlen) == -1) {
+        perror("bind failed");
+        close(server_fd);
+        return -1;
+    }
+    
+    return ws_server_add_listener(server, server_fd, storage.ss_family, NULL);
+}
+
+int ws_server_listen_unix(ws_server_t *server, const char *path) {
+    struct sockaddr_un address;
+    size_t path_len = strlen(path);
+    bool abstract = path[0] == '@';
+    
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    
+    if (path_len == 0 || path_len >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Invalid Unix socket path: %s\n", path);
+        return -1;
+    }
+    
+    // A leading '@' names a socket in the abstract namespace
+    memcpy(address.sun_path, path, path_len);
+    if (abstract) {
+        address.sun_path[0] = '\0';
+    }
+    socklen_t addrlen = offsetof(struct sockaddr_un, sun_path) + path_len + (abstract ? 0 : 1);
+    
+    int server_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server_fd == -1) {
+        perror("socket failed");
+        return -1;
+    }
+    
+    // Replace a stale socket left behind by a previous run
+    struct stat st;
+    if (!abstract && lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
     
-    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) == -1) {
+    if (bind(server_fd, (struct sockaddr *)&address, addrlen) == -1) {
         perror("bind failed");
         close(server_fd);
         return -1;
     }
     
-    // Listen for connections
-    if (listen(server_fd, 10) == -1) {
+    return ws_server_add_listener(server, server_fd, AF_UNIX, path);
+}
+
+static int ws_server_add_listener(ws_server_t *server, int server_fd, int family, const char *path) {
+    if (server->num_listeners >= WS_MAX_LISTENERS) {
+        fprintf(stderr, "Too many listeners\n");
+        close(server_fd);
+        return -1;
+    }
+    
+    // Listen for connections; a short backlog drops SYNs during reconnect storms
+    if (listen(server_fd, SOMAXCONN) == -1) {
         perror("listen failed");
         close(server_fd);
         return -1;
@@ -68,252 +308,2169 @@ int ws_server_init(ws_server_t *server, int port) {
         return -1;
     }
     
-    // Initialize server structure
-    server->socket = server_fd;
-    server->clients = NULL;
+    ws_listener_t *listener = &server->listeners[server->num_listeners];
+    listener->socket = server_fd;
+    listener->family = family;
+    listener->path = path ? ws_strdup(server, path) : NULL;
     
-    // Initialize default callbacks to prevent null pointer dereferences
-    server->on_connect = NULL;
-    server->on_message = NULL;
-    server->on_close = NULL;
-    server->on_error = NULL;
+    if (server->config.busy_poll > 0) {
+        ws_set_busy_poll(server, server_fd);
+    }
+    
+    // The first listener is also reachable through the old field
+    if (server->num_listeners == 0) {
+        server->socket = server_fd;
+    }
+    server->num_listeners++;
     
-    printf("WebSocket server started on port %d\n", port);
     return 0;
 }
 
-int ws_server_run(ws_server_t *server) {
-    while (1) {
-        if (ws_server_step(server, -1) < 0) {
+int ws_server_enable_latency(ws_server_t *server, bool kernel_timestamps) {
+    if (!server->latency) {
+        server->latency = ws_mem_alloc(server->allocator, sizeof(*server->latency));
+        if (!server->latency) {
+            perror("malloc");
             return -1;
         }
+        ws_server_latency_reset(server);
     }
     
+    server->latency->kernel_timestamps = kernel_timestamps;
     return 0;
 }
 
-int ws_server_step(ws_server_t *server, int timeout_ms) {
-    struct pollfd fds[MAX_CLIENTS + 1];
-    int nfds = 0;
-    
-    // Add server socket to poll set
-    fds[nfds].fd = server->socket;
-    fds[nfds].events = POLLIN;
-    nfds++;
+const ws_histogram_t *ws_server_latency(const ws_server_t *server, ws_latency_stage_t stage) {
+    if (!server->latency || stage < 0 || stage >= WS_LATENCY_STAGES) {
+        return NULL;
+    }
     
-    // Add client sockets to poll set
-    ws_connection_t *client = server->clients;
-    while (client != NULL && nfds < MAX_CLIENTS + 1) {
-        fds[nfds].fd = client->socket;
-        fds[nfds].events = POLLIN;
-        nfds++;
-        client = client->next;
+    return &server->latency->stages[stage];
+}
+
+void ws_server_latency_reset(ws_server_t *server) {
+    if (!server->latency) {
+        return;
     }
     
-    // Wait for activity on any socket
-    int activity = poll(fds, nfds, timeout_ms);
+    for (int i = 0; i < WS_LATENCY_STAGES; i++) {
+        ws_histogram_reset(&server->latency->stages[i]);
+    }
+}
+
+int ws_server_enable_capture(ws_server_t *server, const char *path, uint32_t sample_rate,
+                             size_t max_payload) {
+    if (server->capture) {
+        return -1;
+    }
     
-    if (activity < 0) {
-        perror("poll failed");
+    server->capture = ws_capture_open(path, sample_rate, max_payload);
+    return server->capture ? 0 : -1;
+}
+
+int ws_server_enable_relay(ws_server_t *server, const char *host, int port) {
+    if (server->relay_target || server->dispatch || server->events) {
         return -1;
     }
     
-    // Check for activity on server socket (new connection)
-    if (fds[0].revents & POLLIN) {
-        ws_accept_client(server);
+    ws_relay_target_t *target = ws_mem_alloc(server->allocator, sizeof(*target));
+    if (!target) {
+        perror("malloc");
+        return -1;
     }
     
-    // Check for activity on client sockets
-    client = server->clients;
-    int i = 1;
-    while (client != NULL && i < nfds) {
-        ws_connection_t *next = client->next;
-        
-        if (fds[i].revents & POLLIN) {
-            ws_process_client(server, client);
-        }
-        
-        client = next;
-        i++;
+    if (ws_relay_resolve(target, host, port) != 0) {
+        ws_mem_free(server->allocator, target, sizeof(*target));
+        return -1;
     }
     
+    server->relay_target = target;
     return 0;
 }
 
-static void ws_accept_client(ws_server_t *server) {
-    struct sockaddr_in client_addr;
-    socklen_t addrlen = sizeof(client_addr);
+int ws_server_enable_ingest(ws_server_t *server, const char *path, size_t size) {
+    if (server->ingest) {
+        return -1;
+    }
+    
+    server->ingest = ws_ingest_create(path, size ? size : WS_INGEST_DEFAULT_SIZE);
+    return server->ingest ? 0 : -1;
+}
+
+ws_connection_t *ws_server_attach(ws_server_t *server, const ws_transport_t *transport, const char *name) {
+    ws_connection_t *conn = ws_create_client(server, -1);
+    if (!conn) {
+        ws_transport_t closing = *transport;
+        ws_transport_close(&closing);
+        return NULL;
+    }
     
-    int client_fd = accept(server->socket, (struct sockaddr *)&client_addr, &addrlen);
+    conn->transport = *transport;
+    conn->info->host = ws_strdup(server, name ? name : transport->ops->name);
+    conn->info->handshake_deadline = server->config.handshake_timeout > 0 ?
+                               ws_now_ms() + server->config.handshake_timeout : 0;
     
-    if (client_fd < 0) {
-        perror("accept failed");
-        return;
+    // The handshake is read on the next step like that of an accepted client
+    ws_track_client(server, conn);
+    return conn;
+}
+
+int ws_subscribe(ws_connection_t *connection, int topic) {
+    if (topic < 0 || topic >= WS_INGEST_TOPICS) {
+        return -1;
     }
     
-    // Set non-blocking
-    if (ws_set_nonblocking(client_fd) < 0) {
-        perror("set non-blocking failed");
-        close(client_fd);
-        return;
+    connection->info->topics |= (uint64_t)1 << topic;
+    return 0;
+}
+
+int ws_unsubscribe(ws_connection_t *connection, int topic) {
+    if (topic < 0 || topic >= WS_INGEST_TOPICS) {
+        return -1;
     }
     
-    // Create new client connection
-    ws_connection_t *conn = (ws_connection_t *)malloc(sizeof(ws_connection_t));
-    if (!conn) {
-        perror("malloc failed");
-        close(client_fd);
-        return;
+    connection->info->topics &= ~((uint64_t)1 << topic);
+    return 0;
+}
+
+int ws_server_enable_handoff(ws_server_t *server, const char *path) {
+    if (server->handoff_socket >= 0) {
+        return -1;
     }
     
-    // Initialize connection
-    conn->socket = client_fd;
-    conn->state = WS_STATE_CONNECTING;
-    conn->host = strdup(inet_ntoa(client_addr.sin_addr));
-    conn->port = ntohs(client_addr.sin_port);
-    conn->user_data = NULL;
+    server->handoff_socket = ws_handoff_listen(path);
+    if (server->handoff_socket < 0) {
+        return -1;
+    }
     
-    // Add to connection list
-    ws_connection_add(&server->clients, conn);
+    server->handoff_path = ws_strdup(server, path);
+    return 0;
+}
+
+int ws_server_takeover(ws_server_t *server, const char *path) {
+    int control = ws_handoff_connect(path);
+    if (control < 0) {
+        return -1;
+    }
     
-    // Perform WebSocket handshake
-    if (ws_handshake(conn) != 0) {
-        if (server->on_error) {
-            server->on_error(conn, "Handshake failed");
-        }
-        ws_disconnect_client(server, conn, 1002, "Protocol error");
-        return;
+    uint8_t *buffer = (uint8_t *)ws_mem_alloc(server->allocator, WS_HANDOFF_BUFFER_SIZE);
+    if (!buffer) {
+        close(control);
+        return -1;
     }
     
-    conn->state = WS_STATE_OPEN;
+    int listeners = 0;
+    int connections = 0;
+    int result = -1;
     
-    // Call the on_connect callback
-    if (server->on_connect) {
-        server->on_connect(conn);
+    // Listeners come first, then connections, then the end marker
+    while (1) {
+        ws_handoff_record_t record;
+        if (ws_handoff_recv(control, &record, buffer, WS_HANDOFF_BUFFER_SIZE) != 0) {
+            perror("takeover failed");
+            break;
+        }
+        
+        if (record.type == WS_HANDOFF_END) {
+            result = 0;
+            break;
+        }
+        
+        if (record.type == WS_HANDOFF_LISTENER && record.fd >= 0) {
+            if (ws_server_add_listener(server, record.fd, record.family,
+                                       record.host[0] ? record.host : NULL) == 0) {
+                listeners++;
+            }
+        } else if (record.type == WS_HANDOFF_CONNECTION && record.fd >= 0) {
+            ws_adopt_client(server, &record);
+            connections++;
+        } else if (record.fd >= 0) {
+            close(record.fd);
+        }
     }
+    
+    ws_mem_free(server->allocator, buffer, WS_HANDOFF_BUFFER_SIZE);
+    close(control);
+    
+    printf("Took over %d listeners and %d connections\n", listeners, connections);
+    return result;
 }
 
-static void ws_process_client(ws_server_t *server, ws_connection_t *client) {
-    uint8_t buffer[BUFFER_SIZE];
-    ssize_t bytes_read = recv(client->socket, buffer, sizeof(buffer), 0);
+static void ws_hand_off(ws_server_t *server) {
+#ifdef SOCK_CLOEXEC
+    int control = accept4(server->handoff_socket, NULL, NULL, SOCK_CLOEXEC);
+#else
+    int control = accept(server->handoff_socket, NULL, NULL);
+#endif
+    if (control < 0) {
+        perror("control accept failed");
+        return;
+    }
     
-    if (bytes_read <= 0) {
-        // Connection closed or error
-        if (bytes_read == 0) {
-            ws_disconnect_client(server, client, 1000, "Connection closed");
-        } else {
-            if (server->on_error) {
-                server->on_error(client, "Read error");
-            }
-            ws_disconnect_client(server, client, 1001, "Read error");
-        }
+    // Only a process of our own user may take the sockets
+    if (ws_handoff_check_peer(control) != 0) {
+        close(control);
         return;
     }
     
-    // Parse WebSocket frame
-    ws_frame_t frame;
-    if (ws_parse_frame(buffer, bytes_read, &frame) != 0) {
-        if (server->on_error) {
-            server->on_error(client, "Invalid frame");
+    // Listeners first, so the new process accepts while connections move
+    for (int i = 0; i < server->num_listeners; i++) {
+        ws_listener_t *listener = &server->listeners[i];
+        ws_handoff_record_t record;
+        
+        memset(&record, 0, sizeof(record));
+        record.type = WS_HANDOFF_LISTENER;
+        record.fd = listener->socket;
+        record.family = listener->family;
+        if (listener->path) {
+            snprintf(record.host, sizeof(record.host), "%s", listener->path);
+        }
+        
+        if (ws_handoff_send(control, &record) != 0) {
+            perror("handoff failed");
+            close(control);
+            return;
         }
-        ws_disconnect_client(server, client, 1002, "Protocol error");
-        return;
     }
     
-    // Handle different frame types
-    switch (frame.opcode) {
-        case WS_OPCODE_TEXT:
-        case WS_OPCODE_BINARY:
-            if (server->on_message) {
-                server->on_message(client, frame.payload, frame.payload_length, 
-                                 frame.opcode == WS_OPCODE_BINARY);
-            }
-            break;
-            
-        case WS_OPCODE_CLOSE:
-            {
-                uint16_t code = 1000;
-                char reason[124] = "";
-                
-                // Extract close code and reason if available
-                if (frame.payload_length >= 2) {
-                    code = (frame.payload[0] << 8) | frame.payload[1];
-                    
-                    if (frame.payload_length > 2) {
-                        size_t reason_len = frame.payload_length - 2 < 123 ? 
-                                          frame.payload_length - 2 : 123;
-                        memcpy(reason, &frame.payload[2], reason_len);
-                        reason[reason_len] = '\0';
-                    }
-                }
-                
-                ws_disconnect_client(server, client, code, reason);
-            }
-            break;
-            
-        case WS_OPCODE_PING:
-            // Respond with a pong frame
-            ws_send_pong(client, frame.payload, frame.payload_length);
-            break;
+    // Stop accepting; the sockets and their paths belong to the new process now
+    for (int i = 0; i < server->num_listeners; i++) {
+        close(server->listeners[i].socket);
+        ws_strfree(server, server->listeners[i].path);
+        server->listeners[i].path = NULL;
+    }
+    server->num_listeners = 0;
+    server->socket = -1;
+    
+    // The new process creates its own control socket at the same path
+    close(server->handoff_socket);
+    server->handoff_socket = -1;
+    if (server->handoff_path[0] != '@') {
+        unlink(server->handoff_path);
+    }
+    
+    // Connections between messages move; the rest are drained here
+    int moved = 0;
+    ws_connection_t *client = server->clients;
+    while (client != NULL) {
+        ws_connection_t *next = client->next;
+        
+        if (ws_client_at_boundary(client)) {
+            ws_handoff_record_t record;
             
-        case WS_OPCODE_PONG:
-            // Pong received, could update last activity time
-            break;
+            memset(&record, 0, sizeof(record));
+            record.type = WS_HANDOFF_CONNECTION;
+            record.fd = client->socket;
+            record.family = client->info->family;
+            record.port = client->info->port;
+            snprintf(record.host, sizeof(record.host), "%s", client->info->host ? client->info->host : "");
+            record.data = client->rx_data + client->rx_offset;
+            record.data_length = client->rx_length - client->rx_offset;
             
-        default:
-            if (server->on_error) {
-                server->on_error(client, "Unknown opcode");
+            if (ws_handoff_send(control, &record) != 0) {
+                perror("handoff failed");
+                break;
             }
-            break;
+            
+            // Close only our descriptor; no close frame goes out
+            client->state = WS_STATE_CLOSING;
+            ws_disconnect_client(server, client, 1001, "Handed off");
+            moved++;
+        }
+        
+        client = next;
     }
+    
+    ws_handoff_record_t end;
+    memset(&end, 0, sizeof(end));
+    end.type = WS_HANDOFF_END;
+    end.fd = -1;
+    ws_handoff_send(control, &end);
+    close(control);
+    
+    server->handed_off = true;
+    printf("Handed off %d connections, draining %d\n", moved, ws_connection_count(server->clients));
 }
 
-int ws_send_text(ws_connection_t *connection, const char *text, size_t len) {
-    return ws_send_frame(connection, WS_OPCODE_TEXT, (const uint8_t *)text, len);
-}
-
-int ws_send_binary(ws_connection_t *connection, const uint8_t *data, size_t len) {
-    return ws_send_frame(connection, WS_OPCODE_BINARY, data, len);
+static bool ws_client_at_boundary(ws_connection_t *client) {
+    // Nothing half-read, half-written or still owned by a worker
+    return client->state == WS_STATE_OPEN &&
+           !(client->fragment && client->fragment->in_progress) &&
+           !client->queued &&
+           client->refcount == 1 &&
+           !client->info->relay &&
+           client->socket >= 0 &&
+           !ws_output_pending(client->output) &&
+           !ws_output_zerocopy_pending(client->output) &&
+           client->rx_length - client->rx_offset <= WS_HANDOFF_MAX_DATA;
 }
 
-int ws_close(ws_connection_t *connection, int code, const char *reason) {
-    uint8_t payload[128];
-    size_t payload_len = 2; // At least the status code
+static void ws_adopt_client(ws_server_t *server, const ws_handoff_record_t *record) {
+    ws_connection_t *conn = ws_create_client(server, record->fd);
+    if (!conn) {
+        return;
+    }
     
-    // Set status code
-    payload[0] = (code >> 8) & 0xFF;
-    payload[1] = code & 0xFF;
+    conn->state = WS_STATE_OPEN;
+    if (conn->captured) {
+        ws_capture_record(server->capture, conn->id, WS_CAPTURE_OPEN, 0, false, 0, NULL);
+    }
+    conn->info->family = record->family;
+    conn->info->port = record->port;
+    conn->info->host = ws_strdup(server, record->host);
     
-    // Add reason if provided
-    if (reason) {
-        size_t reason_len = strlen(reason);
-        if (reason_len > 123) reason_len = 123; // Max allowed reason length
-        
-        memcpy(&payload[2], reason, reason_len);
-        payload_len += reason_len;
+    // Input the old process received but had not handled yet
+    if (record->data_length > 0) {
+        if (ws_reserve_input(conn, record->data_length, server->config.buffer_size) != 0) {
+            ws_release_client(conn);
+            close(record->fd);
+            return;
+        }
+        memcpy(conn->rx_data, record->data, record->data_length);
+        conn->rx_length = record->data_length;
     }
     
-    return ws_send_frame(connection, WS_OPCODE_CLOSE, payload, payload_len);
+    ws_track_client(server, conn);
+    
+    if (server->on_connect) {
+        server->on_connect(conn);
+    }
+    
+    if (conn->rx_length > 0 && conn->state == WS_STATE_OPEN) {
+        ws_schedule_client(server, conn);
+    }
 }
 
-static void ws_disconnect_client(ws_server_t *server, ws_connection_t *client, int code, const char *reason) {
-    // Send close frame if connection is still open
-    if (client->state == WS_STATE_OPEN) {
-        ws_close(client, code, reason);
-        client->state = WS_STATE_CLOSING;
+int ws_server_enable_dispatch(ws_server_t *server, int num_workers) {
+    if (server->dispatch || !server->on_message || server->events) {
+        return -1;
     }
     
-    // Call the on_close callback
-    if (server->on_close) {
+    server->dispatch = ws_dispatch_create(num_workers, server->on_message, server->allocator);
+    if (!server->dispatch) {
+        fprintf(stderr, "Failed to start dispatch worker pool\n");
+        return -1;
+    }
+    
+    return 0;
+}
+
+int ws_server_run(ws_server_t *server) {
+    while (1) {
+        if (ws_server_step(server, -1) < 0) {
+            return -1;
+        }
+    }
+    
+    return 0;
+}
+
+int ws_server_step(ws_server_t *server, int timeout_ms) {
+    ws_expire_handshakes(server, &timeout_ms);
+    server->memory.limit = server->config.memory_limit;
+    
+    // Room for every client (and its backend when relaying) plus the
+    // listeners, the reply pipe, the control socket, the ingest ring, the
+    // lingering sockets and the HTTP/2 sessions
+    size_t count = (size_t)ws_connection_count(server->clients) * (server->relay_target ? 2 : 1) +
+                   (size_t)ws_connection_count(server->lingering) +
+                   server->num_listeners + server->num_sessions + 4;
+    if (ws_reserve_poll(server, count) != 0) {
+        perror("poll set allocation failed");
+        return -1;
+    }
+    
+    struct pollfd *fds = server->poll_fds;
+    int nfds = 0;
+    
+    // Add listening sockets to poll set
+    for (int i = 0; i < server->num_listeners; i++) {
+        fds[nfds].fd = server->listeners[i].socket;
+        fds[nfds].events = POLLIN;
+        nfds++;
+    }
+    
+    // Add worker reply notifications to poll set
+    int reply_index = nfds;
+    if (server->dispatch) {
+        fds[nfds].fd = ws_dispatch_fd(server->dispatch);
+        fds[nfds].events = POLLIN;
+        nfds++;
+    }
+    
+    // Add hot-restart control socket to poll set
+    int handoff_index = nfds;
+    if (server->handoff_socket >= 0) {
+        fds[nfds].fd = server->handoff_socket;
+        fds[nfds].events = POLLIN;
+        nfds++;
+    }
+    
+    // Add publisher control socket and ring notifications to poll set
+    int ingest_index = nfds;
+    if (server->ingest) {
+        int control, event;
+        ws_ingest_fds(server->ingest, &control, &event);
+        fds[nfds].fd = control;
+        fds[nfds].events = POLLIN;
+        fds[nfds + 1].fd = event;
+        fds[nfds + 1].events = POLLIN;
+        nfds += 2;
+    }
+    
+    // Add closed sockets waiting for zero-copy completions to poll set
+    int first_lingering = nfds;
+    nfds += ws_linger_poll(server, &fds[nfds], &timeout_ms);
+    
+    // Add HTTP/2 connections to poll set, in list order; one whose client
+    // does not read its replies, or that holds more than its share of
+    // memory, takes no input
+    int first_session = nfds;
+    int holders = 0;
+    int over_budget = 0;
+    for (ws_h2_session_t *session = server->sessions; session; session = session->next) {
+        ws_budget_charge(&server->memory, &session->memory, ws_h2_session_footprint(session));
+        holders++;
+        
+        bool paused = ws_h2_session_backlogged(session);
+        if (!paused && ws_budget_over_share(&server->memory, session->memory)) {
+            paused = true;
+            over_budget++;
+        }
+        
+        fds[nfds].fd = session->socket;
+        fds[nfds].events = paused ? 0 : POLLIN;
+        if (ws_h2_session_pending(session)) {
+            fds[nfds].events |= POLLOUT;
+        }
+        nfds++;
+    }
+    int first_client = nfds;
+    
+    // Add client sockets to poll set, relayed ones after their backend
+    ws_connection_t *client = server->clients;
+    while (client != NULL) {
+        bool paused = false;
+        if (server->relay_target && client->info->relay) {
+            ws_relay_poll(client, &fds[nfds]);
+            server->poll_clients[nfds] = client;
+            nfds++;
+            paused = ws_relay_blocked(client->info->relay);
+        }
+        
+        // Under memory pressure the heaviest clients take no input (TCP
+        // pushes back on their peers) until memory is released; one with
+        // part of a frame received still reads the rest of it
+        if (client->memory > 0 || ws_client_queued(client) > 0) {
+            holders++;
+            if (!paused && client->rx_length == client->rx_offset && ws_client_over_budget(server, client)) {
+                paused = true;
+                over_budget++;
+            }
+        }
+        
+        // Transports without a descriptor are asked directly; output
+        // they did not take is retried at the end of the step
+        if (client->socket < 0) {
+            if (!paused && ws_transport_wait(&client->transport, 0) > 0) {
+                ws_schedule_client(server, client);
+            }
+            if (ws_output_pending(client->output)) {
+                client->flush_deferred = true;
+            }
+            client = client->next;
+            continue;
+        }
+        
+        // Input for a backend that cannot take more waits in the socket
+        fds[nfds].fd = client->socket;
+        fds[nfds].events = paused ? 0 : POLLIN;
+        if (ws_output_pending(client->output)) {
+            fds[nfds].events |= POLLOUT;
+        }
+        if (fds[nfds].events == 0) {
+            fds[nfds].fd = -1;
+        }
+        server->poll_clients[nfds] = client;
+        nfds++;
+        client = client->next;
+    }
+    server->memory.holders = holders;
+    server->memory.paused = over_budget;
+    
+    // Clients with input left over from the last step must not wait
+    if (server->run_head) {
+        timeout_ms = 0;
+    }
+    
+    // Nor must messages publishers committed before the ring was armed
+    if (server->ingest && timeout_ms != 0 && ws_ingest_prepare_wait(server->ingest)) {
+        timeout_ms = 0;
+    }
+    
+    // Wait for activity on any socket
+    int activity = ws_poll(server, fds, nfds, timeout_ms);
+    
+    if (activity < 0) {
+        perror("poll failed");
+        return -1;
+    }
+    
+    // Closed sockets go once the kernel has released their payloads
+    if (server->lingering) {
+        ws_linger_ready(server, &fds[first_lingering]);
+    }
+    
+    // Check for activity on listening sockets (new connections)
+    for (int i = 0; i < server->num_listeners; i++) {
+        if (fds[i].revents & POLLIN) {
+            ws_accept_clients(server, &server->listeners[i]);
+        }
+    }
+    
+    // Send replies produced by worker threads
+    if (server->dispatch && (fds[reply_index].revents & POLLIN)) {
+        ws_process_replies(server);
+    }
+    
+    // Publishers attach, then their messages fan out to the clients
+    if (server->ingest) {
+        if (fds[ingest_index].revents & POLLIN) {
+            ws_ingest_accept(server->ingest);
+        }
+        if (fds[ingest_index + 1].revents & POLLIN) {
+            ws_ingest_clear(server->ingest);
+        }
+        ws_ingest_drain(server->ingest, ws_deliver_ingest, server, server->config.ingest_budget);
+    }
+    
+    // A new process wants our sockets; clients handed over leave the list,
+    // so their poll entries are skipped
+    if (server->handoff_socket >= 0 && (fds[handoff_index].revents & POLLIN)) {
+        ws_hand_off(server);
+        return 0;
+    }
+    
+    // Check for activity on client sockets
+    for (int i = first_client; i < nfds; i++) {
+        client = server->poll_clients[i];
+        short revents = fds[i].revents;
+        
+        // The backend entry comes first and never closes the client
+        if (revents && server->relay_target && client->info->relay && fds[i].fd == client->info->relay->backend) {
+            ws_relay_ready(server, client, revents);
+            continue;
+        }
+        
+        // Writable, or zero-copy completions waiting in the error queue
+        if (revents & (POLLOUT | POLLERR)) {
+            if (ws_flush_client(client) != 0) {
+                if (server->on_error) {
+                    server->on_error(client, "Write error");
+                }
+                ws_disconnect_client(server, client, 1001, "Write error");
+                continue;
+            }
+        }
+        
+        // POLLERR without completions to reap is a socket error for recv to report
+        if ((revents & (POLLIN | POLLHUP)) ||
+            ((revents & POLLERR) && !ws_output_zerocopy_pending(client->output))) {
+            ws_schedule_client(server, client);
+        }
+    }
+    
+    // HTTP/2 connections come after the client entries, since a failed
+    // session disconnects the clients it carries
+    ws_h2_session_t *session = server->sessions;
+    for (int i = first_session; i < first_client; i++) {
+        ws_h2_session_t *next = session->next;
+        short revents = fds[i].revents;
+        bool backlogged = ws_h2_session_backlogged(session);
+        
+        // Frames left unparsed while the output was backlogged go on once
+        // it has been written, whether or not more input arrives
+        if (((revents & (POLLIN | POLLHUP | POLLERR)) && ws_h2_session_read(session) != 0) ||
+            ((revents & POLLOUT) && ws_h2_session_flush(session) < 0) ||
+            (backlogged && !ws_h2_session_backlogged(session) && ws_h2_session_read(session) != 0)) {
+            ws_end_session(server, session);
+        } else if (revents) {
+            ws_h2_session_resume(session);
+        }
+        session = next;
+    }
+    
+    ws_run_clients(server);
+    
+    // Write what coalesced sends queued during this step, and close
+    // connections that fell too far behind
+    client = server->clients;
+    while (client != NULL) {
+        ws_connection_t *next = client->next;
+        
+        if (client->overflowed) {
+            if (server->on_error) {
+                server->on_error(client, "Slow consumer");
+            }
+            ws_disconnect_client(server, client, 1008, "Slow consumer");
+        } else if (client->flush_deferred && ws_flush_client(client) != 0) {
+            if (server->on_error) {
+                server->on_error(client, "Write error");
+            }
+            ws_disconnect_client(server, client, 1001, "Write error");
+        }
+        
+        client = next;
+    }
+    
+    return 0;
+}
+
+static void ws_record_event(ws_connection_t *connection, ws_event_type_t type,
+                            const void *data, size_t len, bool text, bool is_binary, int code) {
+    ws_event_t *event = ws_event_queue_push(connection->server->events, type, connection,
+                                            data, len, text);
+    if (!event) {
+        fprintf(stderr, "Out of memory recording event for %s:%d\n", connection->info->host, connection->info->port);
+        return;
+    }
+    
+    event->is_binary = is_binary;
+    event->code = code;
+    
+    // The connection outlives its close until the events are dropped
+    connection->refcount++;
+}
+
+static void ws_record_connect(ws_connection_t *connection) {
+    ws_record_event(connection, WS_EVENT_CONNECT, NULL, 0, false, false, 0);
+}
+
+static void ws_record_message(ws_connection_t *connection, const uint8_t *data, size_t len, bool is_binary) {
+    ws_record_event(connection, WS_EVENT_MESSAGE, data, len, !is_binary, is_binary, 0);
+}
+
+static void ws_record_close(ws_connection_t *connection, int code, const char *reason) {
+    ws_record_event(connection, WS_EVENT_CLOSE, reason, reason ? strlen(reason) : 0, true, false, code);
+}
+
+static void ws_record_error(ws_connection_t *connection, const char *error) {
+    ws_record_event(connection, WS_EVENT_ERROR, error, strlen(error), true, false, 0);
+}
+
+int ws_server_poll_events(ws_server_t *server, ws_event_t *events, int max, int timeout_ms) {
+    if (max <= 0 || server->dispatch) {
+        return -1;
+    }
+    
+    // Switch from callbacks to recording events
+    if (!server->events) {
+        server->events = ws_mem_alloc(server->allocator, sizeof(*server->events));
+        if (!server->events) {
+            perror("malloc");
+            return -1;
+        }
+        ws_event_queue_init(server->events, server->allocator);
+        
+        server->on_connect = ws_record_connect;
+        server->on_message = ws_record_message;
+        server->on_close = ws_record_close;
+        server->on_error = ws_record_error;
+    }
+    
+    // Hand out what the last step produced before running another one
+    if (!ws_event_queue_pending(server->events)) {
+        ws_event_queue_reset(server->events, ws_release_client);
+        if (ws_server_step(server, timeout_ms) != 0) {
+            return -1;
+        }
+    }
+    
+    return ws_event_queue_take(server->events, events, max);
+}
+
+static int ws_poll(ws_server_t *server, struct pollfd *fds, int nfds, int timeout_ms) {
+    if (server->config.busy_poll <= 0 || timeout_ms == 0) {
+        return poll(fds, nfds, timeout_ms);
+    }
+    
+    ws_busy_poll_stats_t *stats = &server->busy_poll_stats;
+    int64_t start = ws_latency_now();
+    int64_t spin_ns = (int64_t)server->config.busy_poll * 1000;
+    int64_t elapsed = 0;
+    
+    // Spin without sleeping so a wake-up costs no scheduler round trip
+    while (elapsed < spin_ns && (timeout_ms < 0 || elapsed < (int64_t)timeout_ms * 1000000)) {
+        int activity = poll(fds, nfds, 0);
+        stats->spins++;
+        elapsed = ws_latency_now() - start;
+        
+        if (activity != 0) {
+            if (activity > 0) {
+                stats->hits++;
+                stats->useful_ns += (uint64_t)elapsed;
+            }
+            return activity;
+        }
+    }
+    
+    stats->blocks++;
+    stats->wasted_ns += (uint64_t)elapsed;
+    
+    // Then block for what is left of the timeout
+    if (timeout_ms > 0) {
+        int spent_ms = (int)(elapsed / 1000000);
+        timeout_ms = spent_ms < timeout_ms ? timeout_ms - spent_ms : 0;
+    }
+    return poll(fds, nfds, timeout_ms);
+}
+
+static void ws_set_busy_poll(ws_server_t *server, int socket) {
+    int busy_poll = server->config.busy_poll;
+    int prefer = busy_poll > 0;
+    
+    // Best effort: unprivileged processes may not raise the busy-poll time
+    setsockopt(socket, SOL_SOCKET, SO_BUSY_POLL, &busy_poll, sizeof(busy_poll));
+    setsockopt(socket, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof(prefer));
+}
+
+int ws_server_enable_busy_poll(ws_server_t *server, int spin_us, int cpu) {
+    server->config.busy_poll = spin_us > 0 ? spin_us : 0;
+    memset(&server->busy_poll_stats, 0, sizeof(server->busy_poll_stats));
+    
+    for (int i = 0; i < server->num_listeners; i++) {
+        ws_set_busy_poll(server, server->listeners[i].socket);
+    }
+    for (ws_connection_t *client = server->clients; client; client = client->next) {
+        ws_set_busy_poll(server, client->socket);
+    }
+    
+    if (cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+            perror("sched_setaffinity");
+            return -1;
+        }
+    }
+    
+    return 0;
+}
+
+static int ws_reserve_poll(ws_server_t *server, size_t count) {
+    if (count <= server->poll_capacity) {
+        return 0;
+    }
+    
+    size_t capacity = server->poll_capacity ? server->poll_capacity : 16;
+    while (capacity < count) {
+        capacity *= 2;
+    }
+    
+    // Both arrays share one block, so a failed allocation leaves the old
+    // one intact with its size; entries are rebuilt every step anyway
+    ws_connection_t **clients = ws_mem_alloc(server->allocator, capacity * WS_POLL_ENTRY_SIZE);
+    if (!clients) {
+        return -1;
+    }
+    ws_mem_free(server->allocator, server->poll_clients, server->poll_capacity * WS_POLL_ENTRY_SIZE);
+    
+    server->poll_clients = clients;
+    server->poll_fds = (struct pollfd *)(clients + capacity);
+    server->poll_capacity = capacity;
+    
+    return 0;
+}
+
+static void ws_schedule_client(ws_server_t *server, ws_connection_t *client) {
+    if (client->queued) {
+        return;
+    }
+    
+    // The queue holds a reference so a client closed meanwhile stays valid
+    client->queued = true;
+    client->refcount++;
+    ws_run_queue_push(server, client);
+}
+
+static void ws_run_queue_push(ws_server_t *server, ws_connection_t *client) {
+    client->run_next = NULL;
+    
+    if (server->run_tail) {
+        server->run_tail->run_next = client;
+    } else {
+        server->run_head = client;
+    }
+    server->run_tail = client;
+}
+
+static void ws_run_clients(ws_server_t *server) {
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    
+    // Every client queued so far gets one turn; those with input left over
+    // go to the back and continue in the next step
+    ws_connection_t *last = server->run_tail;
+    while (server->run_head) {
+        ws_connection_t *client = server->run_head;
+        server->run_head = client->run_next;
+        if (!server->run_head) {
+            server->run_tail = NULL;
+        }
+        
+        bool was_last = client == last;
+        bool more = client->state != WS_STATE_CLOSED && ws_process_client(server, client) > 0;
+        if (more && client->state != WS_STATE_CLOSED) {
+            ws_account_client(server, client);
+            ws_run_queue_push(server, client);
+        } else {
+            client->queued = false;
+            ws_trim_client(client);
+            ws_account_client(server, client);
+            ws_release_client(client);
+        }
+        
+        if (was_last) {
+            break;
+        }
+        
+        // Clients not reached yet keep their place at the front
+        if (server->config.step_budget > 0) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long elapsed_us = (now.tv_sec - start.tv_sec) * 1000000L +
+                              (now.tv_nsec - start.tv_nsec) / 1000;
+            if (elapsed_us >= server->config.step_budget) {
+                break;
+            }
+        }
+    }
+}
+
+static void ws_accept_clients(ws_server_t *server, ws_listener_t *listener) {
+    int limit = server->config.accept_batch;
+    
+    // Drain the listen queue, but leave the rest of the step to established clients
+    for (int accepted = 0; limit <= 0 || accepted < limit; accepted++) {
+        struct sockaddr_storage client_addr;
+        socklen_t addrlen = sizeof(client_addr);
+        
+#ifdef SOCK_NONBLOCK
+        int client_fd = accept4(listener->socket, (struct sockaddr *)&client_addr, &addrlen,
+                                SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+        int client_fd = accept(listener->socket, (struct sockaddr *)&client_addr, &addrlen);
+        if (client_fd >= 0 && ws_set_nonblocking(client_fd) < 0) {
+            perror("set non-blocking failed");
+            close(client_fd);
+            continue;
+        }
+#endif
+        
+        if (client_fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("accept failed");
+            }
+            return;
+        }
+        
+        ws_add_client(server, listener, client_fd, &client_addr);
+    }
+}
+
+static void ws_add_client(ws_server_t *server, ws_listener_t *listener, int client_fd,
+                          const struct sockaddr_storage *client_addr) {
+    ws_connection_t *conn = ws_create_client(server, client_fd);
+    if (!conn) {
+        return;
+    }
+    
+    ws_peer_address(conn, listener, client_addr);
+    WS_PROBE3(accept, conn->id, client_fd, conn->info->family);
+    conn->info->handshake_deadline = server->config.handshake_timeout > 0 ?
+                               ws_now_ms() + server->config.handshake_timeout : 0;
+    
+    // Add to connection list; the handshake is read from the event loop
+    ws_track_client(server, conn);
+}
+
+static ws_connection_t *ws_create_client(ws_server_t *server, int client_fd) {
+    // Create new client connection; adding it to the id index then cannot fail
+    ws_connection_t *conn = ws_reserve_ids(server) == 0 ?
+                            (ws_connection_t *)ws_mem_alloc(server->allocator, sizeof(ws_connection_t)) : NULL;
+    ws_connection_info_t *info = conn ?
+                                 (ws_connection_info_t *)ws_mem_alloc(server->allocator, sizeof(ws_connection_info_t)) : NULL;
+    if (!info) {
+        perror("malloc failed");
+        ws_mem_free(server->allocator, conn, sizeof(ws_connection_t));
+        if (client_fd >= 0) {
+            close(client_fd);
+        }
+        return NULL;
+    }
+    
+    // Initialize connection
+    conn->socket = client_fd;
+    if (client_fd >= 0) {
+        ws_transport_init_socket(&conn->transport, client_fd);
+    } else {
+        memset(&conn->transport, 0, sizeof(conn->transport));
+        conn->transport.fd = -1;
+    }
+    conn->state = WS_STATE_CONNECTING;
+    conn->refcount = 1;
+    conn->overflowed = false;
+    conn->rx_data = NULL;
+    conn->rx_offset = 0;
+    conn->rx_length = 0;
+    conn->rx_capacity = 0;
+    conn->rx_allocated = false;
+    conn->queued = false;
+    conn->flush_deferred = false;
+    conn->run_next = NULL;
+    conn->next = NULL;
+    conn->id_next = NULL;
+    conn->output = NULL;
+    conn->fragment = NULL;
+    conn->id = ++server->last_connection_id;
+    conn->captured = server->capture && ws_capture_sampled(server->capture, conn->id);
+    conn->memory = 0;
+    conn->server = server;
+    conn->info = info;
+    
+    memset(info, 0, sizeof(*info));
+    info->family = AF_UNSPEC;
+    info->high_water = server->config.high_water;
+    info->slow_policy = (ws_slow_policy_t)server->config.slow_policy;
+    
+    if (server->config.busy_poll > 0 && client_fd >= 0) {
+        ws_set_busy_poll(server, client_fd);
+    }
+    
+    // If this fails the receive stage starts at the read instead
+    if (server->latency && server->latency->kernel_timestamps && client_fd >= 0) {
+        int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+        setsockopt(client_fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags));
+    }
+    
+    return conn;
+}
+
+static void ws_peer_address(ws_connection_t *conn, const ws_listener_t *listener,
+                            const struct sockaddr_storage *client_addr) {
+    char host[INET6_ADDRSTRLEN] = "";
+    
+    conn->info->family = client_addr->ss_family;
+    conn->info->port = 0;
+    
+    if (client_addr->ss_family == AF_INET6) {
+        const struct sockaddr_in6 *address6 = (const struct sockaddr_in6 *)client_addr;
+        conn->info->port = ntohs(address6->sin6_port);
+        
+        // IPv4 clients of a dual-stack listener are reported as IPv4
+        if (IN6_IS_ADDR_V4MAPPED(&address6->sin6_addr)) {
+            conn->info->family = AF_INET;
+            inet_ntop(AF_INET, &address6->sin6_addr.s6_addr[12], host, sizeof(host));
+        } else {
+            inet_ntop(AF_INET6, &address6->sin6_addr, host, sizeof(host));
+        }
+    } else if (client_addr->ss_family == AF_INET) {
+        const struct sockaddr_in *address4 = (const struct sockaddr_in *)client_addr;
+        conn->info->port = ntohs(address4->sin_port);
+        inet_ntop(AF_INET, &address4->sin_addr, host, sizeof(host));
+    } else {
+        // Unix peers are usually unnamed; report the socket they came in on
+        conn->info->family = AF_UNIX;
+        conn->info->host = ws_strdup(conn->server, listener->path ? listener->path : "unix");
+        return;
+    }
+    
+    conn->info->host = ws_strdup(conn->server, host);
+}
+
+static int64_t ws_now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static void ws_expire_handshakes(ws_server_t *server, int *timeout_ms) {
+    int64_t now = 0;
+    
+    ws_connection_t *client = server->clients;
+    while (client != NULL) {
+        ws_connection_t *next = client->next;
+        
+        if (client->state == WS_STATE_CONNECTING && client->info->handshake_deadline > 0) {
+            if (now == 0) {
+                now = ws_now_ms();
+            }
+            
+            int64_t remaining = client->info->handshake_deadline - now;
+            if (remaining <= 0) {
+                fprintf(stderr, "Handshake timeout for %s:%d\n", client->info->host, client->info->port);
+                if (server->on_error) {
+                    server->on_error(client, "Handshake failed");
+                }
+                ws_disconnect_client(server, client, 1002, "Protocol error");
+            } else if (*timeout_ms < 0 || remaining < *timeout_ms) {
+                // Wake up in time to enforce the deadline
+                *timeout_ms = (int)remaining;
+            }
+        }
+        
+        client = next;
+    }
+}
+
+static int ws_process_handshake(ws_server_t *server, ws_connection_t *client) {
+    if (ws_reserve_input(client, WS_HANDSHAKE_MAX_REQUEST, server->config.buffer_size) != 0) {
+        if (server->on_error) {
+            server->on_error(client, "Out of memory");
+        }
+        ws_disconnect_client(server, client, 1011, "Internal error");
+        return 0;
+    }
+    
+    // Read whatever part of the request has arrived
+    size_t space = WS_HANDSHAKE_MAX_REQUEST - 1 - client->rx_length;
+    ssize_t bytes_read = ws_transport_read(&client->transport, client->rx_data + client->rx_length, space);
+    
+    if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return 0;
+    }
+    
+    if (bytes_read <= 0) {
+        fprintf(stderr, "Failed to read handshake data from %s:%d\n", client->info->host, client->info->port);
+        ws_disconnect_client(server, client, 1000, "Connection closed");
+        return 0;
+    }
+    
+    client->rx_length += bytes_read;
+    
+    // HTTP/2 with prior knowledge: WebSockets arrive as streams (RFC 8441)
+    if (server->config.http2 && client->socket >= 0 && ws_h2_is_preface(client->rx_data, client->rx_length)) {
+        if (client->rx_length >= WS_H2_PREFACE_LENGTH) {
+            ws_start_session(server, client);
+        }
+        return 0;
+    }
+    
+    size_t request_length = ws_handshake_request_length((const char *)client->rx_data, client->rx_length);
+    if (request_length == 0) {
+        if (client->rx_length < WS_HANDSHAKE_MAX_REQUEST - 1) {
+            return 0; // Wait for the rest of the headers
+        }
+        fprintf(stderr, "Incomplete HTTP headers from %s:%d\n", client->info->host, client->info->port);
+    }
+    
+    char request[WS_HANDSHAKE_MAX_REQUEST];
+    char response[WS_HANDSHAKE_MAX_REQUEST];
+    int response_len = -1;
+    
+    if (request_length > 0) {
+        memcpy(request, client->rx_data, request_length);
+        request[request_length] = '\0';
+        response_len = ws_handshake_response(client, request, response, sizeof(response));
+    }
+    
+    // The response is the first thing written, so the socket buffer takes it whole
+    struct iovec iov = { response, response_len > 0 ? (size_t)response_len : 0 };
+    if (response_len < 0 || ws_transport_writev(&client->transport, &iov, 1) != response_len) {
+        WS_PROBE3(handshake, client->id, request_length, 0);
+        if (server->on_error) {
+            server->on_error(client, "Handshake failed");
+        }
+        ws_disconnect_client(server, client, 1002, "Protocol error");
+        return 0;
+    }
+    
+    printf("Handshake successful with %s:%d\n", client->info->host, client->info->port);
+    WS_PROBE3(handshake, client->id, request_length, 1);
+    
+    // Anything after the headers is already frame data
+    client->rx_offset = request_length;
+    ws_open_client(server, client);
+    
+    return client->state == WS_STATE_OPEN && client->rx_offset < client->rx_length ? 1 : 0;
+}
+
+static void ws_open_client(ws_server_t *server, ws_connection_t *client) {
+    if (client->captured) {
+        ws_capture_record(server->capture, client->id, WS_CAPTURE_OPEN, 0, false, 0, NULL);
+    }
+    client->state = WS_STATE_OPEN;
+    
+    // Call the on_connect callback
+    if (server->on_connect) {
+        server->on_connect(client);
+    }
+    
+    // Pair the connection with its backend
+    if (server->relay_target && client->state == WS_STATE_OPEN) {
+        client->info->relay = ws_relay_open(server->relay_target, client->socket >= 0, server->allocator);
+        if (!client->info->relay) {
+            if (server->on_error) {
+                server->on_error(client, "Backend unavailable");
+            }
+            ws_disconnect_client(server, client, 1011, "Backend unavailable");
+        }
+    }
+}
+
+static void ws_start_session(ws_server_t *server, ws_connection_t *client) {
+    ws_h2_session_t *session = ws_h2_session_create(client->socket, client->rx_data, client->rx_length,
+                                                    ws_h2_event, server, server->allocator);
+    if (!session) {
+        if (server->on_error) {
+            server->on_error(client, "Out of memory");
+        }
+        ws_disconnect_client(server, client, 1011, "Internal error");
+        return;
+    }
+    
+    // Connections of the streams report the peer of the session
+    snprintf(session->host, sizeof(session->host), "%s", client->info->host ? client->info->host : "");
+    session->port = client->info->port;
+    session->family = client->info->family;
+    session->next = server->sessions;
+    server->sessions = session;
+    server->num_sessions++;
+    printf("HTTP/2 connection from %s:%d\n", session->host, session->port);
+    
+    // The socket belongs to the session now; the placeholder client goes
+    // without on_close since it never opened
+    client->socket = -1;
+    client->transport.ops = NULL;
+    ws_untrack_client(server, client);
+    client->state = WS_STATE_CLOSED;
+    ws_release_client(client);
+    
+    if (ws_h2_session_read(session) != 0) {
+        ws_end_session(server, session);
+    }
+}
+
+static void ws_end_session(ws_server_t *server, ws_h2_session_t *session) {
+    // No close frame can reach the clients any more
+    ws_h2_stream_t *stream = session->streams;
+    while (stream) {
+        ws_h2_stream_t *next = stream->next;
+        ws_connection_t *client = (ws_connection_t *)stream->connection;
+        if (client) {
+            client->state = WS_STATE_CLOSING;
+            ws_disconnect_client(server, client, 1000, "Connection closed");
+        }
+        stream = next;
+    }
+    
+    ws_h2_session_t **link = &server->sessions;
+    while (*link != session) {
+        link = &(*link)->next;
+    }
+    *link = session->next;
+    server->num_sessions--;
+    ws_budget_charge(&server->memory, &session->memory, 0);
+    ws_h2_session_close(session);
+}
+
+static int ws_h2_event(void *ctx, ws_h2_stream_t *stream, ws_h2_event_t event) {
+    ws_server_t *server = (ws_server_t *)ctx;
+    ws_connection_t *client = (ws_connection_t *)stream->connection;
+    
+    switch (event) {
+    case WS_H2_OPEN:
+        // The CONNECT request was the handshake; the stream is the socket
+        client = ws_create_client(server, -1);
+        if (!client) {
+            return -1;
+        }
+        client->info->host = ws_strdup(server, stream->session->host);
+        client->info->port = stream->session->port;
+        client->info->family = stream->session->family;
+        if (ws_h2_stream_accept(stream, client) != 0) {
+            ws_release_client(client);
+            return -1;
+        }
+        ws_h2_stream_transport(stream, &client->transport);
+        ws_track_client(server, client);
+        printf("HTTP/2 stream %u opened by %s:%d\n", stream->id, client->info->host, client->info->port);
+        ws_open_client(server, client);
+        return 0;
+    case WS_H2_DATA:
+        ws_schedule_client(server, client);
+        return 0;
+    case WS_H2_RESET:
+        client->state = WS_STATE_CLOSING;
+        ws_disconnect_client(server, client, 1001, "Stream reset");
+        return 0;
+    case WS_H2_WRITABLE:
+        if (ws_flush_client(client) != 0) {
+            if (server->on_error) {
+                server->on_error(client, "Write error");
+            }
+            ws_disconnect_client(server, client, 1001, "Write error");
+        }
+        return 0;
+    }
+    
+    return 0;
+}
+
+static int ws_process_client(ws_server_t *server, ws_connection_t *client) {
+    size_t read_budget = server->config.read_budget;
+    int frame_budget = server->config.frame_budget;
+    size_t bytes = 0;
+    int frames = 0;
+    
+    if (client->state == WS_STATE_CONNECTING) {
+        return ws_process_handshake(server, client);
+    }
+    
+    // A relayed connection ends with its backend
+    if (server->relay_target && client->info->relay && client->state == WS_STATE_OPEN && (client->info->relay->error || client->info->relay->closed)) {
+        if (client->info->relay->error) {
+            if (server->on_error) {
+                server->on_error(client, "Backend error");
+            }
+            ws_disconnect_client(server, client, 1011, "Backend unavailable");
+        } else {
+            ws_disconnect_client(server, client, 1000, "Backend closed");
+        }
+        return 0;
+    }
+    
+    // The caller holds a reference, so handlers may disconnect the client
+    while (client->state == WS_STATE_OPEN) {
+        if (frame_budget > 0 && frames >= frame_budget) {
+            return 1;
+        }
+        
+        // Frames wait until the backend has taken the previous ones
+        if (server->relay_target && client->info->relay && ws_relay_blocked(client->info->relay)) {
+            return 0;
+        }
+        
+        // Handle the next complete frame already received
+        ws_frame_t frame;
+        int parsed = ws_parse_frame(client->rx_data + client->rx_offset,
+                                    client->rx_length - client->rx_offset, &frame);
+        if (parsed < 0) {
+            if (server->on_error) {
+                server->on_error(client, "Invalid frame");
+            }
+            ws_disconnect_client(server, client, 1002, "Protocol error");
+            return 0;
+        }
+        
+        if (parsed == 0) {
+            WS_PROBE4(frame, client->id, frame.opcode, frame.payload_length, frame.fin);
+            if (client->captured) {
+                ws_capture_record(server->capture, client->id, WS_CAPTURE_FRAME, frame.opcode,
+                                  frame.fin, frame.payload_length, frame.payload);
+            }
+            if (server->latency && client->info->rx_timestamp) {
+                int64_t waited = ws_latency_realtime() - client->info->rx_timestamp;
+                ws_histogram_record(&server->latency->stages[WS_LATENCY_RECEIVE],
+                                    waited > 0 ? (uint64_t)waited : 0);
+            }
+            client->rx_offset += frame.frame_length;
+            frames++;
+            ws_process_frame(server, client, &frame);
+            continue;
+        }
+        
+        // Incomplete frame: make room for it and read more
+        if (frame.frame_length > 0 && server->config.max_frame_size > 0 &&
+            frame.payload_length > (uint64_t)server->config.max_frame_size) {
+            if (server->on_error) {
+                server->on_error(client, "Frame too large");
+            }
+            ws_disconnect_client(server, client, 1009, "Message too big");
+            return 0;
+        }
+        
+        // Frames that outgrow the receive buffer must fit the memory budget
+        if (frame.frame_length > client->rx_capacity && frame.frame_length > (size_t)server->config.buffer_size &&
+            !ws_budget_admit(&server->memory, ws_input_capacity(client, frame.frame_length, server->config.buffer_size) -
+                                              client->rx_capacity)) {
+            if (server->on_error) {
+                server->on_error(client, "Memory budget exceeded");
+            }
+            ws_disconnect_client(server, client, 1013, "Try again later");
+            return 0;
+        }
+        
+        if (read_budget > 0 && bytes >= read_budget) {
+            return 1;
+        }
+        
+        // A client paused for memory only finishes the frame it is in;
+        // until its header is complete that is at most 14 bytes
+        bool over_budget = ws_client_over_budget(server, client);
+        size_t rest = 0;
+        if (over_budget) {
+            size_t pending = client->rx_length - client->rx_offset;
+            if (pending == 0) {
+                return 0;
+            }
+            rest = frame.frame_length > 0 ? frame.frame_length - pending : 14 - pending;
+        }
+        
+        if (ws_reserve_input(client, frame.frame_length, server->config.buffer_size) != 0) {
+            if (server->on_error) {
+                server->on_error(client, "Out of memory");
+            }
+            ws_disconnect_client(server, client, 1011, "Internal error");
+            return 0;
+        }
+        ws_account_client(server, client);
+        
+        size_t space = client->rx_capacity - client->rx_length;
+        if (read_budget > 0 && space > read_budget - bytes) {
+            space = read_budget - bytes;
+        }
+        if (over_budget && space > rest) {
+            space = rest;
+        }
+        
+        ssize_t bytes_read = ws_recv_input(server, client, space);
+        
+        if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            return 0;
+        }
+        
+        if (bytes_read <= 0) {
+            // Connection closed or error
+            if (bytes_read == 0) {
+                ws_disconnect_client(server, client, 1000, "Connection closed");
+            } else {
+                if (server->on_error) {
+                    server->on_error(client, "Read error");
+                }
+                ws_disconnect_client(server, client, 1001, "Read error");
+            }
+            return 0;
+        }
+        
+        client->rx_length += bytes_read;
+        bytes += bytes_read;
+    }
+    
+    return 0;
+}
+
+static ssize_t ws_recv_input(ws_server_t *server, ws_connection_t *client, size_t space) {
+    uint8_t *buffer = client->rx_data + client->rx_length;
+    
+    if (!server->latency) {
+        return ws_transport_read(&client->transport, buffer, space);
+    }
+    
+    // Only sockets have kernel timestamps; elsewhere the read is the receive time
+    if (client->socket < 0) {
+        ssize_t bytes_read = ws_transport_read(&client->transport, buffer, space);
+        if (bytes_read > 0) {
+            client->info->rx_timestamp = ws_latency_realtime();
+        }
+        return bytes_read;
+    }
+    
+    // Pick up the kernel receive timestamp along with the data
+    union {
+        char buf[CMSG_SPACE(sizeof(struct scm_timestamping))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = { buffer, space };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    
+    ssize_t bytes_read = recvmsg(client->socket, &msg, 0);
+    if (bytes_read <= 0) {
+        return bytes_read;
+    }
+    
+    int64_t stamp = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_TIMESTAMPING) {
+            struct scm_timestamping *ts = (struct scm_timestamping *)CMSG_DATA(cmsg);
+            stamp = (int64_t)ts->ts[0].tv_sec * 1000000000LL + ts->ts[0].tv_nsec;
+        }
+    }
+    client->info->rx_timestamp = stamp ? stamp : ws_latency_realtime();
+    
+    return bytes_read;
+}
+
+// Size the receive buffer grows to when it has to hold wanted bytes
+static size_t ws_input_capacity(const ws_connection_t *client, size_t wanted, size_t chunk) {
+    size_t capacity = client->rx_capacity ? client->rx_capacity : chunk > 0 ? chunk : WS_BUFFER_SIZE;
+    while (capacity < wanted) {
+        capacity *= 2;
+    }
+    return capacity;
+}
+
+static int ws_reserve_input(ws_connection_t *client, size_t needed, size_t chunk) {
+    // Drop the bytes already handled
+    size_t pending = client->rx_length - client->rx_offset;
+    if (client->rx_offset > 0) {
+        memmove(client->rx_data, client->rx_data + client->rx_offset, pending);
+        client->rx_offset = 0;
+        client->rx_length = pending;
+    }
+    
+    // Room for the whole frame, or for another chunk of input
+    if (chunk == 0) {
+        chunk = WS_BUFFER_SIZE;
+    }
+    size_t wanted = pending + chunk;
+    if (wanted < needed) {
+        wanted = needed;
+    }
+    if (wanted <= client->rx_capacity) {
+        return 0;
+    }
+    
+    // Most input fits a buffer borrowed from the server's pool
+    ws_buffer_pool_t *pool = client->server ? &client->server->rx_pool : NULL;
+    if (pool && pool->buffer_size == 0) {
+        int max_cached = client->server->config.rx_pool_size;
+        ws_buffer_pool_init(pool, chunk, max_cached > 0 ? (size_t)max_cached : 0, client->server->allocator);
+    }
+    if (!client->rx_data && pool && wanted <= pool->buffer_size) {
+        client->rx_data = ws_buffer_pool_get(pool);
+        if (!client->rx_data) {
+            return -1;
+        }
+        client->rx_capacity = pool->buffer_size;
+        return 0;
+    }
+    
+    // Bulk input grows the buffer until the connection goes idle again
+    size_t capacity = ws_input_capacity(client, wanted, chunk);
+    if (capacity > UINT32_MAX) {
+        return -1; // Offsets into the buffer are 32 bits
+    }
+    
+    const ws_allocator_t *allocator = client->server ? client->server->rx_allocator : NULL;
+    if (allocator && !client->rx_allocated) {
+        // Large input moves to memory of the application's choosing
+        uint8_t *data = ws_mem_alloc(allocator, capacity);
+        if (!data) {
+            return -1;
+        }
+        if (pending > 0) {
+            memcpy(data, client->rx_data, pending);
+        }
+        
+        ws_release_input(client);
+        client->rx_data = data;
+        client->rx_length = pending;
+        client->rx_capacity = capacity;
+        client->rx_allocated = true;
+        return 0;
+    }
+    
+    uint8_t *data = ws_mem_realloc(client->rx_allocated ? allocator : ws_server_allocator(client->server),
+                                   client->rx_data, client->rx_capacity, capacity);
+    if (!data) {
+        return -1;
+    }
+    
+    client->rx_data = data;
+    client->rx_capacity = capacity;
+    return 0;
+}
+
+static void ws_release_input(ws_connection_t *client) {
+    ws_buffer_pool_t *pool = client->server ? &client->server->rx_pool : NULL;
+    
+    // Only buffers that were never grown go back to the pool
+    if (client->rx_allocated) {
+        ws_mem_free(client->server->rx_allocator, client->rx_data, client->rx_capacity);
+    } else if (client->rx_data && pool && client->rx_capacity == pool->buffer_size) {
+        ws_buffer_pool_put(pool, client->rx_data);
+    } else {
+        ws_mem_free(ws_server_allocator(client->server), client->rx_data, client->rx_capacity);
+    }
+    
+    client->rx_data = NULL;
+    client->rx_offset = 0;
+    client->rx_length = 0;
+    client->rx_capacity = 0;
+    client->rx_allocated = false;
+}
+
+static void ws_trim_client(ws_connection_t *client) {
+    // An idle connection keeps no buffers between wakeups
+    if (client->rx_offset == client->rx_length) {
+        ws_release_input(client);
+    }
+    
+    if (client->fragment && !client->fragment->in_progress) {
+        ws_fragment_cleanup(client->fragment);
+        ws_mem_free(ws_server_allocator(client->server), client->fragment, sizeof(*client->fragment));
+        client->fragment = NULL;
+    }
+}
+
+// Charge the server's memory budget with a client's input buffers; its
+// output queue charges itself
+static void ws_account_client(ws_server_t *server, ws_connection_t *client) {
+    size_t held = client->rx_capacity;
+    if (client->fragment) {
+        held += client->fragment->buffer_size;
+    }
+    ws_budget_charge(server ? &server->memory : NULL, &client->memory, held);
+}
+
+// Payload bytes waiting in a client's output queue
+static size_t ws_client_queued(const ws_connection_t *client) {
+    return client->output ? client->output->queued_bytes : 0;
+}
+
+// Whether a client should stop reading until memory is released; one in
+// the middle of a fragmented message goes on, since finishing the message
+// is what releases its reassembly buffer and its growth is admitted
+static bool ws_client_over_budget(ws_server_t *server, ws_connection_t *client) {
+    if (client->fragment && client->fragment->in_progress) {
+        return false;
+    }
+    return ws_budget_over_share(&server->memory, client->memory + ws_client_queued(client));
+}
+
+static void ws_process_frame(ws_server_t *server, ws_connection_t *client, ws_frame_t *frame) {
+    // Handle different frame types
+    switch (frame->opcode) {
+        case WS_OPCODE_CONTINUATION:
+        case WS_OPCODE_TEXT:
+        case WS_OPCODE_BINARY:
+            if (client->info->relay) {
+                ws_relay_frame(server, client, frame);
+            } else {
+                ws_process_data_frame(server, client, frame);
+            }
+            break;
+            
+        case WS_OPCODE_CLOSE:
+            {
+                uint16_t code = 1000;
+                char reason[124] = "";
+                
+                // Extract close code and reason if available
+                if (frame->payload_length >= 2) {
+                    code = (frame->payload[0] << 8) | frame->payload[1];
+                    
+                    if (frame->payload_length > 2) {
+                        size_t reason_len = frame->payload_length - 2 < 123 ? 
+                                          frame->payload_length - 2 : 123;
+                        memcpy(reason, &frame->payload[2], reason_len);
+                        reason[reason_len] = '\0';
+                    }
+                    
+                    // The close reason must be UTF-8 as well
+                    if (!ws_utf8_valid(&frame->payload[2], frame->payload_length - 2)) {
+                        code = 1007;
+                        reason[0] = '\0';
+                    }
+                }
+                
+                ws_disconnect_client(server, client, code, reason);
+            }
+            break;
+            
+        case WS_OPCODE_PING:
+            // Respond with a pong frame
+            ws_send_pong(client, frame->payload, frame->payload_length);
+            break;
+            
+        case WS_OPCODE_PONG:
+            // Pong received, could update last activity time
+            break;
+            
+        default:
+            if (server->on_error) {
+                server->on_error(client, "Unknown opcode");
+            }
+            break;
+    }
+}
+
+static void ws_process_data_frame(ws_server_t *server, ws_connection_t *client, ws_frame_t *frame) {
+    ws_fragment_t *fragment = client->fragment;
+    
+    // Unfragmented message: deliver straight from the receive buffer
+    if (frame->fin && frame->opcode != WS_OPCODE_CONTINUATION && !(fragment && fragment->in_progress)) {
+        if (frame->opcode == WS_OPCODE_TEXT && !ws_utf8_valid(frame->payload, frame->payload_length)) {
+            if (server->on_error) {
+                server->on_error(client, "Invalid UTF-8");
+            }
+            ws_disconnect_client(server, client, 1007, "Invalid UTF-8");
+            return;
+        }
+        
+        ws_deliver_message(server, client, frame->payload, frame->payload_length,
+                           frame->opcode == WS_OPCODE_BINARY);
+        return;
+    }
+    
+    // Reassembly state only exists while a fragmented message is in flight
+    if (!fragment) {
+        fragment = ws_mem_alloc(server->allocator, sizeof(*fragment));
+        if (!fragment) {
+            if (server->on_error) {
+                server->on_error(client, "Out of memory");
+            }
+            ws_disconnect_client(server, client, 1011, "Internal error");
+            return;
+        }
+        ws_fragment_init(fragment);
+        fragment->allocator = server->rx_allocator ? server->rx_allocator : server->allocator;
+        client->fragment = fragment;
+    }
+    
+    // First fragment of a new message
+    if (!fragment->in_progress) {
+        ws_utf8_init(&fragment->utf8);
+    }
+    
+    // Reassembly that outgrows its buffer must fit the memory budget
+    size_t assembled = (fragment->in_progress ? fragment->data_length : 0) + frame->payload_length;
+    if (assembled > fragment->buffer_size &&
+        !ws_budget_admit(&server->memory, assembled - fragment->buffer_size)) {
+        ws_fragment_cleanup(fragment);
+        if (server->on_error) {
+            server->on_error(client, "Memory budget exceeded");
+        }
+        ws_disconnect_client(server, client, 1013, "Try again later");
+        return;
+    }
+    
+    int result = ws_fragment_process(fragment, frame->opcode, frame->fin,
+                                     frame->payload, frame->payload_length);
+    ws_account_client(server, client);
+    if (result < 0) {
+        ws_fragment_cleanup(fragment);
+        if (server->on_error) {
+            server->on_error(client, "Invalid fragment");
+        }
+        ws_disconnect_client(server, client, 1002, "Protocol error");
+        return;
+    }
+    
+    // Validate text as it arrives so a code point may span fragments
+    if (fragment->opcode == WS_OPCODE_TEXT &&
+        (ws_utf8_validate(&fragment->utf8, frame->payload, frame->payload_length) != 0 ||
+         (result == 1 && !ws_utf8_complete(&fragment->utf8)))) {
+        ws_fragment_cleanup(fragment);
+        if (server->on_error) {
+            server->on_error(client, "Invalid UTF-8");
+        }
+        ws_disconnect_client(server, client, 1007, "Invalid UTF-8");
+        return;
+    }
+    
+    if (result == 1) {
+        ws_deliver_message(server, client, fragment->data, fragment->data_length,
+                           fragment->opcode == WS_OPCODE_BINARY);
+    }
+}
+
+static void ws_deliver_message(ws_server_t *server, ws_connection_t *client,
+                               const uint8_t *data, size_t len, bool is_binary) {
+    WS_PROBE3(message, client->id, len, is_binary);
+    
+    if (server->dispatch) {
+        if (ws_dispatch_submit(server->dispatch, client, data, len, is_binary) == 0) {
+            client->refcount++;
+        } else if (server->on_error) {
+            server->on_error(client, "Dispatch failed");
+        }
+    } else if (server->on_message) {
+        int64_t start = server->latency ? ws_latency_now() : 0;
+        
+        // Lets on_message take the payload with ws_message_take()
+        server->delivering = client;
+        server->delivering_data = data;
+        server->delivering_length = len;
+        server->on_message(client, data, len, is_binary);
+        server->delivering = NULL;
+        server->delivering_data = NULL;
+        if (server->latency) {
+            ws_histogram_record(&server->latency->stages[WS_LATENCY_HANDLER],
+                                (uint64_t)(ws_latency_now() - start));
+        }
+    }
+}
+
+int ws_send_text(ws_connection_t *connection, const char *text, size_t len) {
+    return ws_send_priority(connection, (const uint8_t *)text, len, false, WS_PRIORITY_HIGH);
+}
+
+int ws_send_binary(ws_connection_t *connection, const uint8_t *data, size_t len) {
+    return ws_send_priority(connection, data, len, true, WS_PRIORITY_HIGH);
+}
+
+int ws_send_priority(ws_connection_t *connection, const uint8_t *data, size_t len,
+                     bool is_binary, ws_priority_t priority) {
+    size_t threshold = connection->server ? connection->server->config.zerocopy_threshold : 0;
+    int lane = priority == WS_PRIORITY_LOW ? WS_LANE_LOW : WS_LANE_HIGH;
+    
+    // Large binary payloads go out straight from the caller's buffer
+    bool zerocopy = is_binary && threshold > 0 && len >= threshold;
+    
+    return ws_send_message(connection, is_binary ? WS_OPCODE_BINARY : WS_OPCODE_TEXT,
+                           data, len, lane, zerocopy);
+}
+
+int ws_send_keyed(ws_connection_t *connection, uint64_t key, const uint8_t *data, size_t len,
+                  bool is_binary) {
+    uint8_t opcode = is_binary ? WS_OPCODE_BINARY : WS_OPCODE_TEXT;
+    ws_output_item_t *item = ws_output_item_create_keyed(opcode, data, len, key,
+                                                         ws_server_allocator(connection->server));
+    if (!item) {
+        return -1;
+    }
+    
+    size_t fragment_size = connection->server ? connection->server->config.fragment_size : 0;
+    if (fragment_size > 0 && len > fragment_size) {
+        ws_output_item_fragment(item, fragment_size);
+    }
+    
+    return ws_queue_frame(connection, item);
+}
+
+void ws_set_slow_policy(ws_connection_t *connection, ws_slow_policy_t policy, size_t high_water) {
+    connection->info->slow_policy = policy;
+    connection->info->high_water = high_water;
+}
+
+int ws_send_prepared(ws_connection_t *connection, ws_prepared_message_t *message) {
+    ws_output_item_t *item = ws_output_item_create_prepared(message, ws_server_allocator(connection->server));
+    if (!item) {
+        return -1;
+    }
+    
+    return ws_queue_frame(connection, item);
+}
+
+int ws_message_take(ws_connection_t *connection, ws_message_buffer_t *message) {
+    memset(message, 0, sizeof(*message));
+    
+    // A dispatched message is already a private copy
+    if (ws_dispatch_current()) {
+        uint8_t *data = ws_dispatch_take_payload(connection, &message->length);
+        if (!data) {
+            return -1;
+        }
+        message->data = data;
+        message->block = data;
+        message->block_size = message->length ? message->length : 1;
+        message->allocator = ws_server_allocator(connection->server);
+        return 0;
+    }
+    
+    ws_server_t *server = connection->server;
+    if (!server || server->delivering != connection || !server->delivering_data) {
+        return -1;
+    }
+    
+    const uint8_t *data = server->delivering_data;
+    ws_fragment_t *fragment = connection->fragment;
+    
+    if (fragment && fragment->data == data) {
+        // Reassembled message: the whole buffer goes
+        message->length = fragment->data_length;
+        message->allocator = fragment->allocator;
+        message->block = ws_fragment_detach(fragment, &message->block_size);
+        if (!message->block) {
+            return -1;
+        }
+    } else if (connection->rx_data && data >= connection->rx_data &&
+               data < connection->rx_data + connection->rx_capacity) {
+        // Single frame: the receive buffer goes, input after the frame
+        // moves to a new one
+        uint8_t *block = connection->rx_data;
+        size_t block_size = connection->rx_capacity;
+        bool allocated = connection->rx_allocated;
+        size_t offset = connection->rx_offset;
+        size_t length = connection->rx_length;
+        size_t pending = length - offset;
+        
+        connection->rx_data = NULL;
+        connection->rx_offset = 0;
+        connection->rx_length = 0;
+        connection->rx_capacity = 0;
+        connection->rx_allocated = false;
+        
+        if (pending > 0) {
+            if (ws_reserve_input(connection, pending, server->config.buffer_size) != 0) {
+                ws_release_input(connection);
+                connection->rx_data = block;
+                connection->rx_offset = offset;
+                connection->rx_length = length;
+                connection->rx_capacity = block_size;
+                connection->rx_allocated = allocated;
+                return -1;
+            }
+            memcpy(connection->rx_data, block + offset, pending);
+            connection->rx_length = pending;
+        }
+        
+        message->block = block;
+        message->block_size = block_size;
+        message->allocator = allocated ? server->rx_allocator : server->allocator;
+        message->length = server->delivering_length;
+    } else {
+        return -1;
+    }
+    
+    message->data = (uint8_t *)data;
+    server->delivering_data = NULL;
+    return 0;
+}
+
+void ws_message_free(ws_message_buffer_t *message) {
+    ws_mem_free(message->allocator, message->block, message->block_size);
+    memset(message, 0, sizeof(*message));
+}
+
+int ws_send_file(ws_connection_t *connection, int fd, off_t offset, size_t len, size_t fragment_size) {
+    if (fragment_size == 0) {
+        fragment_size = connection->server ? connection->server->config.fragment_size : WS_FRAGMENT_SIZE;
+    }
+    
+    ws_output_item_t *item = ws_output_item_create_file(fd, offset, len, fragment_size,
+                                                        ws_server_allocator(connection->server));
+    if (!item) {
+        return -1;
+    }
+    
+    return ws_queue_frame(connection, item) < 0 ? -1 : 0;
+}
+
+int ws_flush(ws_connection_t *connection) {
+    // Frames sent by workers are queued on the loop, which writes them
+    if (ws_dispatch_current()) {
+        return 1;
+    }
+    
+    if (!connection->transport.ops) {
+        return -1;
+    }
+    
+    connection->flush_deferred = false;
+    if (!connection->output) {
+        return 0;
+    }
+    return ws_output_write(connection->output, &connection->transport, ws_send_complete, connection);
+}
+
+int ws_close(ws_connection_t *connection, int code, const char *reason) {
+    uint8_t payload[128];
+    size_t payload_len = 2; // At least the status code
+    
+    // Set status code
+    payload[0] = (code >> 8) & 0xFF;
+    payload[1] = code & 0xFF;
+    
+    // Add reason if provided
+    if (reason) {
+        size_t reason_len = strlen(reason);
+        if (reason_len > 123) reason_len = 123; // Max allowed reason length
+        
+        memcpy(&payload[2], reason, reason_len);
+        payload_len += reason_len;
+    }
+    
+    return ws_send_frame(connection, WS_OPCODE_CLOSE, payload, payload_len);
+}
+
+static void ws_disconnect_client(ws_server_t *server, ws_connection_t *client, int code, const char *reason) {
+    WS_PROBE2(close, client->id, code);
+    if (client->captured && client->state != WS_STATE_CONNECTING) {
+        ws_capture_record(server->capture, client->id, WS_CAPTURE_CLOSE, 0, false, (uint64_t)code, NULL);
+    }
+    
+    // Send close frame if connection is still open
+    if (client->state == WS_STATE_OPEN) {
+        ws_close(client, code, reason);
+        client->state = WS_STATE_CLOSING;
+    }
+    
+    // Unsent frames are dropped and their borrowed payloads handed back;
+    // those the kernel may still be transmitting from wait for it
+    ws_output_abandon(client->output, ws_send_complete, client);
+    ws_relay_close(client->info->relay);
+    client->info->relay = NULL;
+    
+    // Call the on_close callback
+    if (server->on_close) {
         server->on_close(client, code, reason);
     }
     
     // Remove from connection list and free resources
-    ws_connection_remove(&server->clients, client);
+    ws_untrack_client(server, client);
+    client->state = WS_STATE_CLOSED;
+    
+    // Closing the socket would not release zero-copy payloads, only the
+    // means to learn when they are; the loop's reference moves along
+    if (client->socket >= 0 && ws_output_zerocopy_pending(client->output)) {
+        client->info->linger_deadline = server->config.linger_timeout > 0 ?
+                                  ws_now_ms() + server->config.linger_timeout : 0;
+        client->next = server->lingering;
+        server->lingering = client;
+        return;
+    }
+    
+    ws_finish_client(client, false);
+}
+
+static void ws_finish_client(ws_connection_t *client, bool reset) {
+    // A reset purges the send queue, so the kernel lets go of the payloads
+    if (reset && client->socket >= 0) {
+        struct linger linger = { 1, 0 };
+        setsockopt(client->socket, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+    }
+    
+    ws_transport_close(&client->transport);
+    client->socket = -1;
+    ws_output_cleanup(client->output, ws_send_complete, client);
+    ws_release_client(client);
+}
+
+static int ws_linger_poll(ws_server_t *server, struct pollfd *fds, int *timeout_ms) {
+    int nfds = 0;
+    int64_t now = 0;
+    
+    // Only POLLERR is of interest, and it is always reported
+    for (ws_connection_t *client = server->lingering; client; client = client->next) {
+        fds[nfds].fd = client->socket;
+        fds[nfds].events = 0;
+        nfds++;
+        
+        if (client->info->linger_deadline > 0) {
+            if (now == 0) {
+                now = ws_now_ms();
+            }
+            int64_t remaining = client->info->linger_deadline - now;
+            if (remaining < 0) {
+                remaining = 0;
+            }
+            if (*timeout_ms < 0 || remaining < *timeout_ms) {
+                *timeout_ms = (int)remaining;
+            }
+        }
+    }
+    
+    return nfds;
+}
+
+static void ws_linger_ready(ws_server_t *server, const struct pollfd *fds) {
+    ws_connection_t **link = &server->lingering;
+    int64_t now = 0;
+    
+    // Entries were added in list order, and nothing joined the list since
+    while (*link) {
+        ws_connection_t *client = *link;
+        bool reset = false;
+        
+        if ((fds->revents & POLLERR) &&
+            ws_output_reap(client->output, client->socket, ws_send_complete, client) < 0) {
+            reset = true;
+        } else if (ws_output_zerocopy_pending(client->output) && client->info->linger_deadline > 0) {
+            if (now == 0) {
+                now = ws_now_ms();
+            }
+            reset = now >= client->info->linger_deadline;
+        }
+        fds++;
+        
+        if (reset || !ws_output_zerocopy_pending(client->output)) {
+            *link = client->next;
+            ws_finish_client(client, reset);
+        } else {
+            link = &client->next;
+        }
+    }
+}
+
+static void ws_release_client(ws_connection_t *client) {
+    // Dispatched messages keep the connection alive until they complete
+    if (--client->refcount > 0) {
+        return;
+    }
+    
+    ws_dispatch_release_connection(client);
+    if (client->fragment) {
+        ws_fragment_cleanup(client->fragment);
+        ws_mem_free(ws_server_allocator(client->server), client->fragment, sizeof(*client->fragment));
+    }
+    ws_release_input(client);
+    ws_budget_charge(client->server ? &client->server->memory : NULL, &client->memory, 0);
+    ws_mem_free(ws_server_allocator(client->server), client->output, sizeof(*client->output));
+    ws_strfree(client->server, client->info->host);
+    ws_mem_free(ws_server_allocator(client->server), client->info, sizeof(*client->info));
+    ws_mem_free(ws_server_allocator(client->server), client, sizeof(*client));
+}
+
+static void ws_process_replies(ws_server_t *server) {
+    ws_dispatch_reply_t *reply = ws_dispatch_take_replies(server->dispatch);
+    
+    while (reply) {
+        ws_dispatch_reply_t *next = reply->next;
+        ws_connection_t *client = reply->connection;
+        
+        if (!reply->item) {
+            // Completion marker for a dispatched message
+            ws_release_client(client);
+        } else if (client->state == WS_STATE_OPEN) {
+            if (ws_queue_frame(client, reply->item) < 0 && server->on_error) {
+                server->on_error(client, "Write error");
+            }
+        } else {
+            ws_output_item_free(reply->item);
+        }
+        
+        ws_dispatch_free_reply(server->dispatch, reply);
+        reply = next;
+    }
+}
+
+static int ws_flush_client(ws_connection_t *client) {
+    client->flush_deferred = false;
+    
+    if (ws_output_zerocopy_pending(client->output) &&
+        ws_output_reap(client->output, client->socket, ws_send_complete, client) < 0) {
+        return -1;
+    }
+    
+    if (ws_output_pending(client->output) &&
+        ws_output_write(client->output, &client->transport, ws_send_complete, client) < 0) {
+        return -1;
+    }
+    
+    return 0;
+}
+
+static void ws_relay_poll(ws_connection_t *client, struct pollfd *fd) {
+    ws_relay_t *relay = client->info->relay;
+    
+    // Writable once connected, or once buffered client bytes fit
+    fd->fd = relay->backend;
+    fd->events = ws_relay_blocked(relay) ? POLLOUT : 0;
+    
+    // The next backend read waits until the client has taken the last frame,
+    // which also leaves the pipe empty
+    if (!relay->connecting && !relay->closed && !ws_output_pending(client->output)) {
+        fd->events |= POLLIN;
+    }
+    
+    if (fd->events == 0 || relay->error) {
+        fd->fd = -1;
+    }
+}
+
+static void ws_relay_ready(ws_server_t *server, ws_connection_t *client, short revents) {
+    ws_relay_t *relay = client->info->relay;
+    
+    // Connected, or the backend took the buffered bytes: frames may continue
+    if (ws_relay_blocked(relay) && (revents & (POLLOUT | POLLERR | POLLHUP))) {
+        if (ws_relay_flush(relay) <= 0) {
+            ws_schedule_client(server, client);
+        }
+    }
+    
+    // Backend bytes go out as one binary frame
+    if ((revents & (POLLIN | POLLERR | POLLHUP)) && !ws_output_pending(client->output)) {
+        ws_output_item_t *item = ws_relay_receive(relay);
+        if (item) {
+            // A write error shows up on the client socket
+            ws_queue_frame(client, item);
+        } else if (relay->closed || relay->error) {
+            // Torn down from the run queue, where the client is referenced
+            ws_schedule_client(server, client);
+        }
+    }
+}
+
+static void ws_relay_frame(ws_server_t *server, ws_connection_t *client, ws_frame_t *frame) {
+    ws_relay_t *relay = client->info->relay;
+    
+    // The backend gets a byte stream, so only binary messages make sense
+    if (frame->opcode == WS_OPCODE_TEXT) {
+        if (server->on_error) {
+            server->on_error(client, "Text message in relay mode");
+        }
+        ws_disconnect_client(server, client, 1003, "Binary messages only");
+        return;
+    }
+    
+    if ((frame->opcode == WS_OPCODE_CONTINUATION) != relay->in_message) {
+        if (server->on_error) {
+            server->on_error(client, "Unexpected continuation frame");
+        }
+        ws_disconnect_client(server, client, 1002, "Protocol error");
+        return;
+    }
+    relay->in_message = !frame->fin;
+    
+    // Fragments are forwarded as they come, without reassembly
+    if (ws_relay_forward(relay, frame->payload, frame->payload_length) != 0) {
+        if (server->on_error) {
+            server->on_error(client, "Backend error");
+        }
+        ws_disconnect_client(server, client, 1011, "Backend unavailable");
+    }
+}
+
+static void ws_deliver_ingest(void *ctx, ws_ingest_target_t kind, uint64_t target,
+                              const uint8_t *data, size_t len, bool is_binary) {
+    ws_server_t *server = (ws_server_t *)ctx;
+    uint8_t opcode = is_binary ? WS_OPCODE_BINARY : WS_OPCODE_TEXT;
+    
+    if (kind == WS_INGEST_CONNECTION) {
+        // The payload lives in the ring, so it is copied even when large
+        ws_connection_t *client = ws_find_client(server, target);
+        if (client && client->state == WS_STATE_OPEN) {
+            ws_send_message(client, opcode, data, len, WS_LANE_HIGH, false);
+        }
+        return;
+    }
+    
+    if ((kind == WS_INGEST_TOPIC && target >= WS_INGEST_TOPICS) ||
+        (kind != WS_INGEST_TOPIC && kind != WS_INGEST_BROADCAST)) {
+        return; // Only known kinds fan out
+    }
+    uint64_t mask = kind == WS_INGEST_TOPIC ? (uint64_t)1 << target : 0;
+    
+    // Frame the message once, and only if someone receives it
+    ws_prepared_message_t *message = NULL;
+    for (ws_connection_t *client = server->clients; client; client = client->next) {
+        if (client->state != WS_STATE_OPEN || (mask && !(client->info->topics & mask))) {
+            continue;
+        }
+        if (!message) {
+            message = ws_prepared_message_create_with_allocator(opcode, data, len,
+                                                                ws_server_allocator(server));
+            if (!message) {
+                return;
+            }
+        }
+        ws_send_prepared(client, message);
+    }
     
-    close(client->socket);
-    if (client->host) free(client->host);
-    free(client);
+    if (message) {
+        ws_prepared_message_release(message);
+    }
 }
 
 void ws_server_cleanup(ws_server_t *server) {
@@ -324,10 +2481,171 @@ void ws_server_cleanup(ws_server_t *server) {
         ws_disconnect_client(server, client, 1001, "Server shutting down");
         client = next;
     }
+    ws_mem_free(server->allocator, server->by_id, server->id_buckets * sizeof(*server->by_id));
+    server->by_id = NULL;
+    server->id_buckets = 0;
+    
+    // Nothing will wait for the kernel to release zero-copy payloads any
+    // more, so their sockets are reset
+    while (server->lingering) {
+        client = server->lingering;
+        server->lingering = client->next;
+        ws_finish_client(client, true);
+    }
+    
+    // Drop the run queue's references to the closed clients
+    while (server->run_head) {
+        client = server->run_head;
+        server->run_head = client->run_next;
+        client->queued = false;
+        ws_release_client(client);
+    }
+    server->run_tail = NULL;
+    
+    // Let workers finish, then drop the references their messages held
+    if (server->dispatch) {
+        ws_dispatch_stop(server->dispatch);
+        ws_process_replies(server);
+        ws_dispatch_destroy(server->dispatch);
+        server->dispatch = NULL;
+    }
+    
+    // Drop events nobody will poll for, and the connections they kept
+    if (server->events) {
+        ws_event_queue_reset(server->events, ws_release_client);
+        ws_event_queue_destroy(server->events);
+        ws_mem_free(server->allocator, server->events, sizeof(*server->events));
+        server->events = NULL;
+    }
+    
+    // Close hot-restart control socket
+    if (server->handoff_socket >= 0) {
+        close(server->handoff_socket);
+        server->handoff_socket = -1;
+        if (server->handoff_path[0] != '@') {
+            unlink(server->handoff_path);
+        }
+    }
+    ws_strfree(server, server->handoff_path);
+    server->handoff_path = NULL;
+    
+    // Every client has returned its receive buffer by now
+    ws_buffer_pool_destroy(&server->rx_pool);
+    ws_mem_free(server->allocator, server->latency, sizeof(*server->latency));
+    server->latency = NULL;
+    ws_capture_close(server->capture);
+    server->capture = NULL;
+    ws_mem_free(server->allocator, server->relay_target, sizeof(*server->relay_target));
+    server->relay_target = NULL;
+    ws_ingest_close(server->ingest);
+    server->ingest = NULL;
+    
+    // Their clients are gone, so only the connections are left
+    while (server->sessions) {
+        ws_h2_session_t *session = server->sessions;
+        server->sessions = session->next;
+        ws_budget_charge(&server->memory, &session->memory, 0);
+        ws_h2_session_close(session);
+    }
+    server->num_sessions = 0;
+    
+    // Close listening sockets
+    for (int i = 0; i < server->num_listeners; i++) {
+        ws_listener_t *listener = &server->listeners[i];
+        close(listener->socket);
+        
+        // Filesystem Unix sockets outlive the process unless removed
+        if (listener->path) {
+            if (listener->path[0] != '@') {
+                unlink(listener->path);
+            }
+            ws_strfree(server, listener->path);
+            listener->path = NULL;
+        }
+    }
+    server->num_listeners = 0;
+    server->socket = -1;
+    
+    ws_mem_free(server->allocator, server->poll_clients, server->poll_capacity * WS_POLL_ENTRY_SIZE);
+    server->poll_fds = NULL;
+    server->poll_clients = NULL;
+    server->poll_capacity = 0;
+}
+
+static size_t ws_id_bucket(const ws_server_t *server, uint64_t id) {
+    // Fibonacci hashing spreads sequential ids over the buckets
+    return (size_t)((id * 0x9E3779B97F4A7C15ULL) >> 32) & (server->id_buckets - 1);
+}
+
+static int ws_reserve_ids(ws_server_t *server) {
+    if (server->id_count < server->id_buckets) {
+        return 0;
+    }
+    
+    size_t buckets = server->id_buckets ? server->id_buckets * 2 : 16;
+    ws_connection_t **by_id = (ws_connection_t **)ws_mem_alloc(server->allocator, buckets * sizeof(*by_id));
+    if (!by_id) {
+        // Longer chains still find every client
+        return server->by_id ? 0 : -1;
+    }
+    memset(by_id, 0, buckets * sizeof(*by_id));
+    
+    ws_connection_t **old_by_id = server->by_id;
+    size_t old_buckets = server->id_buckets;
+    server->by_id = by_id;
+    server->id_buckets = buckets;
+    
+    for (size_t i = 0; i < old_buckets; i++) {
+        ws_connection_t *client = old_by_id[i];
+        while (client) {
+            ws_connection_t *next = client->id_next;
+            size_t bucket = ws_id_bucket(server, client->id);
+            client->id_next = by_id[bucket];
+            by_id[bucket] = client;
+            client = next;
+        }
+    }
+    ws_mem_free(server->allocator, old_by_id, old_buckets * sizeof(*old_by_id));
+    
+    return 0;
+}
+
+static void ws_track_client(ws_server_t *server, ws_connection_t *client) {
+    ws_connection_add(&server->clients, client);
+    
+    // ws_create_client() reserved the buckets
+    size_t bucket = ws_id_bucket(server, client->id);
+    client->id_next = server->by_id[bucket];
+    server->by_id[bucket] = client;
+    server->id_count++;
+}
+
+static void ws_untrack_client(ws_server_t *server, ws_connection_t *client) {
+    ws_connection_remove(&server->clients, client);
+    if (!server->by_id) {
+        return;
+    }
+    
+    ws_connection_t **link = &server->by_id[ws_id_bucket(server, client->id)];
+    while (*link) {
+        if (*link == client) {
+            *link = client->id_next;
+            client->id_next = NULL;
+            server->id_count--;
+            return;
+        }
+        link = &(*link)->id_next;
+    }
+}
+
+static ws_connection_t *ws_find_client(const ws_server_t *server, uint64_t id) {
+    if (!server->by_id) {
+        return NULL;
+    }
     
-    // Close server socket
-    if (server->socket >= 0) {
-        close(server->socket);
-        server->socket = -1;
+    ws_connection_t *client = server->by_id[ws_id_bucket(server, id)];
+    while (client && client->id != id) {
+        client = client->id_next;
     }
+    return client;
 }
@@ -4,6 +4,25 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <sys/types.h>
+
+#include "utils/capture.h"
+#include "utils/config.h"
+#include "utils/alloc.h"
+#include "utils/budget.h"
+#include "utils/events.h"
+#include "utils/fragmentation.h"
+#include "utils/output.h"
+#include "utils/prepared.h"
+#include "utils/relay.h"
+#include "utils/ingest.h"
+#include "utils/h2.h"
+#include "utils/transport.h"
+#include "utils/pool.h"
+#include "utils/utf8.h"
+
+struct ws_server;
+struct pollfd;
 
 /**
  * WebSocket connection states
@@ -15,41 +34,409 @@ typedef enum {
     WS_STATE_CLOSED
 } ws_state_t;
 
+/**
+ * Priority of an outbound message
+ *
+ * Control frames always go first. High-priority messages are written
+ * before low-priority ones at the next message boundary; fragments of
+ * one message are never interleaved with another message.
+ */
+typedef enum {
+    WS_PRIORITY_HIGH,
+    WS_PRIORITY_LOW
+} ws_priority_t;
+
+/**
+ * What happens once a client's queued output crosses its high-water mark
+ */
+typedef enum {
+    WS_SLOW_NONE = 0,           // Keep queueing
+    WS_SLOW_DISCONNECT,         // Close the connection with 1008 at the end of the step
+    WS_SLOW_DROP_OLDEST,        // Drop the oldest queued data messages, bulk ones first
+    WS_SLOW_CONFLATE            // Replace queued messages sent with ws_send_keyed() by newer ones
+} ws_slow_policy_t;
+
+/**
+ * Connection state kept out of line
+ *
+ * Peer details and what only the handshake, sends, hand-off, relaying or
+ * worker dispatch look at. Allocated with the connection.
+ */
+typedef struct ws_connection_info {
+    char *host;                 // Client host, or the listener path for Unix sockets
+    int port;                   // Client port, 0 for Unix sockets
+    int family;                 // Peer address family: AF_INET, AF_INET6 or AF_UNIX
+    void *user_data;            // User data associated with this connection
+    struct ws_mailbox *mailbox; // Pending dispatched messages (worker-pool mode only)
+    ws_relay_t *relay;          // Backend connection in relay mode, or NULL
+    uint64_t topics;            // Ingest topics subscribed to, one bit each
+    size_t high_water;          // Queued output bytes before slow_policy applies, 0 for no limit
+    ws_slow_policy_t slow_policy; // What to do once high_water is crossed
+    int64_t handshake_deadline; // Monotonic time in ms by which the handshake must finish, 0 for none
+    int64_t linger_deadline;    // Once closed: monotonic time in ms at which a socket still pinning zero-copy payloads is reset
+    int64_t rx_timestamp;       // Receive time of the latest input in CLOCK_REALTIME ns, 0 if not traced
+} ws_connection_info_t;
+
 /**
  * WebSocket connection structure
+ *
+ * The first 64 bytes hold what every step reads, up to the transport
+ * operations (one cache line when the allocator aligns connections to
+ * 64 bytes; malloc only guarantees 16), the next 64 what traffic
+ * touches. Everything else is in info, allocated with the connection,
+ * and the output queue is allocated by the first send. Idle
+ * connections hold no buffers: the receive buffer is borrowed from the
+ * server's pool and the reassembly state is allocated only while
+ * fragmented input is in flight. WS_CONNECTION_SIZE bounds the struct.
  */
 typedef struct ws_connection {
-    int socket;                 // Client socket
-    ws_state_t state;           // Connection state
-    char *host;                 // Client host
-    int port;                   // Client port
-    void *user_data;            // User data associated with this connection
+    int socket;                 // Client socket, -1 on other transports
+    int refcount;               // References held by the loop and dispatched messages
+    uint32_t rx_offset;         // Start of the unhandled bytes
+    uint32_t rx_length;         // End of the received bytes
+    uint32_t rx_capacity;       // Allocated size of rx_data
+    uint8_t state;              // Connection state, a ws_state_t
+    bool queued : 1;            // In the server's run queue
+    bool flush_deferred : 1;    // Output queued by a coalesced send, written at the end of the step
+    bool captured : 1;          // Inbound traffic is written to the server's capture file
+    bool rx_allocated : 1;      // rx_data came from the server's rx_allocator
+    bool overflowed : 1;        // Crossed high_water under WS_SLOW_DISCONNECT, closed at the end of the step
+    uint8_t *rx_data;           // Received bytes not yet handled as frames, NULL when idle
+    struct ws_connection *run_next; // Next connection in the run queue
     struct ws_connection *next; // Next connection in list
+    struct ws_server *server;   // Server owning this connection
+    ws_transport_t transport;   // Carries the bytes: the socket, an HTTP/2 stream or memory
+    ws_output_t *output;        // Frames not yet written to the socket, NULL before the first send
+    ws_fragment_t *fragment;    // Reassembly of fragmented messages, or NULL
+    size_t memory;              // Receive and reassembly bytes charged to the server's memory budget
+    uint64_t id;                // Unique within the server, used by tracepoints and ingest targets
+    struct ws_connection *id_next; // Next connection in the same bucket of the server's id index
+    ws_connection_info_t *info; // Peer details and rarely used state
 } ws_connection_t;
 
+#define WS_CONNECTION_SIZE 128  // Largest sizeof(ws_connection_t), checked when the library is built
+
+#define WS_MAX_LISTENERS 8
+
 /**
- * WebSocket server structure
+ * Listening socket owned by a server
+ */
+typedef struct {
+    int socket;                 // Listening socket
+    int family;                 // AF_INET, AF_INET6 or AF_UNIX
+    char *path;                 // Unix socket path ('@' for abstract), or NULL
+} ws_listener_t;
+
+/**
+ * Counters of the busy-poll loop
+ */
+typedef struct {
+    uint64_t spins;             // Non-blocking polls made while spinning
+    uint64_t hits;              // Spins that ended because a socket was ready
+    uint64_t blocks;            // Spins that ran out and fell back to a blocking poll
+    uint64_t useful_ns;         // Time spent spinning in spins that found work
+    uint64_t wasted_ns;         // Time spent spinning in spins that ran out
+} ws_busy_poll_stats_t;
+
+/**
+ * Message payload owned by the application
+ *
+ * Obtained with ws_message_take() and released with ws_message_free().
  */
 typedef struct {
-    int socket;                 // Server socket
+    uint8_t *data;              // Payload
+    size_t length;              // Payload length
+    void *block;                // Allocation holding the payload
+    size_t block_size;          // Size of block
+    const ws_allocator_t *allocator; // Allocator of block, NULL for malloc
+} ws_message_buffer_t;
+
+/**
+ * WebSocket server structure
+ */
+typedef struct ws_server {
+    int socket;                 // First listening socket
+    ws_listener_t listeners[WS_MAX_LISTENERS]; // Sockets accepting connections
+    int num_listeners;          // Number of listeners in use
+    ws_config_t config;         // Tunables, defaults set by ws_server_init
     ws_connection_t *clients;   // Linked list of clients
+    ws_connection_t **by_id;    // Id index of clients, chained by bucket
+    size_t id_buckets;          // Number of buckets, a power of two, 0 before the first client
+    size_t id_count;            // Clients in the id index
+    ws_connection_t *lingering; // Closed clients whose sockets wait for zero-copy completions
+    struct ws_dispatch *dispatch; // Worker pool for on_message, or NULL
+    struct pollfd *poll_fds;    // Poll set, grown with the number of clients
+    ws_connection_t **poll_clients; // Client of each poll set entry, in one block with poll_fds
+    size_t poll_capacity;       // Allocated entries of poll_fds and poll_clients
+    ws_buffer_pool_t rx_pool;   // Receive buffers lent to clients with input in flight
+    ws_connection_t *run_head;  // Clients waiting for their turn to read
+    ws_connection_t *run_tail;
+    int handoff_socket;         // Hot-restart control socket, or -1
+    char *handoff_path;         // Path of the control socket
+    bool handed_off;            // Listeners went to a new process; only draining is left
+    ws_event_queue_t *events;   // Events for ws_server_poll_events(), or NULL in callback mode
+    uint64_t last_connection_id; // Id of the most recently created connection
+    ws_latency_t *latency;      // Per-stage latency histograms, or NULL when not traced
+    ws_capture_t *capture;      // Traffic capture file, or NULL
+    ws_busy_poll_stats_t busy_poll_stats; // Spin counters, see ws_server_enable_busy_poll()
+    ws_relay_target_t *relay_target; // Backend of relay mode, or NULL
+    ws_ingest_t *ingest;        // Shared-memory ring fed by publisher processes, or NULL
+    ws_h2_session_t *sessions;  // HTTP/2 connections whose streams carry clients
+    int num_sessions;           // Number of sessions
+    ws_memory_budget_t memory;  // Bytes buffered by all clients, limited by config.memory_limit
+    const ws_allocator_t *allocator; // Every other allocation of the library, NULL for malloc
+    const ws_allocator_t *rx_allocator; // Receive buffers beyond config.buffer_size and reassembly, NULL for allocator
+    ws_connection_t *delivering; // Connection whose on_message runs on the loop thread
+    const uint8_t *delivering_data; // Payload passed to that on_message, until taken
+    size_t delivering_length;
     
     // Callbacks
     void (*on_connect)(ws_connection_t *connection);
     void (*on_message)(ws_connection_t *connection, const uint8_t *data, size_t len, bool is_binary);
     void (*on_close)(ws_connection_t *connection, int code, const char *reason);
     void (*on_error)(ws_connection_t *connection, const char *error);
+    void (*on_send_complete)(ws_connection_t *connection, const uint8_t *data, size_t len);
 } ws_server_t;
 
 /**
  * Initialize the WebSocket server
  * 
+ * Listens on port on every IPv6 and IPv4 address. More listeners can be
+ * added with ws_server_listen_tcp() and ws_server_listen_unix().
+ * 
  * @param server Pointer to server structure
  * @param port Port to listen on
  * @return 0 on success, -1 on failure
  */
 int ws_server_init(ws_server_t *server, int port);
 
+/**
+ * Initialize a WebSocket server without any listener
+ * 
+ * Set server->allocator right after this call, before listening, to have
+ * connections, buffers, output items and worker jobs allocated from it;
+ * it must stay valid until ws_server_cleanup() returns and be thread-safe
+ * if dispatch workers are used. A ws_size_class_pool_t provides one.
+ * 
+ * @param server Pointer to server structure
+ */
+void ws_server_create(ws_server_t *server);
+
+/**
+ * Accept TCP connections on an address
+ * 
+ * An IPv4 or IPv6 literal listens on that address only. NULL listens on
+ * every address, dual-stack where IPv6 is available.
+ * 
+ * @param server Pointer to server structure
+ * @param address Address to bind, or NULL for any
+ * @param port Port to listen on
+ * @return 0 on success, -1 on failure
+ */
+int ws_server_listen_tcp(ws_server_t *server, const char *address, int port);
+
+/**
+ * Accept connections on a Unix domain socket
+ * 
+ * A path starting with '@' names a socket in the abstract namespace.
+ * A filesystem socket replaces a stale one at the same path and is
+ * removed by ws_server_cleanup().
+ * 
+ * @param server Pointer to server structure
+ * @param path Socket path
+ * @return 0 on success, -1 on failure
+ */
+int ws_server_listen_unix(ws_server_t *server, const char *path);
+
+/**
+ * Deliver on_message callbacks on a pool of worker threads
+ *
+ * Messages of one connection are still delivered in order and never
+ * concurrently. Frames sent from inside a dispatched on_message are handed
+ * back to the event loop, which writes them to the socket. The connection
+ * pointer stays valid until all of its dispatched messages have been
+ * handled, even if on_close has already been called for it.
+ *
+ * Must be called after on_message has been set.
+ *
+ * @param server Pointer to server structure
+ * @param num_workers Number of worker threads
+ * @return 0 on success, -1 on failure
+ */
+int ws_server_enable_dispatch(ws_server_t *server, int num_workers);
+
+/**
+ * Trade CPU for the lowest wake-up latency
+ * 
+ * Each step first polls without blocking for up to spin_us microseconds,
+ * and only then blocks for the rest of its timeout. Sockets get
+ * SO_BUSY_POLL and SO_PREFER_BUSY_POLL so the kernel polls the device
+ * queue instead of waiting for an interrupt; raising SO_BUSY_POLL above
+ * net.core.busy_read needs CAP_NET_ADMIN and is skipped otherwise. With
+ * cpu >= 0 the calling thread, which must be the one running the loop,
+ * is pinned to that CPU. busy_poll_stats tells how much of the spinning
+ * found work.
+ * 
+ * @param server Pointer to server structure
+ * @param spin_us Time to spin per step in microseconds, 0 to turn off
+ * @param cpu CPU to pin the loop thread to, or -1
+ * @return 0 on success, -1 if the thread could not be pinned
+ */
+int ws_server_enable_busy_poll(ws_server_t *server, int spin_us, int cpu);
+
+/**
+ * Record per-message latencies in histograms
+ * 
+ * Each message is timed through the stages of ws_latency_stage_t. With
+ * kernel_timestamps, client sockets request SO_TIMESTAMPING so the receive
+ * stage starts when the kernel received the data; otherwise, or if the
+ * kernel refuses, it starts when the data was read. A read may complete
+ * several frames, which then share its timestamp. Applies to connections
+ * accepted after the call.
+ * 
+ * @param server Pointer to server structure
+ * @param kernel_timestamps Whether to use kernel receive timestamps
+ * @return 0 on success, -1 on failure
+ */
+int ws_server_enable_latency(ws_server_t *server, bool kernel_timestamps);
+
+/**
+ * Latency histogram of one stage
+ * 
+ * @param server Pointer to server structure
+ * @param stage Stage to query
+ * @return Histogram in nanoseconds, or NULL if tracing is not enabled
+ */
+const ws_histogram_t *ws_server_latency(const ws_server_t *server, ws_latency_stage_t stage);
+
+/**
+ * Empty all latency histograms, e.g. at the start of a reporting interval
+ * 
+ * Values recorded by dispatch workers while this runs may be lost.
+ * 
+ * @param server Pointer to server structure
+ */
+void ws_server_latency_reset(ws_server_t *server);
+
+/**
+ * Relay every connection to a TCP backend
+ * 
+ * After the handshake each connection is paired with a new connection to
+ * host:port. Binary messages from the client are written to the backend
+ * as their frames arrive, and whatever the backend sends comes back as
+ * binary frames, spliced from the backend socket into the client socket
+ * through a pipe. on_message is not called; text messages close the
+ * connection with 1003. Either side closing closes the other.
+ * 
+ * @param server Pointer to server structure
+ * @param host Host name or address of the backend
+ * @param port TCP port of the backend
+ * @return 0 on success, -1 if the backend cannot be resolved
+ */
+int ws_server_enable_relay(ws_server_t *server, const char *host, int port);
+
+/**
+ * Accept messages from publisher processes through shared memory
+ * 
+ * Creates a ring in a memfd and a control socket at path. Publishers
+ * attach with ws_ingest_attach(path) and write messages addressed to a
+ * connection id, a topic or every connection with ws_ingest_publish();
+ * the event loop takes them from the ring and sends them, encoding a
+ * message for a topic or a broadcast only once. Publishers never touch
+ * the network stack.
+ * 
+ * @param server Pointer to server structure
+ * @param path Unix socket path publishers connect to, '@' for the abstract namespace
+ * @param size Bytes of message space, 0 for WS_INGEST_DEFAULT_SIZE
+ * @return 0 on success, -1 on failure
+ */
+int ws_server_enable_ingest(ws_server_t *server, const char *path, size_t size);
+
+/**
+ * Add a connection carried by a transport instead of an accepted socket
+ * 
+ * The connection starts like an accepted one: the opening handshake is
+ * read from the transport, then on_connect is called. A memory transport
+ * makes it possible to run clients in the same process without system
+ * calls, e.g. to measure the library apart from the kernel. Connections
+ * without a descriptor are checked on every step, so drive the server
+ * with ws_server_step(server, 0).
+ * 
+ * @param server Server
+ * @param transport Transport, owned by the connection from now on
+ * @param name Reported as the connection's host
+ * @return Connection, or NULL on allocation failure (the transport is closed)
+ */
+ws_connection_t *ws_server_attach(ws_server_t *server, const ws_transport_t *transport, const char *name);
+
+/**
+ * Subscribe a connection to an ingest topic
+ * 
+ * @param connection Client connection
+ * @param topic Topic number below WS_INGEST_TOPICS
+ * @return 0 on success, -1 if the topic is out of range
+ */
+int ws_subscribe(ws_connection_t *connection, int topic);
+
+/**
+ * Unsubscribe a connection from an ingest topic
+ * 
+ * @param connection Client connection
+ * @param topic Topic number below WS_INGEST_TOPICS
+ * @return 0 on success, -1 if the topic is out of range
+ */
+int ws_unsubscribe(ws_connection_t *connection, int topic);
+
+/**
+ * Record inbound traffic to a file for replay
+ * 
+ * For a sample of connections, the time, opcode, FIN bit and size of every
+ * frame received are written, with the payload if it is no longer than
+ * max_payload. Sampling picks whole connections so their order and timing
+ * can be replayed with websocket-replay. Applies to connections accepted
+ * after the call; the file is closed by ws_server_cleanup().
+ * 
+ * @param server Pointer to server structure
+ * @param path File to write
+ * @param sample_rate Capture one in this many connections, 1 for all
+ * @param max_payload Largest payload stored, 0 to store sizes only
+ * @return 0 on success, -1 on failure
+ */
+int ws_server_enable_capture(ws_server_t *server, const char *path, uint32_t sample_rate,
+                             size_t max_payload);
+
+/**
+ * Let a new process take over this server's sockets
+ * 
+ * Creates a control socket at path. When a process calls
+ * ws_server_takeover() on it, the listeners are passed over and this
+ * server stops accepting. Every connection that is between messages, with
+ * nothing left to write and no dispatched message in flight, moves to the
+ * new process along with any input not yet handled; on_close is called
+ * for it with code 1001 and reason "Handed off", and no close frame is
+ * sent. The remaining connections stay here and are served until they
+ * close; handed_off is set once the handover is done.
+ * 
+ * @param server Pointer to server structure
+ * @param path Unix socket path, '@' for the abstract namespace
+ * @return 0 on success, -1 on failure
+ */
+int ws_server_enable_handoff(ws_server_t *server, const char *path);
+
+/**
+ * Take over the sockets of a running server
+ * 
+ * Receives the listeners and idle connections of the process whose
+ * control socket is at path. Callbacks must be set first: on_connect is
+ * called for every connection taken over. If this fails part way, the
+ * sockets already received are kept.
+ * 
+ * @param server Server created with ws_server_create()
+ * @param path Control socket path of the running server
+ * @return 0 on success, -1 if no server answered or the transfer failed
+ */
+int ws_server_takeover(ws_server_t *server, const char *path);
+
 /**
  * Run the WebSocket server (blocking)
  * 
@@ -61,12 +448,68 @@ int ws_server_run(ws_server_t *server);
 /**
  * Run the WebSocket server single step (non-blocking)
  * 
+ * Readable clients take turns in a round-robin run queue. Each turn reads
+ * at most config.read_budget bytes and handles at most config.frame_budget
+ * frames; a client with input left over goes to the back of the queue and
+ * continues in the next step. Once config.step_budget has been spent, the
+ * remaining clients also wait for the next step, which then does not block.
+ * 
  * @param server Pointer to server structure
  * @param timeout_ms Maximum time to wait in milliseconds, 0 for no waiting
  * @return 0 on success, -1 on failure
  */
 int ws_server_step(ws_server_t *server, int timeout_ms);
 
+/**
+ * Run the server and return what happened as an array of events
+ * 
+ * An alternative to the callbacks for embedding the server in an existing
+ * loop. The first call replaces on_connect, on_message, on_close and
+ * on_error; on_send_complete is still called. Each call either returns
+ * events left over from the previous one or runs ws_server_step() and
+ * returns the events it produced, in order.
+ * 
+ * Payloads and reasons are copies that stay valid, like the connections
+ * the events refer to, until the next call. Connections may be sent to
+ * and closed while handling the events. Cannot be combined with
+ * ws_server_enable_dispatch().
+ * 
+ * @param server Pointer to server structure
+ * @param events Array receiving the events
+ * @param max Size of events
+ * @param timeout_ms Maximum time to wait in milliseconds, 0 for no waiting
+ * @return Number of events stored in events, 0 if nothing happened, -1 on failure
+ */
+int ws_server_poll_events(ws_server_t *server, ws_event_t *events, int max, int timeout_ms);
+
+/**
+ * Take ownership of the payload passed to on_message
+ * 
+ * Must be called from inside on_message, for its connection. The buffer
+ * the payload was read or reassembled into is handed over as is; input
+ * received after the message is moved to a new buffer. Dispatched
+ * messages hand over their private copy. The data pointer stays the one
+ * passed to on_message.
+ * 
+ * Set server->rx_allocator before accepting connections to have messages
+ * larger than config.buffer_size, and every fragmented message, read into
+ * memory from that allocator.
+ * 
+ * @param connection Connection whose on_message is running
+ * @param message Receives the payload
+ * @return 0 on success, -1 if there is no payload to take
+ */
+int ws_message_take(ws_connection_t *connection, ws_message_buffer_t *message);
+
+/**
+ * Free a payload taken with ws_message_take()
+ * 
+ * May be called from any thread, as long as the allocator allows it.
+ * 
+ * @param message Payload
+ */
+void ws_message_free(ws_message_buffer_t *message);
+
 /**
  * Send text message to a client
  * 
@@ -80,6 +523,14 @@ int ws_send_text(ws_connection_t *connection, const char *text, size_t len);
 /**
  * Send binary message to a client
  * 
+ * When config.zerocopy_threshold is set and len reaches it, the payload is
+ * sent with MSG_ZEROCOPY straight from data. The buffer must then stay
+ * unchanged until on_send_complete is called for it; this happens exactly
+ * once per such call, possibly before ws_send_binary returns. If the
+ * connection closes first, on_send_complete comes after on_close: the
+ * socket stays open until the kernel has released the payload, or is
+ * reset after config.linger_timeout, which releases it at once.
+ * 
  * @param connection Client connection
  * @param data Binary data to send
  * @param len Length of data
@@ -87,6 +538,100 @@ int ws_send_text(ws_connection_t *connection, const char *text, size_t len);
  */
 int ws_send_binary(ws_connection_t *connection, const uint8_t *data, size_t len);
 
+/**
+ * Send a message to a client with an explicit priority
+ * 
+ * ws_send_text() and ws_send_binary() use WS_PRIORITY_HIGH. Bulk transfers
+ * should use WS_PRIORITY_LOW so they do not hold up latency-sensitive
+ * messages queued behind them.
+ * 
+ * @param connection Client connection
+ * @param data Message data
+ * @param len Length of data
+ * @param is_binary Whether to send a binary or a text message
+ * @param priority Outbound priority
+ * @return Number of bytes sent, or -1 on error
+ */
+int ws_send_priority(ws_connection_t *connection, const uint8_t *data, size_t len,
+                     bool is_binary, ws_priority_t priority);
+
+/**
+ * Send a message that a newer message with the same key may replace
+ * 
+ * Under WS_SLOW_CONFLATE, a keyed message sent while the client is over
+ * its high-water mark replaces the queued message with the same key in
+ * place instead of queueing behind it, so a slow client gets the latest
+ * state per key (say, per ticker symbol) with bounded memory. Otherwise it
+ * is sent like ws_send_priority() with WS_PRIORITY_HIGH.
+ * 
+ * @param connection Client connection
+ * @param key Conflation key chosen by the application
+ * @param data Message data
+ * @param len Length of data
+ * @param is_binary Whether to send a binary or a text message
+ * @return Number of bytes sent, or -1 on error
+ */
+int ws_send_keyed(ws_connection_t *connection, uint64_t key, const uint8_t *data, size_t len,
+                  bool is_binary);
+
+/**
+ * Set how a connection is treated when it does not keep up
+ * 
+ * Connections start with config.slow_policy and config.high_water.
+ * Only data messages count towards the mark; control frames are never
+ * dropped or counted.
+ * 
+ * @param connection Client connection
+ * @param policy Slow-consumer policy
+ * @param high_water Queued payload bytes above which the policy applies, 0 for no limit
+ */
+void ws_set_slow_policy(ws_connection_t *connection, ws_slow_policy_t policy, size_t high_water);
+
+/**
+ * Send a prepared message to a client
+ * 
+ * Only a reference to the message is queued; the frame encoded by
+ * ws_prepared_message_create() is written as is, without fragmentation.
+ * The caller may release its reference right after this returns.
+ * 
+ * @param connection Client connection
+ * @param message Prepared message
+ * @return Number of bytes sent, or -1 on error
+ */
+int ws_send_prepared(ws_connection_t *connection, ws_prepared_message_t *message);
+
+/**
+ * Stream part of a file to a client as a fragmented binary message
+ * 
+ * Frame headers are generated by the library and the payload is moved
+ * with sendfile(), so memory use stays constant regardless of len. The
+ * transfer continues from the event loop whenever the socket is writable.
+ * The descriptor is duplicated; the caller may close fd right away.
+ * Files are sent with WS_PRIORITY_LOW.
+ * 
+ * @param connection Client connection
+ * @param fd File descriptor to read from
+ * @param offset File offset of the first byte
+ * @param len Number of bytes to send
+ * @param fragment_size Maximum payload per frame, 0 for config.fragment_size
+ * @return 0 on success, -1 on error
+ */
+int ws_send_file(ws_connection_t *connection, int fd, off_t offset, size_t len, size_t fragment_size);
+
+/**
+ * Write a client's queued frames now
+ * 
+ * With config.coalesce set, frames sent during ws_server_step() are
+ * written together when the step ends. Latency-critical callers can use
+ * this to push them out immediately. Must be called on the event loop
+ * thread; frames sent from dispatch workers are written by the loop.
+ * 
+ * @param connection Client connection
+ * @return 0 if everything was written, 1 if the rest waits for the socket
+ *         to become writable, -1 on error
+ */
+int ws_flush(ws_connection_t *connection);
+
 /**
  * Close a WebSocket connection
  * 
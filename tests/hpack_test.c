@@ -0,0 +1,323 @@
+// HPACK decoder against RFC 7541: the Appendix C.4 request examples, a
+// Huffman round trip through every symbol and malformed header blocks
+
+#include "ws/utils/hpack.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define CHECK(condition) do { \
+    if (!(condition)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+        failures++; \
+    } \
+} while (0)
+
+static int failures = 0;
+
+// Huffman code of RFC 7541 Appendix B, indexed by symbol; 256 is EOS
+static const struct {
+    uint32_t code;
+    uint8_t bits;
+} huffman_codes[257] = {
+    { 0x1ff8, 13 }, { 0x7fffd8, 23 }, { 0xfffffe2, 28 }, { 0xfffffe3, 28 },
+    { 0xfffffe4, 28 }, { 0xfffffe5, 28 }, { 0xfffffe6, 28 }, { 0xfffffe7, 28 },
+    { 0xfffffe8, 28 }, { 0xffffea, 24 }, { 0x3ffffffc, 30 }, { 0xfffffe9, 28 },
+    { 0xfffffea, 28 }, { 0x3ffffffd, 30 }, { 0xfffffeb, 28 }, { 0xfffffec, 28 },
+    { 0xfffffed, 28 }, { 0xfffffee, 28 }, { 0xfffffef, 28 }, { 0xffffff0, 28 },
+    { 0xffffff1, 28 }, { 0xffffff2, 28 }, { 0x3ffffffe, 30 }, { 0xffffff3, 28 },
+    { 0xffffff4, 28 }, { 0xffffff5, 28 }, { 0xffffff6, 28 }, { 0xffffff7, 28 },
+    { 0xffffff8, 28 }, { 0xffffff9, 28 }, { 0xffffffa, 28 }, { 0xffffffb, 28 },
+    { 0x14, 6 }, { 0x3f8, 10 }, { 0x3f9, 10 }, { 0xffa, 12 },
+    { 0x1ff9, 13 }, { 0x15, 6 }, { 0xf8, 8 }, { 0x7fa, 11 },
+    { 0x3fa, 10 }, { 0x3fb, 10 }, { 0xf9, 8 }, { 0x7fb, 11 },
+    { 0xfa, 8 }, { 0x16, 6 }, { 0x17, 6 }, { 0x18, 6 },
+    { 0x0, 5 }, { 0x1, 5 }, { 0x2, 5 }, { 0x19, 6 },
+    { 0x1a, 6 }, { 0x1b, 6 }, { 0x1c, 6 }, { 0x1d, 6 },
+    { 0x1e, 6 }, { 0x1f, 6 }, { 0x5c, 7 }, { 0xfb, 8 },
+    { 0x7ffc, 15 }, { 0x20, 6 }, { 0xffb, 12 }, { 0x3fc, 10 },
+    { 0x1ffa, 13 }, { 0x21, 6 }, { 0x5d, 7 }, { 0x5e, 7 },
+    { 0x5f, 7 }, { 0x60, 7 }, { 0x61, 7 }, { 0x62, 7 },
+    { 0x63, 7 }, { 0x64, 7 }, { 0x65, 7 }, { 0x66, 7 },
+    { 0x67, 7 }, { 0x68, 7 }, { 0x69, 7 }, { 0x6a, 7 },
+    { 0x6b, 7 }, { 0x6c, 7 }, { 0x6d, 7 }, { 0x6e, 7 },
+    { 0x6f, 7 }, { 0x70, 7 }, { 0x71, 7 }, { 0x72, 7 },
+    { 0xfc, 8 }, { 0x73, 7 }, { 0xfd, 8 }, { 0x1ffb, 13 },
+    { 0x7fff0, 19 }, { 0x1ffc, 13 }, { 0x3ffc, 14 }, { 0x22, 6 },
+    { 0x7ffd, 15 }, { 0x3, 5 }, { 0x23, 6 }, { 0x4, 5 },
+    { 0x24, 6 }, { 0x5, 5 }, { 0x25, 6 }, { 0x26, 6 },
+    { 0x27, 6 }, { 0x6, 5 }, { 0x74, 7 }, { 0x75, 7 },
+    { 0x28, 6 }, { 0x29, 6 }, { 0x2a, 6 }, { 0x7, 5 },
+    { 0x2b, 6 }, { 0x76, 7 }, { 0x2c, 6 }, { 0x8, 5 },
+    { 0x9, 5 }, { 0x2d, 6 }, { 0x77, 7 }, { 0x78, 7 },
+    { 0x79, 7 }, { 0x7a, 7 }, { 0x7b, 7 }, { 0x7ffe, 15 },
+    { 0x7fc, 11 }, { 0x3ffd, 14 }, { 0x1ffd, 13 }, { 0xffffffc, 28 },
+    { 0xfffe6, 20 }, { 0x3fffd2, 22 }, { 0xfffe7, 20 }, { 0xfffe8, 20 },
+    { 0x3fffd3, 22 }, { 0x3fffd4, 22 }, { 0x3fffd5, 22 }, { 0x7fffd9, 23 },
+    { 0x3fffd6, 22 }, { 0x7fffda, 23 }, { 0x7fffdb, 23 }, { 0x7fffdc, 23 },
+    { 0x7fffdd, 23 }, { 0x7fffde, 23 }, { 0xffffeb, 24 }, { 0x7fffdf, 23 },
+    { 0xffffec, 24 }, { 0xffffed, 24 }, { 0x3fffd7, 22 }, { 0x7fffe0, 23 },
+    { 0xffffee, 24 }, { 0x7fffe1, 23 }, { 0x7fffe2, 23 }, { 0x7fffe3, 23 },
+    { 0x7fffe4, 23 }, { 0x1fffdc, 21 }, { 0x3fffd8, 22 }, { 0x7fffe5, 23 },
+    { 0x3fffd9, 22 }, { 0x7fffe6, 23 }, { 0x7fffe7, 23 }, { 0xffffef, 24 },
+    { 0x3fffda, 22 }, { 0x1fffdd, 21 }, { 0xfffe9, 20 }, { 0x3fffdb, 22 },
+    { 0x3fffdc, 22 }, { 0x7fffe8, 23 }, { 0x7fffe9, 23 }, { 0x1fffde, 21 },
+    { 0x7fffea, 23 }, { 0x3fffdd, 22 }, { 0x3fffde, 22 }, { 0xfffff0, 24 },
+    { 0x1fffdf, 21 }, { 0x3fffdf, 22 }, { 0x7fffeb, 23 }, { 0x7fffec, 23 },
+    { 0x1fffe0, 21 }, { 0x1fffe1, 21 }, { 0x3fffe0, 22 }, { 0x1fffe2, 21 },
+    { 0x7fffed, 23 }, { 0x3fffe1, 22 }, { 0x7fffee, 23 }, { 0x7fffef, 23 },
+    { 0xfffea, 20 }, { 0x3fffe2, 22 }, { 0x3fffe3, 22 }, { 0x3fffe4, 22 },
+    { 0x7ffff0, 23 }, { 0x3fffe5, 22 }, { 0x3fffe6, 22 }, { 0x7ffff1, 23 },
+    { 0x3ffffe0, 26 }, { 0x3ffffe1, 26 }, { 0xfffeb, 20 }, { 0x7fff1, 19 },
+    { 0x3fffe7, 22 }, { 0x7ffff2, 23 }, { 0x3fffe8, 22 }, { 0x1ffffec, 25 },
+    { 0x3ffffe2, 26 }, { 0x3ffffe3, 26 }, { 0x3ffffe4, 26 }, { 0x7ffffde, 27 },
+    { 0x7ffffdf, 27 }, { 0x3ffffe5, 26 }, { 0xfffff1, 24 }, { 0x1ffffed, 25 },
+    { 0x7fff2, 19 }, { 0x1fffe3, 21 }, { 0x3ffffe6, 26 }, { 0x7ffffe0, 27 },
+    { 0x7ffffe1, 27 }, { 0x3ffffe7, 26 }, { 0x7ffffe2, 27 }, { 0xfffff2, 24 },
+    { 0x1fffe4, 21 }, { 0x1fffe5, 21 }, { 0x3ffffe8, 26 }, { 0x3ffffe9, 26 },
+    { 0xffffffd, 28 }, { 0x7ffffe3, 27 }, { 0x7ffffe4, 27 }, { 0x7ffffe5, 27 },
+    { 0xfffec, 20 }, { 0xfffff3, 24 }, { 0xfffed, 20 }, { 0x1fffe6, 21 },
+    { 0x3fffe9, 22 }, { 0x1fffe7, 21 }, { 0x1fffe8, 21 }, { 0x7ffff3, 23 },
+    { 0x3fffea, 22 }, { 0x3fffeb, 22 }, { 0x1ffffee, 25 }, { 0x1ffffef, 25 },
+    { 0xfffff4, 24 }, { 0xfffff5, 24 }, { 0x3ffffea, 26 }, { 0x7ffff4, 23 },
+    { 0x3ffffeb, 26 }, { 0x7ffffe6, 27 }, { 0x3ffffec, 26 }, { 0x3ffffed, 26 },
+    { 0x7ffffe7, 27 }, { 0x7ffffe8, 27 }, { 0x7ffffe9, 27 }, { 0x7ffffea, 27 },
+    { 0x7ffffeb, 27 }, { 0xffffffe, 28 }, { 0x7ffffec, 27 }, { 0x7ffffed, 27 },
+    { 0x7ffffee, 27 }, { 0x7ffffef, 27 }, { 0x7fffff0, 27 }, { 0x3ffffee, 26 },
+    { 0x3fffffff, 30 },
+};
+
+// Decoded header fields as "name: value\n" lines
+typedef struct {
+    char text[16384];
+    size_t length;
+} header_list_t;
+
+static void collect(void *ctx, const char *name, size_t name_length,
+                    const char *value, size_t value_length) {
+    header_list_t *list = (header_list_t *)ctx;
+    if (list->length + name_length + value_length + 4 > sizeof(list->text)) {
+        return;
+    }
+    
+    // Values may hold NUL, so no string formatting
+    memcpy(list->text + list->length, name, name_length);
+    list->length += name_length;
+    memcpy(list->text + list->length, ": ", 2);
+    list->length += 2;
+    memcpy(list->text + list->length, value, value_length);
+    list->length += value_length;
+    list->text[list->length++] = '\n';
+    list->text[list->length] = '\0';
+}
+
+static int decode(ws_hpack_decoder_t *decoder, const uint8_t *block, size_t len, header_list_t *list) {
+    list->length = 0;
+    list->text[0] = '\0';
+    return ws_hpack_decode(decoder, block, len, collect, list);
+}
+
+// Decode a block with a fresh decoder
+static int decode_once(const uint8_t *block, size_t len) {
+    ws_hpack_decoder_t decoder;
+    header_list_t list;
+    ws_hpack_decoder_init(&decoder, WS_HPACK_TABLE_SIZE, NULL);
+    int result = decode(&decoder, block, len, &list);
+    ws_hpack_decoder_cleanup(&decoder);
+    return result;
+}
+
+// Append a Huffman-coded string literal, its length prefixed as a 7-bit integer
+static size_t put_huffman(uint8_t *out, const uint8_t *data, size_t len) {
+    size_t bits = 0;
+    for (size_t i = 0; i < len; i++) {
+        bits += huffman_codes[data[i]].bits;
+    }
+    size_t encoded = (bits + 7) / 8;
+    
+    size_t pos = 0;
+    if (encoded < 127) {
+        out[pos++] = (uint8_t)(0x80 | encoded);
+    } else {
+        out[pos++] = 0xFF;
+        size_t rest = encoded - 127;
+        while (rest >= 128) {
+            out[pos++] = (uint8_t)(0x80 | (rest & 0x7F));
+            rest >>= 7;
+        }
+        out[pos++] = (uint8_t)rest;
+    }
+    
+    uint64_t pending = 0;
+    int pending_bits = 0;
+    for (size_t i = 0; i < len; i++) {
+        pending = (pending << huffman_codes[data[i]].bits) | huffman_codes[data[i]].code;
+        pending_bits += huffman_codes[data[i]].bits;
+        while (pending_bits >= 8) {
+            pending_bits -= 8;
+            out[pos++] = (uint8_t)(pending >> pending_bits);
+        }
+    }
+    if (pending_bits > 0) {
+        // Padding is the most significant bits of EOS, all ones
+        out[pos++] = (uint8_t)((pending << (8 - pending_bits)) | (0xFF >> pending_bits));
+    }
+    return pos;
+}
+
+static void test_rfc_examples(void) {
+    // RFC 7541 C.4: three requests on one connection, Huffman coded
+    static const uint8_t first[] = {
+        0x82, 0x86, 0x84, 0x41, 0x8c, 0xf1, 0xe3, 0xc2, 0xe5, 0xf2, 0x3a, 0x6b,
+        0xa0, 0xab, 0x90, 0xf4, 0xff,
+    };
+    static const uint8_t second[] = {
+        0x82, 0x86, 0x84, 0xbe, 0x58, 0x86, 0xa8, 0xeb, 0x10, 0x64, 0x9c, 0xbf,
+    };
+    static const uint8_t third[] = {
+        0x82, 0x87, 0x85, 0xbf, 0x40, 0x88, 0x25, 0xa8, 0x49, 0xe9, 0x5b, 0xa9,
+        0x7d, 0x7f, 0x89, 0x25, 0xa8, 0x49, 0xe9, 0x5b, 0xb8, 0xe8, 0xb4, 0xbf,
+    };
+    
+    ws_hpack_decoder_t decoder;
+    header_list_t list;
+    ws_hpack_decoder_init(&decoder, WS_HPACK_TABLE_SIZE, NULL);
+    
+    CHECK(decode(&decoder, first, sizeof(first), &list) == 0);
+    CHECK(strcmp(list.text, ":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\n") == 0);
+    CHECK(decoder.count == 1 && decoder.size == 57);
+    
+    CHECK(decode(&decoder, second, sizeof(second), &list) == 0);
+    CHECK(strcmp(list.text, ":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\n"
+                            "cache-control: no-cache\n") == 0);
+    CHECK(decoder.count == 2 && decoder.size == 110);
+    
+    CHECK(decode(&decoder, third, sizeof(third), &list) == 0);
+    CHECK(strcmp(list.text, ":method: GET\n:scheme: https\n:path: /index.html\n:authority: www.example.com\n"
+                            "custom-key: custom-value\n") == 0);
+    CHECK(decoder.count == 3 && decoder.size == 164);
+    
+    ws_hpack_decoder_cleanup(&decoder);
+}
+
+static void test_huffman_round_trip(void) {
+    uint8_t value[512];
+    uint8_t block[4096];
+    char expected[1024];
+    
+    // Every symbol once, then strings of every length up to 64 so that
+    // each padding length comes up
+    for (size_t len = 0; len <= 256 + 64; len++) {
+        size_t value_length = len <= 256 ? len : len - 256;
+        for (size_t i = 0; i < value_length; i++) {
+            value[i] = len <= 256 ? (uint8_t)i : (uint8_t)(i * 37 + len);
+        }
+        
+        // Literal without indexing, new name
+        size_t pos = 0;
+        block[pos++] = 0x00;
+        pos += put_huffman(block + pos, (const uint8_t *)"x-test", 6);
+        pos += put_huffman(block + pos, value, value_length);
+        
+        ws_hpack_decoder_t decoder;
+        header_list_t list;
+        ws_hpack_decoder_init(&decoder, WS_HPACK_TABLE_SIZE, NULL);
+        CHECK(decode(&decoder, block, pos, &list) == 0);
+        ws_hpack_decoder_cleanup(&decoder);
+        
+        memcpy(expected, "x-test: ", 8);
+        memcpy(expected + 8, value, value_length);
+        expected[8 + value_length] = '\n';
+        CHECK(list.length == 9 + value_length && memcmp(list.text, expected, list.length) == 0);
+    }
+}
+
+static void test_truncated(void) {
+    static const uint8_t block[] = {
+        0x82, 0x86, 0x84, 0x41, 0x8c, 0xf1, 0xe3, 0xc2, 0xe5, 0xf2, 0x3a, 0x6b,
+        0xa0, 0xab, 0x90, 0xf4, 0xff,
+    };
+    
+    // Cut anywhere inside the :authority literal
+    for (size_t len = 4; len < sizeof(block); len++) {
+        CHECK(decode_once(block, len) == -1);
+    }
+    
+    // Integers whose continuation bytes are missing
+    static const uint8_t index[] = { 0xff, 0x80 };
+    CHECK(decode_once(index, sizeof(index)) == -1);
+    static const uint8_t update[] = { 0x3f };
+    CHECK(decode_once(update, sizeof(update)) == -1);
+    
+    // Literal name whose string length is missing
+    static const uint8_t literal[] = { 0x40 };
+    CHECK(decode_once(literal, sizeof(literal)) == -1);
+}
+
+static void test_oversized(void) {
+    // Index past the static table with an empty dynamic table
+    static const uint8_t index[] = { 0xbe };
+    CHECK(decode_once(index, sizeof(index)) == -1);
+    
+    // Integer that does not fit in 64 bits
+    static const uint8_t integer[] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x01 };
+    CHECK(decode_once(integer, sizeof(integer)) == -1);
+    
+    // Table size update above the advertised 4096: 31 + 4066
+    static const uint8_t update[] = { 0x3f, 0xe2, 0x1f };
+    CHECK(decode_once(update, sizeof(update)) == -1);
+    
+    // Raw name longer than WS_HPACK_MAX_STRING
+    static uint8_t name[8 + WS_HPACK_MAX_STRING + 1];
+    size_t length = WS_HPACK_MAX_STRING + 1 - 127;
+    name[0] = 0x00;
+    name[1] = 0x7f;
+    name[2] = (uint8_t)(0x80 | (length & 0x7F));
+    name[3] = (uint8_t)(length >> 7);
+    memset(name + 4, 'a', WS_HPACK_MAX_STRING + 1);
+    CHECK(decode_once(name, 4 + WS_HPACK_MAX_STRING + 1) == -1);
+    
+    // Huffman string longer than its block and padding longer than 7 bits
+    static const uint8_t overrun[] = { 0x00, 0x85, 0xf1, 0xe3 };
+    CHECK(decode_once(overrun, sizeof(overrun)) == -1);
+    static const uint8_t padding[] = { 0x00, 0x81, 0xff, 0x80 };
+    CHECK(decode_once(padding, sizeof(padding)) == -1);
+}
+
+static void test_size_update_position(void) {
+    // Allowed ahead of the first field, also twice (RFC 7541 section 4.2)
+    static const uint8_t leading[] = { 0x20, 0x3f, 0xe1, 0x1f, 0x82 };
+    CHECK(decode_once(leading, sizeof(leading)) == 0);
+    
+    // Not after an indexed field or a literal
+    static const uint8_t after_indexed[] = { 0x82, 0x20 };
+    CHECK(decode_once(after_indexed, sizeof(after_indexed)) == -1);
+    static const uint8_t after_literal[] = { 0x44, 0x81, 0x63, 0x20, 0x82 };
+    CHECK(decode_once(after_literal, sizeof(after_literal)) == -1);
+    
+    // A block that starts with a field and updates later leaves the table alone
+    ws_hpack_decoder_t decoder;
+    header_list_t list;
+    ws_hpack_decoder_init(&decoder, WS_HPACK_TABLE_SIZE, NULL);
+    static const uint8_t entry[] = { 0x44, 0x81, 0x63 };
+    CHECK(decode(&decoder, entry, sizeof(entry), &list) == 0);
+    static const uint8_t evict[] = { 0xbe, 0x20 };
+    CHECK(decode(&decoder, evict, sizeof(evict), &list) == -1);
+    CHECK(decoder.count == 1 && decoder.max_size == WS_HPACK_TABLE_SIZE);
+    ws_hpack_decoder_cleanup(&decoder);
+}
+
+int main(void) {
+    test_rfc_examples();
+    test_huffman_round_trip();
+    test_truncated();
+    test_oversized();
+    test_size_update_position();
+    
+    if (failures) {
+        fprintf(stderr, "%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("hpack: all checks passed\n");
+    return 0;
+}
@@ -0,0 +1,222 @@
+// Ingest ring validation: malformed records written by a publisher break
+// the ring without the server reading past the record space. The ring is
+// built on a mapping whose record space is followed by an inaccessible
+// page, so any read out of bounds faults.
+
+#include "ws/utils/ingest.c"
+
+#define CHECK(condition) do { \
+    if (!(condition)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+        failures++; \
+    } \
+} while (0)
+
+static int failures = 0;
+static size_t page_size;
+
+typedef struct {
+    int count;
+    uint64_t target;
+    size_t length;
+} delivered_t;
+
+static void deliver(void *ctx, ws_ingest_target_t kind, uint64_t target,
+                    const uint8_t *data, size_t len, bool is_binary) {
+    delivered_t *delivered = (delivered_t *)ctx;
+    (void)kind;
+    (void)data;
+    (void)is_binary;
+    delivered->count++;
+    delivered->target = target;
+    delivered->length = len;
+}
+
+// Ring of one page of record space followed by a guard page
+static ws_ingest_t *test_ring(void) {
+    ws_ingest_t *ring = (ws_ingest_t *)calloc(1, sizeof(ws_ingest_t));
+    ws_ingest_header_t *header = (ws_ingest_header_t *)aligned_alloc(64, sizeof(ws_ingest_header_t));
+    uint8_t *records = (uint8_t *)mmap(NULL, 2 * page_size, PROT_READ | PROT_WRITE,
+                                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (!ring || !header || records == MAP_FAILED || mprotect(records + page_size, page_size, PROT_NONE) != 0) {
+        perror("test ring");
+        exit(1);
+    }
+    
+    memset(header, 0, sizeof(*header));
+    header->magic = WS_INGEST_MAGIC;
+    header->capacity = page_size;
+    ring->header = header;
+    ring->records = records;
+    ring->capacity = page_size;
+    ring->memfd = -1;
+    ring->event = -1;
+    ring->control = -1;
+    return ring;
+}
+
+static void free_ring(ws_ingest_t *ring) {
+    munmap(ring->records, 2 * page_size);
+    free(ring->header);
+    free(ring);
+}
+
+// Commit a record at a byte offset as a publisher would, header word last
+static void put_record(ws_ingest_t *ring, uint64_t offset, uint64_t size, int kind, uint64_t length) {
+    ws_ingest_record_t *record = (ws_ingest_record_t *)(ring->records + offset);
+    if (offset + sizeof(ws_ingest_record_t) <= ring->capacity) {
+        record->target = 7;
+        record->length = length;
+    }
+    __atomic_store_n(&record->header, size | ((uint64_t)kind << 32), __ATOMIC_RELEASE);
+    ring->header->reserve = offset + size;
+}
+
+// Drain a ring whose first record is malformed and check nothing was taken
+static void expect_broken(ws_ingest_t *ring, uint64_t tail) {
+    delivered_t delivered = { 0, 0, 0 };
+    
+    CHECK(ws_ingest_drain(ring, deliver, &delivered, 0) == 0);
+    CHECK(delivered.count == 0);
+    CHECK(ring->broken);
+    CHECK(ring->tail == tail && ring->header->tail == tail);
+    CHECK(!ws_ingest_prepare_wait(ring));
+    
+    // Valid records after the bad one are never taken
+    CHECK(ws_ingest_drain(ring, deliver, &delivered, 0) == 0);
+}
+
+static void test_valid(void) {
+    ws_ingest_t *ring = test_ring();
+    delivered_t delivered = { 0, 0, 0 };
+    uint8_t payload[600];
+    memset(payload, 'x', sizeof(payload));
+    
+    // Enough messages to wrap, so a pad record ends the ring on the way
+    for (int round = 0; round < 20; round++) {
+        CHECK(ws_ingest_publish(ring, WS_INGEST_CONNECTION, 42, payload, sizeof(payload), true) == 0);
+        CHECK(ws_ingest_drain(ring, deliver, &delivered, 0) == 1);
+    }
+    CHECK(delivered.count == 20 && delivered.target == 42 && delivered.length == sizeof(payload));
+    CHECK(!ring->broken);
+    
+    free_ring(ring);
+}
+
+static void test_bad_size(void) {
+    // Not a multiple of 8
+    ws_ingest_t *ring = test_ring();
+    put_record(ring, 0, 36, WS_INGEST_CONNECTION, 4);
+    expect_broken(ring, 0);
+    free_ring(ring);
+    
+    // Zero, which would never advance
+    ring = test_ring();
+    put_record(ring, 0, 0, WS_INGEST_BROADCAST, 0);
+    expect_broken(ring, 0);
+    free_ring(ring);
+    
+    // Smaller than a record header
+    ring = test_ring();
+    put_record(ring, 0, 16, WS_INGEST_CONNECTION, 0);
+    expect_broken(ring, 0);
+    free_ring(ring);
+    
+    // Past the end of the ring
+    ring = test_ring();
+    uint64_t offset = page_size - 32;
+    ring->tail = offset;
+    ring->header->tail = offset;
+    put_record(ring, offset, 64, WS_INGEST_CONNECTION, 8);
+    expect_broken(ring, offset);
+    free_ring(ring);
+    
+    // Record header cut off by the end of the ring: length is not read
+    ring = test_ring();
+    offset = page_size - 8;
+    ring->tail = offset;
+    ring->header->tail = offset;
+    put_record(ring, offset, 8, WS_INGEST_CONNECTION, 0);
+    expect_broken(ring, offset);
+    free_ring(ring);
+}
+
+static void test_bad_pad(void) {
+    // A pad must reach exactly the end of the ring
+    ws_ingest_t *ring = test_ring();
+    put_record(ring, 0, 64, WS_INGEST_PAD, 0);
+    expect_broken(ring, 0);
+    free_ring(ring);
+    
+    // Running past it is rejected as well
+    ring = test_ring();
+    uint64_t offset = page_size - 64;
+    ring->tail = offset;
+    ring->header->tail = offset;
+    put_record(ring, offset, 128, WS_INGEST_PAD, 0);
+    expect_broken(ring, offset);
+    free_ring(ring);
+    
+    // One that does end there is skipped
+    ring = test_ring();
+    delivered_t delivered = { 0, 0, 0 };
+    ring->tail = offset;
+    ring->header->tail = offset;
+    put_record(ring, offset, 64, WS_INGEST_PAD, 0);
+    put_record(ring, 0, 32, WS_INGEST_TOPIC, 8);
+    CHECK(ws_ingest_drain(ring, deliver, &delivered, 0) == 1);
+    CHECK(!ring->broken && ring->tail == page_size + 32);
+    free_ring(ring);
+}
+
+static void test_unknown_kind(void) {
+    ws_ingest_t *ring = test_ring();
+    put_record(ring, 0, 32, 7, 8);
+    expect_broken(ring, 0);
+    free_ring(ring);
+    
+    ring = test_ring();
+    put_record(ring, 0, 32, 0xFF, 8);
+    expect_broken(ring, 0);
+    free_ring(ring);
+}
+
+static void test_length_over_size(void) {
+    // One byte more than the record holds
+    ws_ingest_t *ring = test_ring();
+    put_record(ring, 0, 32, WS_INGEST_CONNECTION, 9);
+    expect_broken(ring, 0);
+    free_ring(ring);
+    
+    // Far past the ring, right before its end
+    ring = test_ring();
+    uint64_t offset = page_size - 32;
+    ring->tail = offset;
+    ring->header->tail = offset;
+    put_record(ring, offset, 32, WS_INGEST_BROADCAST, (uint64_t)1 << 20);
+    expect_broken(ring, offset);
+    free_ring(ring);
+    
+    // Wrapping around when added to the data pointer
+    ring = test_ring();
+    put_record(ring, 0, 32, WS_INGEST_TOPIC, UINT64_MAX);
+    expect_broken(ring, 0);
+    free_ring(ring);
+}
+
+int main(void) {
+    page_size = (size_t)sysconf(_SC_PAGESIZE);
+    
+    test_valid();
+    test_bad_size();
+    test_bad_pad();
+    test_unknown_kind();
+    test_length_over_size();
+    
+    if (failures) {
+        fprintf(stderr, "%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("ingest: all checks passed\n");
+    return 0;
+}